@@ -35,7 +35,51 @@
 #else
 #define SW_VERSIONS_FILE "/etc/sw-versions"
 #endif
-static int read_sw_version_file(struct swupdate_cfg *sw)
+
+/*
+ * A version string parsed once: both the old-style number and
+ * the semantic version are kept, compare_parsed_versions() picks
+ * the representation that both sides support.
+ */
+struct parsed_version {
+	const char *str;
+	bool is_number;
+	__u64 number;
+	bool is_semver;
+	semver_t sem;
+};
+
+/*
+ * Index of the installed versions, sorted by name and with
+ * pre-parsed versions. It is rebuilt on first use after
+ * the list of installed versions was changed.
+ */
+struct version_entry {
+	struct sw_version *swver;
+	unsigned int pos;
+	struct parsed_version ver;
+};
+
+static struct {
+	struct swver *list;
+	struct version_entry *entries;
+	unsigned int count;
+	bool valid;
+} versions_index;
+
+/*
+ * State and content of SW_VERSIONS_FILE when it was read, to detect
+ * changes done by other processes between two updates and to tell
+ * them apart from the versions updated in memory by this process
+ */
+static bool versions_from_file;
+static struct stat versions_file_stat;
+static struct swver versions_file_list = LIST_HEAD_INITIALIZER(versions_file_list);
+
+static void parse_version(const char *version_string, struct parsed_version *ver);
+static void free_parsed_version(struct parsed_version *ver);
+
+static int read_sw_version_file(struct swver *list)
 {
 	FILE *fp;
 	int ret;
@@ -47,9 +91,17 @@ static int read_sw_version_file(struct swupdate_cfg *sw)
 	 * and generate a list
 	 */
 
+	versions_from_file = true;
+	invalidate_sw_versions_index();
+
 	fp = fopen(SW_VERSIONS_FILE, "r");
-	if (!fp)
+	if (!fp) {
+		memset(&versions_file_stat, 0, sizeof(versions_file_stat));
 		return -EACCES;
+	}
+
+	if (fstat(fileno(fp), &versions_file_stat))
+		memset(&versions_file_stat, 0, sizeof(versions_file_stat));
 
 	while (1) {
 		ret = fscanf(fp, "%ms %ms", &name, &version);
@@ -66,7 +118,7 @@ static int read_sw_version_file(struct swupdate_cfg *sw)
 			strlcpy(swcomp->name, name, sizeof(swcomp->name));
 			strlcpy(swcomp->version, version, sizeof(swcomp->version));
 
-			LIST_INSERT_HEAD(&sw->installed_sw_list, swcomp, next);
+			LIST_INSERT_HEAD(list, swcomp, next);
 			TRACE("Installed %s: Version %s",
 					swcomp->name,
 					swcomp->version);
@@ -93,6 +145,55 @@ static int read_sw_version_file(struct swupdate_cfg *sw)
 	return 0;
 }
 
+static void free_sw_versions(struct swver *list)
+{
+	struct sw_version *swver, *tmp;
+
+	LIST_FOREACH_SAFE(swver, list, next, tmp) {
+		LIST_REMOVE(swver, next);
+		free(swver);
+	}
+}
+
+static struct sw_version *find_sw_version(struct swver *list, const char *name)
+{
+	struct sw_version *swver;
+
+	LIST_FOREACH(swver, list, next) {
+		if (!strcmp(swver->name, name))
+			return swver;
+	}
+
+	return NULL;
+}
+
+/*
+ * Append a copy of each entry of src to dst, keeping the order
+ */
+static int copy_sw_versions(struct swver *dst, struct swver *src)
+{
+	struct sw_version *swver, *swcomp, *last = NULL;
+
+	LIST_FOREACH(swver, dst, next)
+		last = swver;
+
+	LIST_FOREACH(swver, src, next) {
+		swcomp = (struct sw_version *)calloc(1, sizeof(struct sw_version));
+		if (!swcomp) {
+			ERROR("Allocation error");
+			return -ENOMEM;
+		}
+		*swcomp = *swver;
+		if (last)
+			LIST_INSERT_AFTER(last, swcomp, next);
+		else
+			LIST_INSERT_HEAD(dst, swcomp, next);
+		last = swcomp;
+	}
+
+	return 0;
+}
+
 static int versions_settings(void *setting, void *data)
 {
 	struct swupdate_cfg *sw = (struct swupdate_cfg *)data;
@@ -133,7 +234,154 @@ void get_sw_versions(swupdate_cfg_handle *handle, struct swupdate_cfg *sw)
 		return;
 	}
 	/* If not found, fall back to a legacy file in the format "<image name> <version>" */
-	read_sw_version_file(sw);
+	read_sw_version_file(&versions_file_list);
+	copy_sw_versions(&sw->installed_sw_list, &versions_file_list);
+}
+
+/*
+ * Versions are read once at startup. If they come from
+ * SW_VERSIONS_FILE, reload them when the file was replaced
+ * or modified in the meantime, else nothing to do.
+ * SWUpdate does not write the file: versions installed by this
+ * process are only in memory, and they win over the file, while
+ * the entries unchanged since the last read take the new content.
+ */
+void refresh_sw_versions(struct swupdate_cfg *sw)
+{
+	struct swver file = LIST_HEAD_INITIALIZER(file);
+	struct swver merged = LIST_HEAD_INITIALIZER(merged);
+	struct sw_version *swver, *tmp, *found;
+	struct stat st;
+
+	if (!versions_from_file)
+		return;
+
+	if (stat(SW_VERSIONS_FILE, &st))
+		memset(&st, 0, sizeof(st));
+
+	if (same_file_state(&st, &versions_file_stat))
+		return;
+
+	TRACE("%s changed, reloading versions", SW_VERSIONS_FILE);
+
+	read_sw_version_file(&file);
+	copy_sw_versions(&merged, &file);
+
+	LIST_FOREACH_SAFE(swver, &sw->installed_sw_list, next, tmp) {
+		LIST_REMOVE(swver, next);
+		found = find_sw_version(&versions_file_list, swver->name);
+		if (found && !strcmp(found->version, swver->version)) {
+			free(swver);
+			continue;
+		}
+
+		/* installed by this process */
+		found = find_sw_version(&merged, swver->name);
+		if (found) {
+			strlcpy(found->version, swver->version, sizeof(found->version));
+			free(swver);
+		} else {
+			LIST_INSERT_HEAD(&merged, swver, next);
+		}
+	}
+
+	free_sw_versions(&versions_file_list);
+	copy_sw_versions(&versions_file_list, &file);
+	free_sw_versions(&file);
+	copy_sw_versions(&sw->installed_sw_list, &merged);
+	free_sw_versions(&merged);
+}
+
+void invalidate_sw_versions_index(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < versions_index.count; i++)
+		free_parsed_version(&versions_index.entries[i].ver);
+	free(versions_index.entries);
+	versions_index.entries = NULL;
+	versions_index.count = 0;
+	versions_index.valid = false;
+}
+
+static int version_entry_cmp(const void *a, const void *b)
+{
+	const struct version_entry *left = a;
+	const struct version_entry *right = b;
+	int ret;
+
+	ret = strcmp(left->swver->name, right->swver->name);
+	if (ret)
+		return ret;
+
+	return left->pos < right->pos ? -1 : left->pos > right->pos;
+}
+
+static int build_sw_versions_index(struct swver *sw_ver_list)
+{
+	struct sw_version *swver;
+	unsigned int count = 0, i;
+
+	invalidate_sw_versions_index();
+
+	LIST_FOREACH(swver, sw_ver_list, next)
+		count++;
+
+	if (count) {
+		versions_index.entries = calloc(count, sizeof(*versions_index.entries));
+		if (!versions_index.entries) {
+			ERROR("OOM building versions index");
+			return -ENOMEM;
+		}
+	}
+
+	i = 0;
+	LIST_FOREACH(swver, sw_ver_list, next) {
+		versions_index.entries[i].swver = swver;
+		versions_index.entries[i].pos = i;
+		i++;
+	}
+
+	qsort(versions_index.entries, count, sizeof(*versions_index.entries),
+	      version_entry_cmp);
+
+	/* a name may be listed more than once, all entries are kept */
+	for (i = 0; i < count; i++)
+		parse_version(versions_index.entries[i].swver->version,
+			      &versions_index.entries[i].ver);
+
+	versions_index.count = count;
+	versions_index.list = sw_ver_list;
+	versions_index.valid = true;
+
+	return 0;
+}
+
+/* Returns the first entry for name, entries with the same name follow */
+static struct version_entry *find_version_entry(struct swver *sw_ver_list,
+						 const char *name)
+{
+	unsigned int low = 0, high, mid;
+
+	if (!versions_index.valid || versions_index.list != sw_ver_list) {
+		if (build_sw_versions_index(sw_ver_list))
+			return NULL;
+	}
+
+	high = versions_index.count;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (strcmp(name, versions_index.entries[mid].swver->name) > 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low == versions_index.count ||
+	    strcmp(name, versions_index.entries[low].swver->name))
+		return NULL;
+
+	return &versions_index.entries[low];
 }
 
 /*
@@ -194,47 +442,44 @@ static bool is_numbered_version(const char *version_string, __u64 *version_numbe
 	return version_to_number(version_string, version_number);
 }
 
-/*
- * Compare 2 versions.
- *
- * Mind that this function accepts both version types:
- * - old-style: major.minor.revision.buildinfo
- * - semantic versioning: major.minor.patch[-prerelease][+buildinfo]
- *   see https://semver.org
- * - if neither works, we fallback to lexicographical comparison
- *
- * Returns -1, 0 or 1 of left is respectively lower than, equal to or greater than right.
- */
-int compare_versions(const char* left_version, const char* right_version)
+static void parse_version(const char *version_string, struct parsed_version *ver)
 {
+	memset(ver, 0, sizeof(*ver));
+	ver->str = version_string;
+	ver->is_number = is_numbered_version(version_string, &ver->number);
+	ver->is_semver = !semver_parse(version_string, &ver->sem);
+	if (!ver->is_semver)
+		semver_free(&ver->sem);
+}
 
-	__u64 left_u64;
-	__u64 right_u64;
+static void free_parsed_version(struct parsed_version *ver)
+{
+	if (ver->is_semver)
+		semver_free(&ver->sem);
+	ver->is_semver = false;
+}
 
-	if (is_numbered_version(left_version, &left_u64)
-	    && is_numbered_version(right_version, &right_u64))
-	{
+static int compare_parsed_versions(struct parsed_version *left,
+				   struct parsed_version *right)
+{
+	if (left->is_number && right->is_number) {
 		DEBUG("Comparing old-style versions '%s' <-> '%s'",
-		      left_version, right_version);
-		TRACE("Parsed: '%llu' <-> '%llu'", left_u64, right_u64);
+		      left->str, right->str);
+		TRACE("Parsed: '%llu' <-> '%llu'", left->number, right->number);
 
-		if (left_u64 < right_u64)
+		if (left->number < right->number)
 			return -1;
-		else if (left_u64 > right_u64)
+		else if (left->number > right->number)
 			return 1;
 		else
 			return 0;
 	}
 
-	semver_t left_sem = {};
-	semver_t right_sem = {};
-	int comparison;
-
 	/*
 	 * Check if semantic version is possible
 	 */
-	if (!semver_parse(left_version, &left_sem) && !semver_parse(right_version, &right_sem)) {
-		DEBUG("Comparing semantic versions '%s' <-> '%s'", left_version, right_version);
+	if (left->is_semver && right->is_semver) {
+		DEBUG("Comparing semantic versions '%s' <-> '%s'", left->str, right->str);
 		if (loglevel >= TRACELEVEL)
 		{
 			char left_rendered[SWUPDATE_GENERAL_STRING_SIZE];
@@ -242,22 +487,78 @@ int compare_versions(const char* left_version, const char* right_version)
 
 			left_rendered[0] = right_rendered[0] = '\0';
 
-			semver_render(&left_sem, left_rendered);
-			semver_render(&right_sem, right_rendered);
+			semver_render(&left->sem, left_rendered);
+			semver_render(&right->sem, right_rendered);
 			TRACE("Parsed: '%s' <-> '%s'", left_rendered, right_rendered);
 		}
 
-		comparison = semver_compare(left_sem, right_sem);
-		semver_free(&left_sem);
-		semver_free(&right_sem);
-		return comparison;
+		return semver_compare(left->sem, right->sem);
 	}
-	semver_free(&left_sem);
-	semver_free(&right_sem);
 
 	/*
 	 * Last attempt: just compare the two strings
 	 */
-	DEBUG("Comparing lexicographically '%s' <-> '%s'", left_version, right_version);
-	return strcmp(left_version, right_version);
+	DEBUG("Comparing lexicographically '%s' <-> '%s'", left->str, right->str);
+	return strcmp(left->str, right->str);
+}
+
+/*
+ * Compare 2 versions.
+ *
+ * Mind that this function accepts both version types:
+ * - old-style: major.minor.revision.buildinfo
+ * - semantic versioning: major.minor.patch[-prerelease][+buildinfo]
+ *   see https://semver.org
+ * - if neither works, we fallback to lexicographical comparison
+ *
+ * Returns -1, 0 or 1 of left is respectively lower than, equal to or greater than right.
+ */
+int compare_versions(const char* left_version, const char* right_version)
+{
+	struct parsed_version left, right;
+	int comparison;
+
+	parse_version(left_version, &left);
+	parse_version(right_version, &right);
+
+	comparison = compare_parsed_versions(&left, &right);
+
+	free_parsed_version(&left);
+	free_parsed_version(&right);
+
+	return comparison;
+}
+
+/*
+ * Compare a version with the installed version of a component,
+ * the installed one is looked up in the index and was already parsed.
+ *
+ * Returns -ENOENT if the component is not installed, else 0 and
+ * the result of compare_versions(version, installed) in *result.
+ * If the component is listed more than once, *result is 0 when the
+ * version equals any of the installed ones, else the lowest result,
+ * as a scan of the whole list would find.
+ */
+int compare_installed_version(struct swver *sw_ver_list, const char *name,
+			      const char *version, int *result)
+{
+	struct version_entry *entry, *end;
+	struct parsed_version ver;
+	int cmp;
+
+	entry = find_version_entry(sw_ver_list, name);
+	if (!entry)
+		return -ENOENT;
+	end = versions_index.entries + versions_index.count;
+
+	parse_version(version, &ver);
+	*result = compare_parsed_versions(&ver, &entry->ver);
+	while (*result && ++entry < end && !strcmp(name, entry->swver->name)) {
+		cmp = compare_parsed_versions(&ver, &entry->ver);
+		if (!cmp || cmp < *result)
+			*result = cmp;
+	}
+	free_parsed_version(&ver);
+
+	return 0;
 }
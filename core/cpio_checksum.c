@@ -0,0 +1,133 @@
+/*
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+/*
+ * The checksum of a newc cpio archive is the sum of all bytes of a
+ * file, truncated to 32 bit. It is computed for every byte of a SWU,
+ * so the sum uses vector instructions when the CPU has them.
+ * Partial sums wrap exactly as the scalar sum does, so lanes can be
+ * added up without caring about overflow.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpiohdr.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPIO_CHECKSUM_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+typedef uint32_t (*checksum_fn)(const unsigned char *buf, size_t len, uint32_t sum);
+
+uint32_t cpio_checksum_scalar(const unsigned char *buf, size_t len, uint32_t sum)
+{
+	for (size_t i = 0; i < len; i++)
+		sum += buf[i];
+
+	return sum;
+}
+
+#if defined(CPIO_CHECKSUM_X86)
+__attribute__((target("sse2")))
+static uint32_t checksum_sse2(const unsigned char *buf, size_t len, uint32_t sum)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+	uint64_t lanes[2];
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+	}
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	sum += (uint32_t)(lanes[0] + lanes[1]);
+
+	return cpio_checksum_scalar(buf + i, len - i, sum);
+}
+
+__attribute__((target("avx2")))
+static uint32_t checksum_avx2(const unsigned char *buf, size_t len, uint32_t sum)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = _mm256_setzero_si256();
+	uint64_t lanes[4];
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+	}
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	sum += (uint32_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+
+	return cpio_checksum_scalar(buf + i, len - i, sum);
+}
+#elif defined(__ARM_NEON)
+static uint32_t checksum_neon(const unsigned char *buf, size_t len, uint32_t sum)
+{
+	uint32x4_t acc = vdupq_n_u32(0);
+	uint32_t lanes[4];
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16)
+		acc = vpadalq_u16(acc, vpaddlq_u8(vld1q_u8(buf + i)));
+	vst1q_u32(lanes, acc);
+	sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+	return cpio_checksum_scalar(buf + i, len - i, sum);
+}
+#endif
+
+static checksum_fn checksum_impl;
+static const char *checksum_name;
+
+/*
+ * x86 selects at runtime, NEON is a build time choice because it is
+ * part of the ABI on the targets where the compiler enables it
+ */
+static void checksum_select(void)
+{
+	checksum_fn fn = cpio_checksum_scalar;
+	const char *name = "scalar";
+
+#if defined(CPIO_CHECKSUM_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		fn = checksum_avx2;
+		name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		fn = checksum_sse2;
+		name = "sse2";
+	}
+#elif defined(__ARM_NEON)
+	fn = checksum_neon;
+	name = "neon";
+#endif
+	checksum_name = name;
+	__atomic_store_n(&checksum_impl, fn, __ATOMIC_RELEASE);
+}
+
+uint32_t cpio_checksum(const unsigned char *buf, size_t len, uint32_t sum)
+{
+	checksum_fn fn = __atomic_load_n(&checksum_impl, __ATOMIC_ACQUIRE);
+
+	if (!fn) {
+		checksum_select();
+		fn = checksum_impl;
+	}
+
+	return fn(buf, len, sum);
+}
+
+const char *cpio_checksum_impl(void)
+{
+	if (!__atomic_load_n(&checksum_impl, __ATOMIC_ACQUIRE))
+		checksum_select();
+
+	return checksum_name;
+}
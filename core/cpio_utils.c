@@ -21,6 +21,7 @@
 #endif
 #ifdef CONFIG_ZSTD
 #include <zstd.h>
+#include "zstd_mt.h"
 #endif
 #ifdef CONFIG_LZ4
 #include <lz4frame.h>
@@ -32,14 +33,19 @@
 #include "util.h"
 #include "swupdate_crypto.h"
 #include "progress.h"
+#include "ringbuf.h"
+#include "metrics.h"
 
 #define MODULE_NAME "cpio"
 
 #define BUFF_SIZE	 16384
+/* checksum and hash run on blocks that fit into the L1 cache */
+#define FILL_BLOCK_SIZE	 8192
 
 typedef enum {
 	INPUT_FROM_FD,
-	INPUT_FROM_MEMORY
+	INPUT_FROM_MEMORY,
+	INPUT_FROM_RING
 } input_type_t;
 
 int get_cpiohdr(unsigned char *buf, struct filehdr *fhdr)
@@ -65,12 +71,30 @@ int get_cpiohdr(unsigned char *buf, struct filehdr *fhdr)
 	return 0;
 }
 
+/*
+ * Sum and hash block by block, so that the hash reads
+ * the data while it is still in the cache
+ */
+static int fill_update(const unsigned char *buf, size_t len,
+		       uint32_t *checksum, void *dgst)
+{
+	for (size_t done = 0; done < len; done += FILL_BLOCK_SIZE) {
+		size_t n = min_t(size_t, len - done, FILL_BLOCK_SIZE);
+
+		if (checksum)
+			*checksum = cpio_checksum(buf + done, n, *checksum);
+		if (dgst && swupdate_HASH_update(dgst, buf + done, n) < 0)
+			return -EFAULT;
+	}
+
+	return 0;
+}
+
 static int _fill_buffer(int fd, unsigned char *buf, unsigned int nbytes, unsigned long *offs,
 	uint32_t *checksum, void *dgst)
 {
 	ssize_t len;
 	unsigned long count = 0;
-	int i;
 
 	while (nbytes > 0) {
 		len = read(fd, buf, nbytes);
@@ -85,14 +109,8 @@ static int _fill_buffer(int fd, unsigned char *buf, unsigned int nbytes, unsigne
 		if (len == 0) {
 			return count;
 		}
-		if (checksum)
-			for (i = 0; i < len; i++)
-				*checksum += buf[i];
-
-		if (dgst) {
-			if (swupdate_HASH_update(dgst, buf, len) < 0)
-				return -EFAULT;
-		}
+		if (fill_update(buf, len, checksum, dgst) < 0)
+			return -EFAULT;
 		buf += len;
 		count += len;
 		nbytes -= len;
@@ -103,6 +121,31 @@ static int _fill_buffer(int fd, unsigned char *buf, unsigned int nbytes, unsigne
 }
 
 
+/*
+ * Same as _fill_buffer(), reading from a ring shared with
+ * another thread instead of a file descriptor
+ */
+static int _fill_ring(struct ringbuf *ring, unsigned char *buf, unsigned int nbytes,
+		      unsigned long *offs, uint32_t *checksum, void *dgst)
+{
+	ssize_t len;
+	unsigned long count = 0;
+
+	while (nbytes > 0) {
+		len = ringbuf_read(ring, buf, nbytes);
+		if (len <= 0)
+			return count;
+		if (fill_update(buf, len, checksum, dgst) < 0)
+			return -EFAULT;
+		buf += len;
+		count += len;
+		nbytes -= len;
+		*offs += len;
+	}
+
+	return count;
+}
+
 int fill_buffer(int fd, unsigned char *buf, unsigned int nbytes)
 {
 	unsigned long offs = 0;
@@ -238,6 +281,7 @@ typedef int (*PipelineStep)(void *state, void *buffer, size_t size);
 struct InputState
 {
 	int fdin;
+	struct ringbuf *ring;
 	input_type_t source;
 	unsigned char *inbuf;
 	size_t pos;
@@ -245,11 +289,13 @@ struct InputState
 	unsigned long *offs;
 	void *dgst;	/* use a private context for HASH */
 	uint32_t checksum;
+	uint64_t ns;	/* time spent reading, hashing and summing */
 };
 
 static int input_step(void *state, void *buffer, size_t size)
 {
 	struct InputState *s = (struct InputState *)state;
+	uint64_t start = metrics_now_ns();
 	int ret = 0;
 	if (size >= s->nbytes) {
 		size = s->nbytes;
@@ -261,6 +307,12 @@ static int input_step(void *state, void *buffer, size_t size)
 			return ret;
 		}
 		break;
+	case INPUT_FROM_RING:
+		ret = _fill_ring(s->ring, buffer, size, s->offs, &s->checksum, s->dgst);
+		if (ret < 0) {
+			return ret;
+		}
+		break;
 	case INPUT_FROM_MEMORY:
 		memcpy(buffer, &s->inbuf[s->pos], size);
 		if (s->dgst) {
@@ -272,43 +324,66 @@ static int input_step(void *state, void *buffer, size_t size)
 		break;
 	}
 	s->nbytes -= ret;
+	s->ns += metrics_now_ns() - start;
 	return ret;
 }
 
+/*
+ * Ciphertext is decrypted in batches larger than the buffers of the
+ * other steps: a backend offloading to a crypto engine pays a fixed
+ * cost per request.
+ */
+#define DECRYPT_BATCH	(64 * 1024)
+
 struct DecryptState
 {
 	PipelineStep upstream_step;
 	void *upstream_state;
 
 	void *dcrypt;	/* use a private context for decryption */
-	uint8_t input[BUFF_SIZE];
-	uint8_t output[BUFF_SIZE + AES_BLK_SIZE];
-	int outlen;
+	uint8_t *input;		/* DECRYPT_BATCH bytes */
+	uint8_t *output;	/* DECRYPT_BATCH + AES_BLK_SIZE bytes */
+	int head;	/* first plaintext byte not returned yet */
+	int outlen;	/* plaintext bytes from head */
 	bool eof;
+	uint64_t ns;	/* including the time of the upstream steps */
+	unsigned long long bytes;
 };
 
+/*
+ * Plaintext is consumed from head, the output buffer is refilled from
+ * its start only once it is empty: nothing is moved around.
+ */
+static int decrypt_output(struct DecryptState *s, void *buffer, size_t size)
+{
+	if ((int)size > s->outlen) {
+		size = s->outlen;
+	}
+	memcpy(buffer, s->output + s->head, size);
+	s->head += size;
+	s->outlen -= size;
+	return size;
+}
+
 static int decrypt_step(void *state, void *buffer, size_t size)
 {
 	struct DecryptState *s = (struct DecryptState *)state;
+	uint64_t start;
 	int ret;
 	int inlen;
 
 	if (s->outlen != 0) {
-		if ((int)size > s->outlen) {
-			size = s->outlen;
-		}
-		memcpy(buffer, s->output, size);
-		s->outlen -= size;
-		memmove(s->output, s->output + size, s->outlen);
-		return size;
+		return decrypt_output(s, buffer, size);
 	}
 
-	ret = s->upstream_step(s->upstream_state, s->input, sizeof s->input);
+	start = metrics_now_ns();
+	ret = s->upstream_step(s->upstream_state, s->input, DECRYPT_BATCH);
 	if (ret < 0) {
 		return ret;
 	}
 
 	inlen = ret;
+	s->head = 0;
 
 	if (!s->eof) {
 		if (inlen != 0) {
@@ -330,15 +405,11 @@ static int decrypt_step(void *state, void *buffer, size_t size)
 			return ret;
 		}
 	}
+	s->bytes += s->outlen;
+	s->ns += metrics_now_ns() - start;
 
 	if (s->outlen != 0) {
-		if ((int)size > s->outlen) {
-			size = s->outlen;
-		}
-		memcpy(buffer, s->output, size);
-		s->outlen -= size;
-		memmove(s->output, s->output + size, s->outlen);
-		return size;
+		return decrypt_output(s, buffer, size);
 	}
 
 	return 0;
@@ -356,6 +427,31 @@ struct DecompressState {
 };
 #endif
 
+#if defined(CONFIG_XZ) || defined(CONFIG_ZSTD)
+#define DECOMPRESS_MEMLIMIT_DEFAULT	(64 * 1024 * 1024)
+
+/* Threads decoding independent blocks or frames, 0: one per CPU */
+static unsigned int decompress_threads(void)
+{
+	struct swupdate_cfg *cfg = get_swupdate_cfg();
+	long cpus;
+
+	if (cfg->decompress_threads > 0)
+		return cfg->decompress_threads;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return cpus > 0 ? cpus : 1;
+}
+
+static size_t decompress_memlimit(void)
+{
+	struct swupdate_cfg *cfg = get_swupdate_cfg();
+
+	return cfg->decompress_memlimit ? cfg->decompress_memlimit :
+		DECOMPRESS_MEMLIMIT_DEFAULT;
+}
+#endif
+
 #ifdef CONFIG_GUNZIP
 
 struct GunzipState {
@@ -407,6 +503,7 @@ static int gunzip_step(void *state, void *buffer, size_t size)
 struct XzState {
 	lzma_stream strm;
 	bool initialized;
+	bool input_eof;
 };
 static int xz_step(void* state, void* buffer, size_t size)
 {
@@ -414,32 +511,37 @@ static int xz_step(void* state, void* buffer, size_t size)
 	struct XzState *s = (struct XzState *)ds->impl_state;
 	lzma_ret ret;
 	int outlen = 0;
-	lzma_action action = LZMA_RUN;
 
 	s->strm.next_out = buffer;
 	s->strm.avail_out = size;
 
-	while (outlen == 0) {
-		if (s->strm.avail_in == 0) {
+	while (outlen == 0 && !ds->eof) {
+		if (s->strm.avail_in == 0 && !s->input_eof) {
 			ret = ds->upstream_step(ds->upstream_state, ds->input, sizeof ds->input);
 			if (ret < 0) {
 				return ret;
 			} else if (ret == 0) {
-				ds->eof = true;
+				s->input_eof = true;
 			}
 			s->strm.avail_in = ret;
 			s->strm.next_in = ds->input;
 		}
-		if (ds->eof) {
-			break;
-		}
 
-		ret = lzma_code(&s->strm, action);
+		/*
+		 * The multi-threaded decoder holds back output until it
+		 * is told that no more input follows
+		 */
+		ret = lzma_code(&s->strm, s->input_eof ? LZMA_FINISH : LZMA_RUN);
 		outlen = size - s->strm.avail_out;
 		if (ret == LZMA_STREAM_END) {
 			ds->eof = true;
 			break;
 		}
+		if (ret == LZMA_BUF_ERROR && s->input_eof) {
+			/* truncated stream, left to the hash check as before */
+			ds->eof = true;
+			break;
+		}
 		if (ret != LZMA_OK && ret != LZMA_BUF_ERROR) {
 			ERROR("xz failed (returned %d)", ret);
 			return -1;
@@ -455,6 +557,9 @@ static int xz_step(void* state, void* buffer, size_t size)
 struct ZstdState {
 	ZSTD_DStream* dctx;
 	ZSTD_inBuffer input_view;
+	unsigned int threads;
+	size_t memlimit;
+	struct zstd_mt *mt;
 };
 
 static int zstd_step(void* state, void* buffer, size_t size)
@@ -465,6 +570,18 @@ static int zstd_step(void* state, void* buffer, size_t size)
 	int ret;
 	ZSTD_outBuffer output = { buffer, size, 0 };
 
+	/* the upstream step is known once the pipeline is set up */
+	if (s->threads > 1 && !s->mt) {
+		s->mt = zstd_mt_new(s->threads, s->memlimit,
+				    ds->upstream_step, ds->upstream_state);
+		if (!s->mt) {
+			WARN("zstd frames are decoded on a single thread");
+			s->threads = 1;
+		}
+	}
+	if (s->mt)
+		return zstd_mt_read(s->mt, buffer, size);
+
 	do {
 		if (s->input_view.pos == s->input_view.size) {
 			ret = ds->upstream_step(ds->upstream_state, ds->input, sizeof ds->input);
@@ -593,6 +710,41 @@ static int hash_compare(void *dgst, unsigned char *hash)
 	return 0;
 }
 
+/*
+ * Read back the part of the output written before an interruption,
+ * so that checksum and hash cover the whole image again
+ */
+static int copyfile_resume(int fdout, struct copy_checkpoint *ckpt,
+			   struct InputState *input_state)
+{
+	uint8_t buffer[BUFF_SIZE];
+	unsigned long long left = ckpt->resume;
+	unsigned long offs = 0;
+	int ret;
+
+	if (ckpt->resume > input_state->nbytes) {
+		ERROR("Checkpoint after the end of the image");
+		return -EINVAL;
+	}
+
+	while (left) {
+		unsigned int len = min_t(unsigned long long, left, sizeof(buffer));
+
+		ret = _fill_buffer(fdout, buffer, len, &offs,
+				   &input_state->checksum, input_state->dgst);
+		if (ret != (int)len) {
+			ERROR("Cannot read back %llu bytes to resume",
+			      ckpt->resume);
+			return -EIO;
+		}
+		left -= len;
+	}
+	input_state->nbytes -= ckpt->resume;
+	TRACE("Resuming copy after %llu bytes", ckpt->resume);
+
+	return 0;
+}
+
 int copyfile(struct swupdate_copy *args)
 {
 	unsigned int percent, prevpercent = 0;
@@ -618,7 +770,8 @@ int copyfile(struct swupdate_copy *args)
 	struct DecryptState decrypt_state = {
 		.upstream_step = NULL, .upstream_state = NULL,
 		.dcrypt = NULL,
-		.outlen = 0, .eof = false
+		.input = NULL, .output = NULL,
+		.head = 0, .outlen = 0, .eof = false
 	};
 
 #if defined(CONFIG_GUNZIP) || defined(CONFIG_ZSTD) || defined(CONFIG_XZ) || defined(CONFIG_LZ4)
@@ -648,6 +801,7 @@ int copyfile(struct swupdate_copy *args)
 	struct ZstdState zstd_state = {
 		.dctx = NULL,
 		.input_view = { NULL, 0, 0 },
+		.mt = NULL,
 	};
 #endif
 #ifdef CONFIG_LZ4
@@ -666,12 +820,20 @@ int copyfile(struct swupdate_copy *args)
 	if (args->inbuf) {
 		input_state.inbuf = args->inbuf;
 		input_state.source = INPUT_FROM_MEMORY;
+	} else if (args->inring) {
+		input_state.ring = args->inring;
+		input_state.source = INPUT_FROM_RING;
 	}
 
 	PipelineStep step = NULL;
 	void *state = NULL;
 	uint8_t buffer[BUFF_SIZE];
 	writeimage callback = args->callback;
+	struct copy_checkpoint *ckpt = args->checkpoint;
+	unsigned long long since_checkpoint = 0;
+	int ckpt_fd = -1;
+	uint64_t start_ns = metrics_now_ns(), step_ns = 0, write_ns = 0, t;
+	unsigned long long produced = 0, written = 0;
 
 	if (!callback) {
 		callback = copy_write;
@@ -719,6 +881,13 @@ int copyfile(struct swupdate_copy *args)
 			ret = -EFAULT;
 			goto copyfile_exit;
 		}
+		decrypt_state.input = malloc(2 * DECRYPT_BATCH + AES_BLK_SIZE);
+		if (!decrypt_state.input) {
+			ERROR("OOM allocating decryption buffers");
+			ret = -ENOMEM;
+			goto copyfile_exit;
+		}
+		decrypt_state.output = decrypt_state.input + DECRYPT_BATCH;
 	}
 
 	if (args->compressed) {
@@ -743,8 +912,21 @@ int copyfile(struct swupdate_copy *args)
 #endif
 #ifdef CONFIG_XZ
 		if (args->compressed == COMPRESSED_XZ) {
-			if (lzma_stream_decoder(&xz_state.strm, UINT32_MAX,
-						0) != LZMA_OK) {
+			lzma_ret lret;
+#if LZMA_VERSION >= UINT32_C(50040002)
+			/* blocks of xz -T are decoded in parallel */
+			lzma_mt mt = {
+				.threads = decompress_threads(),
+				.memlimit_threading = decompress_memlimit(),
+				.memlimit_stop = UINT32_MAX,
+			};
+
+			if (mt.threads > 1)
+				lret = lzma_stream_decoder_mt(&xz_state.strm, &mt);
+			else
+#endif
+				lret = lzma_stream_decoder(&xz_state.strm, UINT32_MAX, 0);
+			if (lret != LZMA_OK) {
 				ERROR("(lzma_stream_decoder failed");
 				ret = -EFAULT;
 				goto copyfile_exit;
@@ -762,6 +944,8 @@ int copyfile(struct swupdate_copy *args)
 				goto copyfile_exit;
 			}
 			zstd_state.input_view.src = decompress_state.input;
+			zstd_state.threads = decompress_threads();
+			zstd_state.memlimit = decompress_memlimit();
 			decompress_step = &zstd_step;
 			decompress_state.impl_state = &zstd_state;
 		} else
@@ -788,6 +972,24 @@ int copyfile(struct swupdate_copy *args)
 		}
 	}
 
+	/*
+	 * Output bytes match input bytes only without decompression
+	 * and decryption, and they are read back: the output must be
+	 * a file descriptor open for reading too
+	 */
+	if (ckpt && (args->compressed || args->encrypted || args->callback ||
+		     !args->out || args->skip_file ||
+		     (fcntl(*(int *)args->out, F_GETFL) & O_ACCMODE) != O_RDWR)) {
+		if (ckpt->resume) {
+			ERROR("Image cannot be resumed from a checkpoint");
+			ret = -EINVAL;
+			goto copyfile_exit;
+		}
+		ckpt = NULL;
+	}
+	if (ckpt)
+		ckpt_fd = *(int *)args->out;
+
 	if (args->seek) {
 		int fdout = (args->out != NULL) ? *(int *)args->out : -1;
 		if (fdout < 0) {
@@ -804,6 +1006,12 @@ int copyfile(struct swupdate_copy *args)
 		}
 	}
 
+	if (ckpt && ckpt->resume) {
+		ret = copyfile_resume(ckpt_fd, ckpt, &input_state);
+		if (ret < 0)
+			goto copyfile_exit;
+	}
+
 	step = &input_step;
 	state = &input_state;
 
@@ -824,7 +1032,9 @@ int copyfile(struct swupdate_copy *args)
 #endif
 
 	for (;;) {
+		t = metrics_now_ns();
 		ret = step(state, buffer, sizeof buffer);
+		step_ns += metrics_now_ns() - t;
 		if (ret == -EAGAIN) {
 			continue;
 		}
@@ -834,6 +1044,7 @@ int copyfile(struct swupdate_copy *args)
 		if (ret == 0) {
 			break;
 		}
+		produced += ret;
 		if (args->skip_file) {
 			continue;
 		}
@@ -844,10 +1055,23 @@ int copyfile(struct swupdate_copy *args)
 		 * results corrupted. This lets the cleanup routine
 		 * to remove it
 		 */
+		t = metrics_now_ns();
 		if (callback(args->out, buffer, len) < 0) {
 			ret = -ENOSPC;
 			goto copyfile_exit;
 		}
+		write_ns += metrics_now_ns() - t;
+		written += len;
+
+		if (ckpt && ckpt->interval) {
+			since_checkpoint += len;
+			if (since_checkpoint >= ckpt->interval) {
+				since_checkpoint = 0;
+				if (fsync(ckpt_fd) ||
+				    ckpt->save(ckpt, args->nbytes - input_state.nbytes))
+					WARN("Checkpoint cannot be saved");
+			}
+		}
 
 		percent = (unsigned)(100ULL * (args->nbytes - input_state.nbytes) / args->nbytes);
 		if (percent != prevpercent) {
@@ -861,7 +1085,8 @@ int copyfile(struct swupdate_copy *args)
 		goto copyfile_exit;
 	}
 
-	if (!args->inbuf) {
+	/* a ring carries a plain stream, not a cpio archive */
+	if (!args->inbuf && !args->inring) {
 		ret = _fill_buffer(args->fdin, buffer, NPAD_BYTES(*args->offs),
 				   args->offs, args->checksum, NULL);
 		if (ret < 0)
@@ -872,12 +1097,37 @@ int copyfile(struct swupdate_copy *args)
 		*args->checksum = input_state.checksum;
 	}
 
+	/*
+	 * Steps pull from their upstream step: the time of a stage is
+	 * the time of its step minus the time of the step before
+	 */
+	metrics_add(METRIC_COPY_BYTES_READ, args->nbytes - input_state.nbytes);
+	if (input_state.dgst)
+		metrics_add(METRIC_COPY_BYTES_HASHED, args->nbytes - input_state.nbytes);
+	metrics_observe(METRIC_COPY_READ_US, input_state.ns / 1000);
+	t = input_state.ns;
+	if (args->encrypted) {
+		metrics_add(METRIC_COPY_BYTES_DECRYPTED, decrypt_state.bytes);
+		metrics_observe(METRIC_COPY_DECRYPT_US, (decrypt_state.ns - t) / 1000);
+		t = decrypt_state.ns;
+	}
+	if (args->compressed) {
+		metrics_add(METRIC_COPY_BYTES_DECOMPRESSED, produced);
+		metrics_observe(METRIC_COPY_DECOMPRESS_US, (step_ns - t) / 1000);
+	}
+	if (!args->skip_file) {
+		metrics_add(METRIC_COPY_BYTES_WRITTEN, written);
+		metrics_observe(METRIC_COPY_WRITE_US, write_ns / 1000);
+	}
+	metrics_observe_since(METRIC_COPY_US, start_ns);
+
 	ret = 0;
 
 copyfile_exit:
 	if (decrypt_state.dcrypt) {
 		swupdate_DECRYPT_cleanup(decrypt_state.dcrypt);
 	}
+	free(decrypt_state.input);
 	if (input_state.dgst) {
 		swupdate_HASH_cleanup(input_state.dgst);
 	}
@@ -892,6 +1142,7 @@ copyfile_exit:
 	}
 #endif
 #ifdef CONFIG_ZSTD
+	zstd_mt_free(zstd_state.mt);
 	if (zstd_state.dctx != NULL) {
 		ZSTD_freeDStream(zstd_state.dctx);
 	}
@@ -909,6 +1160,7 @@ int copyimage(void *out, struct img_type *img, writeimage callback)
 {
 	struct swupdate_copy copy = {
 		.fdin = img->fdin,
+		.inring = img->ring,
 		.out = out,
 		.callback = callback,
 		.nbytes = img->size,
@@ -922,6 +1174,7 @@ int copyimage(void *out, struct img_type *img, writeimage callback)
 		.imgivt = img->ivt_ascii,
 		.imgaes = img->aes_ascii,
 		.cipher = img->cipher,
+		.checkpoint = img->checkpoint,
 	};
 	return copyfile(&copy);
 }
@@ -244,8 +244,8 @@ int swupdate_dgst_init(struct swupdate_cfg *sw, const char *keyfile)
 	return lib->dgst_init(sw, keyfile);
 }
 
-int swupdate_verify_file(void *dgst, const char *sigfile,
-		const char *file, const char *signer_name)
+int swupdate_verify_buf(void *dgst, const unsigned char *sig, size_t siglen,
+		const unsigned char *data, size_t len, const char *signer_name)
 {
 	swupdate_dgst_lib *lib;
 
@@ -253,5 +253,10 @@ int swupdate_verify_file(void *dgst, const char *sigfile,
 		return -EFAULT;
 	lib = (swupdate_dgst_lib *)current[DGSTLIB]->lib;
 
-	return lib->verify_file(dgst, sigfile, file, signer_name);
+	if (!lib->verify_buf) {
+		ERROR("%s cannot verify a signature in memory", get_dgstlib());
+		return -ENOSYS;
+	}
+
+	return lib->verify_buf(dgst, sig, siglen, data, len, signer_name);
 }
@@ -22,7 +22,8 @@ static unsigned long nr_installers = 0;
 static unsigned long handler_index = ULONG_MAX;
 
 static int __register_handler(const char *desc,
-		handler installer, HANDLER_MASK mask, void *data, handler_type_t lifetime)
+		handler installer, HANDLER_MASK mask, void *data, handler_type_t lifetime,
+		bool reads_fdin)
 {
 	int i;
 
@@ -44,6 +45,7 @@ static int __register_handler(const char *desc,
 	supported_types[nr_installers].data = data;
 	supported_types[nr_installers].mask = mask;
 	supported_types[nr_installers].noglobal = (lifetime == SESSION_HANDLER);
+	supported_types[nr_installers].reads_fdin = reads_fdin;
 	nr_installers++;
 
 	return 0;
@@ -52,13 +54,23 @@ static int __register_handler(const char *desc,
 int register_handler(const char *desc,
 		handler installer, HANDLER_MASK mask, void *data)
 {
-	return __register_handler(desc, installer, mask, data, GLOBAL_HANDLER);
+	return __register_handler(desc, installer, mask, data, GLOBAL_HANDLER, false);
 }
 
 int register_session_handler(const char *desc,
 		handler installer, HANDLER_MASK mask, void *data)
 {
-	return __register_handler(desc, installer, mask, data, SESSION_HANDLER);
+	return __register_handler(desc, installer, mask, data, SESSION_HANDLER, true);
+}
+
+/*
+ * Global handler that reads img->fdin itself instead of calling
+ * copyimage(): a chained stream is passed to it through a pipe.
+ */
+int register_fdin_handler(const char *desc,
+		handler installer, HANDLER_MASK mask, void *data)
+{
+	return __register_handler(desc, installer, mask, data, GLOBAL_HANDLER, true);
 }
 
 int unregister_handler(const char *desc)
@@ -81,6 +93,8 @@ int unregister_handler(const char *desc)
 		supported_types[j - 1].installer = supported_types[j].installer;
 		supported_types[j - 1].data = supported_types[j].data;
 		supported_types[j - 1].mask = supported_types[j].mask;
+		supported_types[j - 1].noglobal = supported_types[j].noglobal;
+		supported_types[j - 1].reads_fdin = supported_types[j].reads_fdin;
 	}
 	nr_installers--;
 
@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "util.h"
 #include "hw-compatibility.h"
 
@@ -44,6 +46,21 @@ int check_hw_compatibility(struct hw_type __attribute__ ((__unused__)) *hwt, str
 }
 #endif
 
+#ifdef CONFIG_HW_COMPATIBILITY_FILE
+#define HW_FILE CONFIG_HW_COMPATIBILITY_FILE
+#else
+#define HW_FILE "/etc/hwrevision"
+#endif
+
+/*
+ * Last content read from HW_FILE, it is valid as long as
+ * the file is not modified.
+ */
+static struct hw_type hw_file_cache;
+static struct stat hw_file_stat;
+static bool hw_file_cached;
+static pthread_mutex_t hw_file_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * This function is strict bounded with the hardware
  * It reads some GPIOs to get the hardware revision
@@ -53,11 +70,7 @@ int get_hw_revision(struct hw_type *hw)
 	FILE *fp;
 	int ret;
 	char *b1, *b2;
-#ifdef CONFIG_HW_COMPATIBILITY_FILE
-#define HW_FILE CONFIG_HW_COMPATIBILITY_FILE
-#else
-#define HW_FILE "/etc/hwrevision"
-#endif
+	struct stat st;
 
 	if (!hw)
 		return -EINVAL;
@@ -76,10 +89,23 @@ int get_hw_revision(struct hw_type *hw)
 	 * Not all boards have pins for revision number
 	 * check if there is a file containing theHW revision number
 	 */
+	pthread_mutex_lock(&hw_file_lock);
+	if (!stat(HW_FILE, &st) && hw_file_cached &&
+	    same_file_state(&st, &hw_file_stat)) {
+		strlcpy(hw->boardname, hw_file_cache.boardname, sizeof(hw->boardname));
+		strlcpy(hw->revision, hw_file_cache.revision, sizeof(hw->revision));
+		pthread_mutex_unlock(&hw_file_lock);
+		return 0;
+	}
+	hw_file_cached = false;
+	pthread_mutex_unlock(&hw_file_lock);
+
 	fp = fopen(HW_FILE, "r");
 	if (!fp)
 		return -1;
 
+	if (fstat(fileno(fp), &st))
+		memset(&st, 0, sizeof(st));
 	ret = fscanf(fp, "%ms %ms", &b1, &b2);
 	fclose(fp);
 
@@ -100,6 +126,12 @@ int get_hw_revision(struct hw_type *hw)
 	strlcpy(hw->boardname, b1, sizeof(hw->boardname));
 	strlcpy(hw->revision, b2, sizeof(hw->revision));
 
+	pthread_mutex_lock(&hw_file_lock);
+	hw_file_cache = *hw;
+	hw_file_stat = st;
+	hw_file_cached = true;
+	pthread_mutex_unlock(&hw_file_lock);
+
 	ret = 0;
 
 out:
@@ -34,6 +34,8 @@
 #include "pctl.h"
 #include "swupdate_vars.h"
 #include "lua_util.h"
+#include "versions.h"
+#include "metrics.h"
 
 /*
  * function returns:
@@ -280,6 +282,7 @@ int run_prepost_scripts(struct imglist *list, script_fn type)
 int install_single_image(struct img_type *img, bool dry_run)
 {
 	struct installer_handler *hnd;
+	uint64_t start = metrics_now_ns();
 	int ret;
 
 	/*
@@ -328,6 +331,9 @@ int install_single_image(struct img_type *img, bool dry_run)
 
 	swupdate_progress_step_completed();
 
+	metrics_observe_since(METRIC_INSTALL_IMAGE_US, start);
+	metrics_add(ret ? METRIC_IMAGES_FAILED : METRIC_IMAGES_INSTALLED, 1);
+
 	return ret;
 }
 
@@ -340,6 +346,8 @@ int update_installed_image_version(struct swver *sw_ver_list,
 	if (!sw_ver_list)
 		return false;
 
+	invalidate_sw_versions_index();
+
 	LIST_FOREACH(swver, sw_ver_list, next) {
 		/*
 		 * If component is already installed, update the version
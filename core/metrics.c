@@ -0,0 +1,310 @@
+/*
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "metrics.h"
+#include "util.h"
+
+/*
+ * Bucket i counts the observations v with 2^(i-1) <= v < 2^i, bucket 0
+ * those below 1 us, the last one everything above about half a minute
+ */
+#define METRIC_BUCKETS	26
+#define METRICS_SLOTS	32
+
+struct metric_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[METRIC_BUCKETS];
+};
+
+/* only uint64_t, so that it can be summed as an array */
+struct metric_values {
+	uint64_t counters[METRIC_COUNTERS];
+	struct metric_hist hist[METRIC_HISTOGRAMS];
+};
+
+#define METRIC_VALUES	(sizeof(struct metric_values) / sizeof(uint64_t))
+
+struct metrics_slot {
+	pid_t owner;	/* thread writing the slot, 0 if free */
+	struct metric_values v;
+} __attribute__((aligned(64)));
+
+/*
+ * A slot has a single writer, which adds with a plain load and store.
+ * Threads that do not find a free slot share the "common" one with
+ * atomic additions, exiting threads move their values there.
+ */
+struct metrics_arena {
+	int64_t gauges[METRIC_GAUGES];
+	struct metrics_slot common;
+	struct metrics_slot slots[METRICS_SLOTS];
+};
+
+static const char *counter_names[METRIC_COUNTERS] = {
+	[METRIC_COPY_BYTES_READ] = "copyfile.bytes_read",
+	[METRIC_COPY_BYTES_HASHED] = "copyfile.bytes_hashed",
+	[METRIC_COPY_BYTES_DECRYPTED] = "copyfile.bytes_decrypted",
+	[METRIC_COPY_BYTES_DECOMPRESSED] = "copyfile.bytes_decompressed",
+	[METRIC_COPY_BYTES_WRITTEN] = "copyfile.bytes_written",
+	[METRIC_IMAGES_INSTALLED] = "installer.images_installed",
+	[METRIC_IMAGES_FAILED] = "installer.images_failed",
+	[METRIC_DOWNLOAD_BYTES] = "download.bytes",
+	[METRIC_DOWNLOAD_RETRIES] = "download.retries",
+	[METRIC_RAW_BYTES_WRITTEN] = "raw.bytes_written",
+	[METRIC_RAW_BYTES_UNCHANGED] = "raw.bytes_unchanged",
+	[METRIC_RAW_BYTES_ZEROED] = "raw.bytes_zeroed",
+	[METRIC_RAW_BYTES_DISCARDED] = "raw.bytes_discarded",
+};
+
+static const char *hist_names[METRIC_HISTOGRAMS] = {
+	[METRIC_COPY_US] = "copyfile.duration_us",
+	[METRIC_COPY_READ_US] = "copyfile.read_us",
+	[METRIC_COPY_DECRYPT_US] = "copyfile.decrypt_us",
+	[METRIC_COPY_DECOMPRESS_US] = "copyfile.decompress_us",
+	[METRIC_COPY_WRITE_US] = "copyfile.write_us",
+	[METRIC_INSTALL_IMAGE_US] = "installer.image_us",
+	[METRIC_FSYNC_US] = "handler.fsync_us",
+	[METRIC_DOWNLOAD_US] = "download.duration_us",
+};
+
+static const char *gauge_names[METRIC_GAUGES] = {
+	[METRIC_IPC_NOTIFY_QUEUE] = "ipc.notify_queue",
+	[METRIC_IPC_SUBPROCESS_QUEUE] = "ipc.subprocess_queue",
+};
+
+/* Used until metrics_init() is called, and if it fails */
+static struct metrics_arena local_arena;
+static struct metrics_arena *arena = &local_arena;
+
+static __thread struct metrics_slot *thread_slot;
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+#define LOAD(p)		__atomic_load_n(p, __ATOMIC_RELAXED)
+#define STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_RELAXED)
+
+static void slot_add(struct metrics_slot *slot, uint64_t *value, uint64_t n)
+{
+	if (slot == &arena->common)
+		__atomic_fetch_add(value, n, __ATOMIC_RELAXED);
+	else
+		STORE(value, LOAD(value) + n);
+}
+
+static void slot_release(void *data)
+{
+	struct metrics_slot *slot = data;
+	uint64_t *from = (uint64_t *)&slot->v;
+	uint64_t *to = (uint64_t *)&arena->common.v;
+
+	for (size_t i = 0; i < METRIC_VALUES; i++) {
+		__atomic_fetch_add(&to[i], LOAD(&from[i]), __ATOMIC_RELAXED);
+		STORE(&from[i], 0);
+	}
+	__atomic_store_n(&slot->owner, 0, __ATOMIC_RELEASE);
+}
+
+static void slot_key_create(void)
+{
+	if (pthread_key_create(&slot_key, slot_release))
+		WARN("Metrics of exiting threads are lost");
+}
+
+static struct metrics_slot *get_slot(void)
+{
+	pid_t tid, free_owner;
+
+	if (thread_slot)
+		return thread_slot;
+
+	thread_slot = &arena->common;
+	tid = syscall(SYS_gettid);
+	for (unsigned int i = 0; i < METRICS_SLOTS; i++) {
+		free_owner = 0;
+		if (__atomic_compare_exchange_n(&arena->slots[i].owner, &free_owner, tid,
+						false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			thread_slot = &arena->slots[i];
+			pthread_once(&slot_key_once, slot_key_create);
+			pthread_setspecific(slot_key, thread_slot);
+			break;
+		}
+	}
+
+	return thread_slot;
+}
+
+/* The child must not write into the slot of the thread that forked */
+static void metrics_atfork_child(void)
+{
+	thread_slot = NULL;
+}
+
+int metrics_init(void)
+{
+	struct metrics_arena *shared;
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		WARN("Metrics are not shared with subprocesses: %s", strerror(errno));
+		return -ENOMEM;
+	}
+	/* called first in main(): nothing to carry over from the local arena */
+	arena = shared;
+	thread_slot = NULL;
+
+	return pthread_atfork(NULL, NULL, metrics_atfork_child) ? -EFAULT : 0;
+}
+
+void metrics_add(enum metric_counter id, uint64_t value)
+{
+	struct metrics_slot *slot = get_slot();
+
+	slot_add(slot, &slot->v.counters[id], value);
+}
+
+void metrics_observe(enum metric_histogram id, uint64_t usecs)
+{
+	struct metrics_slot *slot = get_slot();
+	struct metric_hist *h = &slot->v.hist[id];
+	unsigned int bucket = usecs ? 64 - __builtin_clzll(usecs) : 0;
+
+	if (bucket >= METRIC_BUCKETS)
+		bucket = METRIC_BUCKETS - 1;
+	slot_add(slot, &h->count, 1);
+	slot_add(slot, &h->sum, usecs);
+	slot_add(slot, &h->buckets[bucket], 1);
+}
+
+void metrics_gauge_set(enum metric_gauge id, int64_t value)
+{
+	__atomic_store_n(&arena->gauges[id], value, __ATOMIC_RELAXED);
+}
+
+void metrics_gauge_add(enum metric_gauge id, int64_t value)
+{
+	__atomic_fetch_add(&arena->gauges[id], value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Values are read while they are updated: the dump is not a snapshot,
+ * but each single value is consistent.
+ */
+static void metrics_sum(struct metric_values *sum)
+{
+	uint64_t *to = (uint64_t *)sum;
+
+	memset(sum, 0, sizeof(*sum));
+	for (int s = -1; s < METRICS_SLOTS; s++) {
+		struct metrics_slot *slot = s < 0 ? &arena->common : &arena->slots[s];
+		uint64_t *from = (uint64_t *)&slot->v;
+
+		for (size_t i = 0; i < METRIC_VALUES; i++)
+			to[i] += LOAD(&from[i]);
+	}
+}
+
+struct json_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+	bool failed;
+};
+
+static void json_append(struct json_buf *j, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (j->failed)
+		return;
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(j->buf + j->len, j->size - j->len, fmt, ap);
+		va_end(ap);
+		if (n < 0) {
+			j->failed = true;
+			return;
+		}
+		if ((size_t)n < j->size - j->len)
+			break;
+
+		char *tmp = realloc(j->buf, j->size * 2 + n);
+		if (!tmp) {
+			j->failed = true;
+			return;
+		}
+		j->buf = tmp;
+		j->size = j->size * 2 + n;
+	}
+	j->len += n;
+}
+
+char *metrics_dump_json(void)
+{
+	struct metric_values *sum;
+	struct json_buf j = { .size = 4096 };
+
+	sum = calloc(1, sizeof(*sum));
+	j.buf = malloc(j.size);
+	if (!sum || !j.buf) {
+		free(sum);
+		free(j.buf);
+		return NULL;
+	}
+	metrics_sum(sum);
+
+	json_append(&j, "{\"counters\":{");
+	for (int i = 0; i < METRIC_COUNTERS; i++)
+		json_append(&j, "%s\"%s\":%llu", i ? "," : "", counter_names[i],
+			    (unsigned long long)sum->counters[i]);
+
+	json_append(&j, "},\"gauges\":{");
+	for (int i = 0; i < METRIC_GAUGES; i++)
+		json_append(&j, "%s\"%s\":%lld", i ? "," : "", gauge_names[i],
+			    (long long)LOAD(&arena->gauges[i]));
+
+	/* buckets are named after their exclusive upper bound */
+	json_append(&j, "},\"histograms\":{");
+	for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+		struct metric_hist *h = &sum->hist[i];
+		bool first = true;
+
+		json_append(&j, "%s\"%s\":{\"count\":%llu,\"sum\":%llu,\"buckets\":{",
+			    i ? "," : "", hist_names[i],
+			    (unsigned long long)h->count, (unsigned long long)h->sum);
+		for (int b = 0; b < METRIC_BUCKETS; b++) {
+			if (!h->buckets[b])
+				continue;
+			if (b == METRIC_BUCKETS - 1)
+				json_append(&j, "%s\"inf\":%llu", first ? "" : ",",
+					    (unsigned long long)h->buckets[b]);
+			else
+				json_append(&j, "%s\"%llu\":%llu", first ? "" : ",",
+					    1ULL << b, (unsigned long long)h->buckets[b]);
+			first = false;
+		}
+		json_append(&j, "}}");
+	}
+	json_append(&j, "}}");
+
+	free(sum);
+	if (j.failed) {
+		free(j.buf);
+		return NULL;
+	}
+
+	return j.buf;
+}
@@ -35,6 +35,7 @@
 #include "generated/autoconf.h"
 #include "state.h"
 #include "swupdate_vars.h"
+#include "metrics.h"
 
 #define NUM_CACHED_MESSAGES 100
 #define DEFAULT_INTERNAL_TIMEOUT 60
@@ -186,6 +187,7 @@ static void network_notifier(RECOVERY_STATUS status, int error, int level, const
 		free(oldmsg);
 		nrmsgs--;
 	}
+	metrics_gauge_set(METRIC_IPC_NOTIFY_QUEUE, nrmsgs);
 	newmsg->msg = (char *)newmsg + sizeof(struct msg_elem);
 
 	newmsg->status = status;
@@ -228,6 +230,7 @@ static void cleanum_msg_list(void)
 		free(notification);
 	}
 	nrmsgs = 0;
+	metrics_gauge_set(METRIC_IPC_NOTIFY_QUEUE, 0);
 	pthread_mutex_unlock(&msglock);
 }
 
@@ -344,6 +347,7 @@ static void *subprocess_thread (void *data)
 			struct subprocess_msg_elem *subprocess_msg;
 			subprocess_msg = SIMPLEQ_FIRST(&subprocess_messages);
 			SIMPLEQ_REMOVE_HEAD(&subprocess_messages, next);
+			metrics_gauge_add(METRIC_IPC_SUBPROCESS_QUEUE, -1);
 
 			pthread_mutex_unlock(&subprocess_msg_lock);
 
@@ -377,6 +381,7 @@ void *network_thread (void *data)
 	bool should_close_socket;
 	struct swupdate_cfg *cfg;
 	char *varvalue;
+	char *json;
 
 	if (!instp) {
 		TRACE("Fatal error: Network thread aborting...");
@@ -454,6 +459,7 @@ void *network_thread (void *data)
 
 				pthread_mutex_lock(&subprocess_msg_lock);
 				SIMPLEQ_INSERT_TAIL(&subprocess_messages, subprocess_msg, next);
+				metrics_gauge_add(METRIC_IPC_SUBPROCESS_QUEUE, 1);
 				pthread_cond_signal(&subprocess_wkup);
 				pthread_mutex_unlock(&subprocess_msg_lock);
 				/*
@@ -508,6 +514,7 @@ void *network_thread (void *data)
 				if (notification) {
 					SIMPLEQ_REMOVE_HEAD(&notifymsgs, next);
 					nrmsgs--;
+					metrics_gauge_set(METRIC_IPC_NOTIFY_QUEUE, nrmsgs);
 					strncpy(msg.data.status.desc, notification->msg,
 						sizeof(msg.data.status.desc) - 1);
 					msg.data.status.current = notification->status;
@@ -646,6 +653,25 @@ void *network_thread (void *data)
 							     msg.data.dwl_url.filename,
 							     msg.data.dwl_url.url) == 0 ? ACK : NACK;
 				break;
+			case GET_METRICS:
+				json = metrics_dump_json();
+				if (!json) {
+					msg.type = NACK;
+					memset(msg.data.msg, 0, sizeof(msg.data.msg));
+					break;
+				}
+				/* the JSON does not fit into the message, it follows it */
+				msg.type = ACK;
+				memset(msg.data.msg, 0, sizeof(msg.data.msg));
+				msg.data.metrics.len = strlen(json);
+				if (write(ctrlconnfd, &msg, sizeof(msg)) != sizeof(msg) ||
+				    write(ctrlconnfd, json, msg.data.metrics.len) !=
+				    (ssize_t)msg.data.metrics.len)
+					ERROR("Error write metrics on socket ctrl: %s", strerror(errno));
+				free(json);
+				close(ctrlconnfd);
+				msg.type = GET_METRICS;
+				break;
 			default:
 				msg.type = NACK;
 			}
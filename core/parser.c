@@ -11,6 +11,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include "swupdate.h"
 #include "parsers.h"
 #include "util.h"
@@ -18,10 +19,9 @@
 #include "handler.h"
 #include "swupdate_crypto.h"
 
-static parser_fn parsers[] = {
-	parse_cfg,
-	parse_json,
-	parse_external
+static parser_buf_fn buf_parsers[] = {
+	parse_cfg_buffer,
+	parse_json_buffer
 };
 
 typedef enum {
@@ -142,40 +142,18 @@ struct swupdate_type_cfg *swupdate_find_update_type(struct swupdate_type_list *l
 	return NULL;
 }
 
-int parse(struct swupdate_cfg *sw, const char *descfile)
+/*
+ * Report the errors of all parsers if none of them succeeded
+ */
+static int parse_result(int ret, char **errors, unsigned int nparsers,
+			const struct timespec *start)
 {
-	int ret = -1;
-	parser_fn current;
-#ifdef CONFIG_SIGNED_IMAGES
-	char *sigfile;
+	struct timespec end;
 
-	sigfile = malloc(strlen(descfile) + strlen(".sig") + 1);
-	if (!sigfile)
-		return -ENOMEM;
-	strcpy(sigfile, descfile);
-	strcat(sigfile, ".sig");
-
-	ret = swupdate_verify_file(sw->dgst, sigfile, descfile,
-				   sw->forced_signer_name);
-	free(sigfile);
-
-	if (ret)
-		return ret;
-
-#endif
-	char *errors[ARRAY_SIZE(parsers)] = {0};
-
-	for (unsigned int i = 0; i < ARRAY_SIZE(parsers); i++) {
-		current = parsers[i];
-
-		ret = current(sw, descfile, &errors[i]);
-
-		if (ret == 0)
-			break;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
 	if (ret != 0) {
-		for (unsigned int i = 0; i < ARRAY_SIZE(parsers); i++) {
+		for (unsigned int i = 0; i < nparsers; i++) {
 			if (errors[i] != NULL) {
 				ERROR("%s", errors[i]);
 				free(errors[i]);
@@ -185,10 +163,24 @@ int parse(struct swupdate_cfg *sw, const char *descfile)
 		return ret;
 	}
 
-	for (unsigned int i = 0; i < ARRAY_SIZE(parsers); i++)
+	for (unsigned int i = 0; i < nparsers; i++)
 		if (errors[i] != NULL)
 			free(errors[i]);
 
+	INFO("%s parsed in %ld ms", SW_DESCRIPTION_FILENAME,
+	     (long)((end.tv_sec - start->tv_sec) * 1000 +
+		    (end.tv_nsec - start->tv_nsec) / 1000000));
+
+	return 0;
+}
+
+/*
+ * Checks on the parsed description, common to all parsers
+ */
+static int parse_check(struct swupdate_cfg *sw)
+{
+	int ret;
+
 	ret = check_handler_list(&sw->scripts, SCRIPT_HANDLER, IS_SCRIPT, "scripts");
 	ret |= check_handler_list(&sw->images, IMAGE_HANDLER | FILE_HANDLER, IS_IMAGE_FILE,
 					"images / files");
@@ -315,3 +307,72 @@ int parse(struct swupdate_cfg *sw, const char *descfile)
 
 	return ret;
 }
+
+#ifdef CONFIG_LUAEXTERNAL
+/*
+ * The external parser reads sw-description from TMPDIR
+ */
+static int parse_external_buffer(struct swupdate_cfg *sw, const char *desc,
+				 size_t desclen, char **error)
+{
+	char *fname;
+	int fd, ret;
+
+	if (asprintf(&fname, "%s%s", get_tmpdir(), SW_DESCRIPTION_FILENAME) ==
+	    ENOMEM_ASPRINTF)
+		return -ENOMEM;
+
+	fd = openfileoutput(fname);
+	if (fd < 0) {
+		free(fname);
+		return -EIO;
+	}
+	ret = copy_write(&fd, desc, desclen);
+	close(fd);
+	if (!ret)
+		ret = parse_external(sw, fname, error);
+	free(fname);
+
+	return ret;
+}
+#endif
+
+/*
+ * Verify and parse a sw-description already read into memory,
+ * desc must be NUL terminated.
+ */
+int parse_buffer(struct swupdate_cfg *sw, const char *desc, size_t desclen,
+		 const unsigned char *sig, size_t siglen)
+{
+	int ret = -1;
+#ifdef CONFIG_SIGNED_IMAGES
+	ret = swupdate_verify_buf(sw->dgst, sig, siglen,
+				  (const unsigned char *)desc, desclen,
+				  sw->forced_signer_name);
+	if (ret)
+		return ret;
+#else
+	(void)sig;
+	(void)siglen;
+#endif
+	char *errors[ARRAY_SIZE(buf_parsers) + 1] = {0};
+	struct timespec start;
+	unsigned int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < ARRAY_SIZE(buf_parsers); i++) {
+		ret = buf_parsers[i](sw, desc, desclen, &errors[i]);
+		if (ret == 0)
+			break;
+	}
+#ifdef CONFIG_LUAEXTERNAL
+	if (ret)
+		ret = parse_external_buffer(sw, desc, desclen, &errors[i]);
+#endif
+
+	ret = parse_result(ret, errors, ARRAY_SIZE(errors), &start);
+	if (ret)
+		return ret;
+
+	return parse_check(sw);
+}
@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <assert.h>
 #include "generated/autoconf.h"
 #include "bsdqueue.h"
@@ -21,6 +22,267 @@
 #include "parselib-private.h"
 
 #define MAX_LINKS_DEPTH	10
+#define PATH_INDEX_MIN_SIZE	64
+
+/*
+ * Index of a parsed description: every named node reachable from
+ * the root is stored with its dotted path, so that the lookups done
+ * by the parser for each field do not walk the tree again. The target
+ * of a link ("ref") is resolved once and memoized together with the
+ * path it leads to.
+ * There is a single index, parsing is not reentrant anyway.
+ */
+struct path_entry {
+	char *path;
+	uint32_t hash;
+	void *node;
+	void *target;
+	char **target_nodes;
+};
+
+static struct {
+	parsertype p;
+	void *root;
+	struct path_entry *entries;
+	unsigned int size;
+	unsigned int count;
+} path_index;
+
+static uint32_t path_hash(const char *s)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*s) {
+		hash ^= (unsigned char)*s++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static struct path_entry *path_index_slot(struct path_entry *entries,
+					  unsigned int size,
+					  const char *path, uint32_t hash)
+{
+	unsigned int mask = size - 1;
+
+	for (unsigned int i = hash & mask; ; i = (i + 1) & mask) {
+		struct path_entry *e = &entries[i];
+		if (!e->path || (e->hash == hash && !strcmp(e->path, path)))
+			return e;
+	}
+}
+
+static int path_index_grow(void)
+{
+	unsigned int size = path_index.size ? path_index.size * 2 :
+				PATH_INDEX_MIN_SIZE;
+	struct path_entry *entries = calloc(size, sizeof(*entries));
+
+	if (!entries)
+		return -ENOMEM;
+
+	for (unsigned int i = 0; i < path_index.size; i++) {
+		struct path_entry *e = &path_index.entries[i];
+		if (e->path)
+			*path_index_slot(entries, size, e->path, e->hash) = *e;
+	}
+	free(path_index.entries);
+	path_index.entries = entries;
+	path_index.size = size;
+
+	return 0;
+}
+
+static int path_index_add(const char *path, const char *name, void *node,
+			  void *data)
+{
+	struct path_entry *e;
+	uint32_t hash;
+
+	(void)data;
+
+	/*
+	 * The index joins names with '.', names containing it
+	 * would be ambiguous: leave them to the slow path.
+	 */
+	if (strchr(name, '.'))
+		return 1;
+
+	if ((path_index.count + 1) * 2 > path_index.size && path_index_grow())
+		return -ENOMEM;
+
+	hash = path_hash(path);
+	e = path_index_slot(path_index.entries, path_index.size, path, hash);
+	if (e->path)
+		return 0;
+	e->path = strdup(path);
+	if (!e->path)
+		return -ENOMEM;
+	e->hash = hash;
+	e->node = node;
+	path_index.count++;
+
+	return 0;
+}
+
+static struct path_entry *path_index_lookup(const char **nodes)
+{
+	struct path_entry *e;
+	char *path;
+
+	path = mstrcat(nodes, ".");
+	if (!path)
+		return NULL;
+	e = path_index_slot(path_index.entries, path_index.size, path,
+			    path_hash(path));
+	free(path);
+
+	return e->path ? e : NULL;
+}
+
+static bool path_index_usable(parsertype p, void *root, const char **nodes)
+{
+	if (!path_index.entries || path_index.root != root ||
+	    path_index.p != p || !nodes[0])
+		return false;
+	for (const char **n = nodes; *n; n++)
+		if (strchr(*n, '.'))
+			return false;
+	return true;
+}
+
+void parser_index_free(void)
+{
+	for (unsigned int i = 0; i < path_index.size; i++) {
+		free(path_index.entries[i].path);
+		free_string_array(path_index.entries[i].target_nodes);
+	}
+	free(path_index.entries);
+	memset(&path_index, 0, sizeof(path_index));
+}
+
+int parser_index_build(parsertype p, void *root)
+{
+	int ret;
+
+	parser_index_free();
+
+	switch (p) {
+	case LIBCFG_PARSER:
+		ret = walk_nodes_libconfig((config_t *)root, path_index_add, NULL);
+		break;
+	case JSON_PARSER:
+		ret = walk_nodes_json((json_object *)root, path_index_add, NULL);
+		break;
+	default:
+		ret = -EINVAL;
+	}
+
+	if (ret || !path_index.entries) {
+		parser_index_free();
+		return ret;
+	}
+
+	path_index.p = p;
+	path_index.root = root;
+	TRACE("Path index built with %u nodes", path_index.count);
+
+	return 0;
+}
+
+static bool is_link_container(parsertype p, void *node)
+{
+	enum json_type type;
+
+	switch (p) {
+	case LIBCFG_PARSER:
+		return config_setting_is_group((config_setting_t *)node) ==
+			CONFIG_TRUE;
+	case JSON_PARSER:
+		type = json_object_get_type((json_object *)node);
+		return type == json_type_object || type == json_type_array;
+	default:
+		return false;
+	}
+}
+
+static void *find_root_backend(parsertype p, void *root, const char **nodes,
+			       unsigned int depth)
+{
+	switch (p) {
+	case LIBCFG_PARSER:
+		return find_root_libconfig((config_t *)root, nodes, depth);
+	case JSON_PARSER:
+		return find_root_json((json_object *)root, nodes, depth);
+	default:
+		(void)root;
+		(void)nodes;
+		(void)depth;
+	}
+
+	return NULL;
+}
+
+static void *find_root_indexed(const char **nodes, unsigned int depth)
+{
+	struct path_entry *e;
+	const char *ref;
+	unsigned int count;
+	void *node;
+
+	/*
+	 * check for deadlock links, block recursion
+	 */
+	if (!(--depth))
+		return NULL;
+
+	e = path_index_lookup(nodes);
+	if (!e)
+		return NULL;
+
+	if (e->target) {
+		for (count = 0; e->target_nodes[count]; count++)
+			nodes[count] = e->target_nodes[count];
+		nodes[count] = NULL;
+		return e->target;
+	}
+
+	ref = is_link_container(path_index.p, e->node) ?
+		get_field_string(path_index.p, e->node, "ref") : NULL;
+	if (!ref)
+		return e->node;
+
+	if (!set_find_path(nodes, ref))
+		return NULL;
+	if (path_index_usable(path_index.p, path_index.root, nodes))
+		node = find_root_indexed(nodes, depth);
+	else
+		node = find_root_backend(path_index.p, path_index.root, nodes,
+					 depth);
+
+	/*
+	 * Memoize the resolved link, the target path is copied
+	 * because set_find_path() leaves it to the caller
+	 */
+	if (node) {
+		count = count_string_array(nodes);
+		e->target_nodes = calloc(count + 1, sizeof(char *));
+		if (e->target_nodes) {
+			for (unsigned int i = 0; i < count; i++) {
+				e->target_nodes[i] = strdup(nodes[i]);
+				if (!e->target_nodes[i]) {
+					free_string_array(e->target_nodes);
+					e->target_nodes = NULL;
+					return node;
+				}
+			}
+			e->target = node;
+		}
+	}
+
+	return node;
+}
 
 void check_field_string(const char *src, char *dst, const size_t max_len)
 {
@@ -228,23 +490,20 @@ int exist_field_string(parsertype p, void *e, const char *path)
 
 void *find_root(parsertype p, void *root, const char **nodes)
 {
+	if (path_index_usable(p, root, nodes))
+		return find_root_indexed(nodes, MAX_LINKS_DEPTH);
 
-	switch (p) {
-	case LIBCFG_PARSER:
-		return find_root_libconfig((config_t *)root, nodes, MAX_LINKS_DEPTH);
-
-	case JSON_PARSER:
-		return find_root_json((json_object *)root, nodes, MAX_LINKS_DEPTH);
-	default:
-		(void)root;
-		(void)nodes;
-	}
-
-	return NULL;
+	return find_root_backend(p, root, nodes, MAX_LINKS_DEPTH);
 }
 
 void *get_node(parsertype p, void *root, const char **nodes)
 {
+	struct path_entry *e;
+
+	if (path_index_usable(p, root, nodes)) {
+		e = path_index_lookup(nodes);
+		return e ? e->node : NULL;
+	}
 
 	switch (p) {
 	case LIBCFG_PARSER:
@@ -17,6 +17,7 @@
 #endif
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include <network_ipc.h>
 #include <pctl.h>
@@ -65,6 +66,19 @@ static int threads_towait = 0;
 static pthread_mutex_t threads_towait_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t threads_towait_cond = PTHREAD_COND_INITIALIZER;
 
+/*
+ * Initialization run in background at startup, it must be
+ * completed before an update is started
+ */
+struct init_task {
+	const char *name;
+	void (*fn)(void *data);
+	void *data;
+};
+static int init_tasks_pending = 0;
+static pthread_mutex_t init_tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t init_tasks_cond = PTHREAD_COND_INITIALIZER;
+
 #if defined(__linux__)
 static void parent_dead_handler(int __attribute__ ((__unused__)) dummy)
 {
@@ -119,6 +133,71 @@ void wait_threads_ready(void)
 	pthread_mutex_unlock(&threads_towait_lock);
 }
 
+static void *init_task_thread(void *data)
+{
+	struct init_task *task = (struct init_task *)data;
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	task->fn(task->data);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	INFO("Startup: %s initialized in %ld ms (background)", task->name,
+	     (end.tv_sec - start.tv_sec) * 1000 +
+	     (end.tv_nsec - start.tv_nsec) / 1000000);
+	free(task);
+
+	pthread_mutex_lock(&init_tasks_lock);
+	init_tasks_pending--;
+	if (init_tasks_pending == 0)
+		pthread_cond_broadcast(&init_tasks_cond);
+	pthread_mutex_unlock(&init_tasks_lock);
+
+	return NULL;
+}
+
+/*
+ * Run an initialization step in parallel to the rest of the startup.
+ * If no thread can be started, it is run synchronously.
+ */
+void start_init_task(const char *name, void (*fn)(void *data), void *data)
+{
+	struct init_task *task;
+	pthread_attr_t attr;
+	pthread_t id;
+
+	task = (struct init_task *)calloc(1, sizeof(*task));
+	if (!task) {
+		fn(data);
+		return;
+	}
+	task->name = name;
+	task->fn = fn;
+	task->data = data;
+
+	pthread_mutex_lock(&init_tasks_lock);
+	init_tasks_pending++;
+	pthread_mutex_unlock(&init_tasks_lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&id, &attr, init_task_thread, task)) {
+		WARN("Cannot start %s initialization in background", name);
+		init_task_thread(task);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Wait until all background initialization is done
+ */
+void wait_init_tasks(void)
+{
+	pthread_mutex_lock(&init_tasks_lock);
+	while (init_tasks_pending != 0)
+		pthread_cond_wait(&init_tasks_cond, &init_tasks_lock);
+	pthread_mutex_unlock(&init_tasks_lock);
+}
+
 /*
  * spawn_process forks and start a new process
  * under a new user
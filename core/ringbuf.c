@@ -0,0 +1,164 @@
+/*
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ringbuf.h"
+#include "util.h"
+
+/*
+ * head and tail run freely and are reduced modulo the size (a power
+ * of two) only to index the buffer. The producer owns head, the
+ * consumer owns tail; the lock and condition are used only to sleep
+ * when the ring is full or empty.
+ */
+struct ringbuf {
+	unsigned char *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+	int wclosed;
+	int rclosed;
+	int reader_waiting;
+	int writer_waiting;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+#define LOAD(p)		__atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+
+struct ringbuf *ringbuf_new(size_t size)
+{
+	struct ringbuf *rb;
+	size_t rsize = 4096;
+
+	while (rsize < size)
+		rsize <<= 1;
+
+	rb = calloc(1, sizeof(*rb));
+	if (!rb)
+		return NULL;
+	rb->buf = malloc(rsize);
+	if (!rb->buf) {
+		free(rb);
+		return NULL;
+	}
+	rb->size = rsize;
+	pthread_mutex_init(&rb->lock, NULL);
+	pthread_cond_init(&rb->cond, NULL);
+
+	return rb;
+}
+
+void ringbuf_free(struct ringbuf *rb)
+{
+	if (!rb)
+		return;
+	pthread_mutex_destroy(&rb->lock);
+	pthread_cond_destroy(&rb->cond);
+	free(rb->buf);
+	free(rb);
+}
+
+static void ringbuf_wake(struct ringbuf *rb, int *waiting)
+{
+	if (LOAD(waiting)) {
+		pthread_mutex_lock(&rb->lock);
+		pthread_cond_broadcast(&rb->cond);
+		pthread_mutex_unlock(&rb->lock);
+	}
+}
+
+int ringbuf_write(struct ringbuf *rb, const void *buf, size_t len)
+{
+	const unsigned char *src = buf;
+
+	while (len) {
+		size_t head = rb->head;
+		size_t space = rb->size - (head - LOAD(&rb->tail));
+
+		if (LOAD(&rb->rclosed))
+			return -EPIPE;
+
+		if (!space) {
+			pthread_mutex_lock(&rb->lock);
+			STORE(&rb->writer_waiting, 1);
+			while (rb->size == head - LOAD(&rb->tail) &&
+			       !LOAD(&rb->rclosed))
+				pthread_cond_wait(&rb->cond, &rb->lock);
+			STORE(&rb->writer_waiting, 0);
+			pthread_mutex_unlock(&rb->lock);
+			continue;
+		}
+
+		size_t n = min_t(size_t, len, space);
+		size_t off = head & (rb->size - 1);
+		size_t first = min_t(size_t, n, rb->size - off);
+
+		memcpy(rb->buf + off, src, first);
+		memcpy(rb->buf, src + first, n - first);
+		STORE(&rb->head, head + n);
+		ringbuf_wake(rb, &rb->reader_waiting);
+
+		src += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+ssize_t ringbuf_read(struct ringbuf *rb, void *buf, size_t len)
+{
+	unsigned char *dst = buf;
+	size_t tail = rb->tail;
+	size_t avail;
+
+	for (;;) {
+		avail = LOAD(&rb->head) - tail;
+		if (avail || LOAD(&rb->wclosed))
+			break;
+		pthread_mutex_lock(&rb->lock);
+		STORE(&rb->reader_waiting, 1);
+		while (LOAD(&rb->head) == tail && !LOAD(&rb->wclosed))
+			pthread_cond_wait(&rb->cond, &rb->lock);
+		STORE(&rb->reader_waiting, 0);
+		pthread_mutex_unlock(&rb->lock);
+	}
+
+	/* data written before the end of stream is still delivered */
+	avail = LOAD(&rb->head) - tail;
+	if (!avail)
+		return 0;
+
+	size_t n = min_t(size_t, len, avail);
+	size_t off = tail & (rb->size - 1);
+	size_t first = min_t(size_t, n, rb->size - off);
+
+	memcpy(dst, rb->buf + off, first);
+	memcpy(dst + first, rb->buf, n - first);
+	STORE(&rb->tail, tail + n);
+	ringbuf_wake(rb, &rb->writer_waiting);
+
+	return n;
+}
+
+void ringbuf_close_write(struct ringbuf *rb)
+{
+	pthread_mutex_lock(&rb->lock);
+	STORE(&rb->wclosed, 1);
+	pthread_cond_broadcast(&rb->cond);
+	pthread_mutex_unlock(&rb->lock);
+}
+
+void ringbuf_close_read(struct ringbuf *rb)
+{
+	pthread_mutex_lock(&rb->lock);
+	STORE(&rb->rclosed, 1);
+	pthread_cond_broadcast(&rb->cond);
+	pthread_mutex_unlock(&rb->lock);
+}
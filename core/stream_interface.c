@@ -46,6 +46,8 @@
 #include "bootloader.h"
 #include "hw-compatibility.h"
 #include "swupdate_crypto.h"
+#include "versions.h"
+#include "swupdate_vars.h"
 
 #define BUFF_SIZE	 4096
 #define PERCENT_LB_INDEX	4
@@ -84,14 +86,55 @@ pthread_cond_t stream_cond = PTHREAD_COND_INITIALIZER;
 
 static struct installer inst;
 
-static int extract_file_to_tmp(int fd, const char *fname, unsigned long *poffs,
-			       bool encrypted, int max_size)
+/*
+ * sw-description and its signature are kept in memory
+ * to be verified and parsed. The size in the cpio header is not
+ * authenticated yet: the buffer grows with the data actually read.
+ */
+#define SWDESC_BUF_CHUNK	(64 * 1024)
+
+struct swdesc_buf {
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+	size_t max;	/* announced size and the terminator */
+};
+
+static int swdesc_buf_write(void *out, const void *buf, size_t len)
+{
+	struct swdesc_buf *desc = (struct swdesc_buf *)out;
+	unsigned char *tmp;
+	size_t size;
+
+	/* one byte is reserved for the terminator */
+	if (len >= desc->max - desc->len) {
+		ERROR("%s exceeds its announced size", SW_DESCRIPTION_FILENAME);
+		return -EFBIG;
+	}
+	if (len >= desc->size - desc->len) {
+		size = desc->size;
+		while (len >= size - desc->len)
+			size = min(size * 2, desc->max);
+		tmp = realloc(desc->buf, size);
+		if (!tmp) {
+			ERROR("OOM, %s cannot be read", SW_DESCRIPTION_FILENAME);
+			return -ENOMEM;
+		}
+		desc->buf = tmp;
+		desc->size = size;
+	}
+	memcpy(desc->buf + desc->len, buf, len);
+	desc->len += len;
+	desc->buf[desc->len] = '\0';
+
+	return 0;
+}
+
+static int extract_file_to_buf(int fd, const char *fname, unsigned long *poffs,
+			       bool encrypted, int max_size, struct swdesc_buf *desc)
 {
-	char output_file[MAX_IMAGE_FNAME];
 	struct filehdr fdh;
-	int fdout = -1;
 	uint32_t checksum;
-	const char* TMPDIR = get_tmpdir();
 	cipher_t cipher = AES_CBC;
 	int ret = -1;
 
@@ -111,11 +154,6 @@ static int extract_file_to_tmp(int fd, const char *fname, unsigned long *poffs,
 			fname);
 		goto err;
 	}
-	if (snprintf(output_file, sizeof(output_file), "%s%s", TMPDIR,
-		     fdh.filename) >= (int)sizeof(output_file)) {
-		ERROR("Path too long: %s%s", TMPDIR, fdh.filename);
-		goto err;
-	}
 	if (max_size && fdh.size >= max_size) {
 		ERROR("%s size (%ld) exceeds configured max of %d, aborting",
 			fdh.filename, fdh.size, max_size);
@@ -123,20 +161,27 @@ static int extract_file_to_tmp(int fd, const char *fname, unsigned long *poffs,
 	}
 	if (!is_filename_valid(fdh.filename)) {
 		ERROR("%s is an invalid filename, aborting", fdh.filename);
-		return -1;
+		goto err;
 	}
 
 	TRACE("Found file");
 	TRACE("\tfilename %s", fdh.filename);
 	TRACE("\tsize %u", (unsigned int)fdh.size);
 
-	fdout = openfileoutput(output_file);
-	if (fdout < 0)
+	desc->len = 0;
+	desc->max = fdh.size + 1;
+	desc->size = min_t(size_t, desc->max, SWDESC_BUF_CHUNK);
+	desc->buf = (unsigned char *)malloc(desc->size);
+	if (!desc->buf) {
+		ERROR("OOM, %s cannot be read", fdh.filename);
 		goto err;
+	}
+	desc->buf[0] = '\0';
 
 	struct swupdate_copy copy = {
 		.fdin = fd,
-		.out = &fdout,
+		.callback = swdesc_buf_write,
+		.out = desc,
 		.nbytes = fdh.size,
 		.offs = poffs,
 		.checksum = &checksum,
@@ -155,11 +200,127 @@ err:
 	if (encrypted)
 		set_cryptolib(cryptolib);
 #endif
-	if (fdout >= 0)
-		close(fdout);
+	if (ret) {
+		free(desc->buf);
+		desc->buf = NULL;
+		desc->len = 0;
+	}
 	return ret;
 }
 
+/*
+ * Verify and parse sw-description extracted from the SWU
+ */
+static int parse_swdesc(struct swupdate_cfg *software, struct swdesc_buf *desc,
+			struct swdesc_buf *sig)
+{
+	int ret;
+
+	ret = parse_buffer(software, (const char *)desc->buf, desc->len,
+			   sig->buf, sig->len);
+	free(desc->buf);
+	free(sig->buf);
+	desc->buf = sig->buf = NULL;
+
+	return ret;
+}
+
+/*
+ * Checkpoint of a streamed image. An interrupted install continues when
+ * the stream contains the SWU up to prefix (sw-description and all files
+ * copied to TMPDIR), followed by the image data from dataoff + written.
+ */
+struct stream_checkpoint {
+	char id[17];			/* sw-description digest */
+	unsigned long long prefix;
+	unsigned long long dataoff;
+	unsigned long long written;
+	unsigned long long size;
+	unsigned int chksum;
+	unsigned int done;		/* streamed images since the prefix */
+	char fname[MAX_IMAGE_FNAME];
+	struct copy_checkpoint copy;
+};
+
+static void swdesc_id(struct swdesc_buf *desc, char *id, size_t len)
+{
+	unsigned char md[SHA256_HASH_LENGTH];
+	unsigned int md_len;
+	void *dgst;
+
+	id[0] = '\0';
+	dgst = swupdate_HASH_init(SHA_DEFAULT);
+	if (!dgst)
+		return;
+	if (!swupdate_HASH_update(dgst, desc->buf, desc->len) &&
+	    !swupdate_HASH_final(dgst, md, &md_len)) {
+		for (unsigned int i = 0; i < (len - 1) / 2 && i < md_len; i++)
+			sprintf(&id[i * 2], "%02x", md[i]);
+	}
+	swupdate_HASH_cleanup(dgst);
+}
+
+static int checkpoint_save(struct copy_checkpoint *copy, unsigned long long written)
+{
+	struct stream_checkpoint *ckpt = copy->data;
+	char value[256];
+
+	if (snprintf(value, sizeof(value), STREAM_CHECKPOINT_FMT, ckpt->id,
+		     ckpt->prefix, ckpt->dataoff, written, ckpt->size,
+		     ckpt->chksum, ckpt->done, ckpt->fname) >= (int)sizeof(value))
+		return -ENAMETOOLONG;
+	ckpt->written = written;
+	TRACE("Checkpoint %s after %llu bytes", ckpt->fname, written);
+
+	return swupdate_vars_set(STREAM_CHECKPOINT_VAR, value, NULL);
+}
+
+static bool checkpoint_load(struct stream_checkpoint *ckpt)
+{
+	char *value = swupdate_vars_get(STREAM_CHECKPOINT_VAR, NULL);
+	int n;
+
+	if (!value)
+		return false;
+	n = sscanf(value, "%16s %llu %llu %llu %llu %u %u %255s", ckpt->id,
+		   &ckpt->prefix, &ckpt->dataoff, &ckpt->written, &ckpt->size,
+		   &ckpt->chksum, &ckpt->done, ckpt->fname);
+	free(value);
+
+	return n == 8 && ckpt->prefix <= ckpt->dataoff &&
+		ckpt->written <= ckpt->size;
+}
+
+static void checkpoint_clear(void)
+{
+	char *value = swupdate_vars_get(STREAM_CHECKPOINT_VAR, NULL);
+
+	if (value) {
+		free(value);
+		swupdate_vars_unset(STREAM_CHECKPOINT_VAR, NULL);
+	}
+}
+
+/*
+ * A resumed download does not get the whole SWU and cannot be checked
+ * by the downloader: the files after the checkpoint must be verified
+ * by their own sha256, so checkpoints are only kept if all carry one.
+ */
+static bool checkpoint_allowed(struct swupdate_cfg *software)
+{
+	struct imglist *lists[] = { &software->images, &software->scripts };
+	struct img_type *img;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(lists); i++) {
+		LIST_FOREACH(img, lists[i], next) {
+			if (!IsValidHash(img->sha256))
+				return false;
+		}
+	}
+
+	return true;
+}
+
 static bool update_transaction_state(struct swupdate_cfg *software, update_state_t newstate)
 {
 	if (!software->parms.dry_run && software->bootloader_transaction_marker) {
@@ -177,19 +338,113 @@ static bool update_transaction_state(struct swupdate_cfg *software, update_state
 	return true;
 }
 
+static int install_from_stream(int fd, struct swupdate_cfg *software,
+			       struct img_type *img, bool *installed_directly)
+{
+	struct img_type *part;
+
+	TRACE("Installing STREAM %s, %lld bytes", img->fname, img->size);
+
+	/*
+	 * If this is the first image to be directly installed, set transaction flag
+	 * to on to be checked if a power-off happens. Be sure to set the flag
+	 * just once
+	 */
+	if (!*installed_directly) {
+		update_transaction_state(software, STATE_IN_PROGRESS);
+		*installed_directly = true;
+	}
+
+	/*
+	 * If we are streaming data to store in a UBI volume, make
+	 * sure that the UBI partitions are adjusted beforehand
+	 */
+	LIST_FOREACH(part, &software->images, next) {
+		if (!part->install_directly && part->is_partitioner) {
+			TRACE("Need to adjust partition %s before streaming %s",
+				part->volname, img->fname);
+			if (install_single_image(part, software->parms.dry_run)) {
+				ERROR("Error adjusting partition %s", part->volname);
+				return -1;
+			}
+			/* Avoid trying to adjust again later */
+			part->install_directly = true;
+		}
+	}
+	img->fdin = fd;
+	if (install_single_image(img, software->parms.dry_run)) {
+		ERROR("Error streaming %s", img->fname);
+		return -1;
+	}
+
+	update_installed_image_version(&software->installed_sw_list, img);
+
+	TRACE("END INSTALLING STREAMING");
+
+	return 0;
+}
+
+/*
+ * The stream reached the prefix of the checkpoint: the data of the
+ * interrupted image follows, starting after the bytes already written
+ */
+static int install_resumed(int fd, struct swupdate_cfg *software,
+			   struct stream_checkpoint *saved,
+			   struct stream_checkpoint *ckpt,
+			   bool *installed_directly)
+{
+	struct filehdr fdh = { 0 };
+	struct img_type *img = NULL;
+	int ret;
+
+	strlcpy(fdh.filename, saved->fname, sizeof(fdh.filename));
+	fdh.size = saved->size;
+	fdh.chksum = saved->chksum;
+
+	if (check_if_required(&software->images, &fdh, get_tmpdir(), &img) !=
+	    INSTALL_FROM_STREAM) {
+		ERROR("%s is not streamed, it cannot be resumed", saved->fname);
+		return -1;
+	}
+
+	INFO("Resuming %s after %llu of %llu bytes", saved->fname,
+	     saved->written, saved->size);
+
+	*ckpt = *saved;
+	ckpt->copy.interval = software->checkpoint_interval;
+	ckpt->copy.resume = saved->written;
+	ckpt->copy.save = checkpoint_save;
+	ckpt->copy.data = ckpt;
+
+	/* as if the bytes written before had been read from the stream */
+	img->offset = saved->written;
+	img->checkpoint = &ckpt->copy;
+	ret = install_from_stream(fd, software, img, installed_directly);
+	img->checkpoint = NULL;
+
+	return ret;
+}
+
 static int extract_files(int fd, struct swupdate_cfg *software)
 {
 	int status = STREAM_WAIT_DESCRIPTION;
-	unsigned long offset;
+	unsigned long offset, hdrstart;
 	struct filehdr fdh;
 	swupdate_file_t skip;
 	uint32_t checksum;
 	int fdout;
-	struct img_type *img, *part;
+	struct img_type *img;
 	char output_file[MAX_IMAGE_FNAME];
-	const char* TMPDIR = get_tmpdir();
+	struct swdesc_buf desc = { 0 }, sig = { 0 };
 	bool installed_directly = false;
 	bool encrypted_sw_desc = false;
+	/* position in the stream and checkpoints of streamed images */
+	unsigned long long pos = 0, copy_end = 0;
+	unsigned int streamed = 0;
+	struct stream_checkpoint ckpt = { 0 }, saved = { 0 };
+	bool checkpoints = software->checkpoint_interval &&
+			   !software->parms.dry_run;
+	bool resume = inst.req.resume;
 
 #ifdef CONFIG_ENCRYPTED_SW_DESCRIPTION
 	encrypted_sw_desc = true;
@@ -208,8 +463,9 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 		switch (status) {
 		/* Waiting for the first Header */
 		case STREAM_WAIT_DESCRIPTION:
-			if (extract_file_to_tmp(fd, SW_DESCRIPTION_FILENAME, &offset,
-						encrypted_sw_desc, software->swdesc_max_size) < 0 )
+			if (extract_file_to_buf(fd, SW_DESCRIPTION_FILENAME, &offset,
+						encrypted_sw_desc, software->swdesc_max_size,
+						&desc) < 0 )
 				return -1;
 
 			status = STREAM_WAIT_SIGNATURE;
@@ -218,16 +474,38 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 		case STREAM_WAIT_SIGNATURE:
 #ifdef CONFIG_SIGNED_IMAGES
 			snprintf(output_file, sizeof(output_file), "%s.sig", SW_DESCRIPTION_FILENAME);
-			if (extract_file_to_tmp(fd, output_file, &offset, false,
-						software->swdesc_max_size) < 0 )
+			if (extract_file_to_buf(fd, output_file, &offset, false,
+						software->swdesc_max_size, &sig) < 0 ) {
+				free(desc.buf);
 				return -1;
+			}
 #endif
-			snprintf(output_file, sizeof(output_file), "%s%s", TMPDIR, SW_DESCRIPTION_FILENAME);
-			if (parse(software, output_file)) {
+			pos = copy_end = offset;
+			if (checkpoints || resume)
+				swdesc_id(&desc, ckpt.id, sizeof(ckpt.id));
+			if (parse_swdesc(software, &desc, &sig)) {
 				ERROR("Compatible SW not found");
 				return -1;
 			}
 
+			if ((checkpoints || resume) && !checkpoint_allowed(software)) {
+				TRACE("Not all files have a sha256, no checkpoint");
+				checkpoint_clear();
+				checkpoints = false;
+				if (resume) {
+					ERROR("Update cannot be resumed, it must be downloaded again");
+					return -1;
+				}
+			}
+			if (resume) {
+				if (!checkpoint_load(&saved) ||
+				    strcmp(saved.id, ckpt.id)) {
+					ERROR("No checkpoint to resume this update from");
+					return -1;
+				}
+			} else if (checkpoints)
+				checkpoint_clear();
+
 			if (check_hw_compatibility(&software->hw, &software->hardware)) {
 				ERROR("SW not compatible with hardware");
 				return -1;
@@ -239,10 +517,27 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 			break;
 
 		case STREAM_DATA:
+			if (resume && pos >= saved.prefix) {
+				if (pos != saved.prefix) {
+					ERROR("Stream does not match the checkpoint");
+					return -1;
+				}
+				if (install_resumed(fd, software, &saved, &ckpt,
+						    &installed_directly))
+					return -1;
+				pos = saved.dataoff + saved.size +
+					NPAD_BYTES(saved.size);
+				streamed = saved.done + 1;
+				resume = false;
+				break;
+			}
+
+			hdrstart = offset;
 			if (extract_cpio_header(fd, &fdh, &offset)) {
 				ERROR("CPIO HEADER");
 				return -1;
 			}
+			pos += offset - hdrstart;
 			if (strcmp("TRAILER!!!", fdh.filename) == 0) {
  				/*
 			 	 * Keep reading the cpio padding, if any, up
@@ -308,6 +603,9 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 					return -1;
 				}
 				close(fdout);
+				pos += offset;
+				copy_end = pos;
+				streamed = 0;
 				break;
 
 			case SKIP_FILE:
@@ -318,45 +616,32 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 				if (!swupdate_verify_chksum(checksum, &fdh)) {
 					return -1;
 				}
+				pos += offset;
 				break;
 			case INSTALL_FROM_STREAM:
-				TRACE("Installing STREAM %s, %lld bytes", img->fname, img->size);
-
-				/*
-				 * If this is the first image to be directly installed, set transaction flag
-				 * to on to be checked if a power-off happens. Be sure to set the flag
-				 * just once
-				 */
-				if (!installed_directly) {
-					update_transaction_state(software, STATE_IN_PROGRESS);
-					installed_directly = true;
-				}
-
-				/*
-				 * If we are streaming data to store in a UBI volume, make
-				 * sure that the UBI partitions are adjusted beforehand
-				 */
-				LIST_FOREACH(part, &software->images, next) {
-					if (!part->install_directly && part->is_partitioner) {
-						TRACE("Need to adjust partition %s before streaming %s",
-							part->volname, img->fname);
-						if (install_single_image(part, software->parms.dry_run)) {
-							ERROR("Error adjusting partition %s", part->volname);
-							return -1;
-						}
-						/* Avoid trying to adjust again later */
-						part->install_directly = true;
-					}
+				if (checkpoints) {
+					ckpt.prefix = copy_end;
+					ckpt.dataoff = pos;
+					ckpt.written = 0;
+					ckpt.size = fdh.size;
+					ckpt.chksum = fdh.chksum;
+					ckpt.done = streamed;
+					strlcpy(ckpt.fname, fdh.filename,
+						sizeof(ckpt.fname));
+					ckpt.copy = (struct copy_checkpoint) {
+						.interval = software->checkpoint_interval,
+						.save = checkpoint_save,
+						.data = &ckpt,
+					};
+					img->checkpoint = &ckpt.copy;
 				}
-				img->fdin = fd;
-				if (install_single_image(img, software->parms.dry_run)) {
-					ERROR("Error streaming %s", img->fname);
+				img->offset = 0;
+				if (install_from_stream(fd, software, img,
+							&installed_directly))
 					return -1;
-				}
-
-				update_installed_image_version(&software->installed_sw_list, img);
-
-				TRACE("END INSTALLING STREAMING");
+				img->checkpoint = NULL;
+				pos += img->offset;
+				streamed++;
 				break;
 			}
 
@@ -367,6 +652,8 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 			/*
 			 * Check if all required files were provided
 			 * Update of a single file is not possible.
+			 * After a resume, the images streamed between the
+			 * prefix and the checkpoint were installed before.
 			 */
 
 			LIST_FOREACH(img, &software->images, next) {
@@ -375,11 +662,19 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 				if (! img->fname[0])
 					continue;
 				if (! img->provided) {
+					if (saved.done && img->install_directly) {
+						saved.done--;
+						continue;
+					}
 					ERROR("Required image file %s missing...aborting !",
 						img->fname);
 					return -1;
 				}
 			}
+			if (resume) {
+				ERROR("Checkpoint of %s not reached", saved.fname);
+				return -1;
+			}
 			return 0;
 		default:
 			return -1;
@@ -440,6 +735,7 @@ static int save_stream(int fdin, struct swupdate_cfg *software)
 	unsigned int tmpsize;
 	unsigned long offset;
 	char output_file[MAX_IMAGE_FNAME];
+	struct swdesc_buf desc = { 0 }, sig = { 0 };
 	const char* TMPDIR = get_tmpdir();
 	bool encrypted_sw_desc = false;
 	int files = 1;
@@ -528,24 +824,24 @@ static int save_stream(int fdin, struct swupdate_cfg *software)
 	lseek(tmpfd, 0, SEEK_SET);
 	offset = 0;
 
-	if (extract_file_to_tmp(tmpfd, SW_DESCRIPTION_FILENAME, &offset,
-				encrypted_sw_desc, software->swdesc_max_size) < 0) {
+	if (extract_file_to_buf(tmpfd, SW_DESCRIPTION_FILENAME, &offset,
+				encrypted_sw_desc, software->swdesc_max_size, &desc) < 0) {
 		ERROR("%s cannot be extracted", SW_DESCRIPTION_FILENAME);
 		ret = -EINVAL;
 		goto no_copy_output;
 	}
 #ifdef CONFIG_SIGNED_IMAGES
 	snprintf(output_file, sizeof(output_file), "%s.sig", SW_DESCRIPTION_FILENAME);
-	if (extract_file_to_tmp(tmpfd, output_file, &offset, false,
-				software->swdesc_max_size) < 0 ) {
+	if (extract_file_to_buf(tmpfd, output_file, &offset, false,
+				software->swdesc_max_size, &sig) < 0 ) {
 		ERROR("Signature cannot be extracted:%s", output_file);
+		free(desc.buf);
 		ret = -EINVAL;
 		goto no_copy_output;
 	}
 
 #endif
-	snprintf(output_file, sizeof(output_file), "%s%s", TMPDIR, SW_DESCRIPTION_FILENAME);
-	if (parse(software, output_file)) {
+	if (parse_swdesc(software, &desc, &sig)) {
 		ERROR("Compatible SW not found");
 		ret = -1;
 		goto no_copy_output;
@@ -624,6 +920,9 @@ void *network_initializer(void *data)
 		stream_wkup = false;
 		inst.status = RUN;
 		pthread_mutex_unlock(&stream_mutex);
+
+		/* Subsystems set up in background at startup must be ready */
+		wait_init_tasks();
 		notify(START, RECOVERY_NO_ERROR, INFOLEVEL, "Software Update started !");
 		TRACE("Software update started");
 
@@ -689,9 +988,9 @@ void *network_initializer(void *data)
 		}
 
 		if (!ret) {
+			refresh_sw_versions(software);
 #ifdef CONFIG_MTD
-			mtd_cleanup();
-			scan_mtd_devices();
+			mtd_refresh_topology();
 #endif
 			/*
 		 	 * extract the meta data and relevant parts
@@ -702,6 +1001,10 @@ void *network_initializer(void *data)
 		if (!(inst.fd < 0))
 			close(inst.fd);
 
+		/* A failed resume is not tried again */
+		if (ret && req->resume)
+			checkpoint_clear();
+
 		if (!software->parms.dry_run && is_bootloader(BOOTLOADER_EBG)) {
 			if (!software->bootloader_transaction_marker) {
 				/*
@@ -792,6 +1095,8 @@ void *network_initializer(void *data)
 				} else {
 					notify(SUCCESS, RECOVERY_NO_ERROR, INFOLEVEL, "SWUPDATE successful !");
 					inst.last_install = SUCCESS;
+					if (software->checkpoint_interval)
+						checkpoint_clear();
 				}
 			}
 		} else {
@@ -22,6 +22,7 @@
 #include <sys/mount.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/wait.h>
 
 #include "bsdqueue.h"
@@ -48,10 +49,12 @@
 #include "pctl.h"
 #include "state.h"
 #include "bootloader.h"
+#include "ringbuf.h"
 #include "versions.h"
 #include "hw-compatibility.h"
 #include "swupdate_vars.h"
 #include "swupdate_crypto.h"
+#include "metrics.h"
 
 #ifdef CONFIG_SYSTEMD
 #include <systemd/sd-daemon.h>
@@ -67,6 +70,10 @@ static struct swupdate_cfg swcfg;
 int loglevel = ERRORLEVEL;
 int exit_code = EXIT_SUCCESS;
 
+/* Duration of the startup phases, reported when the daemon is ready */
+static struct timespec startup_begin, startup_last;
+static char startup_report[256];
+
 #ifdef CONFIG_MTD
 /* Global MTD configuration */
 static struct flash_description flashdesc;
@@ -303,11 +310,58 @@ static void swupdate_init(struct swupdate_cfg *sw)
 	sw->update_type = update_type;
 
 	sw->cert_purpose = CERT_PURPOSE_EMAIL_PROT;
+	sw->chain_buffer_size = RINGBUF_DEFAULT_SIZE;
+}
+
+static long startup_elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 +
+		(to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+static void startup_phase_done(const char *phase)
+{
+	struct timespec now;
+	size_t len = strlen(startup_report);
 
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	snprintf(startup_report + len, sizeof(startup_report) - len, "%s%s %ld ms",
+		 len ? ", " : "", phase, startup_elapsed_ms(&startup_last, &now));
+	startup_last = now;
+}
+
+/*
+ * The following are run in background at startup, while the
+ * network thread is set up. They are done before any child
+ * process is started.
+ */
 #ifdef CONFIG_MTD
+static void init_mtd_task(void __attribute__ ((__unused__)) *data)
+{
 	mtd_init();
 	ubi_init();
+}
 #endif
+
+#ifdef CONFIG_SIGNED_IMAGES
+/* set by the task, checked by main() once the init tasks are done */
+static bool init_certificates_failed;
+
+static void init_certificates_task(void *data)
+{
+	struct swupdate_cfg *sw = (struct swupdate_cfg *)data;
+
+	if (swupdate_dgst_init(sw, sw->publickeyfname)) {
+		ERROR("Error: Crypto cannot be initialized.\n");
+		init_certificates_failed = true;
+	}
+}
+#endif
+
+static void init_handlers_task(void __attribute__ ((__unused__)) *data)
+{
+	print_registered_handlers(true);
+	lua_init();
 }
 
 static int parse_cert_purpose(const char *text)
@@ -438,6 +492,32 @@ static int read_globals_settings(void *elem, void *data)
 				"gpgme-protocol", sw->gpgme_protocol);
 	GET_FIELD_INT(LIBCFG_PARSER, elem, "sw-description-max-size",
 				&sw->swdesc_max_size);
+	tmp[0] = '\0';
+	GET_FIELD_STRING(LIBCFG_PARSER, elem,
+				"stream-checkpoint-interval", tmp);
+	if (tmp[0] != '\0') {
+		sw->checkpoint_interval = ustrtoull(tmp, NULL, 10);
+		if (errno)
+			WARN("stream-checkpoint-interval %s: ustrtoull failed", tmp);
+	}
+	tmp[0] = '\0';
+	GET_FIELD_STRING(LIBCFG_PARSER, elem,
+				"chain-buffer-size", tmp);
+	if (tmp[0] != '\0') {
+		sw->chain_buffer_size = ustrtoull(tmp, NULL, 10);
+		if (errno)
+			WARN("chain-buffer-size %s: ustrtoull failed", tmp);
+	}
+	GET_FIELD_INT(LIBCFG_PARSER, elem, "decompress-threads",
+				&sw->decompress_threads);
+	tmp[0] = '\0';
+	GET_FIELD_STRING(LIBCFG_PARSER, elem,
+				"decompress-memlimit", tmp);
+	if (tmp[0] != '\0') {
+		sw->decompress_memlimit = ustrtoull(tmp, NULL, 10);
+		if (errno)
+			WARN("decompress-memlimit %s: ustrtoull failed", tmp);
+	}
 
 
 	read_updatetype_settings(elem, sw->update_type);
@@ -634,6 +714,9 @@ int main(int argc, char **argv)
 
 	memset(fname, 0, sizeof(fname));
 
+	clock_gettime(CLOCK_MONOTONIC, &startup_begin);
+	startup_last = startup_begin;
+
 	/* Initialize internal database */
 	swupdate_init(&swcfg);
 
@@ -643,6 +726,9 @@ int main(int argc, char **argv)
 	 */
 	notify_init();
 
+	/* shared with the subprocesses, before any of them is started */
+	metrics_init();
+
 	/*
 	 * Check if there is a configuration file and parse it
 	 * Parse once the command line just to find if a
@@ -972,6 +1058,8 @@ int main(int argc, char **argv)
 	}
 #endif
 
+	startup_phase_done("configuration");
+
 	swupdate_crypto_init();
 
 	if (strlen(swcfg.hash_provider)) {
@@ -1043,13 +1131,13 @@ int main(int argc, char **argv)
 	print_registered_updatetypes(&swcfg);
 	print_registered_cryptolib();
 
+	/*
+	 * Loading certificate chains, scripting handlers and
+	 * MTD / UBI state is independent of the rest of the startup.
+	 */
 #ifdef CONFIG_SIGNED_IMAGES
-	if (strlen(swcfg.publickeyfname) || strlen(swcfg.gpg_home_directory)) {
-		if (swupdate_dgst_init(&swcfg, swcfg.publickeyfname)) {
-			ERROR("Error: Crypto cannot be initialized.\n");
-			exit(EXIT_FAILURE);
-		}
-	}
+	if (strlen(swcfg.publickeyfname) || strlen(swcfg.gpg_home_directory))
+		start_init_task("certificates", init_certificates_task, &swcfg);
 #endif
 
 	/*
@@ -1063,6 +1151,9 @@ int main(int argc, char **argv)
 	if (strlen(swcfg.mtdblacklist))
 		mtd_set_ubiblacklist(swcfg.mtdblacklist);
 #endif
+#ifdef CONFIG_MTD
+	start_init_task("MTD/UBI", init_mtd_task, NULL);
+#endif
 
 	/*
 	 * If an AES key is passed, load it to allow
@@ -1076,12 +1167,12 @@ int main(int argc, char **argv)
 		}
 	}
 
-	lua_init();
+	start_init_task("handlers", init_handlers_task, NULL);
+	startup_phase_done("setup");
 
 	if(!get_hw_revision(&swcfg.hw))
 		INFO("Running on %s Revision %s", swcfg.hw.boardname, swcfg.hw.revision);
 
-	print_registered_handlers(true);
 	if (swcfg.syslog_enabled) {
 		if (syslog_init()) {
 			ERROR("failed to initialize syslog notifier");
@@ -1103,6 +1194,7 @@ int main(int argc, char **argv)
 
 	/* Read sw-versions */
 	get_sw_versions(&handle, &swcfg);
+	startup_phase_done("versions");
 
 	/*
 	 *  Start daemon if just a check is required
@@ -1117,6 +1209,18 @@ int main(int argc, char **argv)
 
 	/* wait for threads to be done before starting children */
 	wait_threads_ready();
+	startup_phase_done("network");
+
+	/*
+	 * Children are forked without exec: no init task may hold a lock
+	 * (crypto, Lua, MTD) when they are started.
+	 */
+	wait_init_tasks();
+#ifdef CONFIG_SIGNED_IMAGES
+	if (init_certificates_failed)
+		exit(EXIT_FAILURE);
+#endif
+	startup_phase_done("background init");
 
 	/* Start embedded web server */
 #if defined(CONFIG_MONGOOSE)
@@ -1187,6 +1291,10 @@ int main(int argc, char **argv)
 		freeargs(dwlav);
 	}
 
+	startup_phase_done("processes");
+	INFO("Startup: %s, ready after %ld ms", startup_report,
+	     startup_elapsed_ms(&startup_begin, &startup_last));
+
 	if (opt_i) {
 		exit_code = install_from_file(fname, opt_c);
 	}
@@ -1364,6 +1364,20 @@ bool check_same_file(int fd1, int fd2) {
     return (stat1.st_dev == stat2.st_dev) && (stat1.st_ino == stat2.st_ino);
 }
 
+/*
+ * True if both stat() results are of the same file and it was not
+ * modified, replaced or rewritten in place in between
+ */
+bool same_file_state(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+		a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+		a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+		a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
 bool is_filename_valid (const char *file_name)
 {
 	return file_name != NULL && file_name[0] != '/' && strstr(file_name, "../") == NULL;
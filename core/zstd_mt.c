@@ -0,0 +1,413 @@
+/*
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zstd.h>
+#include "util.h"
+#include "zstd_mt.h"
+
+/* Largest frame header, the content size is known once it is read */
+#define ZSTD_MT_HEADER_MAX	18
+#define ZSTD_MT_READ_SIZE	(64 * 1024)
+
+enum zstd_job_state {
+	JOB_QUEUED,
+	JOB_DONE,
+	JOB_FAILED
+};
+
+struct zstd_job {
+	uint8_t *in;
+	size_t in_size;
+	uint8_t *out;
+	size_t out_size;
+	size_t out_pos;		/* bytes already returned */
+	enum zstd_job_state state;
+};
+
+/*
+ * Jobs are a ring of twice as many entries as workers: a job is
+ * queued at tail, picked up by a worker at next and returned to the
+ * caller from head, in order.
+ */
+struct zstd_mt {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *workers;
+	unsigned int threads;
+	unsigned int nworkers;
+	bool stop;
+
+	struct zstd_job *jobs;
+	unsigned int njobs;
+	unsigned long head, next, tail;
+	size_t inflight;	/* bytes held by jobs not returned yet */
+	size_t memlimit;
+
+	zstd_mt_input input;
+	void *input_state;
+	bool input_eof;
+
+	/* compressed data read ahead, the start of the next frame */
+	uint8_t *acc;
+	size_t acc_len;
+	size_t acc_size;
+
+	/*
+	 * The first frame is streamed on the calling thread, the pool is
+	 * only used once a second frame follows. It is streamed as well
+	 * from a frame on that cannot be decoded in memory.
+	 */
+	bool streaming;
+	bool serial_pending;
+	bool serial_boundary;	/* no frame decoded in part */
+	ZSTD_DStream *serial;
+	ZSTD_inBuffer serial_in;
+};
+
+static void *zstd_mt_worker(void *data)
+{
+	struct zstd_mt *z = data;
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+	struct zstd_job *job;
+	size_t ret = 0;
+
+	pthread_mutex_lock(&z->lock);
+	for (;;) {
+		while (!z->stop && z->next == z->tail)
+			pthread_cond_wait(&z->cond, &z->lock);
+		if (z->stop)
+			break;
+		job = &z->jobs[z->next % z->njobs];
+		z->next++;
+		pthread_mutex_unlock(&z->lock);
+
+		if (dctx)
+			ret = ZSTD_decompressDCtx(dctx, job->out, job->out_size,
+						  job->in, job->in_size);
+
+		pthread_mutex_lock(&z->lock);
+		if (!dctx || ZSTD_isError(ret) || ret != job->out_size) {
+			ERROR("zstd frame cannot be decoded: %s",
+			      !dctx ? "out of memory" :
+			      ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "wrong size");
+			job->state = JOB_FAILED;
+		} else {
+			job->state = JOB_DONE;
+		}
+		free(job->in);
+		job->in = NULL;
+		z->inflight -= job->in_size;
+		pthread_cond_broadcast(&z->cond);
+	}
+	pthread_mutex_unlock(&z->lock);
+	ZSTD_freeDCtx(dctx);
+
+	return NULL;
+}
+
+struct zstd_mt *zstd_mt_new(unsigned int threads, size_t memlimit,
+			    zstd_mt_input input, void *input_state)
+{
+	struct zstd_mt *z;
+
+	if (!threads)
+		threads = 1;
+
+	z = calloc(1, sizeof(*z));
+	if (!z)
+		return NULL;
+	pthread_mutex_init(&z->lock, NULL);
+	pthread_cond_init(&z->cond, NULL);
+	z->memlimit = memlimit;
+	z->input = input;
+	z->input_state = input_state;
+	z->threads = threads;
+	z->njobs = 2 * threads;
+	z->jobs = calloc(z->njobs, sizeof(*z->jobs));
+	z->workers = calloc(threads, sizeof(*z->workers));
+	z->acc_size = ZSTD_MT_READ_SIZE;
+	z->acc = malloc(z->acc_size);
+	z->serial = ZSTD_createDStream();
+	if (!z->jobs || !z->workers || !z->acc || !z->serial) {
+		zstd_mt_free(z);
+		return NULL;
+	}
+	z->streaming = true;
+	z->serial_boundary = true;
+	z->serial_in.src = z->acc;
+
+	return z;
+}
+
+/* The workers are started with the second frame */
+static int zstd_mt_start(struct zstd_mt *z)
+{
+	for (unsigned int i = 0; i < z->threads; i++) {
+		if (pthread_create(&z->workers[i], NULL, zstd_mt_worker, z)) {
+			ERROR("zstd decoder thread cannot be started");
+			return -EFAULT;
+		}
+		z->nworkers++;
+	}
+
+	return 0;
+}
+
+/* Hand the complete frame at the start of acc to the workers */
+static int zstd_mt_queue(struct zstd_mt *z, size_t in_size, size_t out_size)
+{
+	struct zstd_job *job = &z->jobs[z->tail % z->njobs];
+
+	if (!z->nworkers && zstd_mt_start(z))
+		return -EFAULT;
+
+	job->in = malloc(in_size);
+	job->out = malloc(out_size ? out_size : 1);
+	if (!job->in || !job->out) {
+		free(job->in);
+		free(job->out);
+		job->in = job->out = NULL;
+		ERROR("OOM queueing a zstd frame of %zu bytes", out_size);
+		return -ENOMEM;
+	}
+	memcpy(job->in, z->acc, in_size);
+	z->acc_len -= in_size;
+	memmove(z->acc, z->acc + in_size, z->acc_len);
+	job->in_size = in_size;
+	job->out_size = out_size;
+	job->out_pos = 0;
+	job->state = JOB_QUEUED;
+
+	pthread_mutex_lock(&z->lock);
+	z->inflight += in_size + out_size;
+	z->tail++;
+	pthread_cond_broadcast(&z->cond);
+	pthread_mutex_unlock(&z->lock);
+
+	return 1;
+}
+
+/*
+ * Read until a whole frame is in acc and queue it.
+ * Returns 1 if a frame was queued, 0 at end of stream, < 0 on error.
+ * serial_pending is set if the frame has to be streamed.
+ */
+static int zstd_mt_next_frame(struct zstd_mt *z)
+{
+	unsigned long long content = 0;
+	size_t frame;
+	int ret;
+
+	for (;;) {
+		if (z->acc_len) {
+			frame = ZSTD_findFrameCompressedSize(z->acc, z->acc_len);
+			if (!ZSTD_isError(frame) ||
+			    z->acc_len >= ZSTD_MT_HEADER_MAX || z->input_eof) {
+				content = ZSTD_getFrameContentSize(z->acc, z->acc_len);
+				if (content == ZSTD_CONTENTSIZE_ERROR) {
+					ERROR("Invalid zstd frame");
+					return -EFAULT;
+				}
+				/* the frame is read into acc and decoded whole */
+				if (content == ZSTD_CONTENTSIZE_UNKNOWN ||
+				    content > z->memlimit ||
+				    z->acc_size > z->memlimit - content) {
+					z->serial_pending = true;
+					return 0;
+				}
+				if (!ZSTD_isError(frame))
+					return zstd_mt_queue(z, frame, content);
+			}
+			if (z->input_eof) {
+				ERROR("Truncated zstd frame");
+				return -EFAULT;
+			}
+		} else if (z->input_eof) {
+			return 0;
+		}
+
+		if (z->acc_len == z->acc_size) {
+			uint8_t *tmp;
+
+			if (z->acc_size > (z->memlimit - content) / 2) {
+				z->serial_pending = true;
+				return 0;
+			}
+			tmp = realloc(z->acc, z->acc_size * 2);
+			if (!tmp)
+				return -ENOMEM;
+			z->acc = tmp;
+			z->acc_size *= 2;
+		}
+		ret = z->input(z->input_state, z->acc + z->acc_len,
+			       z->acc_size - z->acc_len);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			z->input_eof = true;
+		z->acc_len += ret;
+	}
+}
+
+/*
+ * Stream the first frame, or the rest of the data from the frame in acc
+ * on if serial_pending is set. At the end of the first frame, what
+ * follows it is left in acc and streaming is cleared.
+ */
+static int zstd_mt_serial(struct zstd_mt *z, void *buffer, size_t size)
+{
+	ZSTD_outBuffer out = { buffer, size, 0 };
+	size_t ret, in_pos, out_pos;
+	bool progress;
+	int len;
+
+	for (;;) {
+		if (z->serial_in.pos == z->serial_in.size && !z->input_eof) {
+			len = z->input(z->input_state, z->acc, z->acc_size);
+			if (len < 0)
+				return len;
+			if (len == 0)
+				z->input_eof = true;
+			z->serial_in.size = len;
+			z->serial_in.pos = 0;
+		}
+		in_pos = z->serial_in.pos;
+		out_pos = out.pos;
+		ret = ZSTD_decompressStream(z->serial, &out, &z->serial_in);
+		if (ZSTD_isError(ret)) {
+			ERROR("ZSTD_decompressStream failed: %s",
+			      ZSTD_getErrorName(ret));
+			return -EFAULT;
+		}
+		/* without progress, more input is needed */
+		progress = z->serial_in.pos != in_pos || out.pos != out_pos;
+		if (progress)
+			z->serial_boundary = (ret == 0);
+		if (progress && z->serial_boundary && !z->serial_pending) {
+			z->acc_len = z->serial_in.size - z->serial_in.pos;
+			memmove(z->acc, z->acc + z->serial_in.pos, z->acc_len);
+			z->streaming = false;
+			break;
+		}
+		if (out.pos)
+			break;
+		if (z->input_eof && z->serial_in.pos == z->serial_in.size) {
+			if (!z->serial_boundary) {
+				ERROR("Truncated zstd frame");
+				return -EFAULT;
+			}
+			break;
+		}
+	}
+
+	return out.pos;
+}
+
+/* Stream the rest of the data, the frame in acc cannot be decoded whole */
+static void zstd_mt_fallback(struct zstd_mt *z)
+{
+	TRACE("zstd frames without size or too large, not decoded in parallel");
+	ZSTD_DCtx_reset(z->serial, ZSTD_reset_session_only);
+	z->serial_in.src = z->acc;
+	z->serial_in.size = z->acc_len;
+	z->serial_in.pos = 0;
+	z->serial_boundary = true;
+	z->streaming = true;
+}
+
+int zstd_mt_read(struct zstd_mt *z, void *buffer, size_t size)
+{
+	struct zstd_job *job;
+	size_t len;
+	int ret;
+
+	for (;;) {
+		if (z->streaming) {
+			ret = zstd_mt_serial(z, buffer, size);
+			if (ret || z->streaming)
+				return ret;
+			/* end of the first frame */
+			continue;
+		}
+
+		pthread_mutex_lock(&z->lock);
+		job = z->head != z->tail ? &z->jobs[z->head % z->njobs] : NULL;
+		if (job && job->state == JOB_FAILED) {
+			pthread_mutex_unlock(&z->lock);
+			return -EFAULT;
+		}
+		if (job && job->state == JOB_DONE) {
+			pthread_mutex_unlock(&z->lock);
+			len = min(size, job->out_size - job->out_pos);
+			memcpy(buffer, job->out + job->out_pos, len);
+			job->out_pos += len;
+			if (job->out_pos == job->out_size) {
+				free(job->out);
+				job->out = NULL;
+				pthread_mutex_lock(&z->lock);
+				z->inflight -= job->out_size;
+				z->head++;
+				pthread_mutex_unlock(&z->lock);
+			}
+			if (len)
+				return len;
+			continue;
+		}
+
+		/* more work for the pool, as long as it fits */
+		if (!z->serial_pending && (z->acc_len || !z->input_eof) &&
+		    z->tail - z->head < z->njobs &&
+		    (z->inflight + z->acc_size < z->memlimit || z->head == z->tail)) {
+			pthread_mutex_unlock(&z->lock);
+			ret = zstd_mt_next_frame(z);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+
+		if (!job) {
+			pthread_mutex_unlock(&z->lock);
+			if (!z->serial_pending)
+				return 0;
+			zstd_mt_fallback(z);
+			continue;
+		}
+
+		while (job->state == JOB_QUEUED)
+			pthread_cond_wait(&z->cond, &z->lock);
+		pthread_mutex_unlock(&z->lock);
+	}
+}
+
+void zstd_mt_free(struct zstd_mt *z)
+{
+	if (!z)
+		return;
+
+	if (z->nworkers) {
+		pthread_mutex_lock(&z->lock);
+		z->stop = true;
+		pthread_cond_broadcast(&z->cond);
+		pthread_mutex_unlock(&z->lock);
+		for (unsigned int i = 0; i < z->nworkers; i++)
+			pthread_join(z->workers[i], NULL);
+	}
+	for (unsigned int i = 0; z->jobs && i < z->njobs; i++) {
+		free(z->jobs[i].in);
+		free(z->jobs[i].out);
+	}
+	pthread_mutex_destroy(&z->lock);
+	pthread_cond_destroy(&z->cond);
+	ZSTD_freeDStream(z->serial);
+	free(z->jobs);
+	free(z->workers);
+	free(z->acc);
+	free(z);
+}
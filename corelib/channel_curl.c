@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <fcntl.h>
 #include <string.h>
 #include <ctype.h>
@@ -17,23 +19,43 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
 #include <curl/curl.h>
 #include <generated/autoconf.h>
 #include <unistd.h>
 #include <network_ipc.h>
 #include <util.h>
+#include <metrics.h>
 #include "channel_op_res.h"
 #include "swupdate_crypto.h"
 #include "channel.h"
 #include "channel_curl.h"
 #include "progress.h"
+#include "swupdate_vars.h"
 #include <json-c/json.h>
+#ifdef CONFIG_GUNZIP
+#include <zlib.h>
+#endif
 
 #define SPEED_LOW_BYTES_SEC 8
 #define SPEED_LOW_TIME_SEC 300
 #define KEEPALIVE_DELAY 204L
 #define KEEPALIVE_INTERVAL 120L
 
+/*
+ * Idle easy handles kept for reuse by channel_open(). Each handle keeps
+ * its own live connections; DNS entries and TLS sessions are shared
+ * among all of them. The connection cache is not shared: libcurl does
+ * not support sharing it between transfers running at the same time,
+ * as the notify, download and prefetch threads of hawkBit do.
+ */
+#define CHANNEL_POOL_SIZE 4
+/* Drop connections idle for longer than most servers' keep-alive timeout */
+#define CONN_MAX_IDLE_SEC 60L
+/* Re-establish connections older than this even if they are busy */
+#define CONN_MAX_LIFETIME_SEC 3600L
+#define CONN_MAX_PER_HANDLE 2L
+
 typedef struct {
 	char *memory;
 	size_t size;
@@ -47,11 +69,35 @@ typedef struct {
 	struct curl_slist *header;
 } channel_curl_t;
 
+/*
+ * Adaptive download shaping: when the installer cannot keep up, writes
+ * into the IPC stream block and data piles up in the socket until TCP
+ * stalls. The time spent blocked is measured per window and the receive
+ * rate (and socket buffer) is lowered to what the installer accepts,
+ * then raised again when it catches up.
+ */
+#define SHAPER_WINDOW_US	1000000ULL
+#define SHAPER_BLOCKED_HIGH	50	/* % of the window blocked on IPC */
+#define SHAPER_BLOCKED_LOW	10
+#define SHAPER_MIN_RATE		(16 * 1024)
+#define SHAPER_MIN_RCVBUF	(64 * 1024)
+
+typedef struct {
+	unsigned long long start;	/* window start, us */
+	unsigned long long bytes;	/* sent to the installer in the window */
+	unsigned long long blocked;	/* us spent in ipc_send_data() */
+	curl_off_t rate;		/* current receive limit, 0 if none */
+	int rcvbuf;			/* socket buffer before shaping */
+	bool throttled;
+} download_shaper_t;
+
 typedef struct {
 	channel_data_t *channel_data;
 	int output;
 	output_data_t *outdata;
 	channel_t *this;
+	channel_op_res_t result;	/* result of the write callback */
+	download_shaper_t *shaper;	/* set if adaptive_speed is enabled */
 } write_callback_t;
 
 typedef struct {
@@ -110,6 +156,118 @@ channel_op_res_t channel_curl_init(void)
 	return CHANNEL_OK;
 }
 
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t lock;
+	CURLSH *share;
+	pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+	CURL *idle[CHANNEL_POOL_SIZE];
+	unsigned int nidle;
+	unsigned long transfers;
+	unsigned long connects;
+} channel_pool = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void channel_share_lock(CURL *handle, curl_lock_data data,
+			       curl_lock_access access, void *userptr)
+{
+	(void)handle;
+	(void)access;
+	(void)userptr;
+	pthread_mutex_lock(&channel_pool.share_locks[data]);
+}
+
+static void channel_share_unlock(CURL *handle, curl_lock_data data,
+				 void *userptr)
+{
+	(void)handle;
+	(void)userptr;
+	pthread_mutex_unlock(&channel_pool.share_locks[data]);
+}
+
+static void channel_pool_init(void)
+{
+	for (unsigned int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init(&channel_pool.share_locks[i], NULL);
+
+	channel_pool.share = curl_share_init();
+	if (!channel_pool.share) {
+		WARN("cURL share could not be created, DNS and TLS sessions are not shared");
+		return;
+	}
+	if ((curl_share_setopt(channel_pool.share, CURLSHOPT_LOCKFUNC,
+			       channel_share_lock) != CURLSHE_OK) ||
+	    (curl_share_setopt(channel_pool.share, CURLSHOPT_UNLOCKFUNC,
+			       channel_share_unlock) != CURLSHE_OK) ||
+	    (curl_share_setopt(channel_pool.share, CURLSHOPT_SHARE,
+			       CURL_LOCK_DATA_DNS) != CURLSHE_OK)) {
+		WARN("cURL share could not be configured, DNS and TLS sessions are not shared");
+		curl_share_cleanup(channel_pool.share);
+		channel_pool.share = NULL;
+		return;
+	}
+	/* Best effort: older libcurl may lack it */
+	(void)curl_share_setopt(channel_pool.share, CURLSHOPT_SHARE,
+				CURL_LOCK_DATA_SSL_SESSION);
+}
+
+static CURL *channel_pool_get(void)
+{
+	CURL *handle = NULL;
+
+	pthread_once(&channel_pool.once, channel_pool_init);
+
+	pthread_mutex_lock(&channel_pool.lock);
+	if (channel_pool.nidle)
+		handle = channel_pool.idle[--channel_pool.nidle];
+	pthread_mutex_unlock(&channel_pool.lock);
+
+	return handle ? handle : curl_easy_init();
+}
+
+static void channel_pool_put(CURL *handle)
+{
+	pthread_mutex_lock(&channel_pool.lock);
+	if (channel_pool.nidle < CHANNEL_POOL_SIZE) {
+		curl_easy_reset(handle);
+		channel_pool.idle[channel_pool.nidle++] = handle;
+		handle = NULL;
+	}
+	pthread_mutex_unlock(&channel_pool.lock);
+
+	if (handle)
+		curl_easy_cleanup(handle);
+}
+
+/*
+ * Account for the connections set up by the last transfer: any new
+ * connection means a fresh TCP (and TLS) handshake.
+ */
+static void channel_log_connections(channel_t *this)
+{
+	channel_curl_t *channel_curl = this->priv;
+	long connects = 0;
+	unsigned long transfers, total;
+
+	if (curl_easy_getinfo(channel_curl->handle, CURLINFO_NUM_CONNECTS,
+			      &connects) != CURLE_OK)
+		return;
+
+	pthread_mutex_lock(&channel_pool.lock);
+	transfers = ++channel_pool.transfers;
+	total = (channel_pool.connects += connects);
+	pthread_mutex_unlock(&channel_pool.lock);
+
+	if (connects)
+		DEBUG("New connection established (handshakes: %lu in %lu transfers)",
+		      total, transfers);
+	else
+		TRACE("Connection reused (handshakes: %lu in %lu transfers)",
+		      total, transfers);
+}
+
 channel_t *channel_new(void)
 {
 	channel_t *newchan = (channel_t *)calloc(1, sizeof(*newchan) +
@@ -142,7 +300,7 @@ channel_op_res_t channel_close(channel_t *this)
 	if (channel_curl->handle == NULL) {
 		return CHANNEL_OK;
 	}
-	curl_easy_cleanup(channel_curl->handle);
+	channel_pool_put(channel_curl->handle);
 	channel_curl->handle = NULL;
 
 	return CHANNEL_OK;
@@ -165,7 +323,7 @@ channel_op_res_t channel_open(channel_t *this, void *cfg)
 		}
 	}
 
-	if ((channel_curl->handle = curl_easy_init()) == NULL) {
+	if ((channel_curl->handle = channel_pool_get()) == NULL) {
 		ERROR("Initialization of channel failed.");
 		return CHANNEL_EINIT;
 	}
@@ -173,7 +331,103 @@ channel_op_res_t channel_open(channel_t *this, void *cfg)
 	return CHANNEL_OK;
 }
 
-static channel_op_res_t result_channel_callback_ipc;
+static unsigned long long shaper_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void shaper_set_rcvbuf(channel_curl_t *channel_curl,
+			      download_shaper_t *shaper, int size)
+{
+#if LIBCURL_VERSION_NUM >= 0x072D00
+	curl_socket_t sock;
+	socklen_t len = sizeof(shaper->rcvbuf);
+
+	if (curl_easy_getinfo(channel_curl->handle, CURLINFO_ACTIVESOCKET,
+			      &sock) != CURLE_OK || sock == CURL_SOCKET_BAD)
+		return;
+	if (!shaper->rcvbuf &&
+	    getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &shaper->rcvbuf, &len))
+		return;
+	/* the kernel doubles the value set, see socket(7) */
+	if (!size)
+		size = shaper->rcvbuf / 2;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)))
+		TRACE("Cannot set socket receive buffer: %s", strerror(errno));
+#else
+	(void)channel_curl;
+	(void)shaper;
+	(void)size;
+#endif
+}
+
+static void shaper_set_rate(write_callback_t *data, curl_off_t rate)
+{
+	channel_curl_t *channel_curl = data->this->priv;
+	download_shaper_t *shaper = data->shaper;
+	curl_off_t max = data->channel_data->max_download_speed;
+
+	if (max && (!rate || rate > max))
+		rate = max;
+	if (curl_easy_setopt(channel_curl->handle,
+			     CURLOPT_MAX_RECV_SPEED_LARGE, rate) != CURLE_OK)
+		return;
+	shaper->rate = rate;
+	DEBUG("Download rate %s %" CURL_FORMAT_CURL_OFF_T " kB/s",
+	      shaper->throttled ? "shaped to" : "restored to", rate / 1024);
+
+	/* Keep about one second of data in the socket while shaped */
+	shaper_set_rcvbuf(channel_curl, shaper,
+			  shaper->throttled ?
+			  (int)max_t(curl_off_t, rate, SHAPER_MIN_RCVBUF) : 0);
+}
+
+static void channel_shape_download(write_callback_t *data, size_t len,
+				   unsigned long long blocked)
+{
+	download_shaper_t *shaper = data->shaper;
+	unsigned long long now = shaper_now();
+	unsigned long long elapsed = now - shaper->start;
+	unsigned int blocked_pct;
+	curl_off_t accepted, rate;
+
+	shaper->bytes += len;
+	shaper->blocked += blocked;
+	if (elapsed < SHAPER_WINDOW_US)
+		return;
+
+	accepted = shaper->bytes * 1000000ULL / elapsed;
+	blocked_pct = shaper->blocked * 100 / elapsed;
+
+	if (blocked_pct >= SHAPER_BLOCKED_HIGH) {
+		/* The installer is the bottleneck, follow its speed */
+		rate = max_t(curl_off_t, accepted, SHAPER_MIN_RATE);
+		if (!shaper->throttled) {
+			shaper->throttled = true;
+			data->channel_data->stalls_avoided++;
+			shaper_set_rate(data, rate);
+		} else if (rate < shaper->rate)
+			shaper_set_rate(data, rate);
+	} else if (shaper->throttled && blocked_pct <= SHAPER_BLOCKED_LOW) {
+		/*
+		 * The installer keeps up: probe for more, and stop shaping
+		 * when the network and not the limit is the bottleneck
+		 */
+		if (accepted < shaper->rate / 2) {
+			shaper->throttled = false;
+			shaper_set_rate(data, 0);
+		} else
+			shaper_set_rate(data, shaper->rate + shaper->rate / 4);
+	}
+
+	shaper->start = now;
+	shaper->bytes = 0;
+	shaper->blocked = 0;
+}
+
 size_t channel_callback_ipc(void *streamdata, size_t size, size_t nmemb,
 				   write_callback_t *data)
 {
@@ -182,14 +436,14 @@ size_t channel_callback_ipc(void *streamdata, size_t size, size_t nmemb,
 	}
 	if (!data)
 		return 0;
-	result_channel_callback_ipc = CHANNEL_OK;
+	data->result = CHANNEL_OK;
 
 	if (data->channel_data->usessl) {
 		if (swupdate_HASH_update(data->channel_data->dgst,
 					 streamdata,
 					 size * nmemb) < 0) {
 			ERROR("Updating checksum of chunk failed.");
-			result_channel_callback_ipc = CHANNEL_EIO;
+			data->result = CHANNEL_EIO;
 			return 0;
 		}
 	}
@@ -197,12 +451,18 @@ size_t channel_callback_ipc(void *streamdata, size_t size, size_t nmemb,
 	if (!data->channel_data->http_response_code)
 		channel_map_http_code(data->this, &data->channel_data->http_response_code);
 
-	if (!data->channel_data->noipc &&
-		ipc_send_data(data->output, streamdata, (int)(size * nmemb)) <
-	    0) {
-		ERROR("Writing into SWUpdate IPC stream failed.");
-		result_channel_callback_ipc = CHANNEL_EIO;
-		return 0;
+	if (!data->channel_data->noipc) {
+		unsigned long long start = data->shaper ? shaper_now() : 0;
+
+		if (ipc_send_data(data->output, streamdata,
+				  (int)(size * nmemb)) < 0) {
+			ERROR("Writing into SWUpdate IPC stream failed.");
+			data->result = CHANNEL_EIO;
+			return 0;
+		}
+		if (data->shaper)
+			channel_shape_download(data, size * nmemb,
+					       shaper_now() - start);
 	}
 
 	if (data->channel_data->dwlwrdata) {
@@ -366,6 +626,7 @@ channel_op_res_t channel_map_http_code(channel_t *this, long *http_response_code
 	case 204:
 	case 206:
 	case 226:
+	case 304: /* Not Modified, answer to a conditional request */
 		return CHANNEL_OK;
 	case 302:
 		curlrc = curl_easy_getinfo(channel_curl->handle, CURLINFO_REDIRECT_URL,
@@ -490,6 +751,30 @@ static int channel_callback_xferinfo_legacy(void *p, double dltotal, double dlno
 }
 #endif
 
+static void channel_store_etag(channel_data_t *channel_data, const char *buffer,
+			       size_t len)
+{
+	char *etag;
+
+	while (len && isspace((unsigned char)*buffer)) {
+		buffer++;
+		len--;
+	}
+	while (len && isspace((unsigned char)buffer[len - 1]))
+		len--;
+
+	if (!len)
+		return;
+
+	etag = strndup(buffer, len);
+	if (!etag) {
+		ERROR("OOM storing ETag, next request is unconditional.");
+		return;
+	}
+	free(channel_data->etag);
+	channel_data->etag = etag;
+}
+
 static size_t channel_callback_headers(char *buffer, size_t size, size_t nitems, void *userdata)
 {
 	channel_data_t *channel_data = (channel_data_t *)userdata;
@@ -497,6 +782,10 @@ static size_t channel_callback_headers(char *buffer, size_t size, size_t nitems,
 	char *info;
 	char *p, *key, *val;
 
+	if (channel_data->use_etag && size * nitems > 5 &&
+	    !strncasecmp(buffer, "ETag:", 5))
+		channel_store_etag(channel_data, buffer + 5, size * nitems - 5);
+
 	if (dict) {
 		info = malloc(size * nitems + 1);
 		if (!info) {
@@ -717,7 +1006,28 @@ channel_op_res_t channel_set_options(channel_t *this, channel_data_t *channel_da
 	free(header);
 	}
 
-	if (channel_data->received_headers || channel_data->headers) {
+	/*
+	 * Conditional request: the server answers 304 without
+	 * a body if the resource was not changed.
+	 */
+	if (channel_data->use_etag && channel_data->etag) {
+		char *header;
+		if (ENOMEM_ASPRINTF == asprintf(&header, "If-None-Match: %s",
+						channel_data->etag)) {
+			result = CHANNEL_EINIT;
+			goto cleanup;
+		}
+		if ((channel_curl->header = curl_slist_append(
+				channel_curl->header, header)) == NULL) {
+			free(header);
+			result = CHANNEL_EINIT;
+			goto cleanup;
+		}
+		free(header);
+	}
+
+	if (channel_data->received_headers || channel_data->headers ||
+	    channel_data->use_etag) {
 		if ((curl_easy_setopt(channel_curl->handle,
 			      CURLOPT_HEADERFUNCTION,
 			      channel_callback_headers) != CURLE_OK) ||
@@ -821,6 +1131,25 @@ channel_op_res_t channel_set_options(channel_t *this, channel_data_t *channel_da
 		}
 	}
 
+	if (channel_pool.share &&
+	    curl_easy_setopt(channel_curl->handle, CURLOPT_SHARE,
+			     channel_pool.share) != CURLE_OK) {
+		ERROR("cURL share could not be attached to channel.");
+		result = CHANNEL_EINIT;
+		goto cleanup;
+	}
+
+	(void)curl_easy_setopt(channel_curl->handle, CURLOPT_MAXCONNECTS,
+			       CONN_MAX_PER_HANDLE);
+#if LIBCURL_VERSION_NUM >= 0x074100
+	(void)curl_easy_setopt(channel_curl->handle, CURLOPT_MAXAGE_CONN,
+			       CONN_MAX_IDLE_SEC);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x075000
+	(void)curl_easy_setopt(channel_curl->handle, CURLOPT_MAXLIFETIME_CONN,
+			       CONN_MAX_LIFETIME_SEC);
+#endif
+
 	CURLcode curlrc =
 	    curl_easy_setopt(channel_curl->handle, CURLOPT_TCP_KEEPALIVE, 1L);
 	if (curlrc == CURLE_OK) {
@@ -1073,6 +1402,63 @@ static CURLcode channel_set_read_callback(channel_curl_t *handle, channel_data_t
 		curl_easy_setopt(handle, CURLOPT_READDATA, channel_data);
 }
 
+/*
+ * Compress the request body with gzip and announce it with
+ * Content-Encoding. Without zlib, the body is sent as it is.
+ */
+static channel_op_res_t channel_gzip_body(channel_t *this,
+					  channel_data_t *channel_data,
+					  unsigned char **body, size_t *bodylen)
+{
+#ifdef CONFIG_GUNZIP
+	channel_curl_t *channel_curl = this->priv;
+	size_t len = strlen(channel_data->request_body);
+	z_stream strm = { 0 };
+	unsigned char *buf;
+	uLong bound;
+
+	if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		ERROR("Cannot initialize gzip compression.");
+		return CHANNEL_EINIT;
+	}
+	bound = deflateBound(&strm, len);
+	buf = malloc(bound);
+	if (!buf) {
+		deflateEnd(&strm);
+		ERROR("OOM when compressing request body.");
+		return CHANNEL_ENOMEM;
+	}
+	strm.next_in = (Bytef *)channel_data->request_body;
+	strm.avail_in = len;
+	strm.next_out = buf;
+	strm.avail_out = bound;
+	if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&strm);
+		free(buf);
+		ERROR("Compressing request body failed.");
+		return CHANNEL_EINIT;
+	}
+	*bodylen = strm.total_out;
+	deflateEnd(&strm);
+
+	if ((channel_curl->header = curl_slist_append(channel_curl->header,
+			"Content-Encoding: gzip")) == NULL) {
+		free(buf);
+		ERROR("Setting channel header Content-Encoding failed.");
+		return CHANNEL_EINIT;
+	}
+	*body = buf;
+	TRACE("Request body compressed from %zu to %zu bytes", len, *bodylen);
+#else
+	(void)this;
+	(void)channel_data;
+	(void)body;
+	(void)bodylen;
+#endif
+	return CHANNEL_OK;
+}
+
 static channel_op_res_t channel_post_method(channel_t *this, void *data, int method)
 {
 	channel_curl_t *channel_curl = this->priv;
@@ -1084,6 +1470,8 @@ static channel_op_res_t channel_post_method(channel_t *this, void *data, int met
 	channel_data->offs = 0;
 	output_data_t outdata = {};
 	write_callback_t wrdata = { .this = this, .channel_data = channel_data, .outdata = &outdata };
+	unsigned char *gzbody = NULL;
+	size_t gzlen = 0;
 
 	if ((result = channel_set_content_type(this, channel_data)) !=
 	    CHANNEL_OK) {
@@ -1091,6 +1479,14 @@ static channel_op_res_t channel_post_method(channel_t *this, void *data, int met
 		goto cleanup_header;
 	}
 
+	if (channel_data->gzip_body && channel_data->request_body &&
+	    !channel_data->read_fifo &&
+	    (method == CHANNEL_POST || method == CHANNEL_PATCH)) {
+		if ((result = channel_gzip_body(this, channel_data, &gzbody,
+						&gzlen)) != CHANNEL_OK)
+			goto cleanup_header;
+	}
+
 	if ((result = channel_set_options(this, channel_data)) != CHANNEL_OK) {
 		ERROR("Set channel option failed.");
 		goto cleanup_header;
@@ -1109,9 +1505,17 @@ static channel_op_res_t channel_post_method(channel_t *this, void *data, int met
 		else
 			curl_result = curl_easy_setopt(channel_curl->handle, CURLOPT_POST, 1L);
 
-		curl_result |= curl_easy_setopt(channel_curl->handle,
-					       CURLOPT_POSTFIELDS,
-					       channel_data->request_body);
+		if (gzbody) {
+			curl_result |= curl_easy_setopt(channel_curl->handle,
+						       CURLOPT_POSTFIELDSIZE,
+						       (long)gzlen);
+			curl_result |= curl_easy_setopt(channel_curl->handle,
+						       CURLOPT_POSTFIELDS,
+						       gzbody);
+		} else
+			curl_result |= curl_easy_setopt(channel_curl->handle,
+						       CURLOPT_POSTFIELDS,
+						       channel_data->request_body);
 		if (channel_data->read_fifo)
 			curl_result |= channel_set_read_callback(channel_curl->handle, channel_data);
 		break;
@@ -1151,6 +1555,7 @@ static channel_op_res_t channel_post_method(channel_t *this, void *data, int met
 	}
 
 	channel_log_effective_url(this);
+	channel_log_connections(this);
 
 	result = channel_map_http_code(this, &channel_data->http_response_code);
 
@@ -1165,6 +1570,7 @@ static channel_op_res_t channel_post_method(channel_t *this, void *data, int met
 
 cleanup_header:
 	outdata.memory != NULL ? free(outdata.memory) : (void)0;
+	free(gzbody);
 	curl_easy_reset(channel_curl->handle);
 	curl_slist_free_all(channel_curl->header);
 	channel_curl->header = NULL;
@@ -1260,6 +1666,7 @@ channel_op_res_t channel_put_file(channel_t *this, void *data)
 	}
 
 	channel_log_effective_url(this);
+	channel_log_connections(this);
 
 	result = channel_map_http_code(this, &channel_data->http_response_code);
 
@@ -1281,6 +1688,88 @@ cleanup_header:
 	return result;
 }
 
+/*
+ * Check if the installer left a checkpoint for this URL. The URL is
+ * stored as a hash, a different URL starts a new update.
+ */
+static bool channel_stream_checkpoint(channel_data_t *channel_data,
+				      unsigned long long *prefix,
+				      unsigned long long *resume_from)
+{
+	unsigned long long dataoff, written, size;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	char source[17], id[17];
+	char *value;
+	bool found = false;
+	int n;
+
+	for (const char *p = channel_data->url; *p; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 0x100000001b3ULL;
+	}
+	snprintf(source, sizeof(source), "%016llx", (unsigned long long)hash);
+
+	value = swupdate_vars_get(STREAM_SOURCE_VAR, NULL);
+	if (!value || strcmp(value, source)) {
+		free(value);
+		swupdate_vars_set(STREAM_SOURCE_VAR, source, NULL);
+		return false;
+	}
+	free(value);
+
+	value = swupdate_vars_get(STREAM_CHECKPOINT_VAR, NULL);
+	if (!value)
+		return false;
+	n = sscanf(value, "%16s %llu %llu %llu %llu", id, prefix, &dataoff,
+		   &written, &size);
+	if (n == 5 && *prefix && *prefix <= dataoff && written <= size) {
+		*resume_from = dataoff + written;
+		found = true;
+	}
+	free(value);
+
+	return found;
+}
+
+/*
+ * Send again the head of the stream (sw-description and the files
+ * copied before the checkpoint), the rest continues at resume_from.
+ */
+static channel_op_res_t channel_get_prefix(channel_curl_t *channel_curl,
+					   unsigned long long prefix)
+{
+	char range[48];
+	CURLcode curlrc;
+	curl_off_t bytes_downloaded = 0;
+
+	snprintf(range, sizeof(range), "0-%llu", prefix - 1);
+	if (curl_easy_setopt(channel_curl->handle, CURLOPT_RANGE, range) !=
+	    CURLE_OK)
+		return CHANNEL_EINIT;
+
+	curlrc = curl_easy_perform(channel_curl->handle);
+	curl_easy_setopt(channel_curl->handle, CURLOPT_RANGE, NULL);
+	if (curlrc != CURLE_OK) {
+		ERROR("Cannot get stream head for resume (%d): '%s'", curlrc,
+		      curl_easy_strerror(curlrc));
+		return channel_map_curl_error(curlrc);
+	}
+#if LIBCURL_VERSION_NUM >= 0x73700
+	curl_easy_getinfo(channel_curl->handle, CURLINFO_SIZE_DOWNLOAD_T,
+			  &bytes_downloaded);
+#else
+	double dl = 0;
+	curl_easy_getinfo(channel_curl->handle, CURLINFO_SIZE_DOWNLOAD, &dl);
+	bytes_downloaded = (curl_off_t)dl;
+#endif
+	if ((unsigned long long)bytes_downloaded != prefix) {
+		ERROR("Server does not honor range requests, cannot resume");
+		return CHANNEL_EIO;
+	}
+
+	return CHANNEL_OK;
+}
+
 channel_op_res_t channel_get_file(channel_t *this, void *data)
 {
 	channel_curl_t *channel_curl = this->priv;
@@ -1291,7 +1780,16 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 
 	channel_op_res_t result = CHANNEL_OK;
 	channel_data_t *channel_data = (channel_data_t *)data;
+	unsigned long long prefix = 0, resume_from = 0;
+	bool resume = false;
+	uint64_t start = metrics_now_ns();
 	channel_data->http_response_code = 0;
+	channel_data->resumed = false;
+
+	if (channel_data->stream_resume && !channel_data->noipc &&
+	    !channel_data->range && !channel_data->cached_file)
+		resume = channel_stream_checkpoint(channel_data, &prefix,
+						   &resume_from);
 
 	if (channel_data->usessl) {
 		memset(channel_data->sha1hash, 0x0, SWUPDATE_SHA_DIGEST_LENGTH * 2 + 1);
@@ -1334,7 +1832,7 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 	/*
 	 * In case of range do not ask the server for file size
 	 */
-	if (!channel_data->range)  {
+	if (!channel_data->range && !channel_data->noprogress)  {
 		if (channel_enable_download_progress_tracking(channel_curl,
 								channel_data->url,
 								&download_data) == CHANNEL_EINIT) {
@@ -1355,10 +1853,17 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 
 	write_callback_t wrdata = { .this = this };
 	wrdata.channel_data = channel_data;
+	download_shaper_t shaper = { 0 };
+	channel_data->stalls_avoided = 0;
+	if (channel_data->adaptive_speed && !channel_data->noipc) {
+		shaper.start = shaper_now();
+		wrdata.shaper = &shaper;
+	}
 	if (!channel_data->noipc) {
 		swupdate_prepare_req(&req);
 		req.dry_run = channel_data->dry_run;
 		req.source = channel_data->source;
+		req.resume = resume;
 		if (channel_data->info) {
 			strncpy(req.info, channel_data->info,
 				sizeof(req.info) - 1 );
@@ -1378,7 +1883,7 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 	}
 
 	wrdata.output = file_handle;
-	result_channel_callback_ipc = CHANNEL_OK;
+	wrdata.result = CHANNEL_OK;
 
 	if ((curl_easy_setopt(channel_curl->handle, CURLOPT_WRITEFUNCTION,
 			      channel_callback_ipc) != CURLE_OK) ||
@@ -1399,6 +1904,22 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 	unsigned char try_count = 0;
 	CURLcode curlrc = CURLE_OK;
 
+	if (resume) {
+		INFO("Resuming install, continuing download at %llu bytes",
+		     resume_from);
+		if ((result = channel_get_prefix(channel_curl, prefix)) !=
+		    CHANNEL_OK)
+			goto cleanup_file;
+		if (curl_easy_setopt(channel_curl->handle,
+				     CURLOPT_RESUME_FROM_LARGE,
+				     (curl_off_t)resume_from) != CURLE_OK) {
+			result = CHANNEL_EINIT;
+			goto cleanup_file;
+		}
+		total_bytes_downloaded = resume_from;
+		channel_data->resumed = true;
+	}
+
 	if (channel_data->cached_file) {
 
 		total_bytes_downloaded = resume_cache_file(channel_data->cached_file,
@@ -1458,9 +1979,11 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 				      "retrying nonetheless now.");
 			}
 			TRACE("Channel awakened from sleep.");
+			metrics_add(METRIC_DOWNLOAD_RETRIES, 1);
 		}
 
 		curlrc = curl_easy_perform(channel_curl->handle);
+		channel_log_connections(this);
 		result = channel_map_curl_error(curlrc);
 		if (result == CHANNEL_ENONET) {
 			WARN("Lost connection. Retrying after %d seconds.",
@@ -1494,19 +2017,24 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 			goto cleanup_file;
 		}
 		total_bytes_downloaded += bytes_downloaded;
+		metrics_add(METRIC_DOWNLOAD_BYTES, bytes_downloaded);
 
 	} while (++try_count && (result != CHANNEL_OK));
 
 	channel_log_effective_url(this);
+	metrics_observe_since(METRIC_DOWNLOAD_US, start);
 
 	DEBUG("Channel downloaded %llu bytes ~ %llu MiB.",
 	      total_bytes_downloaded, total_bytes_downloaded / 1024 / 1024);
+	if (channel_data->stalls_avoided)
+		INFO("Download was shaped to the installer speed %u times.",
+		     channel_data->stalls_avoided);
 
 	result = channel_map_http_code(this, &channel_data->http_response_code);
 
 	channel_log_reply(result, channel_data, NULL);
 
-	if (result_channel_callback_ipc != CHANNEL_OK) {
+	if (wrdata.result != CHANNEL_OK) {
 		result = CHANNEL_EIO;
 		goto cleanup_file;
 	}
@@ -1557,6 +2085,7 @@ channel_op_res_t channel_get(channel_t *this, void *data)
 	channel_op_res_t result = CHANNEL_OK;
 	channel_data_t *channel_data = (channel_data_t *)data;
 	channel_data->http_response_code = 0;
+	channel_data->not_modified = false;
 	output_data_t outdata = {};
 	write_callback_t wrdata = { .this = this, .channel_data = channel_data, .outdata = &outdata };
 
@@ -1594,6 +2123,7 @@ channel_op_res_t channel_get(channel_t *this, void *data)
 	}
 
 	channel_log_effective_url(this);
+	channel_log_connections(this);
 
 	result = channel_map_http_code(this, &channel_data->http_response_code);
 
@@ -1602,6 +2132,13 @@ channel_op_res_t channel_get(channel_t *this, void *data)
 
 	channel_log_reply(result, channel_data, &outdata);
 
+	if (result == CHANNEL_OK && channel_data->http_response_code == 304) {
+		if (channel_data->debug)
+			TRACE("%s not modified, reply not parsed", channel_data->url);
+		channel_data->not_modified = true;
+		goto cleanup_header;
+	}
+
 	if (result == CHANNEL_OK) {
 	    result = parse_reply(channel_data, &outdata);
 	}
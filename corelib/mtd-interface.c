@@ -13,6 +13,8 @@
 #include <mtd/mtd-user.h>
 #include <sys/types.h>
 #include <sys/mount.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
@@ -22,6 +24,27 @@
 
 static char mtd_ubi_blacklist[100] = { 0 };
 
+/*
+ * The MTD / UBI topology is scanned once and kept across updates.
+ * Changes done outside the handlers are tracked by listening to
+ * kernel uevents: they are consumed before each update and only the
+ * affected UBI devices are scanned again. Renames and resizes send no
+ * uevent and are found by comparing each UBI device and its volumes
+ * with sysfs. A full scan is done if an MTD device appears or
+ * disappears, or if events were lost. MTDs without UBI are attached
+ * again at each update, as a full scan would do.
+ */
+#define UBI_VOL_HASH_SIZE	128
+#define UEVENT_BUFFER_SIZE	(256 * 1024)
+
+static struct {
+	int fd;		/* uevent socket, -1 if not available */
+	bool valid;	/* topology scanned */
+	uint64_t ubi_changed;	/* UBI devices changed by SWUpdate itself */
+} topology = { .fd = -1 };
+
+static struct ubi_part *ubi_vol_hash[UBI_VOL_HASH_SIZE];
+
 /*
  * Note: the functions here are derived directly
  * with minor changes from mtd-utils.
@@ -151,15 +174,47 @@ int flash_erase(int mtdnum)
 	return flash_erase_sector(mtdnum, 0, 0);
 }
 
+static void uevent_open(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,
+	};
+	int size = UEVENT_BUFFER_SIZE;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		TRACE("uevents not available, MTD will be rescanned at each update");
+		return;
+	}
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		TRACE("uevents not available, MTD will be rescanned at each update");
+		close(fd);
+		return;
+	}
+
+	topology.fd = fd;
+}
+
 void mtd_init(void)
 {
 	struct flash_description *flash = get_flash_info();
+
+	if (flash->libmtd)
+		return;
+
 	flash->libmtd = libmtd_open();
 	if (flash->libmtd == NULL) {
 		if (errno == 0)
 			WARN("MTD is not present in the system");
 		WARN("cannot open libmtd");
+		return;
 	}
+
+	uevent_open();
 }
 
 void mtd_set_ubiblacklist(char *mtdlist)
@@ -237,6 +292,9 @@ void ubi_init(void)
 	int err;
 	libubi_t libubi;
 
+	if (nand->libubi)
+		return;
+
 	libubi = libubi_open();
 	if (!libubi) {
 		return;
@@ -255,6 +313,72 @@ void ubi_init(void)
 	}
 }
 
+static unsigned int ubi_vol_hash_key(const char *name)
+{
+	unsigned int hash = 5381;
+
+	while (*name)
+		hash = hash * 33 + (unsigned char)*name++;
+
+	return hash % UBI_VOL_HASH_SIZE;
+}
+
+void ubi_add_volume(int mtdnum, struct ubi_part *vol)
+{
+	struct flash_description *flash = get_flash_info();
+	unsigned int key = ubi_vol_hash_key(vol->vol_info.name);
+
+	vol->mtdnum = mtdnum;
+	LIST_INSERT_HEAD(&flash->mtd_info[mtdnum].ubi_partitions, vol, next);
+	vol->hnext = ubi_vol_hash[key];
+	ubi_vol_hash[key] = vol;
+}
+
+void ubi_remove_volume(struct ubi_part *vol)
+{
+	struct ubi_part **p = &ubi_vol_hash[ubi_vol_hash_key(vol->vol_info.name)];
+
+	for (; *p; p = &(*p)->hnext) {
+		if (*p == vol) {
+			*p = vol->hnext;
+			break;
+		}
+	}
+	LIST_REMOVE(vol, next);
+}
+
+/*
+ * Search a volume by name on the given MTD or, if mtdnum is negative,
+ * on all of them. Names are unique inside a UBI device, if the same
+ * name is found on more devices the lowest MTD wins.
+ */
+struct ubi_part *ubi_find_volume(int mtdnum, const char *name)
+{
+	struct ubi_part *vol, *found = NULL;
+
+	for (vol = ubi_vol_hash[ubi_vol_hash_key(name)]; vol; vol = vol->hnext) {
+		if (strcmp(vol->vol_info.name, name))
+			continue;
+		if (mtdnum >= 0 && vol->mtdnum != mtdnum)
+			continue;
+		if (!found || vol->mtdnum < found->mtdnum)
+			found = vol;
+	}
+
+	return found;
+}
+
+static void ubi_drop_volumes(struct mtd_ubi_info *info)
+{
+	struct ubi_part *vol, *tmp;
+
+	LIST_FOREACH_SAFE(vol, &info->ubi_partitions, next, tmp) {
+		ubi_remove_volume(vol);
+		free(vol);
+	}
+	info->scanned = 0;
+}
+
 static void ubi_insert_list(int index, struct flash_description *flash, bool black)
 {
 	struct mtd_info *mtd = &flash->mtd;
@@ -298,7 +422,7 @@ static void scan_ubi_volumes(struct mtd_ubi_info *info)
 			return;
 		}
 
-		LIST_INSERT_HEAD(&info->ubi_partitions, ubi_part, next);
+		ubi_add_volume(info->dev_info.mtd_num, ubi_part);
 		TRACE("mtd%d:\tVolume found : \t%s",
 			info->dev_info.mtd_num,
 			ubi_part->vol_info.name);
@@ -342,6 +466,44 @@ static void scan_for_ubi_devices(void)
 	}
 }
 
+/*
+ * Scan again a single UBI device after it was changed,
+ * returns false if a full scan is required instead
+ */
+static bool rescan_ubi_device(int ubi_dev)
+{
+	struct flash_description *flash = get_flash_info();
+	struct mtd_info *mtd_info = &flash->mtd;
+	struct ubi_dev_info dev_info;
+	int i, mtd;
+
+	if (!flash->libubi)
+		return true;
+
+	if (ubi_get_dev_info1(flash->libubi, ubi_dev, &dev_info))
+		return false;
+
+	mtd = dev_info.mtd_num;
+	if (mtd < mtd_info->lowest_mtd_num || mtd > mtd_info->highest_mtd_num)
+		return false;
+	if (flash->mtd_info[mtd].skipubi)
+		return true;
+
+	/* the UBI device could have been moved to another MTD */
+	for (i = mtd_info->lowest_mtd_num; i <= mtd_info->highest_mtd_num; i++) {
+		if (flash->mtd_info[i].scanned &&
+		    flash->mtd_info[i].dev_info.dev_num == ubi_dev)
+			ubi_drop_volumes(&flash->mtd_info[i]);
+	}
+	ubi_drop_volumes(&flash->mtd_info[mtd]);
+
+	TRACE("ubi%d changed, scanning volumes on mtd%d", ubi_dev, mtd);
+	memcpy(&flash->mtd_info[mtd].dev_info, &dev_info, sizeof(dev_info));
+	scan_ubi_volumes(&flash->mtd_info[mtd]);
+
+	return true;
+}
+
 #if defined(CONFIG_UBIATTACH)
 static void scan_ubi_partitions(int mtd)
 {
@@ -516,9 +678,188 @@ int scan_mtd_devices (void)
 #endif
 #endif
 
+	topology.valid = true;
+
 	return mtd_info->mtd_dev_cnt;
 }
 
+/*
+ * Collect the changes reported by the kernel since the last call.
+ * Returns false if the whole topology must be scanned again.
+ */
+static bool uevent_collect(uint64_t *ubi_devs)
+{
+	char buf[4096];
+	const char *action, *subsystem, *devname;
+	ssize_t len;
+	bool ok = true;
+	int dev, vol, n;
+
+	for (;;) {
+		len = recv(topology.fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			/* receive buffer overrun, events were lost */
+			if (errno == ENOBUFS) {
+				ok = false;
+				continue;
+			}
+			break;
+		}
+		buf[len] = '\0';
+
+		action = subsystem = devname = NULL;
+		for (char *p = buf; p < buf + len; p += strlen(p) + 1) {
+			if (!strncmp(p, "ACTION=", 7))
+				action = p + 7;
+			else if (!strncmp(p, "SUBSYSTEM=", 10))
+				subsystem = p + 10;
+			else if (!strncmp(p, "DEVNAME=", 8))
+				devname = p + 8;
+		}
+		if (!action || !subsystem || !devname)
+			continue;
+
+		if (!strcmp(subsystem, "mtd")) {
+			if (strcmp(action, "change"))
+				ok = false;
+		} else if (!strcmp(subsystem, "ubi")) {
+			n = sscanf(devname, "ubi%d_%d", &dev, &vol);
+			if (n < 1)
+				continue;
+			/* a detached device may need to be attached again */
+			if ((n == 1 && !strcmp(action, "remove")) ||
+			    dev < 0 || dev >= 64)
+				ok = false;
+			else
+				*ubi_devs |= 1ULL << dev;
+		}
+	}
+
+	return ok;
+}
+
+/*
+ * Volume renames and resizes do not generate uevents: handlers
+ * changing them must tell which UBI device has to be scanned again.
+ */
+void ubi_invalidate_device(int ubi_dev)
+{
+	if (ubi_dev >= 0 && ubi_dev < 64)
+		topology.ubi_changed |= 1ULL << ubi_dev;
+	else
+		topology.valid = false;
+}
+
+#if defined(CONFIG_UBIVOL)
+/* Compare the cached volumes of a UBI device with sysfs */
+static bool ubi_volumes_changed(struct mtd_ubi_info *info)
+{
+	struct flash_description *flash = get_flash_info();
+	struct ubi_vol_info vol_info;
+	struct ubi_part *vol;
+
+	LIST_FOREACH(vol, &info->ubi_partitions, next) {
+		if (ubi_get_vol_info1(flash->libubi, vol->vol_info.dev_num,
+				      vol->vol_info.vol_id, &vol_info) ||
+		    strcmp(vol_info.name, vol->vol_info.name) ||
+		    vol_info.rsvd_bytes != vol->vol_info.rsvd_bytes)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Catch the changes done outside SWUpdate that send no uevent:
+ * resizes change the number of available LEBs of the device,
+ * renames (ubirename, scripts) only the names of the volumes.
+ */
+static void ubi_check_devices(uint64_t *ubi_devs)
+{
+	struct flash_description *flash = get_flash_info();
+	struct mtd_info *mtd_info = &flash->mtd;
+	struct mtd_ubi_info *info;
+	struct ubi_dev_info dev_info;
+	int i;
+
+	for (i = mtd_info->lowest_mtd_num; i <= mtd_info->highest_mtd_num; i++) {
+		info = &flash->mtd_info[i];
+		if (!info->scanned || info->dev_info.dev_num >= 64)
+			continue;
+		if (ubi_get_dev_info1(flash->libubi, info->dev_info.dev_num,
+				      &dev_info) ||
+		    dev_info.avail_lebs != info->dev_info.avail_lebs ||
+		    dev_info.vol_count != info->dev_info.vol_count ||
+		    ubi_volumes_changed(info))
+			*ubi_devs |= 1ULL << info->dev_info.dev_num;
+	}
+}
+
+#if defined(CONFIG_UBIATTACH)
+/*
+ * An MTD without UBI could have been flashed with a UBI image
+ * since the last scan: try to attach it, as a full scan does.
+ */
+static void ubi_attach_new_devices(void)
+{
+	struct flash_description *flash = get_flash_info();
+	struct mtd_info *mtd_info = &flash->mtd;
+	int i;
+
+	for (i = mtd_info->lowest_mtd_num; i <= mtd_info->highest_mtd_num; i++) {
+		if (!flash->mtd_info[i].skipubi &&
+		    !flash->mtd_info[i].scanned &&
+		    mtd_dev_present(flash->libmtd, i) &&
+		    flash->mtd_info[i].mtd.type != MTD_UBIVOLUME)
+			scan_ubi_partitions(i);
+	}
+}
+#endif
+#endif
+
+/*
+ * Bring the cached topology up to date before an update,
+ * this replaces mtd_cleanup() followed by scan_mtd_devices()
+ */
+int mtd_refresh_topology(void)
+{
+	struct flash_description *flash = get_flash_info();
+	uint64_t ubi_devs = 0;
+	bool ok;
+
+	if (topology.fd < 0)
+		goto rescan;
+
+	ok = uevent_collect(&ubi_devs);
+	ubi_devs |= topology.ubi_changed;
+	topology.ubi_changed = 0;
+	if (!topology.valid)
+		goto rescan;
+
+#if defined(CONFIG_UBIVOL)
+	if (flash->libubi)
+		ubi_check_devices(&ubi_devs);
+	for (int dev = 0; ok && dev < 64; dev++) {
+		if (ubi_devs & (1ULL << dev))
+			ok = rescan_ubi_device(dev);
+	}
+#if defined(CONFIG_UBIATTACH)
+	if (ok && flash->libubi)
+		ubi_attach_new_devices();
+#endif
+#endif
+
+	if (ok)
+		return flash->mtd.mtd_dev_cnt;
+
+	TRACE("MTD topology changed, scanning again");
+rescan:
+	mtd_cleanup();
+	return scan_mtd_devices();
+}
+
 void ubi_mount(struct ubi_vol_info *vol, const char *mntpoint)
 {
 	int ret;
@@ -544,21 +885,16 @@ void ubi_umount(const char *mntpoint)
 void mtd_cleanup (void)
 {
 	int i;
-	struct ubilist *list;
-	struct ubi_part *vol, *tmp;
 	struct flash_description *flash = get_flash_info();
 
 	if (flash->mtd_info) {
-		for (i = flash->mtd.lowest_mtd_num; i <= flash->mtd.highest_mtd_num; i++) {
-			list = &flash->mtd_info[i].ubi_partitions;
-			LIST_FOREACH_SAFE(vol, list, next, tmp) {
-				LIST_REMOVE(vol, next);
-				free(vol);
-			}
-		}
+		for (i = flash->mtd.lowest_mtd_num; i <= flash->mtd.highest_mtd_num; i++)
+			ubi_drop_volumes(&flash->mtd_info[i]);
 		free(flash->mtd_info);
 		flash->mtd_info = NULL;
 	}
+	memset(ubi_vol_hash, 0, sizeof(ubi_vol_hash));
+	topology.valid = false;
 
 	/* Do not clear libraries handles */
 	memset(&flash->ubi_info, 0, sizeof(struct ubi_info));
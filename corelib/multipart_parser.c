@@ -8,9 +8,9 @@
 #include <stdarg.h>
 #include <string.h>
 
-static void multipart_log(const char __attribute__((__unused__)) * format, ...)
-{
 #ifdef DEBUG_MULTIPART
+static void multipart_log(const char *format, ...)
+{
 	va_list args;
 	va_start(args, format);
 
@@ -18,8 +18,11 @@ static void multipart_log(const char __attribute__((__unused__)) * format, ...)
 	vfprintf(stderr, format, args);
 	fprintf(stderr, "\n");
 	va_end(args);
-#endif
 }
+#else
+/* Called for every byte, must not cost a function call */
+#define multipart_log(...) do { } while (0)
+#endif
 
 #define NOTIFY_CB(FOR)                                                 \
 do {                                                                   \
@@ -235,16 +238,34 @@ size_t multipart_parser_execute(multipart_parser * p, const char *buf,
 			/* fallthrough */
 		case s_part_data:
 			multipart_log("s_part_data");
-			if (c == CR) {
-				EMIT_DATA_CB(part_data, buf + mark, i - mark);
-				mark = i;
-				p->state = s_part_data_almost_boundary;
-				p->lookbehind[0] = CR;
-				break;
+			/*
+			 * Fast path: a delimiter can only start at a CR, skip
+			 * to the next one. A CR followed by something else
+			 * than the delimiter stays in the data span, so that
+			 * data is emitted in a single callback. Only a CR
+			 * too close to the end of the buffer to decide is
+			 * passed to the byte-wise state machine.
+			 */
+			for (;;) {
+				const char *cr = memchr(buf + i, CR, len - i);
+				if (!cr) {
+					EMIT_DATA_CB(part_data, buf + mark,
+						     len - mark);
+					return len;
+				}
+				i = cr - buf;
+				if (len - i < p->boundary_length + 2)
+					break;
+				if (buf[i + 1] == LF &&
+				    !memcmp(buf + i + 2, p->multipart_boundary,
+					    p->boundary_length))
+					break;
+				i++;
 			}
-			if (is_last)
-				EMIT_DATA_CB(part_data, buf + mark,
-					     (i - mark) + 1);
+			EMIT_DATA_CB(part_data, buf + mark, i - mark);
+			mark = i;
+			p->state = s_part_data_almost_boundary;
+			p->lookbehind[0] = CR;
 			break;
 
 		case s_part_data_almost_boundary:
@@ -206,6 +206,42 @@ void *get_node_libconfig(config_t *cfg, const char **nodes)
 	return NULL;
 }
 
+static int walk_group_libconfig(config_setting_t *group, const char *prefix,
+				walk_callback cb, void *data)
+{
+	config_setting_t *elem;
+	const char *name;
+	char *path;
+	int ret = 0;
+
+	for (int i = 0; i < config_setting_length(group) && !ret; i++) {
+		elem = config_setting_get_elem(group, i);
+		name = elem ? config_setting_name(elem) : NULL;
+		if (!name)
+			continue;
+		if (!prefix)
+			path = strdup(name);
+		else if (asprintf(&path, "%s.%s", prefix, name) == ENOMEM_ASPRINTF)
+			path = NULL;
+		if (!path)
+			return -ENOMEM;
+
+		ret = cb(path, name, elem, data);
+		if (ret > 0)
+			ret = 0;
+		else if (!ret && config_setting_is_group(elem) == CONFIG_TRUE)
+			ret = walk_group_libconfig(elem, path, cb, data);
+		free(path);
+	}
+
+	return ret;
+}
+
+int walk_nodes_libconfig(config_t *cfg, walk_callback cb, void *data)
+{
+	return walk_group_libconfig(config_root_setting(cfg), NULL, cb, data);
+}
+
 void *find_root_libconfig(config_t *cfg, const char **nodes, unsigned int depth)
 {
 	config_setting_t *elem;
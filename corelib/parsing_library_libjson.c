@@ -280,4 +280,39 @@ void *get_node_json(json_object *root, const char **nodes)
 	return find_json_recursive_node(root, nodes);
 }
 
+static int walk_object_json(json_object *obj, const char *prefix,
+			    walk_callback cb, void *data)
+{
+	char *path;
+	int ret = 0;
+
+	json_object_object_foreach(obj, key, node) {
+		if (!prefix)
+			path = strdup(key);
+		else if (asprintf(&path, "%s.%s", prefix, key) == ENOMEM_ASPRINTF)
+			path = NULL;
+		if (!path)
+			return -ENOMEM;
+
+		ret = cb(path, key, node, data);
+		if (ret > 0)
+			ret = 0;
+		else if (!ret && json_object_get_type(node) == json_type_object)
+			ret = walk_object_json(node, path, cb, data);
+		free(path);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+int walk_nodes_json(json_object *root, walk_callback cb, void *data)
+{
+	if (json_object_get_type(root) != json_type_object)
+		return 0;
+
+	return walk_object_json(root, NULL, cb, data);
+}
+
 
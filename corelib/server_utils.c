@@ -32,6 +32,11 @@ int channel_settings(void *elem, void *data)
 			WARN("max-download-speed setting %s: ustrtoull failed", tmp);
 	}
 
+	GET_FIELD_BOOL(LIBCFG_PARSER, elem, "adaptive-download-speed",
+		&chan->adaptive_speed);
+	GET_FIELD_BOOL(LIBCFG_PARSER, elem, "resume-from-checkpoint",
+		&chan->stream_resume);
+
 	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "retrywait", tmp);
 	if (strlen(tmp))
 		chan->retry_sleep =
@@ -238,6 +238,7 @@ static int verify_signer_certs(CMS_ContentInfo* cms, X509_STORE* store)
 
 	if (infos == NULL || cms_certs == NULL) {
 		ERROR("Invalid CMS signed data payload");
+		X509_STORE_CTX_free(ctx);
 		return ret;
 	}
 
@@ -361,8 +362,9 @@ dgst_init_error:
 	return ret;
 }
 
-static int openssl_cms_verify_file(void  *ctx, const char *sigfile,
-		const char *file, const char *signer_name)
+static int openssl_cms_verify_buf(void *ctx, const unsigned char *sig,
+		size_t siglen, const unsigned char *data, size_t len,
+		const char *signer_name)
 {
 	int status = -EFAULT;
 	CMS_ContentInfo *cms = NULL;
@@ -370,18 +372,18 @@ static int openssl_cms_verify_file(void  *ctx, const char *sigfile,
 
 	struct openssl_digest *dgst = (struct openssl_digest *)ctx;
 
-	/* Open CMS blob that needs to be checked */
-	BIO *sigfile_bio = BIO_new_file(sigfile, "rb");
+	/* CMS blob that needs to be checked */
+	BIO *sigfile_bio = BIO_new_mem_buf((void *)sig, (int)siglen);
 	if (!sigfile_bio) {
-		ERROR("%s cannot be opened", sigfile);
-		status = -EBADF;
+		ERROR("Signature cannot be read");
+		status = -ENOMEM;
 		goto out;
 	}
 
 	/* Parse the DER-encoded CMS message */
 	cms = d2i_CMS_bio(sigfile_bio, NULL);
 	if (!cms) {
-		ERROR("%s cannot be parsed as DER-encoded CMS signature blob", sigfile);
+		ERROR("Signature cannot be parsed as DER-encoded CMS signature blob");
 		status = -EFAULT;
 		goto out;
 	}
@@ -392,11 +394,11 @@ static int openssl_cms_verify_file(void  *ctx, const char *sigfile,
 		goto out;
 	}
 
-	/* Open the content file (data which was signed) */
-	content_bio = BIO_new_file(file, "rb");
+	/* Content (data which was signed) */
+	content_bio = BIO_new_mem_buf((void *)data, (int)len);
 	if (!content_bio) {
-		ERROR("%s cannot be opened", file);
-		status = -EBADF;
+		ERROR("Signed data cannot be read");
+		status = -ENOMEM;
 		goto out;
 	}
 
@@ -439,6 +441,6 @@ __attribute__((constructor))
 static void openssl_dgst(void)
 {
 	libs.dgst_init = openssl_cms_dgst_init;
-	libs.verify_file = openssl_cms_verify_file;
+	libs.verify_buf = openssl_cms_verify_buf;
 	(void)register_dgstlib(MODNAME, &libs);
 }
@@ -0,0 +1,276 @@
+/*
+ * SPDX-License-Identifier:     GPL-2.0-only
+ *
+ * AES-CBC decryption through the kernel crypto API (AF_ALG), so that
+ * a crypto engine of the SoC does the work when the kernel has a
+ * driver for it.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/if_alg.h>
+#include "util.h"
+#include "swupdate_crypto.h"
+
+#ifndef SOL_ALG
+#define SOL_ALG	279
+#endif
+
+#define MODNAME	"afalgAES"
+
+/*
+ * The kernel queues the data sent to an operation socket until it is
+ * read back, up to the socket buffer: larger requests would block.
+ */
+#define AFALG_MAX_REQUEST	(64 * 1024)
+
+struct afalg_ctx {
+	int tfmfd;
+	int opfd;
+	unsigned char iv[AES_BLK_SIZE];
+	/*
+	 * Ciphertext not decrypted yet: a partial block, or the last
+	 * full block, which holds the padding if the stream ends there
+	 */
+	unsigned char tail[AES_BLK_SIZE];
+	int taillen;
+};
+
+static swupdate_decrypt_lib afalg;
+
+static void afalg_DECRYPT_cleanup(void *ctx);
+
+static void *afalg_DECRYPT_init(unsigned char *key, char keylen, unsigned char *iv, cipher_t cipher)
+{
+	struct sockaddr_alg sa = {
+		.salg_family = AF_ALG,
+		.salg_type = "skcipher",
+		.salg_name = "cbc(aes)"
+	};
+	struct afalg_ctx *ctx;
+
+	/* Temporary to remove warning */
+	cipher = cipher;
+
+	if ((key == NULL) || (iv == NULL)) {
+		ERROR("no key or iv provided for decryption!");
+		return NULL;
+	}
+
+	switch (keylen) {
+	case AES_128_KEY_LEN:
+	case AES_192_KEY_LEN:
+	case AES_256_KEY_LEN:
+		break;
+	default:
+		return NULL;
+	}
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	ctx->opfd = -1;
+	memcpy(ctx->iv, iv, AES_BLK_SIZE);
+
+	ctx->tfmfd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (ctx->tfmfd < 0) {
+		ERROR("Kernel crypto API not available: %s", strerror(errno));
+		free(ctx);
+		return NULL;
+	}
+	if (bind(ctx->tfmfd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		ERROR("Kernel has no %s: %s", sa.salg_name, strerror(errno));
+		goto fail;
+	}
+	if (setsockopt(ctx->tfmfd, SOL_ALG, ALG_SET_KEY, key, keylen) < 0) {
+		ERROR("Key cannot be set: %s", strerror(errno));
+		goto fail;
+	}
+	ctx->opfd = accept4(ctx->tfmfd, NULL, 0, SOCK_CLOEXEC);
+	if (ctx->opfd < 0) {
+		ERROR("Decryption cannot be started: %s", strerror(errno));
+		goto fail;
+	}
+
+	return ctx;
+
+fail:
+	afalg_DECRYPT_cleanup(ctx);
+	return NULL;
+}
+
+/*
+ * Decrypt len bytes, a multiple of the block size, made of the first
+ * alen bytes of a followed by b. Every request carries its IV, the
+ * last ciphertext block, so no chaining state is kept in the kernel.
+ */
+static int afalg_request(struct afalg_ctx *ctx, unsigned char *out,
+			 const unsigned char *a, int alen,
+			 const unsigned char *b, int len)
+{
+	char cbuf[CMSG_SPACE(sizeof(uint32_t)) +
+		  CMSG_SPACE(sizeof(struct af_alg_iv) + AES_BLK_SIZE)] = { 0 };
+	struct iovec iov[2] = {
+		{ .iov_base = (void *)a, .iov_len = alen },
+		{ .iov_base = (void *)b, .iov_len = len - alen }
+	};
+	struct msghdr msg = {
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+		.msg_iov = alen ? iov : &iov[1],
+		.msg_iovlen = alen ? 2 : 1
+	};
+	struct cmsghdr *cmsg;
+	struct af_alg_iv *alg_iv;
+	ssize_t n;
+	int done = 0;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_ALG;
+	cmsg->cmsg_type = ALG_SET_OP;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+	*(uint32_t *)CMSG_DATA(cmsg) = ALG_OP_DECRYPT;
+
+	cmsg = CMSG_NXTHDR(&msg, cmsg);
+	cmsg->cmsg_level = SOL_ALG;
+	cmsg->cmsg_type = ALG_SET_IV;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(struct af_alg_iv) + AES_BLK_SIZE);
+	alg_iv = (struct af_alg_iv *)CMSG_DATA(cmsg);
+	alg_iv->ivlen = AES_BLK_SIZE;
+	memcpy(alg_iv->iv, ctx->iv, AES_BLK_SIZE);
+
+	/* IV of the next request, before out may overwrite the input */
+	if (len - alen >= AES_BLK_SIZE) {
+		memcpy(ctx->iv, b + len - alen - AES_BLK_SIZE, AES_BLK_SIZE);
+	} else {
+		int from_a = AES_BLK_SIZE - (len - alen);
+
+		memcpy(ctx->iv, a + alen - from_a, from_a);
+		memcpy(ctx->iv + from_a, b, len - alen);
+	}
+
+	do {
+		n = sendmsg(ctx->opfd, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n != len) {
+		ERROR("Decryption request failed: %s",
+		      n < 0 ? strerror(errno) : "short write");
+		return -EFAULT;
+	}
+
+	while (done < len) {
+		n = read(ctx->opfd, out + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			ERROR("Decryption failed: %s",
+			      n < 0 ? strerror(errno) : "no data");
+			return -EFAULT;
+		}
+		done += n;
+	}
+
+	return 0;
+}
+
+static int afalg_DECRYPT_update(void *ctx, unsigned char *buf,
+				int *outlen, const unsigned char *cryptbuf, int inlen)
+{
+	struct afalg_ctx *c = (struct afalg_ctx *)ctx;
+	int total, hold, len, ret;
+
+	if (!c)
+		return -EINVAL;
+
+	*outlen = 0;
+	total = c->taillen + inlen;
+	hold = total % AES_BLK_SIZE ? total % AES_BLK_SIZE : AES_BLK_SIZE;
+	if (total <= AES_BLK_SIZE) {
+		memcpy(c->tail + c->taillen, cryptbuf, inlen);
+		c->taillen = total;
+		return 0;
+	}
+
+	/* the tail goes with the first request, it is at most one block */
+	while (total > hold) {
+		len = min(total - hold, AFALG_MAX_REQUEST);
+		ret = afalg_request(c, buf + *outlen, c->tail, c->taillen,
+				    cryptbuf, len);
+		if (ret < 0)
+			return ret;
+		cryptbuf += len - c->taillen;
+		*outlen += len;
+		total -= len;
+		c->taillen = 0;
+	}
+	memcpy(c->tail, cryptbuf, hold);
+	c->taillen = hold;
+
+	return 0;
+}
+
+static int afalg_DECRYPT_final(void *ctx, unsigned char *buf,
+				int *outlen)
+{
+	struct afalg_ctx *c = (struct afalg_ctx *)ctx;
+	unsigned char block[AES_BLK_SIZE];
+	int pad;
+
+	if (!c)
+		return -EINVAL;
+
+	*outlen = 0;
+	if (c->taillen != AES_BLK_SIZE) {
+#ifndef CONFIG_ENCRYPTED_IMAGES_HARDEN_LOGGING
+		ERROR("Final: Decryption error, wrong final block length");
+#endif
+		return -EFAULT;
+	}
+	if (afalg_request(c, block, NULL, 0, c->tail, AES_BLK_SIZE) < 0)
+		return -EFAULT;
+
+	/* PKCS#7 padding */
+	pad = block[AES_BLK_SIZE - 1];
+	for (int i = 0; i < AES_BLK_SIZE; i++) {
+		if (pad == 0 || pad > AES_BLK_SIZE ||
+		    (i >= AES_BLK_SIZE - pad && block[i] != pad)) {
+#ifndef CONFIG_ENCRYPTED_IMAGES_HARDEN_LOGGING
+			ERROR("Final: Decryption error, bad padding");
+#endif
+			return -EFAULT;
+		}
+	}
+	memcpy(buf, block, AES_BLK_SIZE - pad);
+	*outlen = AES_BLK_SIZE - pad;
+
+	return 0;
+}
+
+static void afalg_DECRYPT_cleanup(void *ctx)
+{
+	struct afalg_ctx *c = (struct afalg_ctx *)ctx;
+
+	if (!c)
+		return;
+	if (c->opfd >= 0)
+		close(c->opfd);
+	if (c->tfmfd >= 0)
+		close(c->tfmfd);
+	free(c);
+}
+
+__attribute__((constructor))
+static void afalg_probe(void)
+{
+	afalg.DECRYPT_init = afalg_DECRYPT_init;
+	afalg.DECRYPT_update = afalg_DECRYPT_update;
+	afalg.DECRYPT_final = afalg_DECRYPT_final;
+	afalg.DECRYPT_cleanup = afalg_DECRYPT_cleanup;
+	(void)register_cryptolib(MODNAME, &afalg);
+}
@@ -8,10 +8,12 @@
 #pragma once
 
 #include <stdint.h>
+#include <gpgme.h>
 #include "util.h"
 
 struct gpg_digest {
 	char *gpg_home_directory;
 	bool verbose;
 	char *gpgme_protocol;
+	gpgme_ctx_t ctx;
 };
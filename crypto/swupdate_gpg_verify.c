@@ -29,11 +29,81 @@ status_cb(void *opaque, const char *keyword, const char *value)
 
 #define MSGBUF_LEN 256
 
+static void gpg_report_error(const char *what, gpgme_error_t err)
+{
+	char msg[MSGBUF_LEN];
+
+	ERROR("%s", what);
+	if (gpgme_strerror_r(err, msg, MSGBUF_LEN) == 0) {
+		ERROR("Reason: %s", msg);
+	}
+}
+
+/*
+ * The gpgme context is created once and reused for all updates
+ */
+static int gpg_setup_context(struct gpg_digest *dgst)
+{
+	gpgme_ctx_t ctx;
+	gpgme_error_t err;
+	gpgme_protocol_t protocol;
+
+	if (gpgme_check_version(NULL) == NULL) {
+		ERROR("Failed to check gpgme library version");
+		return -EFAULT;
+	}
+
+	if (dgst->gpgme_protocol != NULL) {
+		DEBUG("gpg: Enabling protocol %s", dgst->gpgme_protocol);
+		if (!strcmp(dgst->gpgme_protocol, "openpgp")) {
+			TRACE("gpg: using protocol OpenPGP");
+			protocol = GPGME_PROTOCOL_OpenPGP;
+		} else if (!strcmp(dgst->gpgme_protocol, "cms")) {
+			TRACE("gpg: using protocol cms");
+			protocol = GPGME_PROTOCOL_CMS;
+		} else {
+			ERROR("gpg: unsupported protocol! %s", dgst->gpgme_protocol);
+			return -EFAULT;
+		}
+	} else {
+		ERROR("gpg protocol unspecified!");
+		return -EFAULT;
+	}
+
+	err = gpgme_new(&ctx);
+	if (err) {
+		gpg_report_error("Failed to create new gpg context", err);
+		return -EFAULT;
+	}
+
+	gpgme_set_protocol(ctx, protocol);
+	gpgme_set_status_cb(ctx, status_cb, NULL);
+	if (dgst->verbose) {
+		gpgme_set_ctx_flag(ctx, "full-status", "1");
+	}
+	gpgme_set_locale(ctx, LC_ALL, setlocale(LC_ALL, ""));
+
+	if (dgst->gpg_home_directory != NULL) {
+		err = gpgme_ctx_set_engine_info(ctx, protocol, NULL, dgst->gpg_home_directory);
+		if (err) {
+			gpg_report_error("Something went wrong while setting the engine info", err);
+			gpgme_release(ctx);
+			return -EFAULT;
+		}
+	}
+
+	dgst->ctx = ctx;
+
+	return 0;
+}
+
 static int gpg_dgst_init(struct swupdate_cfg *sw, const char *keyfile)
 {
 	struct gpg_digest *dgst;
 	int ret;
 
+	(void)keyfile;
+
 	/*
 	 * Check that it was not called before
 	 */
@@ -51,6 +121,10 @@ static int gpg_dgst_init(struct swupdate_cfg *sw, const char *keyfile)
 	dgst->gpgme_protocol = sw->gpgme_protocol;
 	dgst->verbose = sw->verbose;
 
+	ret = gpg_setup_context(dgst);
+	if (ret)
+		goto dgst_init_error;
+
 	sw->dgst = dgst;
 
 	return 0;
@@ -62,122 +136,42 @@ dgst_init_error:
 	return ret;
 }
 
-static int gpg_verify_file(void *gpgdgst, const char *sigfile,
-                const char *file, const char *signer_name)
+static int gpg_verify_buf(void *gpgdgst, const unsigned char *sigbuf,
+		size_t siglen, const unsigned char *buf, size_t len,
+		const char *signer_name)
 {
 	struct gpg_digest *dgst = (struct gpg_digest *)gpgdgst;
-	gpgme_ctx_t ctx;
 	gpgme_error_t err;
-	gpgme_data_t image_sig, image;
-	FILE *fp_sig = NULL;
-	FILE *fp = NULL;
+	gpgme_data_t image_sig = NULL, image = NULL;
 	gpgme_signature_t sig;
 	int status = 0;
-	gpgme_protocol_t protocol;
 	gpgme_verify_result_t result;
-	char msg[MSGBUF_LEN];
-	int r;
-	const char *tmp;
 
-	tmp = gpgme_check_version(NULL);
-	if (tmp == NULL) {
-		ERROR("Failed to check gpgme library version");
-		status = -EFAULT;
-		goto out;
-	}
+	(void)signer_name;
 
-	err = gpgme_new(&ctx);
-	if (err) {
-		ERROR("Failed to create new gpg context");
-		r = gpgme_strerror_r(err, msg, MSGBUF_LEN);
-		if (r == 0) {
-			ERROR("Reason: %s", msg);
-		}
-		status = -EFAULT;
-		goto out;
+	if (!dgst || !dgst->ctx) {
+		ERROR("gpg context not initialized");
+		return -EFAULT;
 	}
 
-	if (dgst->gpgme_protocol != NULL) {
-		DEBUG("gpg: Enabling protocol %s", dgst->gpgme_protocol);
-		if (!strcmp(dgst->gpgme_protocol, "openpgp")) {
-			TRACE("gpg: using protocol OpenPGP");
-			protocol = GPGME_PROTOCOL_OpenPGP;
-		} else if (!strcmp(dgst->gpgme_protocol, "cms")) {
-			TRACE("gpg: using protocol cms");
-			protocol = GPGME_PROTOCOL_CMS;
-		} else {
-			ERROR("gpg: unsupported protocol! %s", dgst->gpgme_protocol);
-			status = -EFAULT;
-			goto out;
-		}
-	} else {
-		ERROR("gpg protocol unspecified!");
-		status = -EFAULT;
-		goto out;
-	}
-
-	gpgme_set_protocol(ctx, protocol);
-	gpgme_set_status_cb(ctx, status_cb, NULL);
-	if (dgst->verbose) {
-		gpgme_set_ctx_flag(ctx, "full-status", "1");
-	}
-	gpgme_set_locale(ctx, LC_ALL, setlocale(LC_ALL, ""));
-
-	if (dgst->gpg_home_directory != NULL) {
-		err = gpgme_ctx_set_engine_info(ctx, protocol, NULL, dgst->gpg_home_directory);
-		if (err) {
-			ERROR("Something went wrong while setting the engine info");
-			r = gpgme_strerror_r(err, msg, MSGBUF_LEN);
-			if (r == 0) {
-				ERROR("Reason: %s", msg);
-			}
-			status = -EFAULT;
-			goto out;
-		}
-	}
-
-	fp_sig = fopen(sigfile, "rb");
-	if (!fp_sig) {
-		ERROR("Failed to open %s", sigfile);
-		status = -EBADF;
-		goto out;
-	}
-	err = gpgme_data_new_from_stream(&image_sig, fp_sig);
+	err = gpgme_data_new_from_mem(&image_sig, (const char *)sigbuf, siglen, 0);
 	if (err) {
-		ERROR("error allocating data object");
-		r = gpgme_strerror_r(err, msg, MSGBUF_LEN);
-		if (r == 0) {
-			ERROR("Reason: %s", msg);
-		}
+		gpg_report_error("error allocating data object", err);
 		status = -ENOMEM;
 		goto out;
 	}
 
-	fp = fopen(file, "rb");
-	if (!fp) {
-		ERROR("Failed to open %s", file);
-		status = -EBADF;
-		goto out;
-	}
-	err = gpgme_data_new_from_stream(&image, fp);
+	err = gpgme_data_new_from_mem(&image, (const char *)buf, len, 0);
 	if (err) {
-		ERROR("error allocating data object");
-		r = gpgme_strerror_r(err, msg, MSGBUF_LEN);
-		if (r == 0) {
-			ERROR("Reason: %s", msg);
-		}
+		gpg_report_error("error allocating data object", err);
 		status = -ENOMEM;
 		goto out;
 	}
 
-	err = gpgme_op_verify(ctx, image_sig, image, NULL);
-	result = gpgme_op_verify_result(ctx);
+	err = gpgme_op_verify(dgst->ctx, image_sig, image, NULL);
+	result = gpgme_op_verify_result(dgst->ctx);
 	if (err) {
-		ERROR("verify failed");
-		r = gpgme_strerror_r(err, msg, MSGBUF_LEN);
-		if (r == 0) {
-			ERROR("Reason: %s", msg);
-		}
+		gpg_report_error("verify failed", err);
 		status = -EBADMSG;
 		goto out;
 	}
@@ -197,12 +191,6 @@ static int gpg_verify_file(void *gpgdgst, const char *sigfile,
  out:
 	gpgme_data_release(image);
 	gpgme_data_release(image_sig);
-	gpgme_release(ctx);
-
-	if (fp)
-		fclose(fp);
-	if (fp_sig)
-		fclose(fp_sig);
 
 	return status;
 }
@@ -211,6 +199,6 @@ __attribute__((constructor))
 static void gpg_dgst(void)
 {
 	libs.dgst_init = gpg_dgst_init;
-	libs.verify_file = gpg_verify_file;
+	libs.verify_buf = gpg_verify_buf;
 	(void)register_dgstlib("GPG", &libs);
 }
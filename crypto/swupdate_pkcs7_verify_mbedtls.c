@@ -619,15 +619,12 @@ static int mbedtls_pkcs7_dgst_init(struct swupdate_cfg *sw, const char *keyfile)
 	return 0;
 }
 
-static int mbedtls_pkcs7_verify_file(void *ctx, const char *sigfile,
-		const char *file, const char *signer_name)
+static int mbedtls_pkcs7_verify_buf(void *ctx, const unsigned char *sig,
+		size_t siglen, const unsigned char *content, size_t content_len,
+		const char *signer_name)
 {
 	struct mbedtls_digest *dgst = (struct mbedtls_digest *)ctx;
 	mbedtls_pkcs7 pkcs7;
-	unsigned char *sigbuf = NULL;
-	unsigned char *content = NULL;
-	size_t sigbuf_len = 0;
-	size_t content_len = 0;
 	int error;
 	int status = -EFAULT;
 	const mbedtls_x509_crt *crt;
@@ -640,27 +637,16 @@ static int mbedtls_pkcs7_verify_file(void *ctx, const char *sigfile,
 
 	mbedtls_pkcs7_init(&pkcs7);
 
-	error = read_file_into_buf(sigfile, &sigbuf, &sigbuf_len);
-	if (error) {
-		status = error;
-		goto out;
-	}
-
-	int parse_error = mbedtls_pkcs7_parse_der(&pkcs7, sigbuf, sigbuf_len);
+	int parse_error = mbedtls_pkcs7_parse_der(&pkcs7, sig, siglen);
 	if (parse_error == MBEDTLS_ERR_PKCS7_INVALID_SIGNER_INFO) {
 		/*
 		 * The mbedTLS PKCS#7 parser does not support signedAttrs.
-		 * Read the content file and verify manually.
+		 * Verify the content manually.
 		 */
-		error = read_file_into_buf(file, &content, &content_len);
-		if (error) {
-			status = error;
-			goto out;
-		}
 		TRACE("SignerInfo contains authenticatedAttributes; "
 			"using manual verification path");
 		error = pkcs7_verify_with_signed_attrs(
-				sigbuf, sigbuf_len,
+				(unsigned char *)sig, siglen,
 				content, content_len,
 				dgst, signer_name);
 		if (error == 0) {
@@ -673,13 +659,13 @@ static int mbedtls_pkcs7_verify_file(void *ctx, const char *sigfile,
 		goto out;
 	}
 	else if (parse_error < 0) {
-		ERROR("%s cannot be parsed as DER-encoded PKCS#7 signature blob", sigfile);
+		ERROR("Signature cannot be parsed as DER-encoded PKCS#7 signature blob");
 		trace_mbedtls_error("mbedtls_pkcs7_parse_der", parse_error);
 		status = -EFAULT;
 		goto out;
 	}
 	else if (parse_error != MBEDTLS_PKCS7_SIGNED_DATA) {
-		ERROR("%s is not a detached PKCS#7 signed-data blob", sigfile);
+		ERROR("Signature is not a detached PKCS#7 signed-data blob");
 		status = -EBADMSG;
 		goto out;
 	}
@@ -695,12 +681,6 @@ static int mbedtls_pkcs7_verify_file(void *ctx, const char *sigfile,
 	 * The signature was built, e.g., with openssl cms -noattr.
 	 */
 
-	error = read_file_into_buf(file, &content, &content_len);
-	if (error) {
-		status = error;
-		goto out;
-	}
-
 	for (crt = pkcs7.MBEDTLS_PRIVATE(signed_data).MBEDTLS_PRIVATE(no_of_certs) > 0 ?
 			&pkcs7.MBEDTLS_PRIVATE(signed_data).MBEDTLS_PRIVATE(certs) : NULL;
 			crt && crt->raw.p; crt = crt->next) {
@@ -733,8 +713,6 @@ static int mbedtls_pkcs7_verify_file(void *ctx, const char *sigfile,
 
 out:
 	mbedtls_pkcs7_free(&pkcs7);
-	free(content);
-	free(sigbuf);
 	return status;
 }
 
@@ -742,7 +720,7 @@ __attribute__((constructor))
 static void mbedtls_pkcs7_dgst(void)
 {
 	libs.dgst_init = mbedtls_pkcs7_dgst_init;
-	libs.verify_file = mbedtls_pkcs7_verify_file;
+	libs.verify_buf = mbedtls_pkcs7_verify_buf;
 	(void)register_dgstlib("pkcs#7mbedtls", &libs);
 }
 #else
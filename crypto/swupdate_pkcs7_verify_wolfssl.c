@@ -214,43 +214,37 @@ dgst_init_error:
 	return ret;
 }
 
-static int wolfssl_pkcs7_verify_file(void *ctx, const char *sigfile,
-		const char *file, const char *signer_name)
+static int wolfssl_pkcs7_verify_buf(void *ctx, const unsigned char *sig,
+		size_t siglen, const unsigned char *data, size_t len,
+		const char *signer_name)
 {
 	struct wolfssl_digest *dgst = (struct wolfssl_digest *)ctx;
 	int status = -EFAULT;
 	WOLFSSL_PKCS7* pkcs7 =  (WOLFSSL_PKCS7 *)PKCS7_new();
 	BIO *bio_mem = NULL;
-	BIO *content_bio = NULL;
 
-	/* Open detached signature that needs to be checked */
-	BIO *sigfile_bio = BIO_new_file(sigfile, "rb");
-	if (!sigfile_bio) {
-		ERROR("%s cannot be opened", sigfile);
-		status = -EBADF;
-		goto out;
+	if (!pkcs7) {
+		ERROR("PKCS7 context cannot be allocated");
+		return -ENOMEM;
 	}
 
-	pkcs7->len = wolfSSL_BIO_get_len(sigfile_bio);
-	pkcs7->data = calloc(1, pkcs7->len);
-	BIO_read(sigfile_bio, pkcs7->data, pkcs7->len);
+	/* Detached signature that needs to be checked */
+	pkcs7->len = siglen;
+	pkcs7->data = calloc(1, siglen);
 	if (!pkcs7->data) {
-		ERROR("%s cannot be parsed as DER-encoded PKCS#7 signature blob", sigfile);
-		status = -EFAULT;
+		ERROR("Signature cannot be parsed as DER-encoded PKCS#7 signature blob");
+		status = -ENOMEM;
 		goto out;
 	}
+	memcpy(pkcs7->data, sig, siglen);
 
-	/* Open the content file (data which was signed) */
-	content_bio = BIO_new_file(file, "rb");
-	if (!content_bio) {
-		ERROR("%s cannot be opened", file);
-		status = -EBADF;
+	/* Data which was signed */
+	bio_mem = BIO_new_mem_buf((void *)data, (int)len);
+	if (!bio_mem) {
+		ERROR("Signed data cannot be read");
+		status = -ENOMEM;
 		goto out;
 	}
-	long content_len = wolfSSL_BIO_get_len(content_bio);
-	char *content = calloc(1, content_len);
-	BIO_read(content_bio, content, content_len);
-	bio_mem = BIO_new_mem_buf(content, content_len);
 
 	/* Then try to verify signature. The BIO* in parameter has to be a mem BIO.
            See https://github.com/wolfSSL/wolfssl/issues/6174. */
@@ -274,18 +268,10 @@ static int wolfssl_pkcs7_verify_file(void *ctx, const char *sigfile,
 	status = 0;
 out:
 
-	if (pkcs7) {
-		PKCS7_free((PKCS7 *)pkcs7);
-	}
+	PKCS7_free((PKCS7 *)pkcs7);
 	if (bio_mem) {
 		BIO_free(bio_mem);
 	}
-	if (content_bio) {
-		BIO_free(content_bio);
-	}
-	if (sigfile_bio) {
-		BIO_free(sigfile_bio);
-	}
 	return status;
 }
 
@@ -293,6 +279,6 @@ __attribute__((constructor))
 static void wolfssl_dgst(void)
 {
 	libs.dgst_init = wolfssl_pkcs7_dgst_init;
-	libs.verify_file = wolfssl_pkcs7_verify_file;
+	libs.verify_buf = wolfssl_pkcs7_verify_buf;
 	(void)register_dgstlib("pkcs#7WolfSSL", &libs);
 }
@@ -23,12 +23,11 @@
 
 static swupdate_dgst_lib	libs;
 
-static int mbedtls_rsa_verify_file(void *ctx, const char *sigfile,
-		const char *file, const char *signer_name)
+static int mbedtls_rsa_verify_buf(void *ctx, const unsigned char *sig,
+		size_t siglen, const unsigned char *data, size_t len,
+		const char *signer_name)
 {
 	struct mbedtls_digest *dgst = (struct mbedtls_digest *)ctx;
-	unsigned char *sigbuf = NULL;
-	size_t sigbuf_len = 0;
 	int error;
 	uint8_t hash_computed[32];
 	const mbedtls_md_info_t *md_info;
@@ -53,24 +52,17 @@ static int mbedtls_rsa_verify_file(void *ctx, const char *sigfile,
 
 	assert(mbedtls_md_get_size(md_info) == sizeof(hash_computed));
 
-	error = mbedtls_md_file(md_info, file, hash_computed);
+	error = mbedtls_md(md_info, data, len, hash_computed);
 	if (error) {
-		ERROR("mbedtls_md_file: %d", error);
+		ERROR("mbedtls_md: %d", error);
 		return error;
 	}
 
-	error = read_file_into_buf(sigfile, &sigbuf, &sigbuf_len);
-	if (error) {
-		return error;
-	}
-
-	int ret = mbedtls_pk_verify_ext(
+	return mbedtls_pk_verify_ext(
 		pk_type, pss_options,
 		&dgst->mbedtls_pk_context, mbedtls_md_get_type(md_info),
 		hash_computed, sizeof(hash_computed),
-		sigbuf, sigbuf_len);
-	free(sigbuf);
-	return ret;
+		sig, siglen);
 }
 
 static int mbedtls_rsa_dgst_init(struct swupdate_cfg *sw, const char *keyfile)
@@ -101,7 +93,7 @@ __attribute__((constructor))
 static void mbedtls_rsa_dgst(void)
 {
 	libs.dgst_init = mbedtls_rsa_dgst_init;
-	libs.verify_file = mbedtls_rsa_verify_file;
+	libs.verify_buf = mbedtls_rsa_verify_buf;
 #if defined(CONFIG_SIGALG_RAWRSA)
 	(void)register_dgstlib(MODNAME, &libs);
 #endif
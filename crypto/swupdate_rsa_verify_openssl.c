@@ -20,8 +20,6 @@
 #define MODNAME_PSS	"opensslRSAPSS"
 #endif
 
-#define BUFSIZE	(1024 * 8)
-
 static swupdate_dgst_lib	libs;
 
 static EVP_PKEY *load_pubkey(const char *file)
@@ -76,7 +74,7 @@ static int dgst_verify_init(struct openssl_digest *dgst)
 	return 0;
 }
 
-static int verify_update(struct openssl_digest *dgst, char *msg, unsigned int mlen)
+static int verify_update(struct openssl_digest *dgst, const void *msg, size_t mlen)
 {
 	int rc;
 
@@ -104,79 +102,41 @@ static int verify_final(struct openssl_digest *dgst, unsigned char *sig, unsigne
 	return rc;
 }
 
-static int openssl_rsa_verify_file(void *ctx, const char *sigfile,
-		const char *file, const char *signer_name)
+static int openssl_rsa_verify_buf(void *ctx, const unsigned char *sig,
+		size_t siglen, const unsigned char *data, size_t len,
+		const char *signer_name)
 {
 	struct openssl_digest *dgst = (struct openssl_digest *)ctx;
-	FILE *fp = NULL;
-	BIO *sigbio;
-	int siglen = 0;
 	int i;
-	unsigned char *sigbuf = NULL;
-	char *msg = NULL;
-	int size;
-	size_t rbytes;
 	int status = 0;
 
 	(void)signer_name;
 	if (!dgst) {
 		ERROR("Wrong crypto initialization: did you pass the key ?");
-		status = -ENOKEY;
-		goto out;
-	}
-
-	msg = malloc(BUFSIZE);
-	if (!msg) {
-		status = -ENOMEM;
-		goto out;
+		return -ENOKEY;
 	}
 
-	sigbio = BIO_new_file(sigfile, "rb");
-	siglen = EVP_PKEY_size(dgst->pkey);
-	sigbuf = OPENSSL_malloc(siglen);
-
-	siglen = BIO_read(sigbio, sigbuf, siglen);
-	BIO_free(sigbio);
-
-	if(siglen <= 0) {
-		ERROR("Error reading signature file %s", sigfile);
-		status = -ENOKEY;
-		goto out;
+	if (siglen == 0) {
+		ERROR("Error reading signature");
+		return -ENOKEY;
 	}
+	if (siglen > (size_t)EVP_PKEY_size(dgst->pkey))
+		siglen = EVP_PKEY_size(dgst->pkey);
 
 	ERR_clear_error();
 	if (EVP_DigestInit_ex(dgst->ctx, EVP_sha256(), NULL) != 1) {
 		ERROR("EVP_DigestInit_ex failed: %s", ERR_error_string(ERR_get_error(), NULL));
-		status = -ENOKEY;
-		goto out;
-	}
-
-	if (dgst_verify_init(dgst) < 0) {
-		status = -ENOKEY;
-		goto out;
+		return -ENOKEY;
 	}
 
-	fp = fopen(file, "r");
-	if (!fp) {
-		ERROR("%s cannot be opened", file);
-		status = -EBADF;
-		goto out;
-	}
+	if (dgst_verify_init(dgst) < 0)
+		return -ENOKEY;
 
-	size = 0;
-	for (;;) {
-		rbytes = fread(msg, 1, BUFSIZE, fp);
-		if (rbytes > 0) {
-			size += rbytes;
-			if (verify_update(dgst, msg, rbytes) < 0)
-				break;
-		}
-		if (feof(fp))
-			break;
-	}
+	if (verify_update(dgst, data, len) < 0)
+		return -EFAULT;
 
-	TRACE("Verify signed image: Read %d bytes", size);
-	i = verify_final(dgst, sigbuf, (unsigned int)siglen);
+	TRACE("Verify signed image: Read %zu bytes", len);
+	i = verify_final(dgst, (unsigned char *)sig, (unsigned int)siglen);
 	if(i > 0) {
 		TRACE("Verified OK");
 		status = 0;
@@ -188,14 +148,6 @@ static int openssl_rsa_verify_file(void *ctx, const char *sigfile,
 		status = -EFAULT;
 	}
 
-out:
-	if (fp)
-		fclose(fp);
-	if (msg)
-		free(msg);
-	if (sigbuf)
-		OPENSSL_free(sigbuf);
-
 	return status;
 }
 
@@ -258,7 +210,7 @@ __attribute__((constructor))
 static void openssl_dgst(void)
 {
 	libs.dgst_init = openssl_rsa_dgst_init;
-	libs.verify_file = openssl_rsa_verify_file;
+	libs.verify_buf = openssl_rsa_verify_buf;
 #if defined(CONFIG_SIGALG_RAWRSA)
 	(void)register_dgstlib(MODNAME, &libs);
 #endif
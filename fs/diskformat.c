@@ -6,7 +6,14 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
 #include <util.h>
 #include <handler.h>
 #include <blkid/blkid.h>
@@ -123,6 +130,95 @@ int diskformat_mkfs(char *device, char *fstype)
 	return ret;
 }
 
+/*
+ * Read a limit of the request queue, a partition uses
+ * the queue of its disk
+ */
+static unsigned long long blkdev_queue_limit(dev_t rdev, const char *limit)
+{
+	const char *fmt[] = { "/sys/dev/block/%u:%u/queue/%s",
+			      "/sys/dev/block/%u:%u/../queue/%s" };
+	unsigned long long value = 0;
+	char path[128];
+	FILE *fp;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(fmt); i++) {
+		snprintf(path, sizeof(path), fmt[i], major(rdev), minor(rdev), limit);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+		if (fscanf(fp, "%llu", &value) != 1)
+			value = 0;
+		fclose(fp);
+		break;
+	}
+
+	return value;
+}
+
+/*
+ * Clear a device before a file system is created.
+ * zeroed is set if the device then guarantees to read back zeroes,
+ * so that the file system does not need to write them:
+ * - a hole punched into a regular file, its blocks are released
+ * - BLKZEROOUT when the device offloads it (WRITE ZEROES): the kernel
+ *   asks for it with NOUNMAP, so the device writes the zeroes itself
+ *   and the blocks stay allocated. It is not used without offload
+ *   because the kernel would then send the zeroes as data
+ * - BLKDISCARD, which releases the blocks, when the device reports
+ *   that discarded blocks read as zeroes (kernels before 4.12 only)
+ */
+int diskformat_discard(const char *device, bool *zeroed)
+{
+	struct stat st;
+	uint64_t range[2] = { 0, 0 };
+	const char *how = "zeroed";
+	int fd, ret = -EOPNOTSUPP;
+
+	*zeroed = false;
+	fd = open(device, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		if (st.st_size && !fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					     0, st.st_size)) {
+			*zeroed = true;
+			ret = 0;
+		}
+		goto out;
+	}
+	if (!S_ISBLK(st.st_mode) || ioctl(fd, BLKGETSIZE64, &range[1]) < 0)
+		goto out;
+
+	if (blkdev_queue_limit(st.st_rdev, "write_zeroes_max_bytes") &&
+	    !ioctl(fd, BLKZEROOUT, range)) {
+		*zeroed = true;
+		ret = 0;
+	} else if (blkdev_queue_limit(st.st_rdev, "discard_max_bytes") &&
+		   !ioctl(fd, BLKDISCARD, range)) {
+		how = "discarded";
+#ifdef BLKDISCARDZEROES
+		unsigned int zeroes = 0;
+
+		if (!ioctl(fd, BLKDISCARDZEROES, &zeroes) && zeroes)
+			*zeroed = true;
+#endif
+		ret = 0;
+	}
+	if (!ret)
+		TRACE("%s: %llu bytes %s%s", device, (unsigned long long)range[1],
+		      how, *zeroed ? ", reads zeroes" : "");
+
+out:
+	close(fd);
+	return ret;
+}
+
 int diskformat_set_fslabel(char *device, char *fstype, const char *label)
 {
 #ifdef CONFIG_FAT_FILESYSTEM
@@ -7,10 +7,13 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 
 #include "util.h"
 
@@ -18,10 +21,85 @@
 #include "diskio.h"
 
 
-#define SECTOR_SIZE	512
+#define DEFAULT_SECTOR_SIZE	512
+
+/*
+ * Size of the write-back cache. FatFs writes FAT tables, directory
+ * entries and file data in small chunks, mostly to adjacent sectors.
+ * They are collected here and sent to the device in a single write.
+ */
+#define WRITE_CACHE_SIZE	(1024 * 1024)
 
 static int file_descriptor = -1;
+static UINT sector_size = DEFAULT_SECTOR_SIZE;
+
+/*
+ * Write-back cache: it holds one run of contiguous dirty sectors,
+ * starting at cache_start and cache_count sectors long.
+ */
+static BYTE *cache_buf;
+static LBA_t cache_start;
+static UINT cache_count;
+static UINT cache_max;
 
+static UINT get_sector_size(int fd)
+{
+	struct stat st;
+	int ss;
+
+	if (fstat(fd, &st) || !S_ISBLK(st.st_mode))
+		return DEFAULT_SECTOR_SIZE;
+
+	if (ioctl(fd, BLKSSZGET, &ss) < 0) {
+		WARN("Cannot get logical sector size, assuming %d: %s",
+		     DEFAULT_SECTOR_SIZE, strerror(errno));
+		return DEFAULT_SECTOR_SIZE;
+	}
+
+	return ss;
+}
+
+static int write_sectors(const BYTE *buff, LBA_t sector, UINT count)
+{
+	size_t len = (size_t)count * sector_size;
+	off_t offset = (off_t)sector * sector_size;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pwrite(file_descriptor, buff, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR("Cannot write sector %llu: %s",
+			      (unsigned long long)sector, strerror(errno));
+			return -1;
+		}
+		buff += ret;
+		offset += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int cache_flush(void)
+{
+	int ret;
+
+	if (!cache_count)
+		return 0;
+
+	ret = write_sectors(cache_buf, cache_start, cache_count);
+	cache_count = 0;
+
+	return ret;
+}
+
+static bool cache_overlaps(LBA_t sector, UINT count)
+{
+	return cache_count && sector < cache_start + cache_count &&
+		sector + count > cache_start;
+}
 
 /*
  * Extension to FatFs library: fatfs_init associates the fatfs library with
@@ -46,7 +124,27 @@ int fatfs_init(const char *device)
 		return -1;
 	}
 
+	sector_size = get_sector_size(file_descriptor);
+	if (sector_size < FF_MIN_SS || sector_size > FF_MAX_SS) {
+		ERROR("Device %s: sector size %u not supported",
+		      device, sector_size);
+		goto err;
+	}
+
+	cache_max = WRITE_CACHE_SIZE / sector_size;
+	cache_count = 0;
+	cache_buf = malloc(WRITE_CACHE_SIZE);
+	if (!cache_buf) {
+		ERROR("OOM allocating write cache for %s", device);
+		goto err;
+	}
+
 	return 0;
+
+err:
+	(void)close(file_descriptor);
+	file_descriptor = -1;
+	return -1;
 }
 
 /*
@@ -55,9 +153,13 @@ int fatfs_init(const char *device)
 void fatfs_release(void)
 {
 	if (file_descriptor >= 0) {
+		if (cache_flush() || fdatasync(file_descriptor))
+			ERROR("Data could not be flushed to device");
 		(void)close(file_descriptor);
 		file_descriptor = -1;
 	}
+	free(cache_buf);
+	cache_buf = NULL;
 }
 
 DSTATUS disk_status(BYTE pdrv)
@@ -78,6 +180,7 @@ DSTATUS disk_initialize(BYTE pdrv)
 
 DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
 {
+	size_t len = (size_t)count * sector_size;
 	(void)pdrv;
 
 	if (!buff)
@@ -86,7 +189,22 @@ DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
 	if (disk_status(pdrv))
 		return RES_NOTRDY;
 
-	if (pread(file_descriptor, buff, count * SECTOR_SIZE, sector * SECTOR_SIZE) != count * SECTOR_SIZE)
+	/*
+	 * FatFs reads back sectors it has just written (FAT, directory
+	 * entries): serve them from the cache if they are completely in.
+	 */
+	if (cache_overlaps(sector, count)) {
+		if (sector >= cache_start &&
+		    sector + count <= cache_start + cache_count) {
+			memcpy(buff, cache_buf +
+			       (size_t)(sector - cache_start) * sector_size, len);
+			return RES_OK;
+		}
+		if (cache_flush())
+			return RES_ERROR;
+	}
+
+	if (pread(file_descriptor, buff, len, (off_t)sector * sector_size) != (ssize_t)len)
 		return RES_ERROR;
 
 	return RES_OK;
@@ -103,8 +221,34 @@ DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
 	if (disk_status(pdrv))
 		return RES_NOTRDY;
 
-	if (pwrite(file_descriptor, buff, count * SECTOR_SIZE, sector * SECTOR_SIZE) != count * SECTOR_SIZE)
-		return RES_ERROR;
+	/* Requests larger than the cache go straight to the device */
+	if (count >= cache_max) {
+		if (cache_overlaps(sector, count) && cache_flush())
+			return RES_ERROR;
+		if (write_sectors(buff, sector, count))
+			return RES_ERROR;
+		return RES_OK;
+	}
+
+	/* Rewrite of sectors already in the cache */
+	if (sector >= cache_start &&
+	    sector + count <= cache_start + cache_count) {
+		memcpy(cache_buf + (size_t)(sector - cache_start) * sector_size,
+		       buff, (size_t)count * sector_size);
+		return RES_OK;
+	}
+
+	/* Append to the cached run or start a new one */
+	if (!cache_count || sector != cache_start + cache_count ||
+	    cache_count + count > cache_max) {
+		if (cache_flush())
+			return RES_ERROR;
+		cache_start = sector;
+	}
+
+	memcpy(cache_buf + (size_t)cache_count * sector_size, buff,
+	       (size_t)count * sector_size);
+	cache_count += count;
 
 	return RES_OK;
 }
@@ -119,12 +263,12 @@ DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
 
 	switch (cmd) {
 	case CTRL_SYNC:
-		if (syncfs(file_descriptor) != 0)
+		if (cache_flush() || fdatasync(file_descriptor) != 0)
 			return RES_ERROR;
 		break;
 	case GET_SECTOR_COUNT:
 	{
-		off_t size = lseek(file_descriptor, 0, SEEK_END) / SECTOR_SIZE;
+		off_t size = lseek(file_descriptor, 0, SEEK_END) / sector_size;
 
 		if (!buff)
 			return RES_PARERR;
@@ -136,7 +280,7 @@ DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
 		if (!buff)
 			return RES_PARERR;
 
-		*(WORD *)buff = SECTOR_SIZE;
+		*(WORD *)buff = sector_size;
 		break;
 	case GET_BLOCK_SIZE:
 		/* Get erase block size of flash memories, return 1 if not a
@@ -13,13 +13,18 @@
 
 #include "ff.h"
 
+/*
+ * f_mkfs() clears the FAT and the root directory in chunks of the
+ * working buffer size, so a larger buffer means fewer device writes.
+ */
+#define MKFS_WORK_SIZE	(256 * 1024)
 
 int fat_mkfs(const char *device_name, const char __attribute__ ((__unused__)) *fstype)
 {
 	if (fatfs_init(device_name))
 		return -1;
 
-	void* working_buffer = malloc(FF_MAX_SS);
+	void* working_buffer = malloc(MKFS_WORK_SIZE);
 
 	if (!working_buffer) {
 		fatfs_release();
@@ -34,7 +39,7 @@ int fat_mkfs(const char *device_name, const char __attribute__ ((__unused__)) *f
 		.n_root = 0
 	};
 
-	FRESULT result = f_mkfs("", &mkfs_parm, working_buffer, FF_MAX_SS);
+	FRESULT result = f_mkfs("", &mkfs_parm, working_buffer, MKFS_WORK_SIZE);
 	free(working_buffer);
 
 	if (result != FR_OK) {
@@ -816,6 +816,7 @@ int ext_mkfs(const char *device_name, const char *fstype, unsigned long features
 	int		lazy_itable_init;
 	int		journal_flags = 0;
 	int		journal_size = 0;
+	bool		zeroed = false;
 
 	memset(&fs_param, 0, sizeof(struct ext2_super_block));
 
@@ -860,6 +861,13 @@ int ext_mkfs(const char *device_name, const char *fstype, unsigned long features
 
 	io_ptr = unix_io_manager;
 
+	/*
+	 * Zero or discard the whole device before anything is written:
+	 * if it reads back zeroes, inode tables and journal need no wipe
+	 */
+	if (diskformat_discard(device_name, &zeroed))
+		zeroed = false;
+
 	/*
 	 * Initialize the superblock....
 	 */
@@ -885,6 +893,14 @@ int ext_mkfs(const char *device_name, const char *fstype, unsigned long features
 	if (access("/sys/fs/ext4/features/lazy_itable_init", R_OK) == 0)
 		lazy_itable_init = 1;
 
+	if (zeroed) {
+		TRACE("%s reads zeroes after discard, skipping inode table wipe",
+		      device_name);
+		lazy_itable_init = 1;
+		itable_zeroed = 1;
+		journal_flags |= EXT2_MKJOURNAL_LAZYINIT;
+	}
+
 	/* Calculate journal blocks */
 	if (journal_size ||
 	    ext2fs_has_feature_journal(&fs_param))
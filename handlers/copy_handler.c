@@ -13,7 +13,6 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <pthread.h>
-#include <signal.h>
 #include <libgen.h>
 #ifdef CONFIG_MTD
 #include <mtd/mtd-user.h>
@@ -50,9 +49,6 @@
 #include "handler_helpers.h"
 #include "installer.h"
 
-#define PIPE_READ  0
-#define PIPE_WRITE 1
-
 static void copy_handler(void);
 static void raw_copyimage_handler(void);
 
@@ -62,14 +58,13 @@ char *chained_handler;
 
 static int copy_single_file(const char *path, off_t skipbytes, ssize_t size, struct img_type *img, const char *chained)
 {
-	int fdout, fdin, ret;
+	int fdin, ret;
 	struct stat statbuf;
 #ifdef CONFIG_MTD
 	struct mtd_info_user mtdinfo;
 #endif
 	struct chain_handler_data priv;
 	uint32_t checksum;
-	int pipes[2];
 	unsigned long offset = 0;
 	pthread_t chain_handler_thread_id;
 
@@ -136,22 +131,17 @@ static int copy_single_file(const char *path, off_t skipbytes, ssize_t size, str
 		return -ENODEV;
 	}
 
-	if (pipe(pipes) < 0) {
-		ERROR("Could not create pipes for chained handler, existing...");
-		close(fdin);
-		return -EFAULT;
-	}
-
 	/* Overwrite some parameters for chained handler */
 	memcpy(&priv.img, img, sizeof(*img));
 	priv.img.compressed = COMPRESSED_FALSE;
 	memset(priv.img.sha256, 0, SHA256_HASH_LENGTH);
-	priv.img.fdin = pipes[PIPE_READ];
 	priv.img.size = size;
 	strlcpy(priv.img.type, chained, sizeof(priv.img.type));
 
-	fdout = pipes[PIPE_WRITE];
-	signal(SIGPIPE, SIG_IGN);
+	if (chain_handler_open(&priv) < 0) {
+		close(fdin);
+		return -EFAULT;
+	}
 
 	chain_handler_thread_id = start_thread(chain_handler_thread, &priv);
 	wait_threads_ready();
@@ -162,14 +152,15 @@ static int copy_single_file(const char *path, off_t skipbytes, ssize_t size, str
 	 */
 	struct swupdate_copy copy = {
 		.fdin = fdin,
-		.out = &fdout,
+		.callback = chain_handler_write,
+		.out = &priv,
 		.nbytes = size,
 		.offs = &offset,
 		.checksum = &checksum,
 	};
 	ret = copyfile(&copy);
 
-	close(fdout);
+	chain_handler_close(&priv);
 	void *status;
 	ret = pthread_join(chain_handler_thread_id, &status);
 	if (ret) {
@@ -177,6 +168,7 @@ static int copy_single_file(const char *path, off_t skipbytes, ssize_t size, str
 	} else
 		ret = (unsigned long)status;
 
+	chain_handler_cleanup(&priv);
 	close(fdin);
 
 	return ret;
@@ -98,7 +98,6 @@ struct hnd_priv {
 	unsigned long max_ranges;	/* Max allowed ranges (configured via sw-description) */
 	/* Data to be transferred to chain handler */
 	struct img_type img;
-	int fdout;
 	int fdsrc;
 	zckCtx *tgt;
 	/* Structures for downloading chunks */
@@ -163,7 +162,8 @@ static int network_process_data(multipart_parser* p, const char *at, size_t leng
 			if (priv->current.chunksize != 0) {
 				struct swupdate_copy copy = {
 					.inbuf = priv->current.buf,
-					.out = &priv->fdout,
+					.callback = chain_handler_write,
+					.out = &priv->chain_handler_data,
 					.nbytes = priv->current.chunksize,
 					.compressed = COMPRESSED_ZSTD,
 					.hash = hash,
@@ -188,7 +188,7 @@ static int network_process_data(multipart_parser* p, const char *at, size_t leng
 			priv->chunk = zck_get_next_chunk(priv->chunk);
 			if (!priv->chunk && nbytes > 0) {
 				WARN("Still data in range, but no chunks anymore !");
-				close(priv->fdout);
+				chain_handler_close(&priv->chain_handler_data);
 			}
 			if (!priv->chunk)
 				break;
@@ -861,7 +861,8 @@ static bool copy_existing_chunks(zckChunk **dstChunk, struct hnd_priv *priv)
 				len);
 		struct swupdate_copy copy = {
 			.fdin = priv->fdsrc,
-			.out = &priv->fdout,
+			.callback = chain_handler_write,
+			.out = &priv->chain_handler_data,
 			.nbytes = len,
 			.offs = &offset,
 			.checksum = &checksum,
@@ -878,8 +879,6 @@ static bool copy_existing_chunks(zckChunk **dstChunk, struct hnd_priv *priv)
 	return true;
 }
 
-#define PIPE_READ  0
-#define PIPE_WRITE 1
 /*
  * Handler entry point
  */
@@ -893,7 +892,7 @@ static int install_delta(struct img_type *img,
 	zckCtx *zckSrc = NULL, *zckDst = NULL;
 	char *FIFO = NULL;
 	pthread_t chain_handler_thread_id;
-	int pipes[2];
+	bool chained = false;
 
 	/*
 	 * No streaming allowed
@@ -935,11 +934,6 @@ static int install_delta(struct img_type *img,
 		goto cleanup;
 	}
 
-	if (pipe(pipes) < 0) {
-		ERROR("Could not create pipes for chained handler, existing...");
-		ret = -EFAULT;
-		goto cleanup;
-	}
 	/*
 	 * Open files
 	 */
@@ -1085,17 +1079,18 @@ static int install_delta(struct img_type *img,
 	priv_hnd->img.size = uncompressed_size;
 	memset(priv_hnd->img.sha256, 0, SHA256_HASH_LENGTH);
 	strlcpy(priv_hnd->img.type, priv->chainhandler, sizeof(priv_hnd->img.type));
-	priv_hnd->img.fdin = pipes[PIPE_READ];
 	/* zchunk files are not encrypted, CBC is not suitable for range download */
 	priv_hnd->img.is_encrypted = false;
 
-	signal(SIGPIPE, SIG_IGN);
+	if (chain_handler_open(priv_hnd) < 0) {
+		ret = -EFAULT;
+		goto cleanup;
+	}
+	chained = true;
 
 	chain_handler_thread_id = start_thread(chain_handler_thread, priv_hnd);
 	wait_threads_ready();
 
-	priv->fdout = pipes[PIPE_WRITE];
-
 	ret = 0;
 
 	iter = zck_get_first_chunk(zckDst);
@@ -1110,12 +1105,12 @@ static int install_delta(struct img_type *img,
 		}
 		if (!success) {
 			ERROR("Delta Update fails : aborting");
-			ret = -1;
-			goto cleanup;
+			break;
 		}
 	}
 
-	close(priv->fdout);
+	/* the chained handler sees the end of stream and exits */
+	chain_handler_close(priv_hnd);
 
 	INFO("Total downloaded data : %ld bytes", priv->totaldwlbytes);
 
@@ -1126,8 +1121,12 @@ static int install_delta(struct img_type *img,
 	}
 	ret = (unsigned long)status;
 	TRACE("Chained handler returned %d", ret);
+	if (iter)
+		ret = -1;
 
 cleanup:
+	if (chained)
+		chain_handler_cleanup(&priv->chain_handler_data);
 	if (zckSrc) zck_free(&zckSrc);
 	if (zckDst) zck_free(&zckDst);
 	if (dst_fd >= 0) close(dst_fd);
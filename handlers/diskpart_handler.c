@@ -21,6 +21,8 @@
 #include <uuid/uuid.h>
 #include <dirent.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <time.h>
 #include "swupdate_image.h"
 #include "handler.h"
 #include "util.h"
@@ -102,6 +104,7 @@ struct hnd_priv {
 	enum fdisk_labeltype labeltype;
 	bool nolock;
 	bool noinuse;
+	unsigned int mkfs_jobs;		/* concurrent mkfs, 0 = number of CPUs */
 	struct listparts listparts;	/* list of partitions */
 };
 
@@ -1165,18 +1168,83 @@ handler_release:
 	return ret;
 }
 
+struct format_job {
+	struct partition_data *part;
+	char *device;
+	bool do_mkfs;
+	int ret;
+	pthread_t thread;
+	bool started;
+};
+
+static int format_part(struct format_job *job)
+{
+	struct partition_data *part = job->part;
+	struct timespec start, end;
+	int ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (job->do_mkfs) {
+		ret = diskformat_mkfs(job->device, part->fstype);
+	} else {
+		TRACE("Skipping mkfs on %s", job->device);
+	}
+
+	if (!ret && part->fslabel[0] != '\0') {
+		ret = diskformat_set_fslabel(job->device, part->fstype, part->fslabel);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (job->do_mkfs && !ret)
+		INFO("%s: %s created in %ld ms", job->device, part->fstype,
+		     (long)((end.tv_sec - start.tv_sec) * 1000 +
+			    (end.tv_nsec - start.tv_nsec) / 1000000));
+
+	return ret;
+}
+
+static void *format_part_thread(void *data)
+{
+	struct format_job *job = (struct format_job *)data;
+
+	job->ret = format_part(job);
+
+	return NULL;
+}
+
+/*
+ * Partitions are independent, so their file systems are created
+ * concurrently, up to mkfs_jobs at a time. FAT is created by a
+ * library with a single global volume and runs in this thread.
+ */
 static int format_parts(struct hnd_priv priv, struct img_type *img, struct create_table *createtable)
 {
 	int ret = 0;
+	struct format_job *jobs;
+	unsigned int njobs = 0, running = 0, first = 0;
+	unsigned int maxjobs = priv.mkfs_jobs;
+
+	if (!maxjobs) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		maxjobs = cpus > 0 ? cpus : 1;
+	}
 
 	char *path = realpath(img->device, NULL);
 	if (!path)
 		path = strdup(img->device);
 
 	struct partition_data *part;
+	LIST_FOREACH(part, &priv.listparts, next)
+		njobs++;
+	jobs = calloc(njobs ? njobs : 1, sizeof(*jobs));
+	if (!jobs) {
+		free(path);
+		return -ENOMEM;
+	}
+
+	njobs = 0;
 	LIST_FOREACH(part, &priv.listparts, next)
 	{
-		ret = 0; /* reset result */
 		/*
 		 * priv.listparts counts partitions starting with 0,
 		 * but fdisk_partname expects the first partition having
@@ -1187,28 +1255,56 @@ static int format_parts(struct hnd_priv priv, struct img_type *img, struct creat
 		if (!strlen(part->fstype))
 			continue; /* Don't touch partitions without fstype */
 
-		char *device = fdisk_partname(path, partno);
+		struct format_job *job = &jobs[njobs++];
+		job->part = part;
+		job->device = fdisk_partname(path, partno);
 
-		bool do_mkfs = true;
+		job->do_mkfs = true;
 		if (!createtable->parent && !part->force) {
 			/* only create fs if it does not exist */
-			do_mkfs = !diskformat_fs_exists(device, part->fstype);
+			job->do_mkfs = !diskformat_fs_exists(job->device, part->fstype);
 		}
+	}
 
-		if (do_mkfs) {
-			ret = diskformat_mkfs(device, part->fstype);
-		} else {
-			TRACE("Skipping mkfs on %s", device);
-		}
+	for (unsigned int i = 0; i < njobs && !ret; i++) {
+		struct format_job *job = &jobs[i];
 
-		if (!ret && part->fslabel[0] != '\0') {
-			ret = diskformat_set_fslabel(device, part->fstype, part->fslabel);
+		if (maxjobs == 1 || !strcmp(job->part->fstype, "vfat")) {
+			ret = format_part(job);
+			continue;
 		}
 
-		free(device);
+		/* wait for the oldest job if all slots are busy */
+		while (running >= maxjobs) {
+			if (jobs[first].started) {
+				pthread_join(jobs[first].thread, NULL);
+				jobs[first].started = false;
+				running--;
+				if (jobs[first].ret && !ret)
+					ret = jobs[first].ret;
+			}
+			first++;
+		}
 		if (ret)
 			break;
+
+		if (pthread_create(&job->thread, NULL, format_part_thread, job)) {
+			ret = format_part(job);
+			continue;
+		}
+		job->started = true;
+		running++;
 	}
+
+	for (unsigned int i = 0; i < njobs; i++) {
+		if (jobs[i].started) {
+			pthread_join(jobs[i].thread, NULL);
+			if (jobs[i].ret && !ret)
+				ret = jobs[i].ret;
+		}
+		free(jobs[i].device);
+	}
+	free(jobs);
 	free(path);
 	return ret;
 }
@@ -1249,10 +1345,13 @@ static int diskpart(struct img_type *img,
 	}
 
 	/*
-	 * Reads flags: nolock and noinuse
+	 * Reads flags: nolock, noinuse and mkfs-jobs
 	 */
 	priv.nolock = strtobool(dict_get_value(&img->properties, "nolock"));
 	priv.noinuse = strtobool(dict_get_value(&img->properties, "noinuse"));
+	char *jobs = dict_get_value(&img->properties, "mkfs-jobs");
+	if (jobs)
+		priv.mkfs_jobs = strtoul(jobs, NULL, 10);
 
 	/*
 	 * Parse partitions
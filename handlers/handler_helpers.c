@@ -17,9 +17,12 @@
 #include <signal.h>
 #include <unistd.h>
 #include "handler_helpers.h"
+#include "handler.h"
 #include "installer.h"
+#include "swupdate.h"
 #include "swupdate_image.h"
 #include "pctl.h"
+#include "ringbuf.h"
 #include "util.h"
 
 struct thread_handle {
@@ -69,9 +72,89 @@ int handler_transfer_data(void *data, const void *buf, size_t len)
 }
 
 
+/*
+ * Set up the input of a chained handler. Handlers reading their data
+ * through copyimage() get a ring, so that the stream does not cross the
+ * kernel twice. Handlers reading img->fdin themselves, session (Lua)
+ * handlers and the ones registered with register_fdin_handler(), get a
+ * pipe, as when chain-buffer-size is 0.
+ */
+int chain_handler_open(struct chain_handler_data *priv)
+{
+	struct img_type *img = &priv->img;
+	struct swupdate_cfg *cfg = get_swupdate_cfg();
+	struct installer_handler *hnd = find_handler(img);
+	int pipes[2];
+
+	img->ring = NULL;
+	img->fdin = -1;
+	priv->fdout = -1;
+
+	if (cfg->chain_buffer_size && hnd && !hnd->reads_fdin) {
+		img->ring = ringbuf_new(cfg->chain_buffer_size);
+		if (!img->ring) {
+			ERROR("OOM allocating ring for chained handler");
+			return -ENOMEM;
+		}
+		return 0;
+	}
+
+	if (pipe(pipes) < 0) {
+		ERROR("Could not create pipes for chained handler, existing...");
+		return -EFAULT;
+	}
+	img->fdin = pipes[0];
+	priv->fdout = pipes[1];
+	signal(SIGPIPE, SIG_IGN);
+
+	return 0;
+}
+
+/*
+ * copyfile()'s callback to feed the chained handler,
+ * out is the struct chain_handler_data
+ */
+int chain_handler_write(void *out, const void *buf, size_t len)
+{
+	struct chain_handler_data *priv = (struct chain_handler_data *)out;
+
+	if (priv->img.ring) {
+		if (ringbuf_write(priv->img.ring, buf, len) < 0) {
+			ERROR("Chained handler stopped reading");
+			return -EFAULT;
+		}
+		return 0;
+	}
+
+	return copy_write(&priv->fdout, buf, len);
+}
+
+/* End of stream for the chained handler */
+void chain_handler_close(struct chain_handler_data *priv)
+{
+	if (priv->img.ring)
+		ringbuf_close_write(priv->img.ring);
+	if (priv->fdout >= 0) {
+		close(priv->fdout);
+		priv->fdout = -1;
+	}
+}
+
+/* To be called after the chained handler thread has been joined */
+void chain_handler_cleanup(struct chain_handler_data *priv)
+{
+	chain_handler_close(priv);
+	ringbuf_free(priv->img.ring);
+	priv->img.ring = NULL;
+	if (priv->img.fdin >= 0) {
+		close(priv->img.fdin);
+		priv->img.fdin = -1;
+	}
+}
+
 /*
  * Thread to start the chained handler.
- * This received from FIFO the reassembled stream with
+ * This received from FIFO or ring the reassembled stream with
  * the artifact and can pass it to the handler responsible for the install.
  */
 void *chain_handler_thread(void *data)
@@ -81,7 +164,7 @@ void *chain_handler_thread(void *data)
 	unsigned long ret;
 
 	thread_ready();
-	if (img->fdin < 0) {
+	if (img->fdin < 0 && !img->ring) {
 		return (void *)1;
 	}
 
@@ -90,9 +173,16 @@ void *chain_handler_thread(void *data)
 
 	if (ret) {
 		ERROR("Chain handler return with Error");
-		close(img->fdin);
+		if (!img->ring) {
+			close(img->fdin);
+			img->fdin = -1;
+		}
 	}
 
+	/* the producer must not block on a ring nobody reads anymore */
+	if (img->ring)
+		ringbuf_close_read(img->ring);
+
 	return (void *)ret;
 }
 
@@ -6,18 +6,23 @@
  */
 
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
 #include <libgen.h>
 #if defined(__linux__)
+#include <linux/falloc.h>
 #include <linux/fs.h>
 #endif
 
 #include "swupdate_image.h"
 #include "handler.h"
 #include "util.h"
+#include "metrics.h"
+#include "swupdate_crypto.h"
 
 void raw_image_handler(void);
 void raw_file_handler(void);
@@ -107,6 +112,558 @@ blkprotect_out:
 	return ret;
 }
 
+#if defined(__linux__)
+/*
+ * Sparse writing: zero blocks are not written but zeroed by the
+ * kernel (BLKZEROOUT on a block device, a hole in a file), and with
+ * compare-before-write blocks that already hold the data are skipped.
+ * Only whole blocks aligned on the device are elided, the rest is
+ * written as usual. The image hash is computed by copyfile() on the
+ * input, so it still covers the whole stream.
+ */
+#define SPARSE_BLOCK	4096
+
+struct raw_writer {
+	int fd;		/* first: copyfile() seeks and reads back through it */
+	bool zero;
+	bool compare;
+	bool blkdev;
+	off_t offset;	/* -1 until the first write */
+	off_t zero_start;
+	off_t zero_len;	/* zero blocks not handed to the kernel yet */
+	unsigned char readbuf[SPARSE_BLOCK];
+	unsigned char carry[SPARSE_BLOCK];
+	size_t carry_len;	/* start of the block at offset */
+	unsigned long long written;
+	unsigned long long unchanged;
+	unsigned long long zeroed;
+	unsigned long long discarded;
+};
+
+static bool is_zero(const unsigned char *buf, size_t len)
+{
+	return buf[0] == 0 && !memcmp(buf, buf + 1, len - 1);
+}
+
+static int raw_pwrite(int fd, const unsigned char *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			ERROR("cannot write %zu bytes: %s", len,
+			      n < 0 ? strerror(errno) : "no space");
+			return -ENOSPC;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+static int raw_zero_flush(struct raw_writer *w)
+{
+	static const unsigned char zeroes[SPARSE_BLOCK];
+	off_t start = w->zero_start, len = w->zero_len;
+	int ret = -1;
+
+	if (!len)
+		return 0;
+	w->zero_len = 0;
+
+	if (w->blkdev) {
+		uint64_t range[2] = { start, len };
+
+		ret = ioctl(w->fd, BLKZEROOUT, &range);
+	} else {
+		ret = fallocate(w->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				start, len);
+	}
+	if (!ret) {
+		w->zeroed += len;
+		return 0;
+	}
+
+	/* not supported by the device or the file system */
+	TRACE("zeroing %lld bytes by writing: %s", (long long)len, strerror(errno));
+	w->zero = false;
+	while (len) {
+		off_t n = min(len, (off_t)SPARSE_BLOCK);
+
+		if (raw_pwrite(w->fd, zeroes, n, start))
+			return -ENOSPC;
+		w->written += n;
+		start += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Queue len bytes at offset to be zeroed, adjacent ranges are merged */
+static int raw_zero_add(struct raw_writer *w, off_t offset, off_t len)
+{
+	if (w->zero_len && w->zero_start + w->zero_len != offset &&
+	    raw_zero_flush(w))
+		return -ENOSPC;
+	if (!w->zero_len)
+		w->zero_start = offset;
+	w->zero_len += len;
+
+	return 0;
+}
+
+static bool raw_unchanged(struct raw_writer *w, const unsigned char *buf, off_t offset)
+{
+	ssize_t n;
+
+	do {
+		n = pread(w->fd, w->readbuf, SPARSE_BLOCK, offset);
+	} while (n < 0 && errno == EINTR);
+
+	return n == SPARSE_BLOCK && !memcmp(buf, w->readbuf, SPARSE_BLOCK);
+}
+
+/* Returns 1 if the block at offset does not need to be written */
+static int raw_elide(struct raw_writer *w, const unsigned char *p, size_t n, off_t offset)
+{
+	if (n != SPARSE_BLOCK)
+		return 0;
+	if (w->compare && raw_unchanged(w, p, offset)) {
+		w->unchanged += n;
+		return 1;
+	}
+	if (w->zero && is_zero(p, n))
+		return raw_zero_add(w, offset, n) ? -ENOSPC : 1;
+
+	return raw_zero_flush(w);
+}
+
+static int raw_write_run(struct raw_writer *w, const unsigned char *p, size_t n, off_t offset)
+{
+	if (!n)
+		return 0;
+	if (raw_pwrite(w->fd, p, n, offset))
+		return -ENOSPC;
+	w->written += n;
+
+	return 0;
+}
+
+/*
+ * Blocks split across two calls are gathered in carry, whole blocks
+ * are checked in place and contiguous data is written at once.
+ */
+static int raw_sparse_write(void *out, const void *buf, size_t len)
+{
+	struct raw_writer *w = out;
+	const unsigned char *p = buf;
+	const unsigned char *run = p;	/* data to be written at run_offset */
+	off_t run_offset = 0;
+	size_t n;
+	int ret;
+
+	if (w->offset < 0) {
+		w->offset = lseek(w->fd, 0, SEEK_CUR);
+		if (w->offset < 0)
+			return -EIO;
+	}
+
+	while (len) {
+		n = SPARSE_BLOCK - (w->offset + w->carry_len) % SPARSE_BLOCK;
+		if (w->carry_len || len < n) {
+			if (run != p && raw_write_run(w, run, p - run, run_offset))
+				return -ENOSPC;
+			n = min(len, n);
+			memcpy(w->carry + w->carry_len, p, n);
+			w->carry_len += n;
+			p += n;
+			len -= n;
+			run = p;
+			if ((w->offset + w->carry_len) % SPARSE_BLOCK)
+				continue;
+			ret = raw_elide(w, w->carry, w->carry_len, w->offset);
+			if (ret < 0 || (!ret && raw_write_run(w, w->carry,
+							      w->carry_len, w->offset)))
+				return -ENOSPC;
+			w->offset += w->carry_len;
+			w->carry_len = 0;
+			continue;
+		}
+		if (run == p)
+			run_offset = w->offset;
+		ret = raw_elide(w, p, n, w->offset);
+		if (ret < 0)
+			return ret;
+		if (ret) {
+			if (raw_write_run(w, run, p - run, run_offset))
+				return -ENOSPC;
+			run = p + n;
+		}
+		p += n;
+		len -= n;
+		w->offset += n;
+	}
+	if (run != p && raw_write_run(w, run, p - run, run_offset))
+		return -ENOSPC;
+
+	return 0;
+}
+
+/* Write a partial block gathered in carry */
+static int raw_carry_flush(struct raw_writer *w)
+{
+	if (raw_write_run(w, w->carry, w->carry_len, w->offset))
+		return -ENOSPC;
+	w->offset += w->carry_len;
+	w->carry_len = 0;
+
+	return 0;
+}
+
+/* Zero blocks at the end of a file must extend it */
+static int raw_sparse_finish(struct raw_writer *w)
+{
+	struct stat st;
+
+	/* a partial block at the end of the image */
+	if (raw_zero_flush(w) || raw_carry_flush(w))
+		return -ENOSPC;
+	if (!w->blkdev && w->offset > 0 && !fstat(w->fd, &st) &&
+	    st.st_size < w->offset && ftruncate(w->fd, w->offset)) {
+		ERROR("cannot extend to %lld bytes: %s", (long long)w->offset,
+		      strerror(errno));
+		return -ENOSPC;
+	}
+
+	metrics_add(METRIC_RAW_BYTES_WRITTEN, w->written);
+	metrics_add(METRIC_RAW_BYTES_UNCHANGED, w->unchanged);
+	metrics_add(METRIC_RAW_BYTES_ZEROED, w->zeroed);
+	metrics_add(METRIC_RAW_BYTES_DISCARDED, w->discarded);
+	INFO("%llu bytes written, %llu unchanged, %llu zeroed, %llu discarded",
+	     w->written, w->unchanged, w->zeroed, w->discarded);
+
+	return 0;
+}
+
+static int install_raw_sparse(int fdout, struct img_type *img)
+{
+	struct raw_writer *w;
+	struct stat st;
+	int ret;
+
+	if (fstat(fdout, &st))
+		return -ENODEV;
+	if (!S_ISBLK(st.st_mode) && !S_ISREG(st.st_mode)) {
+		TRACE("%s is not a block device or a file, written in full",
+		      img->device);
+		return copyimage(&fdout, img, NULL);
+	}
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+	w->fd = fdout;
+	w->blkdev = S_ISBLK(st.st_mode);
+	w->zero = strtobool(dict_get_value(&img->properties, "sparse"));
+	w->compare = strtobool(dict_get_value(&img->properties, "compare-before-write"));
+	w->offset = -1;
+
+	ret = copyimage(w, img, raw_sparse_write);
+	if (!ret)
+		ret = raw_sparse_finish(w);
+	free(w);
+
+	return ret;
+}
+/*
+ * Block-map images (format = "bmap") carry only the mapped ranges of
+ * an image, each range followed by its data:
+ *
+ *   header  "SWUBMAP\0", u32 version, u32 block size, u64 image size,
+ *           u32 number of ranges, u32 flags
+ *   range   u64 first block, u64 number of blocks, sha256 of the data
+ *   data    the blocks of the range, cut at the image size
+ *
+ * Numbers are little endian, ranges are sorted and do not overlap.
+ * The gaps are zeroed, discarded or left as they are, and each range
+ * is verified as soon as it has been written. BMAP_FLAG_ZERO_GAPS is
+ * set if zero blocks of the image data were left out: the gaps are
+ * then always zeroed. tools/python/swupdate-bmap.py creates such images.
+ */
+#define BMAP_MAGIC		"SWUBMAP"
+#define BMAP_VERSION		1
+#define BMAP_HEADER_SIZE	32
+#define BMAP_RANGE_SIZE		(16 + SHA256_HASH_LENGTH)
+#define BMAP_FLAG_ZERO_GAPS	1
+
+enum bmap_gaps {
+	BMAP_GAPS_ZERO,
+	BMAP_GAPS_DISCARD,
+	BMAP_GAPS_KEEP
+};
+
+struct raw_bmap {
+	struct raw_writer w;	/* first: copyfile() seeks through the fd */
+	enum bmap_gaps gaps;
+	off_t base;		/* device offset of the image, -1 until known */
+	uint32_t block_size;
+	uint64_t image_size;
+	uint32_t ranges;	/* ranges not received yet */
+	uint64_t mapped_end;	/* end of the last range in the image */
+	bool header_done;
+	unsigned char hdr[BMAP_RANGE_SIZE];
+	size_t hdr_len;		/* bytes of the header or range received */
+	uint64_t left;		/* data of the current range still expected */
+	uint64_t range_start;
+	unsigned char hash[SHA256_HASH_LENGTH];
+	void *dgst;
+};
+
+static uint64_t bmap_le(const unsigned char *p, int bytes)
+{
+	uint64_t v = 0;
+
+	while (bytes--)
+		v = v << 8 | p[bytes];
+
+	return v;
+}
+
+static int bmap_gap(struct raw_bmap *b, uint64_t start, uint64_t end)
+{
+	struct raw_writer *w = &b->w;
+	off_t offset = b->base + start, len = end - start;
+
+	if (!len || b->gaps == BMAP_GAPS_KEEP)
+		return 0;
+	/* a hole is punched into a file in both cases */
+	if (b->gaps == BMAP_GAPS_DISCARD && w->blkdev) {
+		uint64_t range[2] = { offset, len };
+
+		if (!ioctl(w->fd, BLKDISCARD, &range)) {
+			w->discarded += len;
+			return 0;
+		}
+		TRACE("discard failed, gaps are zeroed: %s", strerror(errno));
+		b->gaps = BMAP_GAPS_ZERO;
+	}
+
+	return raw_zero_add(w, offset, len);
+}
+
+static int bmap_header(struct raw_bmap *b)
+{
+	const unsigned char *h = b->hdr;
+	uint32_t flags;
+
+	if (memcmp(h, BMAP_MAGIC, sizeof(BMAP_MAGIC))) {
+		ERROR("Not a block-map image");
+		return -EINVAL;
+	}
+	if (bmap_le(h + 8, 4) != BMAP_VERSION) {
+		ERROR("Block map version %u not supported",
+		      (unsigned int)bmap_le(h + 8, 4));
+		return -EINVAL;
+	}
+	b->block_size = bmap_le(h + 12, 4);
+	b->image_size = bmap_le(h + 16, 8);
+	b->ranges = bmap_le(h + 24, 4);
+	flags = bmap_le(h + 28, 4);
+	if (!b->block_size || b->block_size % 512) {
+		ERROR("Invalid block size %u in block map", b->block_size);
+		return -EINVAL;
+	}
+	if (flags & ~BMAP_FLAG_ZERO_GAPS) {
+		ERROR("Unknown block map flags 0x%x", flags);
+		return -EINVAL;
+	}
+	if ((flags & BMAP_FLAG_ZERO_GAPS) && b->gaps != BMAP_GAPS_ZERO) {
+		TRACE("Block map without zero blocks, gaps are zeroed");
+		b->gaps = BMAP_GAPS_ZERO;
+	}
+	TRACE("Block map: %llu bytes, %u ranges of %u bytes blocks",
+	      (unsigned long long)b->image_size, b->ranges, b->block_size);
+
+	return 0;
+}
+
+static int bmap_range(struct raw_bmap *b)
+{
+	uint64_t first = bmap_le(b->hdr, 8), blocks = bmap_le(b->hdr + 8, 8);
+	uint64_t nblocks = b->image_size / b->block_size +
+			   !!(b->image_size % b->block_size);
+	uint64_t start = first * b->block_size;
+
+	if (!blocks || first >= nblocks || blocks > nblocks - first ||
+	    start < b->mapped_end) {
+		ERROR("Invalid range of %llu blocks at block %llu in block map",
+		      (unsigned long long)blocks, (unsigned long long)first);
+		return -EINVAL;
+	}
+	if (bmap_gap(b, b->mapped_end, start))
+		return -ENOSPC;
+
+	b->ranges--;
+	b->range_start = start;
+	b->mapped_end = min_t(uint64_t, (first + blocks) * b->block_size,
+			      b->image_size);
+	b->left = b->mapped_end - start;
+	b->w.offset = b->base + start;
+	memcpy(b->hash, b->hdr + 16, SHA256_HASH_LENGTH);
+#ifdef CONFIG_HASH_VERIFY
+	b->dgst = swupdate_HASH_init(SHA_DEFAULT);
+	if (!b->dgst)
+		return -EFAULT;
+#endif
+
+	return 0;
+}
+
+static int bmap_range_end(struct raw_bmap *b)
+{
+	unsigned char md_value[SHA256_HASH_LENGTH];
+	unsigned int md_len = 0;
+	int ret = 0;
+
+	if (raw_carry_flush(&b->w))
+		return -ENOSPC;
+	if (!b->dgst)
+		return 0;
+
+	if (swupdate_HASH_final(b->dgst, md_value, &md_len) < 0 ||
+	    md_len != SHA256_HASH_LENGTH ||
+	    swupdate_HASH_compare(b->hash, md_value)) {
+		ERROR("HASH mismatch in block map range at %llu",
+		      (unsigned long long)b->range_start);
+		ret = -EFAULT;
+	}
+	swupdate_HASH_cleanup(b->dgst);
+	b->dgst = NULL;
+
+	return ret;
+}
+
+/*
+ * The data of the ranges goes through the sparse writer, so that
+ * sparse and compare-before-write apply to the mapped blocks too.
+ */
+static int raw_bmap_write(void *out, const void *buf, size_t len)
+{
+	struct raw_bmap *b = out;
+	const unsigned char *p = buf;
+	size_t n, want;
+	int ret;
+
+	if (b->base < 0) {
+		b->base = lseek(b->w.fd, 0, SEEK_CUR);
+		if (b->base < 0)
+			return -EIO;
+	}
+
+	while (len) {
+		if (b->left) {
+			n = min_t(uint64_t, len, b->left);
+			if (b->dgst && swupdate_HASH_update(b->dgst, p, n) < 0)
+				return -EFAULT;
+			ret = raw_sparse_write(&b->w, p, n);
+			if (ret)
+				return ret;
+			p += n;
+			len -= n;
+			b->left -= n;
+			if (!b->left && (ret = bmap_range_end(b)))
+				return ret;
+			continue;
+		}
+
+		if (b->header_done && !b->ranges) {
+			ERROR("Data after the last range of the block map");
+			return -EINVAL;
+		}
+		want = b->header_done ? BMAP_RANGE_SIZE : BMAP_HEADER_SIZE;
+		n = min(len, want - b->hdr_len);
+		memcpy(b->hdr + b->hdr_len, p, n);
+		b->hdr_len += n;
+		p += n;
+		len -= n;
+		if (b->hdr_len < want)
+			continue;
+		b->hdr_len = 0;
+		ret = b->header_done ? bmap_range(b) : bmap_header(b);
+		if (ret)
+			return ret;
+		b->header_done = true;
+	}
+
+	return 0;
+}
+
+static int raw_bmap_finish(struct raw_bmap *b)
+{
+	if (!b->header_done || b->ranges || b->left || b->hdr_len) {
+		ERROR("Block-map image is truncated");
+		return -EINVAL;
+	}
+	if (bmap_gap(b, b->mapped_end, b->image_size))
+		return -ENOSPC;
+	b->w.offset = b->base + b->image_size;
+
+	return raw_sparse_finish(&b->w);
+}
+
+static int install_raw_bmap(int fdout, struct img_type *img)
+{
+	const char *gaps = dict_get_value(&img->properties, "gaps");
+	struct raw_bmap *b;
+	struct stat st;
+	int ret;
+
+	if (fstat(fdout, &st))
+		return -ENODEV;
+	if (!S_ISBLK(st.st_mode) && !S_ISREG(st.st_mode)) {
+		ERROR("%s: block-map images need a block device or a file",
+		      img->device);
+		return -EINVAL;
+	}
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return -ENOMEM;
+	if (!gaps || !strcmp(gaps, "zero")) {
+		b->gaps = BMAP_GAPS_ZERO;
+	} else if (!strcmp(gaps, "discard")) {
+		b->gaps = BMAP_GAPS_DISCARD;
+	} else if (!strcmp(gaps, "keep")) {
+		b->gaps = BMAP_GAPS_KEEP;
+	} else {
+		ERROR("Unknown gaps mode %s", gaps);
+		free(b);
+		return -EINVAL;
+	}
+	b->w.fd = fdout;
+	b->w.blkdev = S_ISBLK(st.st_mode);
+	b->w.zero = strtobool(dict_get_value(&img->properties, "sparse"));
+	b->w.compare = strtobool(dict_get_value(&img->properties, "compare-before-write"));
+	b->w.offset = -1;
+	b->base = -1;
+
+	ret = copyimage(b, img, raw_bmap_write);
+	if (!ret)
+		ret = raw_bmap_finish(b);
+	if (b->dgst)
+		swupdate_HASH_cleanup(b->dgst);
+	free(b);
+
+	return ret;
+}
+#endif
+
 static int install_raw_image(struct img_type *img,
 	void __attribute__ ((__unused__)) *data)
 {
@@ -126,11 +683,27 @@ static int install_raw_image(struct img_type *img,
 #if defined(__FreeBSD__)
 	ret = copyimage(&fdout, img, copy_write_padded);
 #else
-	ret = copyimage(&fdout, img, NULL);
+	const char *format = dict_get_value(&img->properties, "format");
+
+	if (format && strcmp(format, "raw")) {
+		if (!strcmp(format, "bmap")) {
+			ret = install_raw_bmap(fdout, img);
+		} else {
+			ERROR("Unknown image format %s", format);
+			ret = -EINVAL;
+		}
+	} else if (strtobool(dict_get_value(&img->properties, "sparse")) ||
+	    strtobool(dict_get_value(&img->properties, "compare-before-write")))
+		ret = install_raw_sparse(fdout, img);
+	else
+		ret = copyimage(&fdout, img, NULL);
 #endif
 
 	if (prot_stat == 1) {
+		uint64_t start = metrics_now_ns();
+
 		fsync(fdout);  // At least with Linux 4.14 data are not automatically flushed before ro mode is enabled
+		metrics_observe_since(METRIC_FSYNC_US, start);
 		blkprotect(img, true);  // no error handling, keep ret from copyimage
 	}
 
@@ -148,6 +721,7 @@ static int install_raw_file(struct img_type *img,
 	int cleanup_ret = 0;
 	bool use_mount = (strlen(img->device) && strlen(img->filesystem)) ? true : false;
 	char* DATADST_DIR = NULL;
+	uint64_t start;
 
 	if (strlen(img->path) == 0) {
 		ERROR("Missing path attribute");
@@ -211,11 +785,13 @@ static int install_raw_file(struct img_type *img,
 		goto cleanup;
 	}
 
+	start = metrics_now_ns();
 	if (fsync(fdout)) {
 		ERROR("Error writing %s to disk: %s", tmp_path, strerror(errno));
 		ret = -1;
 		goto cleanup;
 	}
+	metrics_observe_since(METRIC_FSYNC_US, start);
 
 	close(fdout);
 	fdout = 0;
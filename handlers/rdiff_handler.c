@@ -10,8 +10,11 @@
 #include <stdlib.h>
 #include <libgen.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <librsync.h>
 #if defined(__linux__)
 #include <sys/sendfile.h>
@@ -23,8 +26,16 @@
 #include "handler.h"
 #include "util.h"
 
-/* Use rdiff's default inbuf and outbuf size of 64K */
-#define RDIFF_BUFFER_SIZE 64 * 1024
+/*
+ * librsync hands out COPY commands in pieces of at most the free
+ * output space, a large output buffer means fewer callbacks and writes.
+ */
+#define RDIFF_BUFFER_SIZE 1024 * 1024
+
+/* Read ahead window on the base file for sequential copies */
+#define RDIFF_PREFETCH_SIZE (4 * 1024 * 1024)
+/* Consecutive non-sequential copies before the base is advised as random */
+#define RDIFF_RANDOM_THRESHOLD 4
 
 #define TEST_OR_FAIL(expr, failret) \
 	if (expr) { \
@@ -44,10 +55,23 @@ struct rdiff_t
 	FILE *dest_file;
 	FILE *base_file;
 
-	char *inbuf;
+	/* base file mapping, NULL if it is read with stdio */
+	char *base_map;
+	size_t base_size;
+	rs_long_t base_next;
+	rs_long_t base_prefetched;
+	unsigned int random_streak;
+	bool base_random;
+
 	char *outbuf;
 
 	uint8_t type;
+
+	/* statistics */
+	unsigned long long in_bytes;
+	unsigned long long out_bytes;
+	unsigned long long copy_bytes;
+	unsigned long copy_cmds;
 };
 
 static void rdiff_log(rs_loglevel level, char const *msg)
@@ -67,9 +91,57 @@ static void rdiff_log(rs_loglevel level, char const *msg)
 	swupdate_notify(RUN, "%s", loglevelmap[level], msg);
 }
 
-static rs_result base_file_read_cb(void *fp, rs_long_t pos, size_t *len, void **buf)
+static void base_map_advise(struct rdiff_t *rdiff_state, rs_long_t pos, size_t len)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	rs_long_t start, end;
+
+	if (pos == rdiff_state->base_next) {
+		rdiff_state->random_streak = 0;
+		if (rdiff_state->base_random) {
+			(void)madvise(rdiff_state->base_map, rdiff_state->base_size,
+				      MADV_SEQUENTIAL);
+			rdiff_state->base_random = false;
+			rdiff_state->base_prefetched = 0;
+		}
+	} else if (!rdiff_state->base_random &&
+		   ++rdiff_state->random_streak >= RDIFF_RANDOM_THRESHOLD) {
+		(void)madvise(rdiff_state->base_map, rdiff_state->base_size,
+			      MADV_RANDOM);
+		rdiff_state->base_random = true;
+	}
+	rdiff_state->base_next = pos + len;
+
+	/* Keep a read ahead window in front of sequential copies */
+	if (rdiff_state->base_random ||
+	    pos + (rs_long_t)len + RDIFF_PREFETCH_SIZE / 2 <= rdiff_state->base_prefetched)
+		return;
+	start = (pos + len) & ~((rs_long_t)pagesize - 1);
+	end = min_t(rs_long_t, start + RDIFF_PREFETCH_SIZE, rdiff_state->base_size);
+	if (end > start)
+		(void)madvise(rdiff_state->base_map + start, end - start,
+			      MADV_WILLNEED);
+	rdiff_state->base_prefetched = end;
+}
+
+static rs_result base_file_read_cb(void *opaque, rs_long_t pos, size_t *len, void **buf)
 {
-	FILE *f = (FILE *)fp;
+	struct rdiff_t *rdiff_state = (struct rdiff_t *)opaque;
+	FILE *f = rdiff_state->base_file;
+
+	if (rdiff_state->base_map) {
+		if (pos < 0 || (uint64_t)pos >= rdiff_state->base_size) {
+			ERROR("Unexpected EOF on rdiff base file.");
+			return RS_INPUT_ENDED;
+		}
+		*len = min_t(uint64_t, *len, rdiff_state->base_size - pos);
+		base_map_advise(rdiff_state, pos, *len);
+		/* librsync copies straight from the mapping */
+		*buf = rdiff_state->base_map + pos;
+		rdiff_state->copy_bytes += *len;
+		rdiff_state->copy_cmds++;
+		return RS_DONE;
+	}
 
 	if (fseek(f, pos, SEEK_SET) != 0) {
 		ERROR("Error seeking rdiff base file: %s", strerror(errno));
@@ -86,49 +158,41 @@ static rs_result base_file_read_cb(void *fp, rs_long_t pos, size_t *len, void **
 		return RS_INPUT_ENDED;
 	}
 	*len = ret;
+	rdiff_state->copy_bytes += *len;
+	rdiff_state->copy_cmds++;
 
 	return RS_DONE;
 }
 
-static rs_result fill_inbuffer(struct rdiff_t *rdiff_state, const void *buf, unsigned int *len)
+static void base_file_map(struct rdiff_t *rdiff_state)
 {
-	rs_buffers_t *buffers = &rdiff_state->buffers;
-
-	if (buffers->eof_in == true) {
-		TRACE("EOF on rdiff chunk input, not reading more data.");
-		return RS_DONE;
+	int fd = fileno(rdiff_state->base_file);
+	off_t size = lseek(fd, 0, SEEK_END);
+	void *map;
+
+	/* block devices have no st_size, lseek() works for both */
+	if (size <= 0 || (uint64_t)size > SIZE_MAX) {
+		TRACE("rdiff base not mapped, reading it instead");
+		return;
 	}
-
-	if (*len == 0) {
-		TRACE("No rdiff chunk input to consume.");
-		return RS_DONE;
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		TRACE("rdiff base cannot be mapped (%s), reading it instead",
+		      strerror(errno));
+		return;
 	}
+	(void)madvise(map, size, MADV_SEQUENTIAL);
 
-	if (buffers->avail_in == 0) {
-		/* No more buffered input data pending, get some... */
-		TEST_OR_FAIL(*len <= RDIFF_BUFFER_SIZE, RS_IO_ERROR);
-		buffers->next_in = rdiff_state->inbuf;
-		buffers->avail_in = *len;
-		TRACE("Writing %d bytes to rdiff input buffer.", *len);
-		(void)memcpy(rdiff_state->inbuf, buf, *len);
-		*len = 0;
-	} else {
-		/* There's more input, try to append it to input buffer. */
-		char *target = buffers->next_in + buffers->avail_in;
-		unsigned int buflen = rdiff_state->inbuf + RDIFF_BUFFER_SIZE - target;
-		buflen = buflen > *len ? *len : buflen;
-		TEST_OR_FAIL(target + buflen <= rdiff_state->inbuf + RDIFF_BUFFER_SIZE, RS_IO_ERROR);
-
-		if (buflen == 0) {
-			TRACE("Not consuming rdiff chunk input, buffer already filled.");
-			return RS_BLOCKED;
-		}
-		TRACE("Appending %d bytes to rdiff input buffer.", buflen);
-		buffers->avail_in += buflen;
-		(void)memcpy(target, buf, buflen);
-		*len -= buflen;
-	}
-	return RS_DONE;
+	rdiff_state->base_map = map;
+	rdiff_state->base_size = size;
+}
+
+static void base_file_unmap(struct rdiff_t *rdiff_state)
+{
+	if (!rdiff_state->base_map)
+		return;
+	(void)munmap(rdiff_state->base_map, rdiff_state->base_size);
+	rdiff_state->base_map = NULL;
 }
 
 static rs_result drain_outbuffer(struct rdiff_t *rdiff_state)
@@ -150,7 +214,7 @@ static rs_result drain_outbuffer(struct rdiff_t *rdiff_state)
 	}
 #endif
 	if (len > 0) {
-		TRACE("Draining %d bytes from rdiff output buffer", len);
+		rdiff_state->out_bytes += len;
 		buffers->next_out = rdiff_state->outbuf;
 		buffers->avail_out = RDIFF_BUFFER_SIZE;
 		int dest_file_fd = fileno(rdiff_state->dest_file);
@@ -158,32 +222,35 @@ static rs_result drain_outbuffer(struct rdiff_t *rdiff_state)
 			ERROR("Cannot drain rdiff output buffer.");
 			return RS_IO_ERROR;
 		}
-	} else {
-		TRACE("No output rdiff buffer data to drain.");
 	}
 	return RS_DONE;
 }
 
-static inline void rdiff_stats(const char* msg, struct rdiff_t *rdiff_state, rs_result result) {
-	rs_buffers_t *buffers = &rdiff_state->buffers;
-	char *strresult = (char*)"ERROR";
-	switch (result) {
-		case RS_DONE:    strresult = (char*)"DONE";    break;
-		case RS_BLOCKED: strresult = (char*)"BLOCKED"; break;
-		case RS_RUNNING: strresult = (char*)"RUNNING"; break;
-		default: break;
-	}
-	TRACE("%s avail_in=%zu avail_out=%zu result=%s",
-		  msg, buffers->avail_in, buffers->avail_out, strresult);
+static void rdiff_stats(struct rdiff_t *rdiff_state, struct timespec *start)
+{
+	struct timespec end;
+	unsigned long long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ms = (end.tv_sec - start->tv_sec) * 1000ULL +
+		(end.tv_nsec - start->tv_nsec) / 1000000;
+
+	INFO("rdiff: %llu bytes from %llu bytes of patch: %llu copied from base "
+	     "in %lu commands, %llu literal, %llu ms (%llu KiB/s, base %s)",
+	     rdiff_state->out_bytes, rdiff_state->in_bytes,
+	     rdiff_state->copy_bytes, rdiff_state->copy_cmds,
+	     rdiff_state->out_bytes - min(rdiff_state->copy_bytes,
+					  rdiff_state->out_bytes),
+	     ms, ms ? rdiff_state->out_bytes * 1000 / 1024 / ms : 0,
+	     rdiff_state->base_map ? "mapped" : "read");
 }
 
 static int apply_rdiff_chunk_cb(void *out, const void *buf, size_t len)
 {
 	struct rdiff_t *rdiff_state = (struct rdiff_t *)out;
 	rs_buffers_t *buffers = &rdiff_state->buffers;
-	unsigned int inbytesleft = len;
 	rs_result result = RS_RUNNING;
-	rs_result drain_run_result = RS_RUNNING;
+	bool produced = false;
 
 	if (buffers->next_out == NULL) {
 		TEST_OR_FAIL(buffers->avail_out == 0, -1);
@@ -191,30 +258,42 @@ static int apply_rdiff_chunk_cb(void *out, const void *buf, size_t len)
 		buffers->avail_out = RDIFF_BUFFER_SIZE;
 	}
 
-	while (inbytesleft > 0 || buffers->avail_in > 0) {
-		rdiff_stats("[pre] ", rdiff_state, result);
-		result = fill_inbuffer(rdiff_state, buf, &inbytesleft);
-		if (result != RS_DONE && result != RS_BLOCKED) {
-			return -1;
-		}
+	/*
+	 * The loop below runs until librsync has taken all of the input,
+	 * so the patch data can be consumed straight from the copyfile
+	 * buffer: it is valid until this callback returns.
+	 */
+	TEST_OR_FAIL(buffers->avail_in == 0, -1);
+	if (buffers->eof_in == true || len == 0)
+		return 0;
+	buffers->next_in = (char *)buf;
+	buffers->avail_in = len;
+	rdiff_state->in_bytes += len;
+
+	/*
+	 * Go on while there is input or librsync is still producing
+	 * output, i.e. it was blocked on a full output buffer.
+	 */
+	while (buffers->avail_in > 0 || produced) {
 		result = rs_job_iter(rdiff_state->job, buffers);
 		if (result != RS_DONE && result != RS_BLOCKED) {
 			ERROR("Error processing rdiff chunk: %s", rs_strerror(result));
 			return -1;
 		}
-		drain_run_result = drain_outbuffer(rdiff_state);
-		if (drain_run_result != RS_DONE) {
+		produced = buffers->next_out != rdiff_state->outbuf;
+		if (drain_outbuffer(rdiff_state) != RS_DONE) {
 			ERROR("drain_outbuffer return error");
 			return -1;
 		}
-		rdiff_stats("[post]", rdiff_state, result);
 
 		if (result == RS_DONE) {
 			TRACE("rdiff processing done.");
+			buffers->avail_in = 0;
 			break;
 		}
 	}
-	rdiff_stats("[ret] ", rdiff_state, result);
+	buffers->next_in = NULL;
+
 	return 0;
 }
 
@@ -311,12 +390,6 @@ static int apply_rdiff_patch(struct img_type *img,
 		goto cleanup;
 	}
 
-	if (!(rdiff_state.inbuf = malloc(RDIFF_BUFFER_SIZE))) {
-		ERROR("Cannot allocate memory for rdiff input buffer.");
-		ret = -1;
-		goto cleanup;
-	}
-
 	if (!(rdiff_state.outbuf = malloc(RDIFF_BUFFER_SIZE))) {
 		ERROR("Cannot allocate memory for rdiff output buffer.");
 		ret = -1;
@@ -335,12 +408,21 @@ static int apply_rdiff_patch(struct img_type *img,
 	rs_trace_set_level(loglevelmap[loglevel]);
 	rs_trace_to(rdiff_log);
 
-	rdiff_state.job = rs_patch_begin(base_file_read_cb, rdiff_state.base_file);
+	base_file_map(&rdiff_state);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	rdiff_state.job = rs_patch_begin(base_file_read_cb, &rdiff_state);
 	ret = copyimage(&rdiff_state, img, apply_rdiff_chunk_cb);
 	if (ret != 0) {
 		ERROR("Error %d running rdiff job, aborting.", ret);
 		goto cleanup;
 	}
+	rdiff_stats(&rdiff_state, &start);
+
+	/* The base is overwritten below, the mapping must be gone */
+	base_file_unmap(&rdiff_state);
 
 	if (rdiff_state.type == FILE_HANDLER) {
 		struct stat stat_dest_file;
@@ -395,7 +477,7 @@ static int apply_rdiff_patch(struct img_type *img,
 	}
 
 cleanup:
-	free(rdiff_state.inbuf);
+	base_file_unmap(&rdiff_state);
 	free(rdiff_state.outbuf);
 	if (rdiff_state.job != NULL) {
 		(void)rs_job_free(rdiff_state.job);
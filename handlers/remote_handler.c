@@ -17,6 +17,7 @@
 
 #include "handler.h"
 #include "util.h"
+#include "swupdate_dict.h"
 #include "swupdate_image.h"
 
 #define MSG_FRAMES	2
@@ -24,6 +25,7 @@
 #define FRAME_BODY	1
 
 #define REMOTE_IPC_TIMEOUT	2000
+#define REMOTE_MAX_WINDOW	64
 
 static int timeout = REMOTE_IPC_TIMEOUT;
 
@@ -31,6 +33,32 @@ struct RHmsg {
     zmq_msg_t frame[MSG_FRAMES];
 };
 
+/*
+ * Payload buffer handed over to zeromq, it is given back by
+ * the free callback when the frame has left the socket
+ */
+struct RHslot {
+	void *buf;
+	size_t size;
+	int busy;
+};
+
+/*
+ * Connection to the remote installer. With a window of one frame,
+ * a REQ socket is used as always. With a larger window, a DEALER
+ * socket keeps up to "credits" DATA frames in flight; each ACK gives
+ * one credit back. DEALER prepends the empty delimiter a REP socket
+ * expects, so the remote side does not need any change; a remote
+ * may grant a different number of credits in its answer to INIT.
+ */
+struct RHconn {
+	void *socket;
+	bool pipelined;
+	unsigned int credits;
+	unsigned int inflight;
+	struct RHslot slots[REMOTE_MAX_WINDOW];
+};
+
 struct remote_command {
 	char *cmd;
 };
@@ -54,11 +82,71 @@ static void RHset_payload(struct RHmsg *self, const void *body, size_t size)
     }
 }
 
-static int RHmsg_send_cmd(struct RHmsg *self, void *request)
+static void RHslot_release(void __attribute__ ((__unused__)) *data, void *hint)
+{
+	struct RHslot *slot = hint;
+
+	__atomic_store_n(&slot->busy, 0, __ATOMIC_RELEASE);
+}
+
+static void RHfree(void *data, void __attribute__ ((__unused__)) *hint)
+{
+	free(data);
+}
+
+/*
+ * Fill the payload without a further copy inside zeromq: a free
+ * slot is reused, or a buffer is allocated if zeromq has not yet
+ * released the slots of frames already acknowledged
+ */
+static int RHset_payload_slot(struct RHmsg *self, struct RHconn *conn,
+			      const void *body, size_t size)
+{
+	zmq_msg_t *msg = &self->frame[FRAME_BODY];
+	void *buf;
+
+	for (unsigned int i = 0; i < conn->credits; i++) {
+		struct RHslot *slot = &conn->slots[i];
+
+		if (__atomic_load_n(&slot->busy, __ATOMIC_ACQUIRE))
+			continue;
+		if (slot->size < size) {
+			buf = realloc(slot->buf, size);
+			if (!buf)
+				break;
+			slot->buf = buf;
+			slot->size = size;
+		}
+		memcpy(slot->buf, body, size);
+		slot->busy = 1;
+		if (zmq_msg_init_data(msg, slot->buf, size, RHslot_release, slot)) {
+			slot->busy = 0;
+			return -ENOMEM;
+		}
+		return 0;
+	}
+
+	buf = malloc(size);
+	if (!buf)
+		return -ENOMEM;
+	memcpy(buf, body, size);
+	if (zmq_msg_init_data(msg, buf, size, RHfree, NULL)) {
+		free(buf);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int RHmsg_send_cmd(struct RHmsg *self, void *request, bool pipelined)
 {
 	int i;
 	int ret;
 
+	/* REP expects the envelope delimiter that REQ adds by itself */
+	if (pipelined && zmq_send(request, NULL, 0, ZMQ_SNDMORE) < 0)
+		return errno;
+
 	for (i = 0; i < MSG_FRAMES; i++) {
 		ret = zmq_msg_send (&self->frame[i], request,
 			(i < MSG_FRAMES - 1)? ZMQ_SNDMORE: 0);
@@ -69,14 +157,19 @@ static int RHmsg_send_cmd(struct RHmsg *self, void *request)
 	return 0;
 }
 
-static int RHmsg_get_ack(struct RHmsg *self, void *request)
+/*
+ * Answer: ACK[:timeout[:credits]] or NACK.
+ * credits is set only if the remote sends it.
+ */
+static int RHmsg_get_ack(struct RHmsg *self, void *request, bool pipelined,
+			 unsigned int *credits)
 {
 	int rc;
 	unsigned long size;
 	zmq_pollitem_t zpoll;
-	char *string;
+	char string[64];
+	char *sep;
 	int newtimeout;
-	int len;
 
 	zpoll.socket = request;
 	zpoll.events = ZMQ_POLLIN;
@@ -95,58 +188,95 @@ static int RHmsg_get_ack(struct RHmsg *self, void *request)
 		return -EFAULT;
 	}
 
+	/* skip the envelope delimiter in front of the answer */
+	if (pipelined && zmq_msg_size(&self->frame[0]) == 0 &&
+	    zmq_msg_more(&self->frame[0])) {
+		if (zmq_msg_recv(&self->frame[0], request, 0) == -1) {
+			zmq_msg_close(&self->frame[0]);
+			return -EFAULT;
+		}
+	}
+
 	size = zmq_msg_size(&self->frame[0]);
-	string = malloc (size + 1);
-	if (!string)
-		return -ENOMEM;
+	if (size >= sizeof(string))
+		size = sizeof(string) - 1;
 	memcpy (string, zmq_msg_data (&self->frame[0]), size);
 	string[size] = '\0';
 	zmq_msg_close(&self->frame[0]);
 
-	/*
-	 * Check if the remote send a new timeout
-	 */
-	len = size;
-
-	if (strchr(string, ':'))
-		len = (strchr(string, ':') - string - 1);
-	if (strncmp(string, "ACK", len) != 0) {
+	sep = strchr(string, ':');
+	if (sep)
+		*sep++ = '\0';
+	if (strcmp(string, "ACK") != 0) {
 		ERROR("Remote Handler returns error, exiting");
-		free(string);
 		return -EFAULT;
 	}
 
 	/*
 	 * Check if the remote ask to wait longer
-	 * we get ack, check the rest of the received
-	 * string
+	 * or grants a number of frames in flight
 	 */
-	if ((size > 4) && (string[3] == ':')) {
-		newtimeout = strtoul(&string[4], NULL, 10);
+	if (sep) {
+		newtimeout = strtoul(sep, &sep, 10);
 		if (newtimeout > 0)
 			timeout = newtimeout;
+		if (*sep == ':' && credits)
+			*credits = strtoul(sep + 1, NULL, 10);
 	}
 
-	free(string);
-
 	return 0;
 }
 
-static int forward_data(void *request, const void *buf, size_t len)
+static int forward_data(void *data, const void *buf, size_t len)
 {
+	struct RHconn *conn = data;
 	struct RHmsg RHmessage;
 	int ret;
 
-	if (!request)
+	if (!conn || !conn->socket)
 		return -EFAULT;
 
+	if (!conn->pipelined) {
+		RHset_command(&RHmessage, "DATA");
+		RHset_payload(&RHmessage, buf, len);
+		ret = RHmsg_send_cmd(&RHmessage, conn->socket, false);
+		if (ret)
+			return ret;
+
+		return RHmsg_get_ack(&RHmessage, conn->socket, false, NULL);
+	}
+
+	/* no credit left: wait for the oldest frame to be acknowledged */
+	while (conn->inflight >= conn->credits) {
+		ret = RHmsg_get_ack(&RHmessage, conn->socket, true, NULL);
+		if (ret)
+			return ret;
+		conn->inflight--;
+	}
+
 	RHset_command(&RHmessage, "DATA");
-	RHset_payload(&RHmessage, buf, len);
-	ret = RHmsg_send_cmd(&RHmessage, request);
+	ret = RHset_payload_slot(&RHmessage, conn, buf, len);
+	if (ret) {
+		zmq_msg_close(&RHmessage.frame[FRAME_CMD]);
+		return ret;
+	}
+	ret = RHmsg_send_cmd(&RHmessage, conn->socket, true);
 	if (ret)
 		return ret;
+	conn->inflight++;
+
+	return 0;
+}
+
+static int drain_acks(struct RHconn *conn)
+{
+	struct RHmsg RHmessage;
+	int ret = 0;
 
-	ret = RHmsg_get_ack(&RHmessage, request);
+	while (conn->inflight && !ret) {
+		ret = RHmsg_get_ack(&RHmessage, conn->socket, true, NULL);
+		conn->inflight--;
+	}
 
 	return ret;
 }
@@ -155,12 +285,29 @@ static int install_remote_image(struct img_type *img,
 	void __attribute__ ((__unused__)) *data)
 {
 	void *context = zmq_ctx_new();
-	void *request = zmq_socket (context, ZMQ_REQ);
+	void *request;
 	char *connect_string;
 	int len;
 	int ret = 0;
 	struct RHmsg RHmessage;
 	char bufcmd[80];
+	struct RHconn conn = { .credits = 1 };
+	const char *window = dict_get_value(&img->properties, "window");
+	unsigned int credits = 0;
+	int linger = 0;
+
+	if (window)
+		conn.credits = strtoul(window, NULL, 10);
+	if (conn.credits < 1)
+		conn.credits = 1;
+	if (conn.credits > REMOTE_MAX_WINDOW)
+		conn.credits = REMOTE_MAX_WINDOW;
+	conn.pipelined = conn.credits > 1;
+
+	request = zmq_socket(context, conn.pipelined ? ZMQ_DEALER : ZMQ_REQ);
+	conn.socket = request;
+	/* frames still queued when an error occurs must not keep the slots */
+	zmq_setsockopt(request, ZMQ_LINGER, &linger, sizeof(linger));
 
 	len = strlen(img->type_data) + strlen(get_tmpdir()) + strlen("ipc://") + 4;
 
@@ -190,16 +337,28 @@ static int install_remote_image(struct img_type *img,
 	snprintf(bufcmd, sizeof(bufcmd), "INIT:%lld", img->size);
 	RHset_command(&RHmessage, bufcmd);
 	RHset_payload(&RHmessage, NULL, 0);
-	RHmsg_send_cmd(&RHmessage, request);
-	if (RHmsg_get_ack(&RHmessage, request))
-		return -ENODEV;
+	RHmsg_send_cmd(&RHmessage, request, conn.pipelined);
+	if (RHmsg_get_ack(&RHmessage, request, conn.pipelined, &credits)) {
+		ret = -ENODEV;
+		goto cleanup;
+	}
+
+	if (conn.pipelined && credits) {
+		conn.credits = min_t(unsigned int, credits, REMOTE_MAX_WINDOW);
+		TRACE("Remote grants %u frames in flight", conn.credits);
+	}
 
-	ret = copyimage(request, img, forward_data);
+	ret = copyimage(&conn, img, forward_data);
+	if (!ret && conn.pipelined)
+		ret = drain_acks(&conn);
 
 cleanup:
 	free(connect_string);
 	zmq_close(request);
+	/* zmq_ctx_destroy() waits until zeromq has released all frames */
 	zmq_ctx_destroy(context);
+	for (unsigned int i = 0; i < REMOTE_MAX_WINDOW; i++)
+		free(conn.slots[i].buf);
 
 	return ret;
 }
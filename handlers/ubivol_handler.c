@@ -22,33 +22,10 @@
 
 void ubi_handler(void);
 
-static struct ubi_part *search_volume(const char *str, struct ubilist *list)
-{
-	struct ubi_part *vol;
-
-	LIST_FOREACH(vol, list, next) {
-		if (strcmp(vol->vol_info.name, str) == 0)
-			return vol;
-	}
-	return NULL;
-}
-
 /* search a UBI volume by name across all mtd partitions */
 static struct ubi_part *search_volume_global(const char *str)
 {
-	struct flash_description *flash = get_flash_info();
-	struct mtd_info *mtd_info = &flash->mtd;
-	struct mtd_ubi_info *mtd_ubi_info;
-	struct ubi_part *ubivol;
-	int i;
-
-	for (i = mtd_info->lowest_mtd_num; i <= mtd_info->highest_mtd_num; i++) {
-		mtd_ubi_info = &flash->mtd_info[i];
-		ubivol = search_volume(str, &mtd_ubi_info->ubi_partitions);
-		if (ubivol)
-			return ubivol;
-	}
-	return NULL;
+	return ubi_find_volume(-1, str);
 }
 
 /* search for a UBI volume by name on a specified MTD partition */
@@ -56,7 +33,6 @@ static struct ubi_part *search_volume_local(char *device, const char *volname)
 {
 	struct flash_description *flash = get_flash_info();
 	int mtdnum;
-	struct mtd_ubi_info *mtd_ubi_info;
 
 	mtdnum = get_mtd_from_device(device);
 	if (mtdnum < 0) {
@@ -66,9 +42,8 @@ static struct ubi_part *search_volume_local(char *device, const char *volname)
 		ERROR("%s does not exist", device);
 		return NULL;
 	}
-	mtd_ubi_info = &flash->mtd_info[mtdnum];
 
-	return search_volume(volname, &mtd_ubi_info->ubi_partitions);
+	return ubi_find_volume(mtdnum, volname);
 }
 
 /**
@@ -152,6 +127,8 @@ static int swap_volnames(libubi_t libubi,
 
 	rnvol.count = 2;
 
+	ubi_invalidate_device(vol1->dev_num);
+
 	return ubi_rnvols(libubi, masternode, &rnvol);
 }
 
@@ -180,6 +157,8 @@ static int rename_vol(libubi_t libubi,
 	strlcpy(rnvol.ents[0].name, name, sizeof(rnvol.ents[0].name));
 	rnvol.count = 1;
 
+	ubi_invalidate_device(vol->dev_num);
+
 	return ubi_rnvols(libubi, masternode, &rnvol);
 }
 
@@ -341,14 +320,7 @@ static int resize_volume(struct img_type *cfg, long long size)
 	/*
 	 * Search for volume with the same name
 	 */
-	ubivol = mtd_info->ubi_partitions.lh_first;
-	for(ubivol = mtd_info->ubi_partitions.lh_first;
-		ubivol != NULL;
-		ubivol = ubivol->next.le_next) {
-		if (strcmp(ubivol->vol_info.name, cfg->volname) == 0) {
-			break;
-		}
-	}
+	ubivol = ubi_find_volume(mtdnum, cfg->volname);
 
 	if (ubivol) {
 		unsigned int requested_lebs, allocated_lebs;
@@ -380,7 +352,7 @@ static int resize_volume(struct img_type *cfg, long long size)
 		}
 		TRACE("Removed UBI Volume %s", ubivol->vol_info.name);
 
-		LIST_REMOVE(ubivol, next);
+		ubi_remove_volume(ubivol);
 		free(ubivol);
 	}
 
@@ -419,7 +391,7 @@ static int resize_volume(struct img_type *cfg, long long size)
 				"newly created UBI volume");
 			return err;
 		}
-		LIST_INSERT_HEAD(&mtd_info->ubi_partitions, ubivol, next);
+		ubi_add_volume(mtdnum, ubivol);
 		TRACE("Created %s UBI volume %s of %lld bytes (old size %lld)",
 			  (req_vol_type == UBI_DYNAMIC_VOLUME) ? "dynamic" : "static",
 			  req.name, req.bytes, ubivol->vol_info.rsvd_bytes);
@@ -641,6 +613,8 @@ static int swap_volume(struct img_type *img, void *data)
 
 	rnvol.count = count * 2;
 
+	ubi_invalidate_device(global_dev_num);
+
 	ret = ubi_rnvols(libubi, masternode, &rnvol);
 	if (ret)
 		ERROR("failed to swap UBI volume names");
@@ -76,8 +76,13 @@ typedef struct {
 	bool strictssl;
 	bool nocheckanswer;
 	bool noipc;	/* do not send to SWUpdate IPC if set */
+	bool noprogress;	/* do not report download progress if set */
+	bool gzip_body;	/* send request_body gzip-compressed if set */
 	long http_response_code;
 	bool nofollow;
+	bool use_etag;		/* send If-None-Match with etag, record ETag of the reply */
+	char *etag;		/* ETag of the last reply, malloc'ed */
+	bool not_modified;	/* set if the server answered 304, reply was not parsed */
 	size_t (*dwlwrdata)(char *streamdata, size_t size, size_t nmemb,
 				   void *data);
 	/*
@@ -93,6 +98,10 @@ typedef struct {
 	struct dict *headers_to_send;
 	struct dict *received_headers;
 	unsigned int max_download_speed;
+	bool adaptive_speed;	/* follow the installer speed when it is slower */
+	unsigned int stalls_avoided;	/* times the download was shaped */
+	bool stream_resume;	/* continue an install from its checkpoint */
+	bool resumed;		/* set if get_file resumed an install */
 	size_t	upload_filesize;
 	char *range; /* Range request for get_file in any */
 	void *user;
@@ -63,3 +63,6 @@ int extract_img_from_cpio(int fd, unsigned long offset, struct filehdr *fdh);
 void extract_padding(int fd);
 bool swupdate_verify_chksum(const uint32_t chk1, struct filehdr *fhdr);
 int fill_buffer(int fd, unsigned char *buf, unsigned int nbytes);
+uint32_t cpio_checksum(const unsigned char *buf, size_t len, uint32_t sum);
+uint32_t cpio_checksum_scalar(const unsigned char *buf, size_t len, uint32_t sum);
+const char *cpio_checksum_impl(void);
@@ -18,7 +18,9 @@
 
 struct ubi_part {
 	struct ubi_vol_info vol_info;
+	int mtdnum;
 	LIST_ENTRY(ubi_part) next;
+	struct ubi_part *hnext;	/* volume name hash chain */
 };
 
 LIST_HEAD(ubilist, ubi_part);
@@ -48,7 +50,12 @@ void mtd_init(void);
 void mtd_set_ubiblacklist(char *mtdlist);
 void ubi_init(void);
 int scan_mtd_devices (void);
+int mtd_refresh_topology(void);
 void mtd_cleanup (void);
+void ubi_add_volume(int mtdnum, struct ubi_part *vol);
+void ubi_remove_volume(struct ubi_part *vol);
+struct ubi_part *ubi_find_volume(int mtdnum, const char *name);
+void ubi_invalidate_device(int ubi_dev);
 int get_mtd_from_device(char *s);
 int get_mtd_from_name(const char *s);
 long long get_mtd_size(int mtdnum);
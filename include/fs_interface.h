@@ -13,6 +13,7 @@ bool diskformat_fs_exists(char *device, char *fstype);
 
 int diskformat_mkfs(char *device, char *fstype);
 int diskformat_set_fslabel(char *device, char *fstype, const char *label);
+int diskformat_discard(const char *device, bool *zeroed);
 
 #if defined(CONFIG_FAT_FILESYSTEM)
 extern int fat_mkfs(const char *device_name, const char *fstype);
@@ -61,6 +61,8 @@ struct installer_handler{
 	unsigned int mask;	/* Mask (see HANDLER_MASK) */
 	bool	noglobal;	/* true if handler is not global and
 				   should be removed after install */
+	bool	reads_fdin;	/* true if handler reads img->fdin itself
+				   instead of calling copyimage() */
 };
 
 struct script_handler_data {
@@ -76,6 +78,8 @@ int register_handler(const char *desc,
 		handler installer, HANDLER_MASK mask, void *data);
 int register_session_handler(const char *desc,
 		handler installer, HANDLER_MASK mask, void *data);
+int register_fdin_handler(const char *desc,
+		handler installer, HANDLER_MASK mask, void *data);
 int unregister_handler(const char *desc);
 void unregister_session_handlers(void);
 
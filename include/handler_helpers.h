@@ -10,6 +10,7 @@
 #include "swupdate_image.h"
 struct chain_handler_data {
 	struct img_type img;
+	int fdout;		/* write end of the pipe if there is no ring */
 };
 
 #define FIFO_THREAD_READ	0
@@ -27,6 +28,10 @@ struct bgtask_handle {
 	struct img_type *img;
 };
 
+int chain_handler_open(struct chain_handler_data *priv);
+int chain_handler_write(void *out, const void *buf, size_t len);
+void chain_handler_close(struct chain_handler_data *priv);
+void chain_handler_cleanup(struct chain_handler_data *priv);
 void *chain_handler_thread(void *data);
 extern int handler_transfer_data(void *data, const void *buf, size_t len);
 int bgtask_handler(struct bgtask_handle *bg);
@@ -0,0 +1,76 @@
+/*
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Counters, histograms and gauges of the update hot paths. Every
+ * thread adds to its own slot without locks, a dump sums the slots of
+ * all threads. Slots live in memory shared with the subprocesses
+ * (suricatta, downloader, webserver), so their metrics are part of
+ * the dump of the main process.
+ */
+enum metric_counter {
+	METRIC_COPY_BYTES_READ,
+	METRIC_COPY_BYTES_HASHED,
+	METRIC_COPY_BYTES_DECRYPTED,
+	METRIC_COPY_BYTES_DECOMPRESSED,
+	METRIC_COPY_BYTES_WRITTEN,
+	METRIC_IMAGES_INSTALLED,
+	METRIC_IMAGES_FAILED,
+	METRIC_DOWNLOAD_BYTES,
+	METRIC_DOWNLOAD_RETRIES,
+	METRIC_RAW_BYTES_WRITTEN,
+	METRIC_RAW_BYTES_UNCHANGED,
+	METRIC_RAW_BYTES_ZEROED,
+	METRIC_RAW_BYTES_DISCARDED,
+	METRIC_COUNTERS
+};
+
+/* Durations in microseconds, one observation per call or per image */
+enum metric_histogram {
+	METRIC_COPY_US,
+	METRIC_COPY_READ_US,
+	METRIC_COPY_DECRYPT_US,
+	METRIC_COPY_DECOMPRESS_US,
+	METRIC_COPY_WRITE_US,
+	METRIC_INSTALL_IMAGE_US,
+	METRIC_FSYNC_US,
+	METRIC_DOWNLOAD_US,
+	METRIC_HISTOGRAMS
+};
+
+enum metric_gauge {
+	METRIC_IPC_NOTIFY_QUEUE,
+	METRIC_IPC_SUBPROCESS_QUEUE,
+	METRIC_GAUGES
+};
+
+/* Call before threads and subprocesses are started */
+int metrics_init(void);
+
+void metrics_add(enum metric_counter id, uint64_t value);
+void metrics_observe(enum metric_histogram id, uint64_t usecs);
+void metrics_gauge_set(enum metric_gauge id, int64_t value);
+void metrics_gauge_add(enum metric_gauge id, int64_t value);
+
+/* JSON object with all metrics, to be freed by the caller */
+char *metrics_dump_json(void);
+
+static inline uint64_t metrics_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void metrics_observe_since(enum metric_histogram id, uint64_t start_ns)
+{
+	metrics_observe(id, (metrics_now_ns() - start_ns) / 1000);
+}
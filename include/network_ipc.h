@@ -42,6 +42,7 @@ typedef enum {
 	SET_SWUPDATE_VARS,
 	GET_SWUPDATE_VARS,
 	SET_DELTA_URL,
+	GET_METRICS,
 } msgtype;
 
 /*
@@ -76,6 +77,7 @@ struct swupdate_request {
 	char software_set[256];
 	char running_mode[256];
 	bool disable_store_swu;
+	bool resume;	/* the stream continues from the saved checkpoint */
 };
 
 typedef union {
@@ -133,6 +135,9 @@ typedef union {
 		char filename[256];
 		char url[1024];
 	} dwl_url;
+	struct {
+		unsigned int len;	/* JSON following the reply */
+	} metrics;
 } msgdata;
 	
 typedef struct {
@@ -152,6 +157,7 @@ int ipc_notify_connect(void);
 int ipc_notify_receive(int *connfd, ipc_message *msg);
 int ipc_postupdate(ipc_message *msg);
 int ipc_send_cmd(ipc_message *msg);
+int ipc_get_metrics(char **json);
 
 typedef int (*writedata)(char **buf, int *size);
 typedef int (*getstatus)(ipc_message *msg);
@@ -11,6 +11,15 @@
 #include <stdbool.h>
 #include <json-c/json.h>
 
+/*
+ * Called for every named node reachable from the root through
+ * groups / objects, with the dotted path leading to it.
+ * A negative return value stops the walk, a positive one
+ * skips the children of the node.
+ */
+typedef int (*walk_callback)(const char *path, const char *name, void *node,
+			     void *data);
+
 bool is_field_numeric_cfg(config_setting_t *e, const char *path);
 bool is_field_bool_cfg(config_setting_t *e, const char *path);
 bool is_field_string_cfg(config_setting_t *e, const char *path);
@@ -21,6 +30,7 @@ void iterate_field_libconfig(config_setting_t *e, iterate_callback cb,
 const char *get_field_string_libconfig(config_setting_t *e, const char *path);
 void *find_root_libconfig(config_t *cfg, const char **nodes, unsigned int depth);
 void *get_node_libconfig(config_t *cfg, const char **nodes);
+int walk_nodes_libconfig(config_t *cfg, walk_callback cb, void *data);
 
 /*
  * JSON implementation for parselib
@@ -36,3 +46,4 @@ void iterate_field_json(json_object *e, iterate_callback cb, void *data);
 json_object *find_json_recursive_node(json_object *root, const char **names);
 void *find_root_json(json_object *root, const char **nodes, unsigned int depth);
 void *get_node_json(json_object *root, const char **nodes);
+int walk_nodes_json(json_object *root, walk_callback cb, void *data);
@@ -65,6 +65,13 @@ void *find_root(parsertype p, void *root, const char **nodes);
 void *get_node(parsertype p, void *root, const char **nodes);
 bool set_find_path(const char **nodes, const char *newpath);
 
+/*
+ * Index the nodes below root to speed up find_root() and get_node().
+ * root must stay unchanged until parser_index_free() is called.
+ */
+int parser_index_build(parsertype p, void *root);
+void parser_index_free(void);
+
 static inline void get_field_bool(parsertype p, void *e, const char *path, bool *dest)
 {
 	get_field(p, e, path, dest, TYPE_BOOL);
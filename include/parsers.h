@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include <stddef.h>
 #include "generated/autoconf.h"
 
 #ifndef CONFIG_SETSWDESCRIPTION
@@ -17,9 +18,11 @@
 
 struct swupdate_cfg;
 
-typedef int (*parser_fn)(struct swupdate_cfg *swcfg, const char *filename, char **error);
+/* buf must be NUL terminated, len does not include the terminator */
+typedef int (*parser_buf_fn)(struct swupdate_cfg *swcfg, const char *buf, size_t len, char **error);
 
-int parse(struct swupdate_cfg *swcfg, const char *filename);
-int parse_cfg(struct swupdate_cfg *swcfg, const char *filename, char **error);
-int parse_json(struct swupdate_cfg *swcfg, const char *filename, char **error);
+int parse_buffer(struct swupdate_cfg *swcfg, const char *desc, size_t desclen,
+		 const unsigned char *sig, size_t siglen);
 int parse_external(struct swupdate_cfg *swcfg, const char *filename, char **error);
+int parse_cfg_buffer(struct swupdate_cfg *swcfg, const char *buf, size_t len, char **error);
+int parse_json_buffer(struct swupdate_cfg *swcfg, const char *buf, size_t len, char **error);
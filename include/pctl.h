@@ -30,6 +30,9 @@ pthread_t start_thread(void *(* start_routine) (void *), void *arg);
 void thread_ready(void);
 void wait_threads_ready(void);
 
+void start_init_task(const char *name, void (*fn)(void *data), void *data);
+void wait_init_tasks(void);
+
 typedef int (*swupdate_process)(const char *cfgname, int argc, char **argv);
 typedef server_op_res_t(*server_ipc_fn)(int fd);
 
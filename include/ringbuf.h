@@ -0,0 +1,31 @@
+/*
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Single producer, single consumer byte stream between two threads
+ * of the same process. It replaces a pipe when both ends are in
+ * SWUpdate: data is copied once into the ring and once out of it,
+ * without system calls unless one side has to wait for the other.
+ */
+#define RINGBUF_DEFAULT_SIZE	(1024 * 1024)
+
+struct ringbuf;
+
+struct ringbuf *ringbuf_new(size_t size);
+void ringbuf_free(struct ringbuf *rb);
+
+/* Blocks until everything is queued, -EPIPE if the reader is gone */
+int ringbuf_write(struct ringbuf *rb, const void *buf, size_t len);
+/* Blocks until some data is available, 0 at end of stream */
+ssize_t ringbuf_read(struct ringbuf *rb, void *buf, size_t len);
+
+/* End of stream for the reader */
+void ringbuf_close_write(struct ringbuf *rb);
+/* The reader gives up: pending and further writes fail */
+void ringbuf_close_read(struct ringbuf *rb);
@@ -113,6 +113,14 @@ struct swupdate_cfg {
 	char gpg_home_directory[SWUPDATE_GENERAL_STRING_SIZE];
 	char gpgme_protocol[SWUPDATE_GENERAL_STRING_SIZE];
 	int swdesc_max_size;
+	/* bytes between two checkpoints of a streamed image, 0 = off */
+	unsigned long long checkpoint_interval;
+	/* ring between a handler and its chained handler, 0 = pipe */
+	unsigned long long chain_buffer_size;
+	/* parallel xz / zstd decoding, 0 = one thread per CPU */
+	int decompress_threads;
+	/* data of blocks or frames decoded in parallel, 0 = default */
+	unsigned long long decompress_memlimit;
 	/*
 	 * Select which provider is used in case of multiple
 	 * crypto libraries
@@ -8,6 +8,7 @@
 
 #pragma once
 #include <stdbool.h>
+#include <stddef.h>
 #include <swupdate_aes.h>
 
 #define SHA_DEFAULT	"sha256"
@@ -58,9 +59,13 @@ typedef struct {
 	void (*HASH_cleanup)(void *ctx);
 } swupdate_HASH_lib;
 
+/*
+ * A verification library checks a signature of data in memory
+ */
 typedef struct {
 	int (*dgst_init)(struct swupdate_cfg *sw, const char *keyfile);
-	int (*verify_file)(void *ctx, const char *sigfile, const char *file, const char *signer_name);
+	int (*verify_buf)(void *ctx, const unsigned char *sig, size_t siglen,
+			  const unsigned char *data, size_t len, const char *signer_name);
 } swupdate_dgst_lib;
 
 /*
@@ -117,8 +122,9 @@ int swupdate_HASH_update(void *ctx, const unsigned char *buf,
 int swupdate_HASH_final(void *ctx, unsigned char *md_value,
 	       			unsigned int *md_len);
 void swupdate_HASH_cleanup(void *ctx);
-int swupdate_verify_file(void *ctx, const char *sigfile,
-				const char *file, const char *signer_name);
+int swupdate_verify_buf(void *ctx, const unsigned char *sig, size_t siglen,
+				const unsigned char *data, size_t len,
+				const char *signer_name);
 int swupdate_HASH_compare(const unsigned char *hash1, const unsigned char *hash2);
 
 void *swupdate_DECRYPT_init(unsigned char *key, char keylen, unsigned char *iv, cipher_t cipher);
@@ -15,6 +15,9 @@
 #include "lua_util.h"
 #include "swupdate_aes.h"
 
+struct copy_checkpoint;
+struct ringbuf;
+
 typedef enum {
 	FLASH,
 	UBI,
@@ -81,6 +84,8 @@ struct img_type {
 	long long size;
 	unsigned int checksum;
 	unsigned char sha256[SHA256_HASH_LENGTH];	/* SHA-256 is 32 byte */
+	struct copy_checkpoint *checkpoint;	/* set if streamed with checkpoints */
+	struct ringbuf *ring;	/* input from a ring instead of fdin */
 	LIST_ENTRY(img_type) next;
 };
 
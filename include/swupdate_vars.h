@@ -10,6 +10,17 @@
 #include <libuboot.h>
 #include <stdbool.h>
 
+/*
+ * Checkpoint of an interrupted streamed install: it is written by the
+ * installer and read by the downloader to continue with range requests.
+ * Fields: sw-description id, stream offsets of the part to send again
+ * and of the image data, bytes written, image size, cpio checksum,
+ * streamed images done since the prefix, image filename.
+ */
+#define STREAM_CHECKPOINT_VAR	"stream_checkpoint"
+#define STREAM_SOURCE_VAR	"stream_source"
+#define STREAM_CHECKPOINT_FMT	"%s %llu %llu %llu %llu %u %u %s"
+
 int swupdate_vars_initialize(struct uboot_ctx **ctx, const char *namespace);
 int swupdate_vars_apply_list(const char *filename, const char *namespace);
 char *swupdate_vars_get(const char *name, const char *namespace);
@@ -41,6 +41,8 @@
 struct img_type;
 struct imglist;
 struct hw_type;
+struct ringbuf;
+struct stat;
 
 extern int loglevel;
 extern int exit_code;
@@ -69,10 +71,23 @@ enum compression_type {
 
 typedef int (*writeimage) (void *out, const void *buf, size_t len);
 
+/*
+ * A copy into a file descriptor can save its progress every interval
+ * bytes (after a sync) and restart after resume bytes, that are read
+ * back from the output to compute the hash.
+ */
+struct copy_checkpoint {
+	unsigned long long interval;
+	unsigned long long resume;
+	int (*save)(struct copy_checkpoint *ckpt, unsigned long long written);
+	void *data;
+};
+
 struct swupdate_copy {
-	/* input: either fdin is set or fdin < 0 and inbuf */
+	/* input: either fdin is set or fdin < 0 and inbuf or inring */
 	int fdin;
 	unsigned char *inbuf;
+	struct ringbuf *inring;
 	/* data handler callback and output argument.
 	 * out must point to a fd if seeking */
 	writeimage callback;
@@ -96,6 +111,8 @@ struct swupdate_copy {
 	const char *imgivt;
 	const char *imgaes;
 	cipher_t cipher;
+	/* checkpoint of a resumable copy, uncompressed and not encrypted */
+	struct copy_checkpoint *checkpoint;
 };
 
 /*
@@ -304,6 +321,7 @@ int read_lines_notify(int fd, char *buf, int buf_size, int *buf_offset,
 long long get_output_size(struct img_type *img, bool strict);
 bool img_check_free_space(struct img_type *img, int fd);
 bool check_same_file(int fd1, int fd2);
+bool same_file_state(const struct stat *a, const struct stat *b);
 bool is_filename_valid (const char *file_name);
 
 /* location for libubootenv configuration file */
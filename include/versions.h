@@ -8,5 +8,13 @@
 #pragma once
 
 #include "swupdate_settings.h"
+
+struct swupdate_cfg;
+struct swver;
+
 void get_sw_versions(swupdate_cfg_handle *handle, struct swupdate_cfg *sw);
+void refresh_sw_versions(struct swupdate_cfg *sw);
+void invalidate_sw_versions_index(void);
+int compare_installed_version(struct swver *sw_ver_list, const char *name,
+			      const char *version, int *result);
 
@@ -0,0 +1,31 @@
+/*
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Decoder for zstd streams made of several frames (pzstd, seekable
+ * format): the first frame is streamed on the calling thread, the
+ * following complete frames are decoded on a pool of threads and
+ * returned in order. Frames whose size is not in their header or that
+ * do not fit into the memory limit make the decoder fall back to
+ * streaming, on the calling thread, from that frame on.
+ */
+struct zstd_mt;
+
+/* Pulls compressed data, returns 0 at end of stream, < 0 on error */
+typedef int (*zstd_mt_input)(void *state, void *buffer, size_t size);
+
+/*
+ * No frame is queued while the compressed and decompressed data of
+ * the frames in flight and the read ahead buffer exceed memlimit,
+ * larger frames are streamed
+ */
+struct zstd_mt *zstd_mt_new(unsigned int threads, size_t memlimit,
+			    zstd_mt_input input, void *input_state);
+/* Returns the number of bytes in buffer, 0 at end of stream, < 0 on error */
+int zstd_mt_read(struct zstd_mt *z, void *buffer, size_t size);
+void zstd_mt_free(struct zstd_mt *z);
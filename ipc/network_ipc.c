@@ -384,3 +384,50 @@ int ipc_send_cmd(ipc_message *msg)
 
 	return -ret;
 }
+
+/*
+ * The metrics do not fit into an IPC message, SWUpdate sends their
+ * length in the reply and the JSON after it.
+ * @return : length of the JSON in *json (to be freed), -1 on error
+ */
+int ipc_get_metrics(char **json)
+{
+	ipc_message msg;
+	char *buf;
+	size_t pos = 0;
+	ssize_t n;
+	int connfd = prepare_ipc();
+	if (connfd < 0)
+		return -1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = IPC_MAGIC;
+	msg.type = GET_METRICS;
+
+	if (write(connfd, &msg, sizeof(msg)) != sizeof(msg) ||
+	    read(connfd, &msg, sizeof(msg)) != sizeof(msg) ||
+	    msg.type != ACK) {
+		close(connfd);
+		return -1;
+	}
+
+	buf = malloc(msg.data.metrics.len + 1);
+	if (!buf) {
+		close(connfd);
+		return -1;
+	}
+	while (pos < msg.data.metrics.len) {
+		n = read(connfd, buf + pos, msg.data.metrics.len - pos);
+		if (n <= 0) {
+			free(buf);
+			close(connfd);
+			return -1;
+		}
+		pos += n;
+	}
+	buf[pos] = '\0';
+	close(connfd);
+	*json = buf;
+
+	return pos;
+}
@@ -363,6 +363,25 @@ static void restart_handler(struct mg_connection *nc, void *ev_data)
 	mg_http_reply(nc, 201, "", "%s", "Device will reboot now.\n");
 }
 
+static void metrics_handler(struct mg_connection *nc, void *ev_data)
+{
+	struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+	char *json;
+
+	if(mg_strcasecmp(hm->method, mg_str("GET")) != 0) {
+		mg_http_reply(nc, 405, "", "%s", "Method Not Allowed\n");
+		return;
+	}
+
+	if (ipc_get_metrics(&json) < 0) {
+		mg_http_reply(nc, 500, "", "%s", "Failed to get metrics\n");
+		return;
+	}
+
+	mg_http_reply(nc, 200, "Content-Type: application/json\r\n", "%s\n", json);
+	free(json);
+}
+
 static int level_to_rfc_5424(int level)
 {
 	switch(level) {
@@ -697,6 +716,8 @@ static void ev_handler(struct mg_connection *nc, int ev, void *ev_data)
 			websocket_handler(nc, ev_data);
 		else if (mg_match(hm->uri, mg_str("#/restart"), NULL))
 			restart_handler(nc, ev_data);
+		else if (mg_match(hm->uri, mg_str("#/metrics"), NULL))
+			metrics_handler(nc, ev_data);
 	        else if (mg_match(hm->uri, mg_str("#/upload"), NULL)) {
 			nc->pfn = upload_handler;
 			nc->pfn_data = NULL;
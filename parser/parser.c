@@ -26,6 +26,7 @@
 #include "swupdate_dict.h"
 #include "swupdate_aes.h"
 #include "lua_util.h"
+#include "versions.h"
 
 #define MODULE_NAME	"PARSER"
 
@@ -344,7 +345,7 @@ static int parse_hw_compatibility(parsertype __attribute__ ((__unused__))p,
 static int is_image_installed(struct swver *sw_ver_list,
                               struct img_type *img)
 {
-    struct sw_version *swver;
+    int cmp;
 
     if (!sw_ver_list)
         return false;
@@ -353,18 +354,16 @@ static int is_image_installed(struct swver *sw_ver_list,
         !img->id.install_if_different)
         return false;
 
-    LIST_FOREACH(swver, sw_ver_list, next) {
-        /*
-         * Check if name and version are identical
-         */
-        if (!strncmp(img->id.name, swver->name, sizeof(img->id.name)) &&
-            !compare_versions(img->id.version, swver->version)) {
-            TRACE("%s(%s) already installed, skipping...",
-                  img->id.name,
-                  img->id.version);
-
-            return true;
-        }
+    /*
+     * Check if name and version are identical
+     */
+    if (!compare_installed_version(sw_ver_list, img->id.name,
+                                   img->id.version, &cmp) && !cmp) {
+        TRACE("%s(%s) already installed, skipping...",
+              img->id.name,
+              img->id.version);
+
+        return true;
     }
 
     return false;
@@ -373,7 +372,7 @@ static int is_image_installed(struct swver *sw_ver_list,
 static int is_image_higher(struct swver *sw_ver_list,
                            struct img_type *img)
 {
-    struct sw_version *swver;
+    int cmp;
 
     if (!sw_ver_list)
         return false;
@@ -382,22 +381,17 @@ static int is_image_higher(struct swver *sw_ver_list,
         !img->id.install_if_higher)
         return false;
 
-    LIST_FOREACH(swver, sw_ver_list, next) {
-        const char* current_version = swver->version;
-        const char* proposed_version = img->id.version;
-
-        /*
-         * Check if name are identical and the new version is lower
-         * or equal.
-         */
-        if (!strncmp(img->id.name, swver->name, sizeof(img->id.name)) &&
-            (compare_versions(proposed_version, current_version) <= 0)) {
-            TRACE("%s(%s) has a higher or same version installed, skipping...",
-                  img->id.name,
-                  img->id.version);
-
-            return true;
-        }
+    /*
+     * Check if name are identical and the new version is lower
+     * or equal.
+     */
+    if (!compare_installed_version(sw_ver_list, img->id.name,
+                                   img->id.version, &cmp) && cmp <= 0) {
+        TRACE("%s(%s) has a higher or same version installed, skipping...",
+              img->id.name,
+              img->id.version);
+
+        return true;
     }
 
     return false;
@@ -1116,75 +1110,86 @@ static int parser(parsertype p, void *cfg, struct swupdate_cfg *swcfg)
 	return ret;
 }
 
-int parse_cfg(struct swupdate_cfg *swcfg, const char *filename, char **error)
+static int parse_cfg_tree(config_t *cfg, struct swupdate_cfg *swcfg)
 {
-	config_t cfg;
 	parsertype p = LIBCFG_PARSER;
 	int ret;
 
+	if (parser_index_build(p, cfg))
+		WARN("Path index not available, parsing may be slow");
+
+	if (!get_common_fields(p, cfg, swcfg)) {
+		parser_index_free();
+		config_destroy(cfg);
+		return -1;
+	}
+
+	ret = parser(p, cfg, swcfg);
+
+	parser_index_free();
+	config_destroy(cfg);
+
+	return ret;
+}
+
+int parse_cfg_buffer(struct swupdate_cfg *swcfg, const char *buf, size_t len,
+		     char **error)
+{
+	config_t cfg;
+
+	(void)len;
 	memset(&cfg, 0, sizeof(cfg));
 	config_init(&cfg);
 
-	/* Read the file. If there is an error, report it and exit. */
-	DEBUG("Parsing config file %s", filename);
-	if(config_read_file(&cfg, filename) != CONFIG_TRUE) {
-		if (asprintf(error, "%s:%d - %s\n", config_error_file(&cfg),
+	DEBUG("Parsing config from memory");
+	if(config_read_string(&cfg, buf) != CONFIG_TRUE) {
+		if (asprintf(error, "%s:%d - %s\n", SW_DESCRIPTION_FILENAME,
 			     config_error_line(&cfg), config_error_text(&cfg)) == ENOMEM_ASPRINTF) {
 			ERROR("OOM when caching error");
+			config_destroy(&cfg);
 			return -ENOMEM;
 		}
 		config_destroy(&cfg);
 		return -1;
 	}
 
-	if (!get_common_fields(p, &cfg, swcfg))
-		return -1;
-
-	ret = parser(p, &cfg, swcfg);
-
-	config_destroy(&cfg);
-
-	return ret;
+	return parse_cfg_tree(&cfg, swcfg);
 }
 
 #define JSON_OBJECT_FREED 1
 
-int parse_json(struct swupdate_cfg *swcfg, const char *filename, char **error)
+int parse_json_buffer(struct swupdate_cfg *swcfg, const char *buf, size_t len,
+		      char **error)
 {
 	int ret;
-	size_t read_len = 0;
-	char *string = NULL;
 	json_object *cfg;
 	parsertype p = JSON_PARSER;
 
-	DEBUG("Parsing config file %s", filename);
-	ret = read_file_into_buf(filename, (unsigned char **)&string, &read_len);
-	if (ret)
-		return ret;
-
-	cfg = json_tokener_parse(string);
+	(void)len;
+	cfg = json_tokener_parse(buf);
 	if (!cfg) {
 		if (asprintf(error, "JSON File corrupted") == ENOMEM_ASPRINTF) {
 			ERROR("OOM when caching error");
-			free(string);
 			return -ENOMEM;
 		}
-		free(string);
 		return -1;
 	}
 
+	if (parser_index_build(p, cfg))
+		WARN("Path index not available, parsing may be slow");
+
 	if (!get_common_fields(p, cfg, swcfg)) {
-		free(string);
+		parser_index_free();
 		return -1;
 	}
 
 	ret = parser(p, cfg, swcfg);
 
+	parser_index_free();
+
 	if (json_object_put(cfg) != JSON_OBJECT_FREED) {
 		WARN("Leaking cfg json object");
 	}
 
-	free(string);
-
 	return ret;
 }
@@ -13,6 +13,7 @@
 #include <getopt.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <json-c/json.h>
 #include <generated/autoconf.h>
 #include <util.h>
@@ -34,6 +35,7 @@
 #include "swupdate_vars.h"
 
 #define INITIAL_STATUS_REPORT_WAIT_DELAY 10
+#define MAX_POLLING_BACKOFF_SHIFT 16
 
 #define JSON_OBJECT_FREED 1
 #define SERVER_NAME "hawkbit"
@@ -92,6 +94,7 @@ static struct option long_options[] = {
 	{"custom-http-header", required_argument, NULL, 'a'},
 	{"identify", required_argument, NULL, '3'},
 	{"max-download-speed", required_argument, NULL, 'l'},
+	{"prefetch-size", required_argument, NULL, '4'},
     {NULL, 0, NULL, 0}};
 
 static unsigned short mandatory_argument_count = 0;
@@ -156,6 +159,7 @@ server_hawkbit_t server_hawkbit = {.url = NULL,
 				   .cancel_url = NULL,
 				   .update_action = NULL,
 				   .usetokentodwl = true,
+				   .use_etag = true,
 				   .cached_file = NULL,
 				   .channel = NULL};
 
@@ -513,9 +517,54 @@ server_op_res_t server_set_polling_interval_json(json_object *json_root)
 
 static unsigned int server_get_polling_interval(void)
 {
+	if (server_hawkbit.next_polling_interval)
+		return server_hawkbit.next_polling_interval;
 	return server_hawkbit.polling_interval;
 }
 
+/*
+ * Compute the delay until the next poll: the polling interval is
+ * doubled for each consecutive failed poll up to max-polling-backoff,
+ * and it is spread by polling-jitter percent so that devices
+ * started at the same time do not keep polling the server together.
+ */
+static void server_update_polling_delay(server_op_res_t result)
+{
+	unsigned long long interval = server_hawkbit.polling_interval;
+	unsigned int jitter;
+
+	switch (result) {
+	case SERVER_EAGAIN:
+	case SERVER_EACCES:
+	case SERVER_EERR:
+		if (server_hawkbit.failed_polls < MAX_POLLING_BACKOFF_SHIFT)
+			server_hawkbit.failed_polls++;
+		break;
+	default:
+		server_hawkbit.failed_polls = 0;
+		break;
+	}
+
+	if (server_hawkbit.max_polling_backoff && server_hawkbit.failed_polls > 1) {
+		interval <<= server_hawkbit.failed_polls - 1;
+		interval = min_t(unsigned long long, interval,
+				 max(server_hawkbit.max_polling_backoff,
+				     server_hawkbit.polling_interval));
+	}
+
+	if (server_hawkbit.polling_jitter) {
+		jitter = interval * server_hawkbit.polling_jitter / 100;
+		if (jitter)
+			interval = interval - jitter + random() % (2 * jitter + 1);
+	}
+
+	server_hawkbit.next_polling_interval = interval ? interval : 1;
+	if (server_hawkbit.next_polling_interval != server_hawkbit.polling_interval)
+		DEBUG("Next poll in %us (%u failed polls)",
+		      server_hawkbit.next_polling_interval,
+		      server_hawkbit.failed_polls);
+}
+
 static void server_get_current_time(struct timeval *tv)
 {
 	struct timespec ts;
@@ -552,6 +601,26 @@ static void report_server_status(int server_status)
 	pthread_mutex_unlock(&ipc_lock);
 }
 
+/*
+ * Keep the last reply of the base resource: if the server
+ * answers 304 to the next conditional request, it is reused
+ * without downloading and parsing it again.
+ */
+static void server_cache_device_info(channel_data_t *channel_data)
+{
+	if (server_hawkbit.device_info)
+		json_object_put(server_hawkbit.device_info);
+	server_hawkbit.device_info = NULL;
+	server_hawkbit.device_info_size = 0;
+
+	if (!server_hawkbit.etag || !channel_data->json_reply)
+		return;
+
+	server_hawkbit.device_info = json_object_get(channel_data->json_reply);
+	server_hawkbit.device_info_size =
+		strlen(json_object_to_json_string(channel_data->json_reply));
+}
+
 static server_op_res_t server_get_device_info(channel_t *channel, channel_data_t *channel_data)
 {
 	assert(channel != NULL);
@@ -571,13 +640,43 @@ static server_op_res_t server_get_device_info(channel_t *channel, channel_data_t
 		goto cleanup;
 	}
 
+	/*
+	 * A conditional request makes sense only if
+	 * the previous reply is still available
+	 */
+	channel_data->use_etag = server_hawkbit.use_etag;
+	if (!server_hawkbit.device_info) {
+		free(server_hawkbit.etag);
+		server_hawkbit.etag = NULL;
+	}
+	channel_data->etag = server_hawkbit.etag;
+
 	channel_op_res_t ch_response = channel->get(channel, (void *)channel_data);
 
+	server_hawkbit.etag = channel_data->etag;
+	channel_data->etag = NULL;
+
 	report_server_status(ch_response);
 	if ((result = map_channel_retcode(ch_response)) !=
 	    SERVER_OK) {
 		goto cleanup;
 	}
+
+	pthread_mutex_lock(&ipc_lock);
+	server_hawkbit.polls++;
+	if (channel_data->not_modified) {
+		server_hawkbit.polls_not_modified++;
+		server_hawkbit.polls_bytes_saved += server_hawkbit.device_info_size;
+	}
+	pthread_mutex_unlock(&ipc_lock);
+
+	if (channel_data->not_modified && server_hawkbit.device_info) {
+		DEBUG("Device information not modified, reusing last reply");
+		channel_data->json_reply = json_object_get(server_hawkbit.device_info);
+	} else {
+		server_cache_device_info(channel_data);
+	}
+
 	if ((result = server_set_polling_interval_json(channel_data->json_reply)) !=
 	    SERVER_OK) {
 		goto cleanup;
@@ -663,11 +762,9 @@ static server_op_res_t server_get_deployment_info(channel_t *channel, channel_da
 	result = update_status;
 
 cleanup:
-	if (channel_data_device_info.json_reply != NULL &&
-	    json_object_put(channel_data_device_info.json_reply) !=
-		JSON_OBJECT_FREED) {
-		ERROR("JSON object should be freed but was not.");
-	}
+	/* The reply can be still referenced by server_hawkbit.device_info */
+	if (channel_data_device_info.json_reply != NULL)
+		json_object_put(channel_data_device_info.json_reply);
 	if (url_cancel != NULL) {
 		free(url_cancel);
 	}
@@ -758,6 +855,8 @@ static server_op_res_t server_has_pending_action(int *action_id)
 	    server_get_deployment_info(server_hawkbit.channel,
 			    		&channel_data, action_id);
 
+	server_update_polling_delay(result);
+
 	/*
 	 * Retrieve if "update" changed before freeing object, used later
 	 */
@@ -997,7 +1096,10 @@ static void *process_notification_thread(void *data)
 	channel_data_t channel_data = channel_data_defaults;
 	unsigned int percent = 0;
 	unsigned int step = 0;
+	unsigned int requests = 0, total_details = 0;
+	struct timespec last_flush, now;
 
+	clock_gettime(CLOCK_MONOTONIC, &last_flush);
 
 	/*
 	 * Create a new channel to the server. The opened channel is
@@ -1016,6 +1118,8 @@ static void *process_notification_thread(void *data)
 	for (;;) {
 		ipc_message msg;
 		bool data_avail = false;
+		bool terminal = false;
+		bool window_elapsed = false;
 		int ret = ipc_get_status(&msg);
 
 		if (ret < 0) {
@@ -1023,6 +1127,8 @@ static void *process_notification_thread(void *data)
 			stop = true;
 		} else {
 			data_avail = (strlen(msg.data.status.desc) != 0);
+			terminal = (msg.data.status.current == SUCCESS ||
+				    msg.data.status.current == FAILURE);
 		}
 
 		/*
@@ -1052,11 +1158,24 @@ static void *process_notification_thread(void *data)
 			details[numdetails++] = strdup(msg.data.status.desc);
 		}
 
+		/*
+		 * Details are coalesced and sent once per feedback window,
+		 * a terminal state is sent without waiting for it
+		 */
+		if (server_hawkbit.feedback_interval && numdetails) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			window_elapsed = (now.tv_sec - last_flush.tv_sec) >=
+				(time_t)server_hawkbit.feedback_interval;
+		}
+
 		/*
 		 * Flush to the server
 		 */
-		if (numdetails == MAX_DETAILS || (stop && !data_avail)) {
+		if (numdetails == MAX_DETAILS || (stop && !data_avail) ||
+		    (numdetails && (terminal || window_elapsed))) {
 			TRACE("Update log to server from thread");
+			requests++;
+			total_details += numdetails;
 			if (server_send_deployment_reply(
 				channel,
 				action_id, step, percent,
@@ -1074,6 +1193,7 @@ static void *process_notification_thread(void *data)
 				percent = 0;
 				step++;
 			}
+			clock_gettime(CLOCK_MONOTONIC, &last_flush);
 		}
 
 		if (stop && !data_avail)
@@ -1086,6 +1206,9 @@ static void *process_notification_thread(void *data)
 
 	pthread_mutex_unlock(&notifylock);
 
+	DEBUG("Feedback: %u details sent in %u requests", total_details,
+	      requests);
+
 	/*
 	 * Now close the channel for feedback
 	 */
@@ -1095,6 +1218,236 @@ static void *process_notification_thread(void *data)
 	return NULL;
 }
 
+/*
+ * While an artifact is installed, the next one can be downloaded
+ * into a file in TMPDIR (prefetch-size bounds it). When it completes
+ * and its checksum matches, the file is streamed to the installer,
+ * else the part already downloaded is used to resume the download.
+ */
+#define PREFETCH_BUFFER_SIZE	16384
+
+struct artifact_prefetch {
+	artifact_t *artifact;
+	pthread_t thread;
+	bool started;
+	bool stop;
+	bool complete;
+	int fd;
+	char *path;
+	unsigned long long written;
+};
+
+static size_t prefetch_write(char *streamdata, size_t size, size_t nmemb,
+			     void *data)
+{
+	channel_data_t *channel_data = (channel_data_t *)data;
+	struct artifact_prefetch *pf = channel_data->user;
+	size_t len = size * nmemb;
+
+	if (__atomic_load_n(&pf->stop, __ATOMIC_RELAXED) ||
+	    server_hawkbit.cancelDuringUpdate)
+		return 0;
+
+	if (pf->written + len > server_hawkbit.prefetch_size) {
+		WARN("Prefetch of '%s' exceeds %llu bytes, stopped",
+		     pf->artifact->filename, server_hawkbit.prefetch_size);
+		return 0;
+	}
+
+	if (copy_write(&pf->fd, streamdata, len) < 0)
+		return 0;
+	pf->written += len;
+
+	return len;
+}
+
+static void *prefetch_thread(void *data)
+{
+	struct artifact_prefetch *pf = (struct artifact_prefetch *)data;
+	channel_data_t channel_data = channel_data_defaults;
+	channel_op_res_t cresult;
+
+	channel_t *channel = channel_new();
+	if (!channel)
+		return NULL;
+
+	if (channel->open(channel, &channel_data) != CHANNEL_OK) {
+		channel->close(channel);
+		free(channel);
+		return NULL;
+	}
+
+	channel_data.url = pf->artifact->url;
+	channel_data.noipc = true;
+	channel_data.noprogress = true;
+	channel_data.dwlwrdata = prefetch_write;
+	channel_data.user = pf;
+	if (!server_hawkbit.usetokentodwl)
+		channel_data.auth_token = NULL;
+
+	cresult = channel->get_file(channel, (void *)&channel_data);
+	if (cresult == CHANNEL_OK &&
+	    pf->written == (unsigned long long)pf->artifact->size) {
+#ifdef CONFIG_SURICATTA_SSL
+		if (strncmp((char *)&channel_data.sha1hash,
+			    pf->artifact->sha1hash,
+			    SWUPDATE_SHA_DIGEST_LENGTH) != 0) {
+			WARN("Prefetched '%s' does not match its checksum, "
+			     "discarded", pf->artifact->filename);
+			if (ftruncate(pf->fd, 0) == 0)
+				pf->written = 0;
+		} else
+#endif
+			pf->complete = true;
+	}
+	DEBUG("Prefetch of '%s' %s after %llu bytes",
+	      pf->artifact->filename,
+	      pf->complete ? "completed" : "stopped", pf->written);
+
+	channel->close(channel);
+	free(channel);
+
+	return NULL;
+}
+
+static void prefetch_release(struct artifact_prefetch *pf)
+{
+	if (pf->started) {
+		__atomic_store_n(&pf->stop, true, __ATOMIC_RELAXED);
+		pthread_join(pf->thread, NULL);
+	}
+	if (pf->fd >= 0)
+		close(pf->fd);
+	if (pf->path) {
+		unlink(pf->path);
+		free(pf->path);
+	}
+	memset(pf, 0, sizeof(*pf));
+	pf->fd = -1;
+}
+
+/*
+ * Start the download of the first artifact after index that
+ * is going to be installed
+ */
+static void prefetch_start(struct artifact_prefetch *pf, artifact_t *artifacts,
+			   int index, int max)
+{
+	artifact_t *artifact = NULL;
+
+	if (!server_hawkbit.prefetch_size)
+		return;
+
+	for (; index < max; index++) {
+		if (!artifacts[index].skip) {
+			artifact = &artifacts[index];
+			break;
+		}
+	}
+	if (!artifact)
+		return;
+
+	if (artifact->size <= 0 ||
+	    (unsigned long long)artifact->size > server_hawkbit.prefetch_size) {
+		DEBUG("'%s' does not fit in the prefetch cache, not prefetched",
+		      artifact->filename);
+		return;
+	}
+
+	if (asprintf(&pf->path, "%s/hawkbit-prefetch-XXXXXX",
+		     get_tmpdir()) == ENOMEM_ASPRINTF) {
+		pf->path = NULL;
+		return;
+	}
+	pf->fd = mkstemp(pf->path);
+	if (pf->fd < 0) {
+		WARN("Cannot create prefetch file %s: %s", pf->path,
+		     strerror(errno));
+		prefetch_release(pf);
+		return;
+	}
+
+	pf->artifact = artifact;
+	if (pthread_create(&pf->thread, NULL, prefetch_thread, pf)) {
+		WARN("Cannot start prefetch of '%s'", artifact->filename);
+		prefetch_release(pf);
+		return;
+	}
+	pf->started = true;
+	DEBUG("Prefetching '%s'", artifact->filename);
+}
+
+static void prefetch_wait(struct artifact_prefetch *pf)
+{
+	if (!pf->started)
+		return;
+	pthread_join(pf->thread, NULL);
+	pf->started = false;
+}
+
+/*
+ * Stream a completely prefetched artifact to the installer, checking
+ * for a cancel on the server as during a download
+ */
+static channel_op_res_t server_install_prefetched(struct artifact_prefetch *pf,
+						  channel_data_t *channel_data)
+{
+	struct swupdate_request req;
+	channel_op_res_t result = CHANNEL_OK;
+	int file_handle = -1;
+	ssize_t cnt;
+	char *buf;
+
+	if (lseek(pf->fd, 0, SEEK_SET) < 0)
+		return CHANNEL_EIO;
+
+	buf = malloc(PREFETCH_BUFFER_SIZE);
+	if (!buf) {
+		ERROR("OOM installing prefetched artifact");
+		return CHANNEL_ENOMEM;
+	}
+
+	swupdate_prepare_req(&req);
+	req.dry_run = channel_data->dry_run;
+	req.source = channel_data->source;
+	if (channel_data->info) {
+		strncpy(req.info, channel_data->info, sizeof(req.info) - 1);
+		req.len = strlen(channel_data->info);
+	}
+	for (int retries = 3; retries >= 0; retries--) {
+		file_handle = ipc_inst_start_ext(&req, sizeof(req));
+		if (file_handle > 0)
+			break;
+		sleep(1);
+	}
+	if (file_handle < 0) {
+		ERROR("Cannot open SWUpdate IPC stream: %s", strerror(errno));
+		free(buf);
+		return CHANNEL_EIO;
+	}
+
+	while ((cnt = read(pf->fd, buf, PREFETCH_BUFFER_SIZE)) > 0) {
+		if (ipc_send_data(file_handle, buf, (int)cnt) < 0) {
+			ERROR("Writing into SWUpdate IPC stream failed.");
+			result = CHANNEL_EIO;
+			break;
+		}
+		if (!server_check_during_dwl(buf, cnt, 1, channel_data)) {
+			result = CHANNEL_EIO;
+			break;
+		}
+	}
+	if (cnt < 0) {
+		ERROR("Cannot read prefetched artifact: %s", strerror(errno));
+		result = CHANNEL_EIO;
+	}
+
+	close(file_handle);
+	free(buf);
+
+	return result;
+}
+
 static server_op_res_t json_extract_artifact(struct array_list *json_data_artifact_array, int json_data_artifact_max,
 				      artifact_t *artifacts)
 {
@@ -1213,6 +1566,8 @@ server_op_res_t server_process_update_artifact(int action_id,
 	assert(json_object_get_type(json_data_artifact) == json_type_array);
 	server_op_res_t result = SERVER_OK;
 	pthread_t notify_to_hawkbit_thread;
+	struct artifact_prefetch prefetch[2] = { { .fd = -1 }, { .fd = -1 } };
+	struct artifact_prefetch *pf_cur = &prefetch[0], *pf_next = &prefetch[1];
 
 	/* Initialize list of errors */
 	for (int i = 0; i < HAWKBIT_MAX_REPORTED_ERRORS; i++)
@@ -1256,6 +1611,8 @@ server_op_res_t server_process_update_artifact(int action_id,
 	     json_data_artifact_count++) {
 		int thread_ret = -1;
 		artifact_t *artifact = &artifacts[json_data_artifact_count];
+		struct artifact_prefetch *pf;
+		bool from_prefetch = false;
 
 		if (artifact->skip)
 			continue;
@@ -1264,6 +1621,19 @@ server_op_res_t server_process_update_artifact(int action_id,
 		      artifact->filename,
 		      artifact->url);
 
+		/*
+		 * The slot prefetched during the previous install becomes
+		 * the current one, the other is free for the next artifact
+		 */
+		pf = pf_cur;
+		pf_cur = pf_next;
+		pf_next = pf;
+		prefetch_release(pf_next);
+		if (pf_cur->artifact == artifact) {
+			prefetch_wait(pf_cur);
+			from_prefetch = pf_cur->complete;
+		}
+
 		channel_data_t channel_data = channel_data_defaults;
 		channel_data.url = 
 		    strdup(artifact->url);
@@ -1306,6 +1676,8 @@ server_op_res_t server_process_update_artifact(int action_id,
 		 */
 		if (server_hawkbit.cached_file)
 			channel_data.cached_file = server_hawkbit.cached_file;
+		else if (!from_prefetch && pf_cur->written)
+			channel_data.cached_file = pf_cur->path;
 
 		/*
 		 * Retrieve current time to check download time
@@ -1329,8 +1701,16 @@ server_op_res_t server_process_update_artifact(int action_id,
 		thread_ret = pthread_create(&notify_to_hawkbit_thread, &attr,
 				process_notification_thread, &action_id);
 
-		channel_op_res_t cresult =
-		    channel->get_file(channel, (void *)&channel_data);
+		prefetch_start(pf_next, artifacts, json_data_artifact_count + 1,
+			       json_data_artifact_max);
+
+		channel_op_res_t cresult;
+		if (from_prefetch) {
+			INFO("Installing '%s' from prefetch cache",
+			     artifact->filename);
+			cresult = server_install_prefetched(pf_cur, &channel_data);
+		} else
+			cresult = channel->get_file(channel, (void *)&channel_data);
 		if ((result = map_channel_retcode(cresult)) != SERVER_OK) {
 			/* this is called to collect errors */
 			ipc_wait_for_complete(server_update_status_callback);
@@ -1338,7 +1718,13 @@ server_op_res_t server_process_update_artifact(int action_id,
 		}
 
 #ifdef CONFIG_SURICATTA_SSL
-		if (strncmp((char *)&channel_data.sha1hash,
+		/*
+		 * A download resumed from a checkpoint has not hashed
+		 * the whole artifact. The installer only leaves checkpoints
+		 * if each file has a sha256, and verifies them instead.
+		 */
+		if (!from_prefetch && !channel_data.resumed &&
+		    strncmp((char *)&channel_data.sha1hash,
 			    artifact->sha1hash,
 			    SWUPDATE_SHA_DIGEST_LENGTH) != 0) {
 				ERROR(
@@ -1350,9 +1736,10 @@ server_op_res_t server_process_update_artifact(int action_id,
 			result = SERVER_EBADMSG;
 			goto cleanup_loop;
 		}
-		DEBUG("Downloaded artifact's checksum matches server's: "
-		      "'%s'.\n",
-		      channel_data.sha1hash);
+		if (!channel_data.resumed)
+			DEBUG("Downloaded artifact's checksum matches server's: "
+			      "'%s'.\n",
+			      channel_data.sha1hash);
 #endif
 
 		switch (ipc_wait_for_complete(server_update_status_callback)) {
@@ -1387,6 +1774,8 @@ server_op_res_t server_process_update_artifact(int action_id,
 			break;
 		}
 	}
+	prefetch_release(pf_cur);
+	prefetch_release(pf_next);
 cleanup:
 	/* Nothing installed ? Report that something was wrong */
 	if (!json_data_artifact_installed) {
@@ -1776,7 +2165,9 @@ static void server_print_help(void)
 	    "appended to every HTTP request being sent.\n"
 	    "\t  --identify <name> <value> Set custom device attributes for Suricatta.\n"
 	    "\t  -n, --max-download-speed <limit>  Set download speed limit.\n"
-	    "\t                                    Example: -n 100k; -n 1M; -n 100; -n 1G\n",
+	    "\t                                    Example: -n 100k; -n 1M; -n 100; -n 1G\n"
+	    "\t  --prefetch-size <size> Download the next artifact while the current one\n"
+	    "\t                         is installed, if not larger than <size> (default: off).\n",
 	    CHANNEL_DEFAULT_POLLING_INTERVAL, CHANNEL_DEFAULT_RESUME_TRIES,
 	    CHANNEL_DEFAULT_RESUME_DELAY,
 	    INITIAL_STATUS_REPORT_WAIT_DELAY);
@@ -1813,9 +2204,33 @@ static int server_hawkbit_settings(void *elem, void  __attribute__ ((__unused__)
 	GET_FIELD_BOOL(LIBCFG_PARSER, elem, "usetokentodwl",
 		&server_hawkbit.usetokentodwl);
 
+	GET_FIELD_BOOL(LIBCFG_PARSER, elem, "etag",
+		&server_hawkbit.use_etag);
+
+	GET_FIELD_INT(LIBCFG_PARSER, elem, "polling-jitter",
+		(int *)&server_hawkbit.polling_jitter);
+	if (server_hawkbit.polling_jitter > 100)
+		server_hawkbit.polling_jitter = 100;
+
+	GET_FIELD_INT(LIBCFG_PARSER, elem, "max-polling-backoff",
+		(int *)&server_hawkbit.max_polling_backoff);
+
 	GET_FIELD_INT(LIBCFG_PARSER, elem, "connection-timeout",
 		(int *)&channel_data_defaults.connection_timeout);
 
+	GET_FIELD_INT(LIBCFG_PARSER, elem, "feedback-interval",
+		(int *)&server_hawkbit.feedback_interval);
+
+	GET_FIELD_BOOL(LIBCFG_PARSER, elem, "feedback-gzip",
+		&channel_data_defaults.gzip_body);
+
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "prefetch-size", tmp);
+	if (strlen(tmp)) {
+		server_hawkbit.prefetch_size = ustrtoull(tmp, NULL, 10);
+		if (errno)
+			WARN("prefetch-size setting %s: ustrtoull failed", tmp);
+	}
+
 	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "targettoken", tmp);
 	if (strlen(tmp))
 		SETSTRING(server_hawkbit.targettoken, tmp);
@@ -1837,6 +2252,7 @@ static server_op_res_t server_start(const char *fname, int argc, char *argv[])
 	pthread_mutex_lock(&ipc_lock);
 	LIST_INIT(&server_hawkbit.configdata);
 	LIST_INIT(&server_hawkbit.httpheaders);
+	srandom(time(NULL) ^ getpid());
 
 	server_hawkbit.initial_report_resend_period = INITIAL_STATUS_REPORT_WAIT_DELAY;
 	if (fname) {
@@ -1990,6 +2406,14 @@ static server_op_res_t server_start(const char *fname, int argc, char *argv[])
 				return SERVER_EINIT;
 			}
 			break;
+		case '4':
+			server_hawkbit.prefetch_size = ustrtoull(optarg, NULL, 10);
+			if (errno) {
+				ERROR("prefetch-size %s: ustrtoull failed",
+				      optarg);
+				return SERVER_EINIT;
+			}
+			break;
 		/* Ignore not recognized options, they can be already parsed by the caller */
 		case '?':
 			break;
@@ -2079,6 +2503,11 @@ static server_op_res_t server_stop(void)
 {
 	(void)server_hawkbit.channel->close(server_hawkbit.channel);
 	free(server_hawkbit.channel);
+	if (server_hawkbit.device_info)
+		json_object_put(server_hawkbit.device_info);
+	server_hawkbit.device_info = NULL;
+	free(server_hawkbit.etag);
+	server_hawkbit.etag = NULL;
 	return SERVER_OK;
 }
 
@@ -2242,6 +2671,7 @@ static server_op_res_t server_configuration_ipc(ipc_message *msg)
 		if (polling > 0) {
 			server_hawkbit.polling_interval_from_server = false;
 			server_hawkbit.polling_interval = polling;
+			server_hawkbit.next_polling_interval = polling;
 		} else
 			server_hawkbit.polling_interval_from_server = true;
 	}
@@ -2266,10 +2696,16 @@ static server_op_res_t server_status_ipc(ipc_message *msg)
 	};
 
 	pthread_mutex_lock(&ipc_lock);
-	sprintf(msg->data.procmsg.buf,
-		"{\"server\":{\"status\":%d,\"time\":\"%s\"}}",
+	snprintf(msg->data.procmsg.buf, sizeof(msg->data.procmsg.buf),
+		"{\"server\":{\"status\":%d,\"time\":\"%s\"},"
+		"\"polling\":{\"interval\":%u,\"requests\":%llu,"
+		"\"not-modified\":%llu,\"bytes-saved\":%llu}}",
 		server_hawkbit.server_status,
-		swupdate_time_iso8601(&tv));
+		swupdate_time_iso8601(&tv),
+		server_get_polling_interval(),
+		server_hawkbit.polls,
+		server_hawkbit.polls_not_modified,
+		server_hawkbit.polls_bytes_saved);
 	msg->data.procmsg.len = strlen(msg->data.procmsg.buf);
 	pthread_mutex_unlock(&ipc_lock);
 
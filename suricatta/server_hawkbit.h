@@ -49,6 +49,24 @@ typedef struct {
 	unsigned int initial_report_resend_period;
 	int server_status;
 	time_t server_status_time;
+	/* conditional polling of the base resource */
+	bool use_etag;
+	char *etag;
+	json_object *device_info;
+	size_t device_info_size;
+	/* spread and back-off of the polling interval */
+	unsigned int polling_jitter;
+	unsigned int max_polling_backoff;
+	unsigned int next_polling_interval;
+	unsigned int failed_polls;
+	/* polling statistics */
+	unsigned long long polls;
+	unsigned long long polls_not_modified;
+	unsigned long long polls_bytes_saved;
+	/* window in seconds to coalesce feedback details, 0 disables it */
+	unsigned int feedback_interval;
+	/* maximum size of an artifact downloaded ahead, 0 disables it */
+	unsigned long long prefetch_size;
 } server_hawkbit_t;
 
 extern server_hawkbit_t server_hawkbit;
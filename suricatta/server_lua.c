@@ -14,6 +14,7 @@
 #include <pthread.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <time.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -133,6 +134,10 @@ struct msgq_data_t {
 	STAILQ_ENTRY(msgq_data_t) entries;
 };
 STAILQ_HEAD(messageq_head_t, msgq_data_t);
+struct lua_call_stats {
+	unsigned long calls;
+	unsigned long long ns;
+};
 typedef struct {
 	lua_State *L;
 	pthread_mutex_t *lua_lock;
@@ -142,9 +147,27 @@ typedef struct {
 	pthread_mutex_t *progress_msgq_lock;
 	bool drain_progress_msgq;
 	int lua_check_cancel_func;
+	/* Cancellation poller, see cancel_poller_thread() */
+	unsigned int cancel_check_interval;
+	pthread_t *thread_cancel_poller;
+	pthread_mutex_t cancel_lock;
+	pthread_cond_t cancel_cond;
+	bool cancel_poller_stop;
+	bool cancelled;
+	/* Time spent in Lua callbacks, protected by lua_lock */
+	struct lua_call_stats stats_check_cancel;
+	struct lua_call_stats stats_progress;
+	/* Output buffer for suricatta.download() */
 	int fdout;
+	char *outbuf;
+	size_t outbuf_len;
 } callback_data_t;
 
+/* Default interval in milliseconds between check_cancel Lua callbacks */
+#define CANCEL_CHECK_INTERVAL_MS 1000
+/* Size of the buffer collecting download chunks before write() */
+#define DOWNLOAD_BUFFER_SIZE (1024 * 1024)
+
 
 /**
  * @brief Push name=value to Lua Table on stack top.
@@ -456,6 +479,31 @@ static int call_lua_func(lua_State *L, function_t func, int numargs)
 }
 
 
+/**
+ * @brief Call a Lua function via call_lua_func(), accounting its runtime.
+ *
+ * @param  L        The Lua state.
+ * @param  func     The Lua function to call.
+ * @param  numargs  The number of arguments for the Lua function.
+ * @param  stats    Counters to account the call in.
+ * @return func's (int) return code, or, in case of error, -1.
+ */
+static int call_lua_func_timed(lua_State *L, function_t func, int numargs,
+			       struct lua_call_stats *stats)
+{
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int result = call_lua_func(L, func, numargs);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	stats->calls++;
+	stats->ns += (unsigned long long)(end.tv_sec - start.tv_sec) * 1000000000ULL +
+		     end.tv_nsec - start.tv_nsec;
+	return result;
+}
+
+
 /**
  * @brief Helper function properly mapping call_lua_func() to server_op_res_t.
  *
@@ -808,45 +856,151 @@ static int lua_suricatta_get_tmpdir(lua_State *L)
 
 
 /**
- * @brief Callback to check for (download) cancellation on server.
- *
- * Run the Lua equivalent of the dwlwrdata callback function
- * (see channel_data_t in include/channel_curl.h) to decide
- * on whether an installation should be cancelled while the
- * download phase.
- *
- * The Lua function must have been registered as with the
- * "regular" suricatta interface functions.
+ * @brief Run the Lua check_cancel callback, recording a cancellation.
  *
  * Note: The "original" suricatta Lua state is suspended here in the
  * call to suricatta.{install,download}(), so that it's safe to reuse
  * the Lua state here to check for cancellation, mutex'd with other Lua
  * callbacks.
  *
+ * @param  callback_data  Pointer to a callback_data_t structure.
+ */
+static void check_cancel(callback_data_t *callback_data)
+{
+	(void)pthread_mutex_lock(callback_data->lua_lock);
+	int result = call_lua_func_timed(callback_data->L,
+					 callback_data->lua_check_cancel_func, 0,
+					 &callback_data->stats_check_cancel);
+	(void)pthread_mutex_unlock(callback_data->lua_lock);
+	if (result == SERVER_UPDATE_CANCELED) {
+		__atomic_store_n(&callback_data->cancelled, true, __ATOMIC_RELEASE);
+	}
+}
+
+
+/**
+ * @brief Thread periodically checking for (download) cancellation on server.
+ *
+ * Runs the Lua check_cancel callback every cancel_check_interval
+ * milliseconds so that the download path only has to test the
+ * cancelled flag instead of entering Lua for each received chunk.
+ *
+ * @param  data  Pointer to a callback_data_t structure.
+ */
+static void *cancel_poller_thread(void *data)
+{
+	callback_data_t *thread_data = (callback_data_t *)data;
+	struct timespec deadline;
+	int ret = ETIMEDOUT;
+
+	(void)pthread_mutex_lock(&thread_data->cancel_lock);
+	while (!thread_data->cancel_poller_stop) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += thread_data->cancel_check_interval / 1000;
+		deadline.tv_nsec += (thread_data->cancel_check_interval % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (!thread_data->cancel_poller_stop) {
+			ret = pthread_cond_timedwait(&thread_data->cancel_cond,
+						     &thread_data->cancel_lock,
+						     &deadline);
+			/* 0 is a signal or a spurious wakeup, wait until the deadline */
+			if (ret != 0)
+				break;
+		}
+		if (thread_data->cancel_poller_stop)
+			break;
+		if (ret != ETIMEDOUT) {
+			ERROR("Cancellation poller wait failed: %s", strerror(ret));
+			break;
+		}
+
+		(void)pthread_mutex_unlock(&thread_data->cancel_lock);
+		check_cancel(thread_data);
+		(void)pthread_mutex_lock(&thread_data->cancel_lock);
+		if (__atomic_load_n(&thread_data->cancelled, __ATOMIC_ACQUIRE))
+			break;
+	}
+	(void)pthread_mutex_unlock(&thread_data->cancel_lock);
+	return NULL;
+}
+
+
+/**
+ * @brief Write out the buffered download data.
+ *
+ * @param  callback_data  Pointer to a callback_data_t structure.
+ * @return 0 on success, -1 on write error.
+ */
+static int flush_download_buffer(callback_data_t *callback_data)
+{
+	if (callback_data->outbuf_len == 0)
+		return 0;
+	if (copy_write(&callback_data->fdout, callback_data->outbuf,
+		       callback_data->outbuf_len) != 0) {
+		return -1;
+	}
+	callback_data->outbuf_len = 0;
+	return 0;
+}
+
+
+/**
+ * @brief Callback to check for (download) cancellation on server.
+ *
+ * Run as the dwlwrdata callback function (see channel_data_t in
+ * include/channel_curl.h) to decide on whether an installation should
+ * be cancelled while the download phase.
+ *
+ * The Lua check_cancel function must have been registered as with the
+ * "regular" suricatta interface functions. It is polled by
+ * cancel_poller_thread() so that only a flag is tested here; with a
+ * cancel_check_interval of 0, it is called for every chunk instead.
+ *
+ * For suricatta.download(), received data is collected in a buffer and
+ * written out in DOWNLOAD_BUFFER_SIZE blocks.
+ *
  * @return size * nmemb to continue downloading, != size * nmemb to cancel
  */
 static size_t check_cancel_callback(char *streamdata, size_t size, size_t nmemb, void *data)
 {
 	channel_data_t *channel_data = (channel_data_t *)data;
 	callback_data_t *callback_data = (callback_data_t *)channel_data->user;
+	size_t len = size * nmemb;
 
-	if (callback_data->lua_check_cancel_func != SURICATTA_FUNC_NULL) {
-		(void)pthread_mutex_lock(callback_data->lua_lock);
-		int result = call_lua_func(callback_data->L,
-					   callback_data->lua_check_cancel_func, 0);
-		(void)pthread_mutex_unlock(callback_data->lua_lock);
-		if (result == SERVER_UPDATE_CANCELED) {
-			return 0;
-		}
+	if (callback_data->lua_check_cancel_func != SURICATTA_FUNC_NULL &&
+	    callback_data->cancel_check_interval == 0) {
+		check_cancel(callback_data);
+	}
+	if (__atomic_load_n(&callback_data->cancelled, __ATOMIC_ACQUIRE)) {
+		return 0;
 	}
 
 	if (callback_data->fdout != -1) {
-		if (copy_write(&callback_data->fdout, streamdata, size * nmemb) != 0) {
+		if (!callback_data->outbuf) {
+			if (copy_write(&callback_data->fdout, streamdata, len) != 0) {
+				return 0;
+			}
+			return len;
+		}
+		if (callback_data->outbuf_len + len > DOWNLOAD_BUFFER_SIZE &&
+		    flush_download_buffer(callback_data) != 0) {
 			return 0;
 		}
+		if (len >= DOWNLOAD_BUFFER_SIZE) {
+			if (copy_write(&callback_data->fdout, streamdata, len) != 0) {
+				return 0;
+			}
+			return len;
+		}
+		memcpy(callback_data->outbuf + callback_data->outbuf_len,
+		       streamdata, len);
+		callback_data->outbuf_len += len;
 	}
 
-	return size * nmemb;
+	return len;
 }
 
 
@@ -932,7 +1086,9 @@ static void *progress_offloader_thread(void *data)
 			STAILQ_REMOVE_HEAD(&thread_data->progress_msgq, entries);
 			free(qitem);
 			(void)pthread_mutex_unlock(thread_data->progress_msgq_lock);
-			(void)call_lua_func(thread_data->L, SURICATTA_FUNC_CALLBACK_PROGRESS, 1);
+			(void)call_lua_func_timed(thread_data->L,
+						  SURICATTA_FUNC_CALLBACK_PROGRESS, 1,
+						  &thread_data->stats_progress);
 			(void)pthread_mutex_unlock(thread_data->lua_lock);
 			(void)pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
@@ -1031,6 +1187,27 @@ static void join_progress_threads(pthread_t *thread, const char *thread_name)
 }
 
 
+/**
+ * @brief Helper function to stop and join the cancellation poller thread.
+ *
+ * @param  callback_data  Pointer to a callback_data_t structure.
+ */
+static void stop_cancel_poller(callback_data_t *callback_data)
+{
+	if (!callback_data->thread_cancel_poller)
+		return;
+
+	(void)pthread_mutex_lock(&callback_data->cancel_lock);
+	callback_data->cancel_poller_stop = true;
+	(void)pthread_cond_signal(&callback_data->cancel_cond);
+	(void)pthread_mutex_unlock(&callback_data->cancel_lock);
+	if (pthread_join(*callback_data->thread_cancel_poller, NULL) != 0) {
+		ERROR("Thread join on cancel_poller thread failed!");
+	}
+	callback_data->thread_cancel_poller = NULL;
+}
+
+
 /**
  * @brief Installation helper doing the installation heavy lifting.
  *
@@ -1047,7 +1224,12 @@ static void join_progress_threads(pthread_t *thread, const char *thread_name)
 static void do_install(lua_State *L, int fdout)
 {
 	__attribute__((cleanup(channel_free_options))) channel_data_t channel_data = { 0 };
-	callback_data_t callback_data = { .L = L, .fdout = fdout };
+	callback_data_t callback_data = {
+		.L = L,
+		.fdout = fdout,
+		.cancel_check_interval = CANCEL_CHECK_INTERVAL_MS
+	};
+	bool cancel_sync_init = false;
 
 	lua_getfield(L, -1, "channel");
 	if (!lua_istable(L, -1) || (lua_getmetatable(L, -1) == 0)) {
@@ -1071,6 +1253,7 @@ static void do_install(lua_State *L, int fdout)
 	lua_pop(L, 3);
 	channel_set_options(L, &channel_data);
 	get_from_table(L, "drain_messages", callback_data.drain_progress_msgq);
+	get_from_table(L, "cancel_check_interval", callback_data.cancel_check_interval);
 	lua_pop(L, 1);
 
 	channel_data.noipc = fdout == -1 ? false : true;
@@ -1093,6 +1276,14 @@ static void do_install(lua_State *L, int fdout)
 		callback_data.lua_check_cancel_func = SURICATTA_FUNC_CALLBACK_CHECK_CANCEL;
 	}
 
+	/* Collect downloaded data into larger blocks before writing it out. */
+	if (fdout != -1) {
+		callback_data.outbuf = malloc(DOWNLOAD_BUFFER_SIZE);
+		if (!callback_data.outbuf) {
+			WARN("Cannot allocate download buffer, writing unbuffered.");
+		}
+	}
+
 	/* Setup progress message handling threads and Lua callback function. */
 	pthread_mutex_t _progress_msgq_lock;
 	pthread_t _thread_progress_collector;
@@ -1131,9 +1322,45 @@ static void do_install(lua_State *L, int fdout)
 	LIST_INIT(&received_headers);
 	channel_data.received_headers = &received_headers;
 
+	/*
+	 * Setup cancellation poller thread, if not checking on every chunk.
+	 * It is started last since it uses the Lua state: from here on, the
+	 * Lua state is only used with the Lua state lock held until the
+	 * poller is stopped.
+	 */
+	pthread_t _thread_cancel_poller;
+	if (callback_data.lua_check_cancel_func != SURICATTA_FUNC_NULL &&
+	    callback_data.cancel_check_interval > 0) {
+		pthread_condattr_t cattr;
+		if (pthread_mutex_init(&callback_data.cancel_lock, NULL) == 0) {
+			if (pthread_condattr_init(&cattr) == 0) {
+				if (pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC) == 0 &&
+				    pthread_cond_init(&callback_data.cancel_cond, &cattr) == 0) {
+					cancel_sync_init = true;
+				}
+				(void)pthread_condattr_destroy(&cattr);
+			}
+			if (!cancel_sync_init) {
+				(void)pthread_mutex_destroy(&callback_data.cancel_lock);
+			}
+		}
+		if (cancel_sync_init &&
+		    pthread_create(&_thread_cancel_poller, NULL,
+				   cancel_poller_thread, &callback_data) == 0) {
+			callback_data.thread_cancel_poller = &_thread_cancel_poller;
+		} else {
+			WARN("Cannot start cancellation poller thread, checking on every chunk.");
+			callback_data.cancel_check_interval = 0;
+		}
+	}
+
 	/* Perform the operation.... */
 	server_op_res_t result = map_channel_retcode(
 	    udc->channel->get_file(udc->channel, (void *)&channel_data));
+	stop_cancel_poller(&callback_data);
+	if (result == SERVER_OK && flush_download_buffer(&callback_data) != 0) {
+		result = SERVER_EERR;
+	}
 	RECOVERY_STATUS iresult = (RECOVERY_STATUS)ipc_wait_for_complete(
 	    ipc_wait_for_complete_cb);
 
@@ -1184,11 +1411,22 @@ static void do_install(lua_State *L, int fdout)
 
 	goto done;
 error:
+	stop_cancel_poller(&callback_data);
 	lua_pushnil(L);
 	lua_pushinteger(L, SERVER_EINIT);
 	lua_newtable(L);
 	lua_newtable(L);
 done:
+	if (cancel_sync_init) {
+		(void)pthread_cond_destroy(&callback_data.cancel_cond);
+		(void)pthread_mutex_destroy(&callback_data.cancel_lock);
+	}
+	free(callback_data.outbuf);
+	DEBUG("Lua callbacks: check_cancel %lu calls in %llu ms, progress %lu calls in %llu ms",
+	      callback_data.stats_check_cancel.calls,
+	      callback_data.stats_check_cancel.ns / 1000000ULL,
+	      callback_data.stats_progress.calls,
+	      callback_data.stats_progress.ns / 1000000ULL);
 	if (callback_data.progress_msgq_lock) {
 		if (pthread_mutex_destroy(callback_data.progress_msgq_lock) != 0) {
 			ERROR("Mutex deallocation for progress message queue failed!");
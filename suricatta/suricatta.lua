@@ -272,6 +272,7 @@ suricatta.channel = {
 --- @class suricatta.operation_channel
 --- @field channel          suricatta.open_channel           Channel table as returned by `suricatta.channel.open()`
 --- @field drain_messages   boolean  | nil                   Whether to flush all progress messages or only those while in-flight operation (default)
+--- @field cancel_check_interval number | nil              Milliseconds between calls of the `CHECK_CANCEL` callback function (default 1000), 0 to call it for every received chunk
 --- @field ∈                suricatta.channel.options | nil  Channel options to override for this operation
 
 --- Channel HTTP response table.
@@ -0,0 +1,658 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Benchmark of the copyfile() pipeline on synthetic SWUs.
+ *
+ * Every scenario generates a cpio archive (newc with CRC, as it is
+ * built for SWUpdate) and reads it back the way the installer does,
+ * each stage in its own process so that CPU time and peak RSS are
+ * those of the stage only:
+ *
+ *   verify   extract_cpio_header() and copyfile() skipping the data,
+ *            checking the cpio checksum and the sha256 of each image
+ *   install  the same with decryption, decompression and writing of
+ *            the images into BENCH_DIR or, when BENCH_DEVICE is set,
+ *            one after the other into that device (a loop device, a
+ *            spare partition)
+ *
+ * Environment:
+ *   BENCH_MB       payload of each scenario in MiB (default 64)
+ *   BENCH_DIR      directory for the archives and images (default /dev/shm)
+ *   BENCH_DEVICE   device the install stage writes to
+ *   BENCH_FILTER   run only the scenarios whose name contains it
+ *   BENCH_OUTPUT   append a JSON object per scenario and stage to it
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef CONFIG_GUNZIP
+#include <zlib.h>
+#endif
+#ifdef CONFIG_XZ
+#include <lzma.h>
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#if defined(CONFIG_ENCRYPTED_IMAGES) && defined(CONFIG_SSL_IMPL_OPENSSL)
+#define BENCH_ENCRYPTION
+#include <openssl/evp.h>
+#endif
+
+#include "generated/autoconf.h"
+#include "cpiohdr.h"
+#include "swupdate_crypto.h"
+#include "util.h"
+
+#define CHUNK		(64 * 1024)
+#define SMALL_FILE	(64 * 1024)
+
+/* Test key and IV, only used to encrypt the synthetic images */
+#define BENCH_AES_KEY "d6a0d2e6a5c6d8e0c1b0a6b5d1c0e9f8a7b6c5d4e3f2a1b0c9d8e7f6a5b4c3d2"
+#define BENCH_AES_IVT "0f1e2d3c4b5a69788796a5b4c3d2e1f0"
+
+struct compressor {
+	const char *name;
+	enum compression_type type;
+};
+
+static const struct compressor compressors[] = {
+	{ "none", COMPRESSED_FALSE },
+#ifdef CONFIG_GUNZIP
+	{ "zlib", COMPRESSED_ZLIB },
+#endif
+#ifdef CONFIG_XZ
+	{ "xz", COMPRESSED_XZ },
+#endif
+#ifdef CONFIG_ZSTD
+	{ "zstd", COMPRESSED_ZSTD },
+#endif
+};
+
+struct scenario {
+	char name[64];
+	const struct compressor *comp;
+	bool encrypted;
+	bool small;		/* many small files instead of a single one */
+	unsigned int files;
+	size_t file_size;
+	unsigned char (*hashes)[SHA256_HASH_LENGTH];
+	unsigned long long archive_size;
+};
+
+struct writer {
+	int fd;
+	const struct scenario *sc;
+	unsigned long long size;	/* bytes of the current entry */
+	uint32_t chksum;
+	void *dgst;
+#ifdef CONFIG_GUNZIP
+	z_stream z;
+#endif
+#ifdef CONFIG_XZ
+	lzma_stream xz;
+#endif
+#ifdef CONFIG_ZSTD
+	ZSTD_CStream *zstd;
+#endif
+#ifdef BENCH_ENCRYPTION
+	EVP_CIPHER_CTX *enc;
+	unsigned char crypt[CHUNK + 32];
+#endif
+	unsigned char in[CHUNK];
+	unsigned char out[CHUNK];
+};
+
+static const char *bench_dir;
+static const char *bench_device;
+static FILE *bench_json;
+
+/*
+ * Random and repeated halves of every 4 KiB block, so that the
+ * compressors have something to do without making it trivial
+ */
+static void fill_payload(unsigned char *buf, size_t len, uint32_t *seed)
+{
+	for (size_t i = 0; i < len; i++) {
+		if ((i & 4095) < 2048) {
+			*seed = *seed * 1103515245 + 12345;
+			buf[i] = *seed >> 16;
+		} else
+			buf[i] = "swupdate"[i & 7];
+	}
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Bytes as they are stored in the archive */
+static int emit(struct writer *w, const unsigned char *buf, size_t len)
+{
+	if (!len)
+		return 0;
+	w->chksum = cpio_checksum(buf, len, w->chksum);
+	if (w->dgst && swupdate_HASH_update(w->dgst, buf, len))
+		return -EFAULT;
+	w->size += len;
+
+	return write_all(w->fd, buf, len);
+}
+
+/* Compressed bytes, encrypted if the scenario asks for it */
+static int sink(struct writer *w, const unsigned char *buf, size_t len, bool last)
+{
+#ifdef BENCH_ENCRYPTION
+	if (w->sc->encrypted) {
+		int outlen = 0;
+		int ret;
+
+		if (len && !EVP_EncryptUpdate(w->enc, w->crypt, &outlen, buf, len))
+			return -EFAULT;
+		ret = emit(w, w->crypt, outlen);
+		if (ret || !last)
+			return ret;
+		if (!EVP_EncryptFinal_ex(w->enc, w->crypt, &outlen))
+			return -EFAULT;
+		return emit(w, w->crypt, outlen);
+	}
+#else
+	(void)last;
+#endif
+	return emit(w, buf, len);
+}
+
+static int compress_start(struct writer *w)
+{
+	switch (w->sc->comp->type) {
+#ifdef CONFIG_GUNZIP
+	case COMPRESSED_ZLIB:
+		memset(&w->z, 0, sizeof(w->z));
+		/* gzip header, as expected by copyfile() */
+		if (deflateInit2(&w->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+				 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return -EFAULT;
+		break;
+#endif
+#ifdef CONFIG_XZ
+	case COMPRESSED_XZ: {
+		lzma_stream init = LZMA_STREAM_INIT;
+
+		w->xz = init;
+#if LZMA_VERSION >= UINT32_C(50040002)
+		/* independent blocks as xz -T0, they can be decoded in parallel */
+		lzma_mt mt = {
+			.threads = lzma_cputhreads() ? lzma_cputhreads() : 1,
+			.preset = 1,
+			.check = LZMA_CHECK_CRC32,
+		};
+
+		if (lzma_stream_encoder_mt(&w->xz, &mt) != LZMA_OK)
+			return -EFAULT;
+#else
+		if (lzma_easy_encoder(&w->xz, 1, LZMA_CHECK_CRC32) != LZMA_OK)
+			return -EFAULT;
+#endif
+		break;
+	}
+#endif
+#ifdef CONFIG_ZSTD
+	case COMPRESSED_ZSTD:
+		w->zstd = ZSTD_createCStream();
+		if (!w->zstd)
+			return -ENOMEM;
+		ZSTD_CCtx_setParameter(w->zstd, ZSTD_c_compressionLevel, 3);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static int compress_data(struct writer *w, const unsigned char *buf, size_t len, bool last)
+{
+	int ret;
+
+	switch (w->sc->comp->type) {
+#ifdef CONFIG_GUNZIP
+	case COMPRESSED_ZLIB:
+		w->z.next_in = (unsigned char *)buf;
+		w->z.avail_in = len;
+		do {
+			w->z.next_out = w->out;
+			w->z.avail_out = sizeof(w->out);
+			ret = deflate(&w->z, last ? Z_FINISH : Z_NO_FLUSH);
+			if (ret == Z_STREAM_ERROR)
+				return -EFAULT;
+			ret = sink(w, w->out, sizeof(w->out) - w->z.avail_out, false);
+			if (ret)
+				return ret;
+		} while (w->z.avail_out == 0);
+		if (last)
+			deflateEnd(&w->z);
+		break;
+#endif
+#ifdef CONFIG_XZ
+	case COMPRESSED_XZ: {
+		lzma_ret lret;
+
+		w->xz.next_in = buf;
+		w->xz.avail_in = len;
+		do {
+			w->xz.next_out = w->out;
+			w->xz.avail_out = sizeof(w->out);
+			lret = lzma_code(&w->xz, last ? LZMA_FINISH : LZMA_RUN);
+			if (lret != LZMA_OK && lret != LZMA_STREAM_END)
+				return -EFAULT;
+			ret = sink(w, w->out, sizeof(w->out) - w->xz.avail_out, false);
+			if (ret)
+				return ret;
+		} while (w->xz.avail_out == 0 || (last && lret != LZMA_STREAM_END));
+		if (last)
+			lzma_end(&w->xz);
+		break;
+	}
+#endif
+#ifdef CONFIG_ZSTD
+	case COMPRESSED_ZSTD: {
+		ZSTD_inBuffer in = { buf, len, 0 };
+		size_t remaining;
+
+		do {
+			ZSTD_outBuffer out = { w->out, sizeof(w->out), 0 };
+
+			remaining = ZSTD_compressStream2(w->zstd, &out, &in,
+							 last ? ZSTD_e_end : ZSTD_e_continue);
+			if (ZSTD_isError(remaining))
+				return -EFAULT;
+			ret = sink(w, w->out, out.pos, false);
+			if (ret)
+				return ret;
+		} while (last ? remaining != 0 : in.pos < in.size);
+		if (last)
+			ZSTD_freeCStream(w->zstd);
+		break;
+	}
+#endif
+	default:
+		return sink(w, buf, len, last);
+	}
+
+	return last ? sink(w, NULL, 0, true) : 0;
+}
+
+/* Header and name, padded to 4 bytes */
+static size_t cpio_header(char *buf, size_t size, unsigned int ino,
+			  const char *name, unsigned long filesize, uint32_t chksum)
+{
+	size_t namesize = strlen(name) + 1;
+	size_t len = sizeof(struct new_ascii_header) + namesize;
+
+	memset(buf, 0, size);
+	snprintf(buf, size, "070702%08x%08x%08x%08x%08x%08x%08lx%08x%08x%08x%08x%08x%08x%s",
+		 ino, 0100644, 0, 0, 1, 0, filesize, 0, 0, 0, 0,
+		 (unsigned int)namesize, chksum, name);
+
+	return len + NPAD_BYTES(len);
+}
+
+static int write_entry(struct writer *w, unsigned int ino, const char *name,
+		       uint32_t *seed, unsigned char *hash)
+{
+	char header[sizeof(struct new_ascii_header) + MAX_IMAGE_FNAME + 4];
+	static const unsigned char zeroes[4];
+	size_t hlen, left = w->sc->file_size;
+	off_t start;
+	unsigned int md_len;
+	int ret;
+
+	start = lseek(w->fd, 0, SEEK_CUR);
+	hlen = cpio_header(header, sizeof(header), ino, name, 0, 0);
+	/* placeholder, rewritten once size and checksum are known */
+	ret = write_all(w->fd, header, hlen);
+	if (ret)
+		return ret;
+
+	w->size = 0;
+	w->chksum = 0;
+	w->dgst = NULL;
+#ifdef CONFIG_HASH_VERIFY
+	w->dgst = swupdate_HASH_init(SHA_DEFAULT);
+	if (!w->dgst)
+		return -EFAULT;
+#endif
+#ifdef BENCH_ENCRYPTION
+	if (w->sc->encrypted) {
+		unsigned char key[AES_256_KEY_LEN], ivt[AES_BLK_SIZE];
+
+		if (ascii_to_bin(key, sizeof(key), BENCH_AES_KEY) ||
+		    ascii_to_bin(ivt, sizeof(ivt), BENCH_AES_IVT) ||
+		    !EVP_EncryptInit_ex(w->enc, EVP_aes_256_cbc(), NULL, key, ivt))
+			return -EFAULT;
+	}
+#endif
+	ret = compress_start(w);
+	if (ret)
+		return ret;
+
+	do {
+		size_t n = min_t(size_t, left, sizeof(w->in));
+
+		fill_payload(w->in, n, seed);
+		left -= n;
+		ret = compress_data(w, w->in, n, left == 0);
+		if (ret)
+			return ret;
+	} while (left);
+
+	if (w->dgst) {
+		ret = swupdate_HASH_final(w->dgst, hash, &md_len);
+		swupdate_HASH_cleanup(w->dgst);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = write_all(w->fd, zeroes, NPAD_BYTES(w->size));
+	if (ret)
+		return ret;
+
+	cpio_header(header, sizeof(header), ino, name, w->size, w->chksum);
+	if (pwrite(w->fd, header, hlen, start) != (ssize_t)hlen)
+		return -EIO;
+
+	return 0;
+}
+
+static int generate(struct scenario *sc, const char *archive)
+{
+	char header[sizeof(struct new_ascii_header) + MAX_IMAGE_FNAME + 4];
+	struct writer *w;
+	uint32_t seed = 1;
+	char name[32];
+	size_t hlen;
+	int ret = 0;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+	w->sc = sc;
+	w->fd = open(archive, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (w->fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+#ifdef BENCH_ENCRYPTION
+	w->enc = EVP_CIPHER_CTX_new();
+	if (!w->enc) {
+		ret = -ENOMEM;
+		goto out;
+	}
+#endif
+
+	for (unsigned int i = 0; i < sc->files; i++) {
+		snprintf(name, sizeof(name), "image-%05u", i);
+		ret = write_entry(w, i + 1, name, &seed, sc->hashes[i]);
+		if (ret)
+			goto out;
+	}
+	hlen = cpio_header(header, sizeof(header), 0, "TRAILER!!!", 0, 0);
+	ret = write_all(w->fd, header, hlen);
+	sc->archive_size = lseek(w->fd, 0, SEEK_CUR);
+
+out:
+#ifdef BENCH_ENCRYPTION
+	EVP_CIPHER_CTX_free(w->enc);
+#endif
+	if (w->fd >= 0)
+		close(w->fd);
+	free(w);
+
+	return ret;
+}
+
+/* Runs in the child process of a stage, the exit code is the result */
+static int run_stage(const struct scenario *sc, const char *archive, bool install)
+{
+	char path[PATH_MAX];
+	struct filehdr fdh;
+	unsigned long offset = 0;
+	int fd, devfd = -1;
+	int ret = 0;
+
+	fd = open(archive, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	if (install && bench_device) {
+		devfd = open(bench_device, O_WRONLY);
+		if (devfd < 0) {
+			ERROR("%s cannot be opened: %s", bench_device, strerror(errno));
+			return 1;
+		}
+	}
+
+	for (unsigned int i = 0; i < sc->files && !ret; i++) {
+		uint32_t checksum;
+		int out = devfd;
+
+		if (extract_cpio_header(fd, &fdh, &offset))
+			return 1;
+
+		if (install && devfd < 0) {
+			snprintf(path, sizeof(path), "%s/%s", bench_dir, fdh.filename);
+			out = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+			if (out < 0)
+				return 1;
+		}
+
+		struct swupdate_copy copy = {
+			.fdin = fd,
+			.out = &out,
+			.nbytes = fdh.size,
+			.offs = &offset,
+			.skip_file = !install,
+			.compressed = sc->comp->type,
+			.checksum = &checksum,
+#ifdef CONFIG_HASH_VERIFY
+			.hash = sc->hashes[i],
+#endif
+			.encrypted = sc->encrypted,
+			.imgaes = BENCH_AES_KEY,
+			.imgivt = BENCH_AES_IVT,
+			.cipher = AES_CBC_256,
+		};
+		ret = copyfile(&copy);
+		if (!ret && !swupdate_verify_chksum(checksum, &fdh))
+			ret = -EINVAL;
+
+		if (out >= 0 && out != devfd) {
+			if (fsync(out))
+				ret = -errno;
+			close(out);
+		}
+	}
+
+	if (devfd >= 0) {
+		if (fsync(devfd))
+			ret = -errno;
+		close(devfd);
+	}
+	close(fd);
+
+	return ret ? 1 : 0;
+}
+
+static double timeval_secs(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static int bench_stage(const struct scenario *sc, const char *archive, bool install)
+{
+	const char *stage = install ? "install" : "verify";
+	double payload = (double)sc->files * sc->file_size / (1024 * 1024);
+	struct timespec start, end;
+	struct rusage ru;
+	double secs;
+	int status;
+	pid_t pid;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+	if (pid == 0)
+		_exit(run_stage(sc, archive, install));
+	if (wait4(pid, &status, 0, &ru) != pid)
+		return -errno;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "%s %s: FAILED\n", sc->name, stage);
+		return -EFAULT;
+	}
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-24s %-8s %7.1f MiB %8.3f s %9.1f MiB/s  cpu %.3f user %.3f sys  rss %ld KiB\n",
+	       sc->name, stage, payload, secs, secs > 0 ? payload / secs : 0,
+	       timeval_secs(&ru.ru_utime), timeval_secs(&ru.ru_stime), ru.ru_maxrss);
+
+	if (bench_json) {
+		fprintf(bench_json,
+			"{\"scenario\":\"%s\",\"stage\":\"%s\",\"compression\":\"%s\","
+			"\"encrypted\":%s,\"files\":%u,\"payload_bytes\":%llu,"
+			"\"archive_bytes\":%llu,\"target\":\"%s\",\"seconds\":%.6f,"
+			"\"mib_per_s\":%.3f,\"cpu_user_s\":%.6f,\"cpu_sys_s\":%.6f,"
+			"\"peak_rss_kib\":%ld,\"cpio_checksum\":\"%s\"}\n",
+			sc->name, stage, sc->comp->name,
+			sc->encrypted ? "true" : "false", sc->files,
+			(unsigned long long)sc->files * sc->file_size,
+			sc->archive_size,
+			install ? (bench_device ? bench_device : bench_dir) : "",
+			secs, secs > 0 ? payload / secs : 0,
+			timeval_secs(&ru.ru_utime), timeval_secs(&ru.ru_stime),
+			ru.ru_maxrss, cpio_checksum_impl());
+		fflush(bench_json);
+	}
+
+	return 0;
+}
+
+static int bench_scenario(struct scenario *sc)
+{
+	char archive[PATH_MAX], path[PATH_MAX];
+	int ret;
+
+	sc->hashes = calloc(sc->files, sizeof(*sc->hashes));
+	if (!sc->hashes)
+		return -ENOMEM;
+
+	snprintf(archive, sizeof(archive), "%s/%s.swu", bench_dir, sc->name);
+	ret = generate(sc, archive);
+	if (ret) {
+		fprintf(stderr, "%s: archive cannot be generated (%d)\n", sc->name, ret);
+		goto out;
+	}
+
+	ret = bench_stage(sc, archive, false);
+	if (!ret)
+		ret = bench_stage(sc, archive, true);
+
+	if (!bench_device) {
+		for (unsigned int i = 0; i < sc->files; i++) {
+			snprintf(path, sizeof(path), "%s/image-%05u", bench_dir, i);
+			unlink(path);
+		}
+	}
+	unlink(archive);
+
+out:
+	free(sc->hashes);
+	sc->hashes = NULL;
+
+	return ret;
+}
+
+int main(void)
+{
+	const char *env = getenv("BENCH_MB");
+	const char *filter = getenv("BENCH_FILTER");
+	const char *output = getenv("BENCH_OUTPUT");
+	size_t total = (env ? strtoull(env, NULL, 10) : 64) * 1024 * 1024;
+	int failed = 0;
+
+	bench_dir = getenv("BENCH_DIR") ? getenv("BENCH_DIR") : "/dev/shm";
+	bench_device = getenv("BENCH_DEVICE");
+	if (!total || total > UINT32_MAX) {
+		fprintf(stderr, "BENCH_MB must be between 1 and 4095\n");
+		return 1;
+	}
+	if (output) {
+		bench_json = fopen(output, "a");
+		if (!bench_json) {
+			fprintf(stderr, "%s: %s\n", output, strerror(errno));
+			return 1;
+		}
+	}
+
+	for (int small = 0; small <= 1; small++) {
+		for (unsigned int c = 0; c < ARRAY_SIZE(compressors); c++) {
+			for (int encrypted = 0; encrypted <= 1; encrypted++) {
+				struct scenario sc = {
+					.comp = &compressors[c],
+					.encrypted = encrypted,
+					.small = small,
+					.files = small ? total / SMALL_FILE : 1,
+					.file_size = small ? SMALL_FILE : total,
+				};
+
+#ifndef BENCH_ENCRYPTION
+				if (encrypted)
+					continue;
+#endif
+				if (!sc.files)
+					continue;
+				snprintf(sc.name, sizeof(sc.name), "%s-%s%s",
+					 small ? "small" : "large", sc.comp->name,
+					 encrypted ? "-aes" : "");
+				if (filter && !strstr(sc.name, filter))
+					continue;
+				if (bench_scenario(&sc))
+					failed++;
+			}
+		}
+	}
+
+	if (bench_json)
+		fclose(bench_json);
+
+	return failed;
+}
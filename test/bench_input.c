@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Throughput of the byte-wise stages in front of copyfile(): the cpio
+ * checksum, scalar and selected implementation, and the multipart
+ * parser of the webserver and the chunked downloads, fed with parts of
+ * 1 MiB of random data.
+ *
+ * Environment:
+ *   BENCH_MB       data run through each stage in MiB (default 256)
+ *   BENCH_FILTER   run only the stages whose name contains it
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpiohdr.h"
+#include "multipart_parser.h"
+
+#define BUF_SIZE	(1024 * 1024)
+#define CHUNK		(16 * 1024)
+#define BOUNDARY	"--3d6b6a416f9b5"
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double rate(unsigned long long mb, double secs)
+{
+	return secs > 0 ? mb / secs : 0;
+}
+
+static uint32_t checksum_run(uint32_t (*fn)(const unsigned char *, size_t, uint32_t),
+			     const unsigned char *buf, unsigned long long mb,
+			     double *secs)
+{
+	struct timespec start;
+	uint32_t sum = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long long i = 0; i < mb; i++)
+		sum = fn(buf, BUF_SIZE, sum);
+	*secs = elapsed(&start);
+
+	return sum;
+}
+
+static int bench_checksum(const unsigned char *buf, unsigned long long mb)
+{
+	uint32_t scalar_sum, vector_sum;
+	double scalar, vector;
+
+	scalar_sum = checksum_run(cpio_checksum_scalar, buf, mb, &scalar);
+	vector_sum = checksum_run(cpio_checksum, buf, mb, &vector);
+	if (scalar_sum != vector_sum) {
+		fprintf(stderr, "checksum: %s differs from scalar\n",
+			cpio_checksum_impl());
+		return 1;
+	}
+
+	printf("checksum: scalar %.1f MiB/s, %s %.1f MiB/s (x%.1f)\n",
+	       rate(mb, scalar), cpio_checksum_impl(), rate(mb, vector),
+	       vector > 0 ? scalar / vector : 0);
+
+	return 0;
+}
+
+struct multipart_count {
+	unsigned long long parts;
+	unsigned long long bytes;
+	unsigned long long callbacks;
+};
+
+static int on_part_data_begin(multipart_parser *p)
+{
+	struct multipart_count *c = multipart_parser_get_data(p);
+
+	c->parts++;
+	return 0;
+}
+
+static int on_part_data(multipart_parser *p, const char *at, size_t length)
+{
+	struct multipart_count *c = multipart_parser_get_data(p);
+
+	(void)at;
+	c->callbacks++;
+	c->bytes += length;
+	return 0;
+}
+
+static const multipart_parser_settings callbacks = {
+	.on_part_data = on_part_data,
+	.on_part_data_begin = on_part_data_begin,
+};
+
+static int bench_multipart(const unsigned char *data, unsigned long long mb)
+{
+	struct multipart_count c = { 0 };
+	struct timespec start;
+	char header[128];
+	char *buf;
+	size_t hlen, blen;
+	double secs;
+	multipart_parser *p;
+
+	buf = malloc(BUF_SIZE + 2 * sizeof(header));
+	p = multipart_parser_init(BOUNDARY, &callbacks);
+	if (!buf || !p) {
+		fprintf(stderr, "multipart: out of memory\n");
+		free(buf);
+		return 1;
+	}
+	multipart_parser_set_data(p, &c);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long long part = 0; part < mb; part++) {
+		hlen = snprintf(header, sizeof(header),
+				"%s\r\nContent-Range: bytes %llu-%llu/*\r\n\r\n",
+				BOUNDARY, part * BUF_SIZE,
+				(part + 1) * BUF_SIZE - 1);
+		memcpy(buf, header, hlen);
+		memcpy(buf + hlen, data, BUF_SIZE);
+		blen = hlen + BUF_SIZE;
+		memcpy(buf + blen, "\r\n", 2);
+		blen += 2;
+		if (part == mb - 1)
+			blen += snprintf(buf + blen, sizeof(header), "%s--\r\n", BOUNDARY);
+
+		for (size_t off = 0; off < blen; off += CHUNK) {
+			size_t n = blen - off < CHUNK ? blen - off : CHUNK;
+
+			if (multipart_parser_execute(p, buf + off, n) != n)
+				break;
+		}
+	}
+	secs = elapsed(&start);
+	multipart_parser_free(p);
+	free(buf);
+
+	if (c.parts != mb || c.bytes != mb * BUF_SIZE) {
+		fprintf(stderr, "multipart: %llu parts, %llu bytes parsed\n",
+			c.parts, c.bytes);
+		return 1;
+	}
+
+	printf("multipart: %llu MiB in %.3f s (%.1f MiB/s, %llu callbacks)\n",
+	       mb, secs, rate(mb, secs), c.callbacks);
+
+	return 0;
+}
+
+int main(void)
+{
+	const char *env = getenv("BENCH_MB");
+	const char *filter = getenv("BENCH_FILTER");
+	unsigned long long mb = env ? strtoull(env, NULL, 10) : 256;
+	unsigned char *buf;
+	uint32_t seed = 1;
+	int failed = 0;
+
+	if (!mb) {
+		fprintf(stderr, "BENCH_MB must be at least 1\n");
+		return 1;
+	}
+	buf = malloc(BUF_SIZE);
+	if (!buf)
+		return 1;
+	for (size_t i = 0; i < BUF_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	if (!filter || strstr("checksum", filter))
+		failed |= bench_checksum(buf, mb);
+	if (!filter || strstr("multipart", filter))
+		failed |= bench_multipart(buf, mb);
+
+	free(buf);
+
+	return failed;
+}
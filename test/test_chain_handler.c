@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <cmocka.h>
+#include "swupdate.h"
+#include "handler.h"
+#include "handler_helpers.h"
+#include "metrics.h"
+#include "util.h"
+
+#define DATA_SIZE	(1024 * 1024 + 123)	/* more than a pipe and a ring */
+#define CHUNK		(16 * 1024)
+
+static unsigned char data[DATA_SIZE];
+static unsigned char received[DATA_SIZE];
+static size_t received_len;
+
+static int buffer_write(void *out, const void *buf, size_t len)
+{
+	(void)out;
+	if (received_len + len > sizeof(received))
+		return -1;
+	memcpy(received + received_len, buf, len);
+	received_len += len;
+
+	return 0;
+}
+
+static int copy_installer(struct img_type *img, void *hnd_data)
+{
+	(void)hnd_data;
+	return copyimage(NULL, img, buffer_write);
+}
+
+/* as the flash-hamming1 handler, reads the stream without copyimage() */
+static int fdin_installer(struct img_type *img, void *hnd_data)
+{
+	unsigned char buf[4096];
+	ssize_t n;
+
+	(void)hnd_data;
+	while ((n = read(img->fdin, buf, sizeof(buf))) > 0) {
+		if (buffer_write(NULL, buf, n))
+			return -1;
+	}
+
+	return n < 0 ? -1 : 0;
+}
+
+static void chain(const char *type, bool ring)
+{
+	struct chain_handler_data priv;
+	pthread_t thread;
+	void *ret;
+
+	memset(&priv, 0, sizeof(priv));
+	strlcpy(priv.img.type, type, sizeof(priv.img.type));
+	strlcpy(priv.img.fname, "chained", sizeof(priv.img.fname));
+	priv.img.size = DATA_SIZE;
+	received_len = 0;
+
+	assert_int_equal(chain_handler_open(&priv), 0);
+	assert_int_equal(priv.img.ring != NULL, ring);
+	assert_int_equal(priv.img.fdin >= 0, !ring);
+
+	assert_int_equal(pthread_create(&thread, NULL, chain_handler_thread, &priv), 0);
+	for (size_t off = 0; off < DATA_SIZE; off += CHUNK) {
+		size_t n = DATA_SIZE - off < CHUNK ? DATA_SIZE - off : CHUNK;
+
+		assert_int_equal(chain_handler_write(&priv, data + off, n), 0);
+	}
+	chain_handler_close(&priv);
+	pthread_join(thread, &ret);
+	chain_handler_cleanup(&priv);
+
+	assert_null(ret);
+	assert_int_equal(received_len, DATA_SIZE);
+	assert_memory_equal(received, data, DATA_SIZE);
+}
+
+static void test_chain_copyimage(void **state)
+{
+	(void)state;
+	chain("test-copyimage", true);
+}
+
+static void test_chain_fdin(void **state)
+{
+	(void)state;
+	chain("test-fdin", false);
+}
+
+static int setup(void **state)
+{
+	uint32_t seed = 1;
+
+	(void)state;
+	for (size_t i = 0; i < sizeof(data); i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed >> 16;
+	}
+	get_swupdate_cfg()->chain_buffer_size = 64 * 1024;
+	if (register_handler("test-copyimage", copy_installer, IMAGE_HANDLER, NULL) ||
+	    register_fdin_handler("test-fdin", fdin_installer, IMAGE_HANDLER, NULL))
+		return -1;
+
+	return metrics_init();
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest chain_tests[] = {
+	    cmocka_unit_test(test_chain_copyimage),
+	    cmocka_unit_test(test_chain_fdin)
+	};
+	error_count += cmocka_run_group_tests_name("chain_handler", chain_tests,
+						   setup, NULL);
+	return error_count;
+}
@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include "cpiohdr.h"
+
+static unsigned char *random_buf(size_t len)
+{
+	unsigned char *buf = malloc(len);
+	uint32_t seed = 1;
+
+	assert_non_null(buf);
+	for (size_t i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	return buf;
+}
+
+static void test_cpio_checksum_equal(void **state)
+{
+	(void)state;
+	const size_t size = 4096;
+	unsigned char *buf = random_buf(size + 64);
+
+	/* Every misalignment and every tail length of the vector loops */
+	for (size_t off = 0; off < 64; off++) {
+		for (size_t len = 0; len <= 256; len++)
+			assert_int_equal(cpio_checksum(buf + off, len, off),
+					 cpio_checksum_scalar(buf + off, len, off));
+		assert_int_equal(cpio_checksum(buf + off, size, 0),
+				 cpio_checksum_scalar(buf + off, size, 0));
+	}
+
+	/* All 0xff: lanes wrap the same way as the 32 bit sum */
+	memset(buf, 0xff, size);
+	assert_int_equal(cpio_checksum(buf, size, 0xfffffff0),
+			 cpio_checksum_scalar(buf, size, 0xfffffff0));
+	free(buf);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest checksum_tests[] = {
+	    cmocka_unit_test(test_cpio_checksum_equal)
+	};
+	error_count += cmocka_run_group_tests_name("cpio_checksum",
+						   checksum_tests, NULL, NULL);
+	return error_count;
+}
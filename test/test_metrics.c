@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <cmocka.h>
+#include "metrics.h"
+
+#define THREADS	40	/* more than the slots, some share one */
+#define ADDS	100000
+
+static unsigned long long counter(const char *json, const char *name)
+{
+	char key[64];
+	const char *p;
+
+	snprintf(key, sizeof(key), "\"%s\":", name);
+	p = strstr(json, key);
+	assert_non_null(p);
+
+	return strtoull(p + strlen(key), NULL, 10);
+}
+
+static void *adder(void *data)
+{
+	(void)data;
+	for (int i = 0; i < ADDS; i++)
+		metrics_add(METRIC_DOWNLOAD_BYTES, 1);
+
+	return NULL;
+}
+
+static void test_metrics_threads(void **state)
+{
+	(void)state;
+	pthread_t threads[THREADS];
+	char *json;
+
+	/* values of threads that have exited are kept */
+	for (int i = 0; i < THREADS; i++)
+		assert_int_equal(pthread_create(&threads[i], NULL, adder, NULL), 0);
+	for (int i = 0; i < THREADS; i++)
+		pthread_join(threads[i], NULL);
+	metrics_add(METRIC_DOWNLOAD_BYTES, 1);
+
+	json = metrics_dump_json();
+	assert_non_null(json);
+	assert_true(counter(json, "download.bytes") == THREADS * ADDS + 1ULL);
+	free(json);
+}
+
+static void test_metrics_subprocess(void **state)
+{
+	(void)state;
+	unsigned long long before;
+	int status;
+	char *json;
+	pid_t pid;
+
+	json = metrics_dump_json();
+	before = counter(json, "installer.images_installed");
+	free(json);
+
+	pid = fork();
+	assert_true(pid >= 0);
+	if (pid == 0) {
+		metrics_add(METRIC_IMAGES_INSTALLED, 3);
+		_exit(0);
+	}
+	metrics_add(METRIC_IMAGES_INSTALLED, 2);
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+
+	json = metrics_dump_json();
+	assert_true(counter(json, "installer.images_installed") == before + 5);
+	free(json);
+}
+
+static void test_metrics_histogram(void **state)
+{
+	(void)state;
+	char *json, *h;
+
+	metrics_observe(METRIC_FSYNC_US, 0);
+	metrics_observe(METRIC_FSYNC_US, 5);
+	metrics_observe(METRIC_FSYNC_US, 7);
+	metrics_observe(METRIC_FSYNC_US, 8);
+
+	json = metrics_dump_json();
+	h = strstr(json, "\"handler.fsync_us\":");
+	assert_non_null(h);
+	assert_true(counter(h, "count") == 4);
+	assert_true(counter(h, "sum") == 20);
+	/* [0, 1), [4, 8) and [8, 16) */
+	assert_true(counter(h, "1") == 1);
+	assert_true(counter(h, "8") == 2);
+	assert_true(counter(h, "16") == 1);
+	free(json);
+}
+
+static int setup(void **state)
+{
+	(void)state;
+	return metrics_init();
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest metrics_tests[] = {
+	    cmocka_unit_test(test_metrics_threads),
+	    cmocka_unit_test(test_metrics_subprocess),
+	    cmocka_unit_test(test_metrics_histogram)
+	};
+	error_count += cmocka_run_group_tests_name("metrics", metrics_tests,
+						   setup, NULL);
+	return error_count;
+}
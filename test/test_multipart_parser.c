@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include "multipart_parser.h"
+
+#define BOUNDARY "--3d6b6a416f9b5"
+#define MAX_PARTS 8
+
+struct collected {
+	char *data[MAX_PARTS];
+	size_t len[MAX_PARTS];
+	size_t size[MAX_PARTS];
+	int parts;
+	int ended;
+};
+
+static int on_part_data_begin(multipart_parser *p)
+{
+	struct collected *c = multipart_parser_get_data(p);
+
+	assert_true(c->parts < MAX_PARTS);
+	c->parts++;
+	return 0;
+}
+
+static int on_part_data(multipart_parser *p, const char *at, size_t length)
+{
+	struct collected *c = multipart_parser_get_data(p);
+	int n = c->parts - 1;
+
+	if (c->len[n] + length > c->size[n]) {
+		c->size[n] = (c->len[n] + length) * 2;
+		c->data[n] = realloc(c->data[n], c->size[n]);
+		assert_non_null(c->data[n]);
+	}
+	memcpy(c->data[n] + c->len[n], at, length);
+	c->len[n] += length;
+	return 0;
+}
+
+static int on_body_end(multipart_parser *p)
+{
+	struct collected *c = multipart_parser_get_data(p);
+
+	c->ended = 1;
+	return 0;
+}
+
+static const multipart_parser_settings callbacks = {
+	.on_part_data = on_part_data,
+	.on_part_data_begin = on_part_data_begin,
+	.on_body_end = on_body_end,
+};
+
+/* Part contents with CRs, CRLFs and partial delimiters in the data */
+static const char *parts[] = {
+	"plain data",
+	"\r\r\n\r\n-\r\n--\r\n--3d6b6a\r\n--3d6b6a416f9b\r",
+	"",
+	"\r\n",
+};
+
+static char *build_body(size_t *len)
+{
+	size_t size = 4096, pos = 0;
+	char *body = malloc(size);
+
+	assert_non_null(body);
+	for (unsigned int i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+		pos += snprintf(body + pos, size - pos,
+				"%s\r\nContent-Range: bytes %u-%u/100\r\n\r\n",
+				BOUNDARY, i, i);
+		memcpy(body + pos, parts[i], strlen(parts[i]));
+		pos += strlen(parts[i]);
+		pos += snprintf(body + pos, size - pos, "\r\n");
+	}
+	pos += snprintf(body + pos, size - pos, "%s--\r\n", BOUNDARY);
+	*len = pos;
+
+	return body;
+}
+
+static void test_multipart_parser_chunks(void **state)
+{
+	(void)state;
+	size_t len;
+	char *body = build_body(&len);
+
+	/* Every chunk size, so that delimiters get split everywhere */
+	for (size_t chunk = 1; chunk <= len; chunk++) {
+		struct collected c = { 0 };
+		multipart_parser *p = multipart_parser_init(BOUNDARY, &callbacks);
+
+		assert_non_null(p);
+		multipart_parser_set_data(p, &c);
+		for (size_t off = 0; off < len; off += chunk) {
+			size_t n = len - off < chunk ? len - off : chunk;
+			assert_int_equal(multipart_parser_execute(p, body + off, n), n);
+		}
+
+		assert_int_equal(c.parts, sizeof(parts) / sizeof(parts[0]));
+		assert_true(c.ended);
+		for (int i = 0; i < c.parts; i++) {
+			assert_int_equal(c.len[i], strlen(parts[i]));
+			if (c.len[i])
+				assert_memory_equal(c.data[i], parts[i], c.len[i]);
+			free(c.data[i]);
+		}
+		multipart_parser_free(p);
+	}
+	free(body);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest multipart_tests[] = {
+	    cmocka_unit_test(test_multipart_parser_chunks)
+	};
+	error_count += cmocka_run_group_tests_name("multipart_parser",
+						   multipart_tests, NULL, NULL);
+	return error_count;
+}
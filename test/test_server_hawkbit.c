@@ -93,12 +93,20 @@ channel_op_res_t __wrap_channel_get_file(channel_t *this, void *data)
 	return mock_type(channel_op_res_t);
 }
 
+/* If set, the mocked server answers 304 to conditional requests */
+static bool mock_channel_etag = false;
+
 extern channel_op_res_t __real_channel_get(channel_t *this, void *data);
 channel_op_res_t __wrap_channel_get(channel_t *this, void *data);
 channel_op_res_t __wrap_channel_get(channel_t *this, void *data)
 {
 	(void)this;
 	channel_data_t *channel_data = (channel_data_t *)data;
+	if (mock_channel_etag && channel_data->use_etag) {
+		channel_data->not_modified = channel_data->etag != NULL;
+		if (!channel_data->etag)
+			channel_data->etag = strdup("\"1\"");
+	}
 	channel_data->json_reply = mock_ptr_type(json_object *);
 	return mock_type(channel_op_res_t);
 }
@@ -230,6 +238,44 @@ static void test_server_has_pending_action(void **state)
 		server_hawkbit_funcs.has_pending_action(&action_id));
 }
 
+static void test_server_has_pending_action_not_modified(void **state)
+{
+	(void)state;
+
+	/* clang-format off */
+	static const char *json_reply_no_update = JSONQUOTE(
+	{
+		"config" : {
+			"polling" : {
+				"sleep" : "00:01:00"
+			}
+		}
+	}
+	);
+	/* clang-format on */
+
+	int action_id;
+	mock_channel_etag = true;
+
+	/* Test Case: first reply is parsed and kept */
+	will_return(__wrap_channel_get,
+		    json_tokener_parse(json_reply_no_update));
+	will_return(__wrap_channel_get, CHANNEL_OK);
+	assert_int_equal(SERVER_NO_UPDATE_AVAILABLE,
+		server_hawkbit_funcs.has_pending_action(&action_id));
+	assert_non_null(server_hawkbit.etag);
+	assert_non_null(server_hawkbit.device_info);
+
+	/* Test Case: 304 Not Modified reuses the last reply */
+	will_return(__wrap_channel_get, NULL);
+	will_return(__wrap_channel_get, CHANNEL_OK);
+	assert_int_equal(SERVER_NO_UPDATE_AVAILABLE,
+		server_hawkbit_funcs.has_pending_action(&action_id));
+	assert_int_equal(1, server_hawkbit.polls_not_modified);
+
+	mock_channel_etag = false;
+}
+
 extern server_op_res_t server_set_polling_interval_json(json_object *json_root);
 static void test_server_set_polling_interval_json(void **state)
 {
@@ -555,7 +601,8 @@ int main(void)
 	    cmocka_unit_test(test_server_send_cancel_reply),
 	    cmocka_unit_test(test_server_process_update_artifact),
 	    cmocka_unit_test(test_server_set_polling_interval_json),
-	    cmocka_unit_test(test_server_has_pending_action)};
+	    cmocka_unit_test(test_server_has_pending_action),
+	    cmocka_unit_test(test_server_has_pending_action_not_modified)};
 	pid = getpid();
 	error_count += cmocka_run_group_tests_name(
 	    "server_hawkbit", hawkbit_server_tests, server_hawkbit_setup,
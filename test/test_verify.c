@@ -21,10 +21,12 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <cmocka.h>
 
 #include "swupdate_crypto.h"
 #include "swupdate.h"
+#include "util.h"
 
 #define DATADIR "test/data/"
 
@@ -32,6 +34,8 @@ static void test_verify_pkcs15(void **state)
 {
 	int error;
 	struct swupdate_cfg config;
+	unsigned char *sig = NULL, *data = NULL;
+	size_t siglen = 0, len = 0;
 
 	(void)state;
 
@@ -39,9 +43,19 @@ static void test_verify_pkcs15(void **state)
 	error = swupdate_dgst_init(&config, DATADIR "signing-pubkey.pem");
 	assert_int_equal(error, 0);
 
-	error = swupdate_verify_file(config.dgst, DATADIR "signature",
-		DATADIR "to-be-signed", NULL);
+	assert_int_equal(read_file_into_buf(DATADIR "signature", &sig, &siglen), 0);
+	assert_int_equal(read_file_into_buf(DATADIR "to-be-signed", &data, &len), 0);
+
+	error = swupdate_verify_buf(config.dgst, sig, siglen, data, len, NULL);
 	assert_int_equal(error, 0);
+
+	/* A modified payload must not verify */
+	data[0] ^= 0xff;
+	error = swupdate_verify_buf(config.dgst, sig, siglen, data, len, NULL);
+	assert_int_not_equal(error, 0);
+
+	free(sig);
+	free(data);
 }
 
 int main(void)
@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <zstd.h>
+#include "zstd_mt.h"
+
+#define PLAIN_SIZE	(3 * 1024 * 1024 + 123)
+#define FRAME_SIZE	(256 * 1024)
+
+struct source {
+	const uint8_t *data;
+	size_t len;
+	size_t pos;
+};
+
+static uint8_t *plain;
+
+/* returns odd sized chunks, as a pipeline step may */
+static int source_read(void *state, void *buffer, size_t size)
+{
+	struct source *s = state;
+	size_t len = s->len - s->pos;
+
+	if (len > size)
+		len = size;
+	if (len > 7777)
+		len = 7777;
+	memcpy(buffer, s->data + s->pos, len);
+	s->pos += len;
+
+	return len;
+}
+
+/*
+ * Frames of FRAME_SIZE like pzstd, a skippable frame in between;
+ * with a streamed frame without content size at the end if unsized
+ */
+static uint8_t *compress_frames(size_t *len, bool unsized)
+{
+	size_t size = ZSTD_compressBound(PLAIN_SIZE) + 4096, pos = 0;
+	uint8_t *out = malloc(size);
+	size_t end = unsized ? PLAIN_SIZE - FRAME_SIZE : PLAIN_SIZE;
+
+	assert_non_null(out);
+	for (size_t off = 0; off < end; off += FRAME_SIZE) {
+		size_t n = end - off < FRAME_SIZE ? end - off : FRAME_SIZE;
+		size_t ret = ZSTD_compress(out + pos, size - pos, plain + off, n, 3);
+
+		assert_false(ZSTD_isError(ret));
+		pos += ret;
+		if (off == FRAME_SIZE) {
+			static const uint8_t skippable[] = {
+				0x50, 0x2a, 0x4d, 0x18, 4, 0, 0, 0, 1, 2, 3, 4
+			};
+
+			memcpy(out + pos, skippable, sizeof(skippable));
+			pos += sizeof(skippable);
+		}
+	}
+	if (unsized) {
+		ZSTD_CCtx *cctx = ZSTD_createCCtx();
+		ZSTD_inBuffer in = { plain + end, PLAIN_SIZE - end, 0 };
+		ZSTD_outBuffer o = { out + pos, size - pos, 0 };
+
+		assert_non_null(cctx);
+		assert_int_equal(ZSTD_compressStream2(cctx, &o, &in, ZSTD_e_end), 0);
+		ZSTD_freeCCtx(cctx);
+		pos += o.pos;
+	}
+	*len = pos;
+
+	return out;
+}
+
+static void decode(bool unsized, unsigned int threads, size_t memlimit)
+{
+	struct source src = { 0 };
+	uint8_t *out = malloc(PLAIN_SIZE + 1);
+	size_t done = 0;
+	struct zstd_mt *z;
+	int ret;
+
+	assert_non_null(out);
+	src.data = compress_frames(&src.len, unsized);
+	z = zstd_mt_new(threads, memlimit, source_read, &src);
+	assert_non_null(z);
+	do {
+		ret = zstd_mt_read(z, out + done, 16384 < PLAIN_SIZE + 1 - done ?
+				   16384 : PLAIN_SIZE + 1 - done);
+		assert_true(ret >= 0);
+		done += ret;
+	} while (ret > 0);
+	zstd_mt_free(z);
+
+	assert_int_equal(done, PLAIN_SIZE);
+	assert_memory_equal(out, plain, PLAIN_SIZE);
+	free((void *)src.data);
+	free(out);
+}
+
+static void test_zstd_mt_frames(void **state)
+{
+	(void)state;
+	decode(false, 4, 64 * 1024 * 1024);
+	/* a single frame and the read ahead buffer in flight at a time */
+	decode(false, 4, FRAME_SIZE + 64 * 1024);
+	/* no frame fits, all streamed */
+	decode(false, 4, 1);
+}
+
+/*
+ * A single frame with its size in the header is streamed: output comes
+ * before the input is read to the end, whatever the memory limit
+ */
+static void test_zstd_mt_single_frame(void **state)
+{
+	(void)state;
+	struct source src = { 0 };
+	size_t size = ZSTD_compressBound(PLAIN_SIZE), done = 0;
+	uint8_t *data = malloc(size);
+	uint8_t *out = malloc(PLAIN_SIZE + 1);
+	struct zstd_mt *z;
+	int ret;
+
+	assert_non_null(data);
+	assert_non_null(out);
+	src.len = ZSTD_compress(data, size, plain, PLAIN_SIZE, 3);
+	assert_false(ZSTD_isError(src.len));
+	assert_int_equal(ZSTD_getFrameContentSize(data, src.len), PLAIN_SIZE);
+	src.data = data;
+
+	z = zstd_mt_new(4, 64 * 1024 * 1024, source_read, &src);
+	assert_non_null(z);
+	ret = zstd_mt_read(z, out, 16384);
+	assert_true(ret > 0);
+	assert_true(src.pos < src.len);
+	done = ret;
+	do {
+		ret = zstd_mt_read(z, out + done, 16384 < PLAIN_SIZE + 1 - done ?
+				   16384 : PLAIN_SIZE + 1 - done);
+		assert_true(ret >= 0);
+		done += ret;
+	} while (ret > 0);
+	zstd_mt_free(z);
+
+	assert_int_equal(done, PLAIN_SIZE);
+	assert_memory_equal(out, plain, PLAIN_SIZE);
+	free(data);
+	free(out);
+}
+
+static void test_zstd_mt_unsized(void **state)
+{
+	(void)state;
+	decode(true, 3, 64 * 1024 * 1024);
+}
+
+static void test_zstd_mt_truncated(void **state)
+{
+	(void)state;
+	struct source src = { 0 };
+	uint8_t out[16384];
+	struct zstd_mt *z;
+	int ret;
+
+	src.data = compress_frames(&src.len, false);
+	src.len -= 10;
+	z = zstd_mt_new(2, 64 * 1024 * 1024, source_read, &src);
+	assert_non_null(z);
+	do {
+		ret = zstd_mt_read(z, out, sizeof(out));
+	} while (ret > 0);
+	assert_true(ret < 0);
+	zstd_mt_free(z);
+	free((void *)src.data);
+}
+
+static int setup(void **state)
+{
+	(void)state;
+	plain = malloc(PLAIN_SIZE);
+	if (!plain)
+		return -1;
+	/* compressible, not trivially */
+	for (size_t i = 0; i < PLAIN_SIZE; i++)
+		plain[i] = (i * 2654435761u >> 13) % 23 + (i % 4096 < 2048 ? 'a' : 0);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	(void)state;
+	free(plain);
+	return 0;
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest zstd_mt_tests[] = {
+	    cmocka_unit_test(test_zstd_mt_frames),
+	    cmocka_unit_test(test_zstd_mt_single_frame),
+	    cmocka_unit_test(test_zstd_mt_unsized),
+	    cmocka_unit_test(test_zstd_mt_truncated)
+	};
+	error_count += cmocka_run_group_tests_name("zstd_mt", zstd_mt_tests,
+						   setup, teardown);
+	return error_count;
+}
@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier:     GPL-2.0-only
+#
+# Create a block-map image for the raw handler (format = "bmap"):
+# only the blocks of the input that hold data are stored, together
+# with a map of their ranges and the sha256 of each range.
+#
+#   header  "SWUBMAP\0", u32 version, u32 block size, u64 image size,
+#           u32 number of ranges, u32 flags
+#   range   u64 first block, u64 number of blocks, sha256 of the data,
+#           followed by the data, cut at the image size
+#
+# All numbers are little endian. Only the holes of the input are left
+# out, zero blocks inside its data are file contents. If the holes are
+# not known (no SEEK_DATA, block devices) or with --skip-zeroes, all
+# zero blocks are left out and FLAG_ZERO_GAPS tells the handler that
+# the gaps must be zeroed.
+
+import argparse
+import errno
+import hashlib
+import os
+import struct
+import sys
+
+MAGIC = b"SWUBMAP\0"
+VERSION = 1
+HEADER = struct.Struct("<8sIIQII")
+RANGE = struct.Struct("<QQ32s")
+FLAG_ZERO_GAPS = 1
+
+
+def data_extents(fd, size):
+    """Return the (start, end) of the data of a file, None if the
+    holes cannot be found"""
+    extents = []
+    pos = 0
+    while pos < size:
+        try:
+            start = os.lseek(fd, pos, os.SEEK_DATA)
+        except OSError as e:
+            if e.errno == errno.ENXIO:
+                break
+            return None
+        end = os.lseek(fd, start, os.SEEK_HOLE)
+        extents.append((start, min(end, size)))
+        pos = end
+    return extents
+
+
+def mapped_blocks(fd, extents, bs, skip_zeroes):
+    """Yield the numbers of the blocks with data"""
+    zero = bytes(bs)
+    last = -1
+    for start, end in extents:
+        block = max(start // bs, last + 1)
+        while block * bs < end:
+            data = os.pread(fd, bs, block * bs) if skip_zeroes else None
+            if not skip_zeroes or data != zero[: len(data)]:
+                yield block
+            last = block
+            block += 1
+
+
+def ranges(fd, extents, bs, skip_zeroes):
+    first = count = 0
+    for block in mapped_blocks(fd, extents, bs, skip_zeroes):
+        if count and block == first + count:
+            count += 1
+            continue
+        if count:
+            yield first, count
+        first, count = block, 1
+    if count:
+        yield first, count
+
+
+def create(image, output, bs, skip_zeroes):
+    fd = os.open(image, os.O_RDONLY)
+    try:
+        size = os.fstat(fd).st_size
+        extents = None
+        if size == 0:
+            size = os.lseek(fd, 0, os.SEEK_END)
+        elif not skip_zeroes:
+            extents = data_extents(fd, size)
+        if extents is None:
+            extents = [(0, size)]
+            skip_zeroes = True
+        table = list(ranges(fd, extents, bs, skip_zeroes))
+        flags = FLAG_ZERO_GAPS if skip_zeroes else 0
+        mapped = 0
+        with open(output, "wb") as out:
+            out.write(HEADER.pack(MAGIC, VERSION, bs, size, len(table), flags))
+            for first, count in table:
+                start = first * bs
+                end = min((first + count) * bs, size)
+                entry = out.tell()
+                out.write(RANGE.pack(first, count, bytes(32)))
+                sha = hashlib.sha256()
+                for pos in range(start, end, 1024 * 1024):
+                    data = os.pread(fd, min(1024 * 1024, end - pos), pos)
+                    sha.update(data)
+                    out.write(data)
+                out.seek(entry)
+                out.write(RANGE.pack(first, count, sha.digest()))
+                out.seek(0, os.SEEK_END)
+                mapped += end - start
+    finally:
+        os.close(fd)
+
+    print(
+        f"{image}: {size} bytes, {mapped} mapped in {len(table)} ranges"
+        + (", zero blocks left out" if skip_zeroes else ""),
+        file=sys.stderr,
+    )
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Create a block-map image for the SWUpdate raw handler"
+    )
+    parser.add_argument("image", help="file system image or block device")
+    parser.add_argument("output", help="block-map image to be created")
+    parser.add_argument(
+        "-b",
+        "--block-size",
+        type=int,
+        default=4096,
+        help="block size, a multiple of 512 (default 4096)",
+    )
+    parser.add_argument(
+        "-z",
+        "--skip-zeroes",
+        action="store_true",
+        help="leave out all zero blocks, the gaps are then always zeroed",
+    )
+    args = parser.parse_args()
+
+    if args.block_size <= 0 or args.block_size % 512:
+        parser.error("block size must be a multiple of 512")
+    create(args.image, args.output, args.block_size, args.skip_zeroes)
+
+
+if __name__ == "__main__":
+    main()
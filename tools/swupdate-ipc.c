@@ -100,6 +100,10 @@ static void usage_monitor(const char *program) {
 		);
 }
 
+static void usage_metrics(const char *program) {
+	fprintf(stdout, "\t %s\n", program);
+}
+
 static void usage_dwlurl(const char *program) {
 	fprintf(stdout,"\t %s \n", program);
 	fprintf(stdout,
@@ -419,6 +423,21 @@ static int sendaes(cmd_t *cmd, int argc, char *argv[]) {
 	return 0;
 }
 
+static int metrics(cmd_t  __attribute__((__unused__)) *cmd,
+		   int  __attribute__((__unused__)) argc,
+		   char  __attribute__((__unused__)) *argv[]) {
+	char *json;
+
+	if (ipc_get_metrics(&json) < 0) {
+		fprintf(stderr, "Error IPC getting metrics\n");
+		return 1;
+	}
+	fprintf(stdout, "%s\n", json);
+	free(json);
+
+	return 0;
+}
+
 static int setversions(cmd_t *cmd, int argc, char *argv[]) {
 	char *type = NULL;
 	if (argc < 4) {
@@ -774,6 +793,7 @@ cmd_t commands[] = {
 	{"sysrestart", sysrestart, usage_sysrestart},
 	{"monitor", monitor, usage_monitor},
 	{"dwlurl", dwlurl, usage_dwlurl},
+	{"metrics", metrics, usage_metrics},
 	{NULL, NULL, NULL}
 };
 